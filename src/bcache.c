@@ -0,0 +1,420 @@
+// bcache.c
+//
+// Block buffer cache. See bcache.h for the policy; this file keeps the
+// buffers on three structures: a hash on the block number for lookup, an
+// LRU list of every buffer holding (or filling) a block, and a free list.
+
+#include <stdint.h>
+#include "bcache.h"
+#include "ide.h"
+#include "blkq.h"
+#include "writeback.h"
+#include "page.h"
+#include "klib.h"
+#include "tsc.h"
+#include "rprintf.h"
+#include "console.h"
+
+#define BCACHE_BUFFERS    512         // one 2 MiB frame of 4 KiB blocks
+#define BCACHE_BENCH_LBA  2048
+
+static struct bbuf bufs[BCACHE_BUFFERS];
+static struct bbuf *hash[BCACHE_HASH];
+static struct bbuf *lru_head = 0, *lru_tail = 0;
+static struct bbuf *free_list = 0;
+static uint32_t reads_in_flight = 0;
+static struct bcache_stats stats;
+
+// Read-ahead state for the one sequential stream we track
+static int ra_enabled = 1;
+static uint32_t ra_last = 0xFFFFFFFF;   // last block a reader asked for
+static uint32_t ra_window = 0;          // blocks, 0 while access looks random
+static uint32_t ra_next = 0;            // first block not yet prefetched
+
+static struct bbuf *lookup(uint32_t block) {
+    struct bbuf *b = hash[block & (BCACHE_HASH - 1)];
+
+    while (b && b->block != block)
+        b = b->hnext;
+    return b;
+}
+
+static void hash_insert(struct bbuf *b) {
+    struct bbuf **bucket = &hash[b->block & (BCACHE_HASH - 1)];
+
+    b->hnext = *bucket;
+    *bucket = b;
+}
+
+static void hash_remove(struct bbuf *b) {
+    struct bbuf **p = &hash[b->block & (BCACHE_HASH - 1)];
+
+    while (*p != b)
+        p = &(*p)->hnext;
+    *p = b->hnext;
+}
+
+static void lru_unlink(struct bbuf *b) {
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        lru_head = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    else
+        lru_tail = b->prev;
+}
+
+static void lru_push_front(struct bbuf *b) {
+    b->prev = 0;
+    b->next = lru_head;
+    if (lru_head)
+        lru_head->prev = b;
+    else
+        lru_tail = b;
+    lru_head = b;
+}
+
+// Blocks on the device blkq is queueing to
+static uint32_t disk_blocks(void) {
+    struct blkdev *d = blkq_get_device();
+
+    return d ? (d->sectors + BCACHE_BLOCK_SECTORS - 1) / BCACHE_BLOCK_SECTORS : 0;
+}
+
+// Sectors in a block; the last block of the disk may be short
+static uint32_t block_count(uint32_t block) {
+    uint32_t lba = block * BCACHE_BLOCK_SECTORS;
+    uint32_t left = blkq_get_device()->sectors - lba;
+
+    return left < BCACHE_BLOCK_SECTORS ? left : BCACHE_BLOCK_SECTORS;
+}
+
+// Account for a read that has completed
+static void bcache_complete(struct bbuf *b) {
+    b->flags &= ~BB_IO;
+    reads_in_flight--;
+    if (b->req.status == ATA_OK) {
+        // Sectors written since the read was queued are newer than the disk
+        wb_overlay(b->req.lba, b->data, b->req.count);
+        b->flags |= BB_VALID;
+    }
+}
+
+static void bcache_drop(struct bbuf *b) {
+    if (b->flags & BB_RA)
+        stats.ra_wasted++;
+    hash_remove(b);
+    lru_unlink(b);
+    b->flags = 0;
+    b->next = free_list;
+    free_list = b;
+}
+
+// A buffer for block, from the free list or by evicting the LRU unpinned block
+static struct bbuf *bcache_alloc(uint32_t block) {
+    struct bbuf *b = free_list;
+
+    if (!b) {
+        for (b = lru_tail; b; b = b->prev) {
+            if (b->pins)
+                continue;
+            if (b->flags & BB_IO) {
+                if (b->req.status == ATA_PENDING)
+                    continue;
+                bcache_complete(b);
+            }
+            break;
+        }
+        if (!b)
+            return 0;
+        bcache_drop(b);
+        stats.evictions++;
+    }
+    free_list = b->next;
+
+    b->block = block;
+    b->flags = 0;
+    b->pins = 0;
+    hash_insert(b);
+    lru_push_front(b);
+    return b;
+}
+
+// Queue the read that fills b
+static int bcache_start_read(struct bbuf *b) {
+    int rc;
+
+    b->req.lba = b->block * BCACHE_BLOCK_SECTORS;
+    b->req.buf = b->data;
+    b->req.count = block_count(b->block);
+    b->req.op = ATA_OP_READ;
+    if ((rc = blkq_submit(&b->req)) == ATA_OK) {
+        b->flags |= BB_IO;
+        reads_in_flight++;
+    }
+    return rc;
+}
+
+/*
+ * Write-back flush hook. A read queued before the flush's writes returns
+ * the old sectors, and the dirty copies are about to go away, so finish
+ * every read now and merge while the copies still exist. The flush would
+ * wait behind these reads on the drive anyway.
+ */
+static void bcache_finish_reads(void) {
+    for (struct bbuf *b = lru_head; b && reads_in_flight; b = b->next) {
+        if (b->flags & BB_IO) {
+            blkq_wait(&b->req);
+            bcache_complete(b);
+        }
+    }
+}
+
+// Queue reads for the blocks from block up to end that aren't cached.
+// Returns the first block not queued.
+static uint32_t bcache_prefetch_blocks(uint32_t block, uint32_t end) {
+    for (; block < end; block++) {
+        struct bbuf *b;
+
+        if (lookup(block))
+            continue;
+        if (!(b = bcache_alloc(block)))
+            break;
+        if (bcache_start_read(b) != ATA_OK) {
+            bcache_drop(b);
+            break;
+        }
+        b->flags |= BB_RA;
+        stats.ra_blocks++;
+    }
+    return block;
+}
+
+static void bcache_readahead(uint32_t block) {
+    uint32_t end;
+
+    if (!ra_enabled || block == ra_last)
+        return;
+    if (block != ra_last + 1) {
+        // Not sequential: close the window
+        ra_last = block;
+        ra_window = 0;
+        ra_next = block + 1;
+        return;
+    }
+    ra_last = block;
+    if (ra_next <= block)
+        ra_next = block + 1;
+    // Only top up once the reader is halfway into what's already prefetched
+    if (ra_window && ra_next - block > ra_window / 2)
+        return;
+
+    ra_window = ra_window ? ra_window * 2 : BCACHE_RA_MIN;
+    if (ra_window > BCACHE_RA_MAX)
+        ra_window = BCACHE_RA_MAX;
+    end = block + 1 + ra_window;
+    if (end > disk_blocks())
+        end = disk_blocks();
+
+    ra_next = bcache_prefetch_blocks(ra_next, end);
+}
+
+int bcache_init(void) {
+    struct ppage *frame;
+    struct pfa_stats pst;
+
+    pfa_get_stats(&pst);
+    if (pst.frame_size < BCACHE_BUFFERS * BCACHE_BLOCK_SIZE)
+        return -1;
+    if (!(frame = allocate_physical_pages(1)))
+        return -1;
+
+    for (int i = 0; i < BCACHE_HASH; i++)
+        hash[i] = 0;
+    free_list = 0;
+    for (int i = BCACHE_BUFFERS - 1; i >= 0; i--) {
+        bufs[i].data = (uint8_t *)frame->physical_addr + i * BCACHE_BLOCK_SIZE;
+        bufs[i].flags = 0;
+        bufs[i].pins = 0;
+        bufs[i].next = free_list;
+        free_list = &bufs[i];
+    }
+    lru_head = lru_tail = 0;
+    wb_set_flush_hook(bcache_finish_reads);
+    return 0;
+}
+
+struct bbuf *bcache_get(uint32_t lba) {
+    uint32_t block = lba / BCACHE_BLOCK_SECTORS;
+    struct bbuf *b;
+
+    if (block >= disk_blocks())
+        return 0;
+    stats.lookups++;
+    if ((b = lookup(block))) {
+        stats.hits++;
+        lru_unlink(b);
+        lru_push_front(b);
+    } else {
+        stats.misses++;
+        if (!(b = bcache_alloc(block)))
+            return 0;
+        if (bcache_start_read(b) != ATA_OK) {
+            bcache_drop(b);
+            return 0;
+        }
+    }
+
+    // Pinned before read-ahead goes looking for buffers to evict
+    b->pins++;
+    if (b->flags & BB_RA) {
+        stats.ra_used++;
+        b->flags &= ~BB_RA;
+    }
+    // Queue the prefetches before sleeping on this block's own read
+    bcache_readahead(block);
+
+    if (b->flags & BB_IO) {
+        if (b->req.status == ATA_PENDING) {
+            stats.io_waits++;
+            blkq_wait(&b->req);
+        }
+        bcache_complete(b);
+    }
+    if (!(b->flags & BB_VALID)) {
+        b->pins--;
+        bcache_drop(b);
+        return 0;
+    }
+    return b;
+}
+
+void bcache_prefetch(uint32_t lba, uint32_t count) {
+    uint32_t end = (lba + count + BCACHE_BLOCK_SECTORS - 1) / BCACHE_BLOCK_SECTORS;
+
+    if (!ra_enabled || count == 0)
+        return;
+    if (end > disk_blocks())
+        end = disk_blocks();
+    bcache_prefetch_blocks(lba / BCACHE_BLOCK_SECTORS, end);
+}
+
+void bcache_put(struct bbuf *b) {
+    if (b && b->pins)
+        b->pins--;
+}
+
+int bcache_read(uint32_t lba, uint8_t *buf, uint32_t count) {
+    while (count) {
+        uint32_t n = BCACHE_BLOCK_SECTORS - lba % BCACHE_BLOCK_SECTORS;
+        struct bbuf *b = bcache_get(lba);
+
+        if (!b)
+            return ATA_EIO;
+        if (n > count)
+            n = count;
+        memcpy(buf, bcache_sector(b, lba), n * ATA_SECTOR_SIZE);
+        bcache_put(b);
+        lba += n;
+        buf += n * ATA_SECTOR_SIZE;
+        count -= n;
+    }
+    return ATA_OK;
+}
+
+int bcache_write(uint32_t lba, const uint8_t *buf, uint32_t count) {
+    int rc = wb_write(lba, buf, count);
+
+    if (rc != ATA_OK)
+        return rc;
+
+    // Update whichever of the blocks are cached; the rest aren't loaded
+    while (count) {
+        uint32_t n = BCACHE_BLOCK_SECTORS - lba % BCACHE_BLOCK_SECTORS;
+        struct bbuf *b = lookup(lba / BCACHE_BLOCK_SECTORS);
+
+        if (n > count)
+            n = count;
+        if (b && (b->flags & BB_IO)) {
+            blkq_wait(&b->req);
+            bcache_complete(b);
+        }
+        if (b && (b->flags & BB_VALID))
+            memcpy(bcache_sector(b, lba), buf, n * ATA_SECTOR_SIZE);
+        lba += n;
+        buf += n * ATA_SECTOR_SIZE;
+        count -= n;
+    }
+    return ATA_OK;
+}
+
+int bcache_sync(void) {
+    return wb_sync();
+}
+
+void bcache_invalidate(void) {
+    struct bbuf *b = lru_head;
+
+    while (b) {
+        struct bbuf *next = b->next;
+        if (!b->pins) {
+            if (b->flags & BB_IO) {
+                blkq_wait(&b->req);
+                bcache_complete(b);
+            }
+            bcache_drop(b);
+        }
+        b = next;
+    }
+    ra_last = 0xFFFFFFFF;
+    ra_window = 0;
+}
+
+void bcache_set_readahead(int on) {
+    ra_enabled = on;
+    ra_window = 0;
+}
+
+void bcache_get_stats(struct bcache_stats *st) {
+    *st = stats;
+    st->buffers = BCACHE_BUFFERS;
+    st->cached = 0;
+    st->pinned = 0;
+    for (struct bbuf *b = lru_head; b; b = b->next) {
+        st->cached++;
+        if (b->pins)
+            st->pinned++;
+    }
+    st->bytes = BCACHE_BUFFERS * (BCACHE_BLOCK_SIZE + sizeof(struct bbuf)) + sizeof(hash);
+}
+
+void bcache_bench(unsigned int nsectors) {
+    for (int ra = 0; ra < 2; ra++) {
+        struct bcache_stats before = stats;
+        uint64_t t0, elapsed;
+        uint32_t us, done;
+
+        bcache_invalidate();
+        bcache_set_readahead(ra);
+        t0 = rdtsc();
+        // One sector at a time, the way a filesystem walks a file
+        for (done = 0; done < nsectors; done++) {
+            struct bbuf *b = bcache_get(BCACHE_BENCH_LBA + done);
+            if (!b) {
+                esp_printf(kputc, "read at lba %d failed\n", BCACHE_BENCH_LBA + done);
+                break;
+            }
+            bcache_put(b);
+        }
+        elapsed = rdtsc() - t0;
+        us = tsc_to_us(elapsed);
+        if (us == 0)
+            us = 1;
+        esp_printf(kputc, "read-ahead %s: %d sectors in %d us, %d KiB/s, %d misses, %d waits, %d prefetched\n",
+                   ra ? "on " : "off", done, us, div64_32((uint64_t)done * 500000, us),
+                   stats.misses - before.misses, stats.io_waits - before.io_waits,
+                   stats.ra_blocks - before.ra_blocks);
+    }
+    bcache_set_readahead(1);
+}
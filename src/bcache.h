@@ -0,0 +1,95 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include "ide.h"
+#include "blkq.h"
+
+/*
+ * Block buffer cache over the block queue. Blocks are BCACHE_BLOCK_SECTORS
+ * aligned sectors held in one page-allocator frame, so DMA lands directly in
+ * the cache. Lookups go through a hash on the block number and eviction
+ * takes the least recently used unpinned block.
+ *
+ * Writes go through the cache to the write-back layer, so cached blocks are
+ * never dirty and can always be dropped.
+ *
+ * A reader walking consecutive blocks opens a read-ahead window that doubles
+ * each time the reader gets halfway through it, up to BCACHE_RA_MAX blocks.
+ * The prefetch requests go to the block queue, which merges adjacent ones
+ * into one command, and are not waited for; a reader only sleeps if it
+ * catches up with one.
+ */
+
+#define BCACHE_BLOCK_SECTORS  8
+#define BCACHE_BLOCK_SIZE     (BCACHE_BLOCK_SECTORS * ATA_SECTOR_SIZE)
+#define BCACHE_HASH           256     // must be a power of two
+#define BCACHE_RA_MIN         4       // blocks
+#define BCACHE_RA_MAX         32
+
+struct bbuf {
+    uint32_t block;              // lba / BCACHE_BLOCK_SECTORS
+    uint8_t *data;
+    uint16_t pins;
+    uint8_t flags;               // BB_*
+    struct bbuf *hnext;
+    struct bbuf *prev, *next;    // LRU list, most recent first; free list
+    struct blk_request req;      // the read filling this buffer
+};
+
+#define BB_VALID  0x01
+#define BB_IO     0x02           // a read is in flight
+#define BB_RA     0x04           // filled by read-ahead and not used yet
+
+struct bcache_stats {
+    uint32_t lookups;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t io_waits;           // lookups that slept on an in-flight read
+    uint32_t ra_blocks;          // blocks prefetched
+    uint32_t ra_used;            // prefetched blocks a reader asked for
+    uint32_t ra_wasted;          // prefetched blocks evicted unused
+    uint32_t buffers;
+    uint32_t cached;             // buffers holding a block
+    uint32_t pinned;
+    uint32_t bytes;              // data plus metadata
+};
+
+// Take a frame from the page allocator for the buffers. Call after wb_init().
+int bcache_init(void);
+
+// Pin the block holding lba, reading it if needed. 0 on I/O error or if
+// every buffer is pinned.
+struct bbuf *bcache_get(uint32_t lba);
+
+// The sector lba inside b
+static inline uint8_t *bcache_sector(struct bbuf *b, uint32_t lba) {
+    return b->data + (lba % BCACHE_BLOCK_SECTORS) * ATA_SECTOR_SIZE;
+}
+
+void bcache_put(struct bbuf *b);
+
+// Start reading count sectors from lba into the cache without waiting, for
+// callers that know better than the sequential detector what comes next.
+// Counts as read-ahead, and does nothing while read-ahead is off.
+void bcache_prefetch(uint32_t lba, uint32_t count);
+
+// Copying helpers. Return ATA_* codes.
+int bcache_read(uint32_t lba, uint8_t *buf, uint32_t count);
+int bcache_write(uint32_t lba, const uint8_t *buf, uint32_t count);
+
+// Flush the write-back layer and the drive cache
+int bcache_sync(void);
+
+// Drop every unpinned block
+void bcache_invalidate(void);
+
+void bcache_set_readahead(int on);
+
+void bcache_get_stats(struct bcache_stats *st);
+
+// Read nsectors one sector at a time, without and with read-ahead
+void bcache_bench(unsigned int nsectors);
+
+#endif
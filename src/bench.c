@@ -0,0 +1,206 @@
+// bench.c
+//
+// The suite's registry and its runner. Each entry's run() is one sample;
+// setup() and teardown() keep whatever it needs out of the timing.
+
+#include <stdint.h>
+#include "bench.h"
+#include "page.h"
+#include "paging.h"
+#include "ide.h"
+#include "interrupt.h"
+#include "multiboot2.h"
+#include "trace.h"
+#include "tsc.h"
+#include "klib.h"
+#include "rprintf.h"
+#include "console.h"
+#include "serial.h"
+
+#define BENCH_MAP_PAGES  16
+#define BENCH_ATA_SECTORS 64          // 32 KiB a read
+#define BENCH_ATA_SPAN   16384        // sectors the reads walk through, 8 MiB
+
+// alloc: one frame from the allocator and back
+
+static void alloc_run(void) {
+    free_physical_pages(allocate_physical_pages(1));
+}
+
+// map_pages: BENCH_MAP_PAGES pages into a scratch directory and out again.
+// The page table stays after the first run, so this is the PTE work.
+
+static struct page_directory_entry *map_pd;
+static struct ppage *map_frame;
+static struct ppage map_list[BENCH_MAP_PAGES];
+
+static int map_setup(void) {
+    if (!(map_pd = paging_new_directory()))
+        return ATA_ENODEV;
+    if (!(map_frame = allocate_physical_pages(1))) {
+        paging_free_directory(map_pd);
+        return ATA_ENODEV;
+    }
+    for (int i = 0; i < BENCH_MAP_PAGES; i++) {
+        map_list[i].physical_addr = (uint8_t *)map_frame->physical_addr + i * PAGE_SIZE;
+        map_list[i].next = i + 1 < BENCH_MAP_PAGES ? &map_list[i + 1] : 0;
+    }
+    return ATA_OK;
+}
+
+static void map_run(void) {
+    map_pages((void *)VM_MAP_BASE, map_list, map_pd);
+    unmap_pages((void *)VM_MAP_BASE, BENCH_MAP_PAGES, map_pd);
+}
+
+static void map_teardown(void) {
+    paging_free_directory(map_pd);
+    free_physical_pages(map_frame);
+}
+
+// esp_printf: formatting alone, into a putc that drops everything
+
+static int null_putc(int c) {
+    return c;
+}
+
+static void printf_run(void) {
+    esp_printf(null_putc, "Line %d: 0x%x %s %c\n", 12345, 0xdeadbeef, "scroll", '!');
+}
+
+// kputc: a full line on the active console, which scrolls it
+
+static void kputc_run(void) {
+    for (int i = 0; i < 79; i++)
+        kputc('a' + i % 26);
+    kputc('\n');
+    kflush();
+}
+
+// isr: int, a handler that counts, iret
+
+static void isr_run(void) {
+    asm volatile("int %0" : : "i"(BENCH_VECTOR) : "memory");
+}
+
+// ata: sequential ata_lba_read()s of BENCH_ATA_SECTORS, in whatever mode
+// the driver is in
+
+static struct ppage *ata_frame;
+static uint32_t ata_lba;
+
+static int ata_setup(void) {
+    if (!ata_get_info()->present || ata_get_info()->sectors < BENCH_ATA_SECTORS)
+        return ATA_ENODEV;
+    if (!(ata_frame = allocate_physical_pages(1)))
+        return ATA_ENODEV;
+    ata_lba = 0;
+    return ATA_OK;
+}
+
+static void ata_run(void) {
+    uint32_t span = ata_get_info()->sectors < BENCH_ATA_SPAN ? ata_get_info()->sectors : BENCH_ATA_SPAN;
+
+    ata_lba_read(ata_lba, ata_frame->physical_addr, BENCH_ATA_SECTORS);
+    ata_lba += BENCH_ATA_SECTORS;
+    if (ata_lba + BENCH_ATA_SECTORS > span)
+        ata_lba = 0;
+}
+
+static void ata_teardown(void) {
+    free_physical_pages(ata_frame);
+}
+
+static const struct bench benches[] = {
+    { "alloc",  0,          alloc_run,  0,            0 },
+    { "map",    map_setup,  map_run,    map_teardown, 0 },
+    { "printf", 0,          printf_run, 0,            0 },
+    { "kputc",  0,          kputc_run,  0,            0 },
+    { "isr",    0,          isr_run,    0,            0 },
+    { "ata",    ata_setup,  ata_run,    ata_teardown, BENCH_ATA_SECTORS * 512 },
+};
+
+#define NBENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static int selected(const char *name, const char *names, uint32_t len) {
+    uint32_t n = strlen(name);
+
+    if (len == 3 && memcmp(names, "all", 3) == 0)
+        return 1;
+    while (len) {
+        uint32_t w = 0;
+
+        while (w < len && names[w] != ',')
+            w++;
+        if (w == n && memcmp(names, name, n) == 0)
+            return 1;
+        names += w;
+        len -= w;
+        if (len) {
+            names++;
+            len--;
+        }
+    }
+    return 0;
+}
+
+static void bench_one(const struct bench *b) {
+    static uint32_t samples[BENCH_REPS];
+
+    if (b->setup && b->setup() != ATA_OK) {
+        esp_printf(kputc, "bench %s: skipped, nothing to run it on\n", b->name);
+        return;
+    }
+    for (int i = 0; i < BENCH_WARMUP; i++)
+        b->run();
+    for (int i = 0; i < BENCH_REPS; i++) {
+        uint64_t t0 = rdtsc();
+
+        b->run();
+        samples[i] = rdtsc() - t0;
+    }
+    if (b->teardown)
+        b->teardown();
+
+    // Insertion sort: BENCH_REPS is small and mostly in order already
+    for (int i = 1; i < BENCH_REPS; i++) {
+        uint32_t v = samples[i];
+        int j = i;
+
+        for (; j > 0 && samples[j - 1] > v; j--)
+            samples[j] = samples[j - 1];
+        samples[j] = v;
+    }
+    esp_printf(serial_putc, "bench,%s,%d,%d,", b->name, BENCH_REPS, samples[0]);
+    esp_printf(serial_putc, "%d,%d,%d,%d\n", samples[BENCH_REPS / 2],
+               samples[BENCH_REPS * 99 / 100], b->bytes, tsc_khz);
+    esp_printf(kputc, "%s: min %d, median %d, p99 %d cycles\n", b->name, samples[0],
+               samples[BENCH_REPS / 2], samples[BENCH_REPS * 99 / 100]);
+}
+
+void bench_suite(const char *names, uint32_t len) {
+#ifdef CONFIG_TRACE
+    // A trace record is a serial write; it would be most of what we time
+    int traced = trace_enabled;
+
+    trace_set(0);
+#endif
+    esp_printf(serial_putc, "bench,name,reps,min_cycles,median_cycles,p99_cycles,bytes,tsc_khz\n");
+    for (uint32_t i = 0; i < NBENCHES; i++) {
+        if (selected(benches[i].name, names, len))
+            bench_one(&benches[i]);
+    }
+#ifdef CONFIG_TRACE
+    trace_set(traced);
+#endif
+}
+
+void bench_boot(void) {
+    uint32_t len;
+    const char *names = mb2_cmdline_arg("bench", &len);
+
+    if (!names)
+        return;
+    bench_suite(names, len);
+    outb(BENCH_EXIT_PORT, 0);
+}
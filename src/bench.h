@@ -0,0 +1,45 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+/*
+ * The microbenchmark suite: short hot paths, each timed one run at a time
+ * with the TSC. After BENCH_WARMUP runs that aren't kept, BENCH_REPS
+ * samples are sorted for their min, median and 99th percentile, and each
+ * benchmark becomes one CSV row over COM1:
+ *
+ *   bench,name,reps,min_cycles,median_cycles,p99_cycles,bytes,tsc_khz
+ *
+ * bytes is what one run moves, 0 where that means nothing, so bytes and
+ * tsc_khz give throughput on the host. The rows start with "bench," so they
+ * can be picked out of a capture that carries trace records too.
+ *
+ * bench=all, or bench=alloc,map,... on the kernel command line runs the
+ * suite at the end of boot, then writes to QEMU's isa-debug-exit port so a
+ * headless `make bench` ends by itself. Elsewhere the write does nothing
+ * and the shell starts as usual.
+ */
+
+#define BENCH_WARMUP     16
+#define BENCH_REPS       256
+
+// QEMU's -device isa-debug-exit,iobase=0xf4,iosize=0x04
+#define BENCH_EXIT_PORT  0xf4
+
+struct bench {
+    const char *name;
+    int (*setup)(void);               // ATA_OK, or the benchmark is skipped
+    void (*run)(void);                // one sample
+    void (*teardown)(void);
+    uint32_t bytes;                   // moved by one run
+};
+
+// Run the benchmarks named in the comma-separated list of len characters,
+// or all of them for "all". Rows go to COM1, a summary to the console.
+void bench_suite(const char *names, uint32_t len);
+
+// From main(): run whatever bench= on the command line asks for
+void bench_boot(void);
+
+#endif
@@ -0,0 +1,29 @@
+// blkdev.c
+//
+// The table of registered block devices.
+
+#include <stdint.h>
+#include "blkdev.h"
+#include "klib.h"
+
+static struct blkdev *devices[BLKDEV_MAX];
+static int ndevices = 0;
+
+int blkdev_register(struct blkdev *dev) {
+    if (ndevices == BLKDEV_MAX)
+        return -1;
+    devices[ndevices++] = dev;
+    return 0;
+}
+
+struct blkdev *blkdev_get(int i) {
+    return (i >= 0 && i < ndevices) ? devices[i] : 0;
+}
+
+struct blkdev *blkdev_find(const char *name) {
+    for (int i = 0; i < ndevices; i++) {
+        if (strcmp(devices[i]->name, name) == 0)
+            return devices[i];
+    }
+    return 0;
+}
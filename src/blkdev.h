@@ -0,0 +1,53 @@
+#ifndef BLKDEV_H
+#define BLKDEV_H
+
+#include <stdint.h>
+#include "ide.h"
+
+/*
+ * The interface a disk driver offers the block layer. Drivers register a
+ * struct blkdev at init; blkq queues requests to one of them, and the
+ * write-back layer, the buffer cache and the filesystem sit on blkq, so
+ * they run on any registered disk.
+ *
+ * Ops and status codes are the ATA_* ones, which the block layer has used
+ * from the start.
+ */
+
+struct blk_request {
+    uint32_t lba;
+    uint8_t *buf;
+    uint32_t count;                   // sectors
+    enum ata_op op;
+    volatile int status;              // ATA_PENDING until the request completes
+    // Called once status is final, with interrupts off, from the driver's
+    // interrupt handler or from inside submit. May be 0. May submit more
+    // requests.
+    void (*done)(struct blk_request *req);
+    void *priv;
+    struct blk_request *next;
+};
+
+struct blkdev {
+    const char *name;
+    uint32_t sectors;
+    uint32_t depth;                   // requests the driver takes at once
+    uint32_t max_sectors;             // per request
+    // Start req. Runs with interrupts off and never sleeps. The caller
+    // keeps at most depth requests outstanding.
+    int (*submit)(struct blkdev *dev, struct blk_request *req);
+    // Called by waiters each time they wake, e.g. to check timeouts. May be 0.
+    void (*idle)(struct blkdev *dev);
+    void *priv;
+};
+
+#define BLKDEV_MAX  4
+
+int blkdev_register(struct blkdev *dev);
+
+// The i-th registered device, in registration order, or 0
+struct blkdev *blkdev_get(int i);
+
+struct blkdev *blkdev_find(const char *name);
+
+#endif
@@ -0,0 +1,496 @@
+// blkq.c
+//
+// The elevator in front of the block device. Requests wait on one list,
+// kept sorted by LBA while the elevator is on; the requests that make up a
+// command in flight are unlinked onto its slot's batch list until it
+// completes.
+
+#include <stdint.h>
+#include "blkq.h"
+#include "blkdev.h"
+#include "interrupt.h"
+#include "page.h"
+#include "klib.h"
+#include "tsc.h"
+#include "rprintf.h"
+#include "console.h"
+
+#define BLKQ_BENCH_LBA    2048
+#define BLKQ_BENCH_SPAN   4096        // sectors the random reads fall in
+#define BLKQ_BENCH_MAXREQ 512
+#define BLKQ_BENCH_SECTORS 8          // longest random read, and the IOPS block
+
+#define BLKQ_STAGE_SIZE   (BLKQ_MAX_SECTORS * ATA_SECTOR_SIZE)
+
+struct blkq_slot {
+    struct blk_request cmd;           // what the device sees
+    struct blk_request *batch;        // the requests cmd carries
+    uint8_t *stage;                   // 0 if there was no frame for it
+    int staged;                       // cmd.buf is stage
+    int busy;
+};
+
+static struct blkdev *dev = 0;
+static struct blkq_slot slots[BLKQ_DEPTH];
+static uint32_t inflight = 0;
+
+static struct blk_request *waiting = 0;       // not yet on the device
+static struct blk_request *held = 0;          // submitted behind a queued flush
+static struct blk_request *held_tail = 0;
+static struct blk_request *barrier = 0;       // the queued flush
+static int barrier_issued = 0;
+
+static int dispatching = 0;
+static int elevator = 1;
+static uint32_t head_lba = 0;                 // sector after the last command
+static struct blkq_stats stats;
+
+static void blkq_dispatch(void);
+
+static void blkq_insert(struct blk_request *req) {
+    struct blk_request **p = &waiting;
+
+    // Sorted by LBA, after any equal ones; plain FIFO without the elevator
+    while (*p && (!elevator || (*p)->lba <= req->lba))
+        p = &(*p)->next;
+    req->next = *p;
+    *p = req;
+}
+
+// Move requests queued behind a flush that has now completed
+static void blkq_release_held(void) {
+    while (held && !barrier) {
+        struct blk_request *r = held;
+
+        held = r->next;
+        r->next = 0;
+        if (r->op == ATA_OP_FLUSH)
+            barrier = r;
+        else
+            blkq_insert(r);
+    }
+    if (!held)
+        held_tail = 0;
+}
+
+static void blkq_cmd_done(struct blk_request *c) {
+    struct blkq_slot *s = c->priv;
+    struct blk_request *r = s->batch;
+    uint8_t *p = c->buf;
+
+    s->busy = 0;
+    s->batch = 0;
+    inflight--;
+    if (c->op == ATA_OP_FLUSH) {
+        barrier = 0;
+        barrier_issued = 0;
+        blkq_release_held();
+    }
+    while (r) {
+        struct blk_request *next = r->next;
+
+        if (s->staged && r->op == ATA_OP_READ && c->status == ATA_OK)
+            memcpy(r->buf, p, r->count * ATA_SECTOR_SIZE);
+        p += r->count * ATA_SECTOR_SIZE;
+        r->next = 0;
+        stats.depth--;
+        r->status = c->status;
+        if (r->done)
+            r->done(r);
+        r = next;
+    }
+    blkq_dispatch();
+}
+
+/*
+ * Unlink the next batch from the waiting list and describe it in s->cmd.
+ * C-LOOK: the first request at or past head_lba, else the lowest one.
+ */
+static void blkq_take_batch(struct blkq_slot *s) {
+    struct blk_request **p = &waiting, *first, *last, *next;
+    uint32_t count, limit = BLKQ_MAX_SECTORS;
+    int contiguous = 1, n = 1;
+
+    if (elevator) {
+        while (*p && (*p)->lba < head_lba)
+            p = &(*p)->next;
+        if (!*p) {
+            p = &waiting;
+            stats.sweeps++;
+        }
+    }
+    first = last = *p;
+    count = first->count;
+    if (dev->max_sectors < limit)
+        limit = dev->max_sectors;
+
+    while (elevator && (next = last->next) && next->op == first->op &&
+           next->lba == first->lba + count && count + next->count <= limit) {
+        if (next->buf != last->buf + last->count * ATA_SECTOR_SIZE) {
+            if (!s->stage)
+                break;
+            contiguous = 0;
+        }
+        last = next;
+        count += last->count;
+        n++;
+    }
+    *p = last->next;
+    last->next = 0;
+    s->batch = first;
+
+    s->cmd.lba = first->lba;
+    s->cmd.count = count;
+    s->cmd.op = first->op;
+    s->staged = !contiguous;
+    s->cmd.buf = s->staged ? s->stage : first->buf;
+    if (s->staged && s->cmd.op == ATA_OP_WRITE) {
+        uint8_t *q = s->stage;
+        for (struct blk_request *r = first; r; r = r->next) {
+            memcpy(q, r->buf, r->count * ATA_SECTOR_SIZE);
+            q += r->count * ATA_SECTOR_SIZE;
+        }
+    }
+    head_lba = first->lba + count;
+
+    stats.commands++;
+    stats.sectors += count;
+    stats.merged += n - 1;
+    if (s->staged)
+        stats.staged++;
+}
+
+// Keep the device busy. Runs with interrupts off.
+static void blkq_dispatch(void) {
+    uint32_t depth;
+
+    // A device that completes inside submit comes back here through
+    // blkq_cmd_done(); the loop below picks up the next command instead.
+    if (dispatching || !dev)
+        return;
+    dispatching = 1;
+    depth = dev->depth < BLKQ_DEPTH ? dev->depth : BLKQ_DEPTH;
+
+    while (inflight < depth) {
+        struct blkq_slot *s = slots;
+        int rc;
+
+        while (s->busy)
+            s++;
+        if (waiting) {
+            blkq_take_batch(s);
+        } else if (barrier && !barrier_issued && !inflight) {
+            s->batch = barrier;
+            s->staged = 0;
+            s->cmd.op = ATA_OP_FLUSH;
+            s->cmd.buf = 0;
+            s->cmd.lba = s->cmd.count = 0;
+            barrier_issued = 1;
+            stats.commands++;
+        } else {
+            break;
+        }
+        s->cmd.done = blkq_cmd_done;
+        s->cmd.priv = s;
+        s->cmd.next = 0;
+        s->cmd.status = ATA_PENDING;
+        s->busy = 1;
+        inflight++;
+        if ((rc = dev->submit(dev, &s->cmd)) != ATA_OK) {
+            s->cmd.status = rc;
+            blkq_cmd_done(&s->cmd);
+        }
+    }
+    dispatching = 0;
+}
+
+void blkq_init(void) {
+    struct ppage *frame = allocate_physical_pages(1);
+
+    // Staging buffers for merged commands; without them only requests
+    // whose buffers are contiguous get merged
+    for (int i = 0; i < BLKQ_DEPTH; i++)
+        slots[i].stage = frame ? (uint8_t *)frame->physical_addr + i * BLKQ_STAGE_SIZE : 0;
+    dev = blkdev_get(0);
+}
+
+void blkq_set_device(struct blkdev *d) {
+    // Drain the old device; stats.depth counts everything still queued
+    while (*(volatile uint32_t *)&stats.depth) {
+        if (dev->idle)
+            dev->idle(dev);
+        asm volatile("cli");
+        if (*(volatile uint32_t *)&stats.depth)
+            asm volatile("sti\n hlt");
+        else
+            asm volatile("sti");
+    }
+    dev = d;
+    head_lba = 0;
+}
+
+struct blkdev *blkq_get_device(void) {
+    return dev;
+}
+
+int blkq_submit(struct blk_request *req) {
+    uint32_t flags;
+
+    if (!dev)
+        return ATA_ENODEV;
+    if (req->op == ATA_OP_FLUSH) {
+        req->count = 0;
+    } else if (req->count == 0 || req->count > BLKQ_MAX_SECTORS ||
+               req->lba >= dev->sectors || req->count > dev->sectors - req->lba) {
+        return ATA_EINVAL;
+    }
+    req->status = ATA_PENDING;
+    req->next = 0;
+
+    flags = irq_save();
+    stats.requests++;
+    if (++stats.depth > stats.max_depth)
+        stats.max_depth = stats.depth;
+    if (barrier) {
+        if (held_tail)
+            held_tail->next = req;
+        else
+            held = req;
+        held_tail = req;
+    } else if (req->op == ATA_OP_FLUSH) {
+        barrier = req;
+    } else {
+        blkq_insert(req);
+    }
+    blkq_dispatch();
+    irq_restore(flags);
+    return ATA_OK;
+}
+
+int blkq_wait(struct blk_request *req) {
+    while (req->status == ATA_PENDING) {
+        if (dev->idle)
+            dev->idle(dev);
+        // As in ata_wait(): test with interrupts off, then sti;hlt
+        asm volatile("cli");
+        if (req->status == ATA_PENDING)
+            asm volatile("sti\n hlt");
+        else
+            asm volatile("sti");
+    }
+    return req->status;
+}
+
+// One request at a time, in pieces of at most BLKQ_MAX_SECTORS
+static int blkq_sync(uint32_t lba, uint8_t *buf, uint32_t count, enum ata_op op) {
+    do {
+        struct blk_request req = {
+            .lba = lba,
+            .buf = buf,
+            .count = count < BLKQ_MAX_SECTORS ? count : BLKQ_MAX_SECTORS,
+            .op = op,
+        };
+        int rc = blkq_submit(&req);
+
+        if (rc == ATA_OK)
+            rc = blkq_wait(&req);
+        if (rc != ATA_OK)
+            return rc;
+        lba += req.count;
+        buf += req.count * ATA_SECTOR_SIZE;
+        count -= req.count;
+    } while (count);
+    return ATA_OK;
+}
+
+int blkq_read(uint32_t lba, uint8_t *buf, uint32_t count) {
+    return blkq_sync(lba, buf, count, ATA_OP_READ);
+}
+
+int blkq_write(uint32_t lba, const uint8_t *buf, uint32_t count) {
+    return blkq_sync(lba, (uint8_t *)buf, count, ATA_OP_WRITE);
+}
+
+int blkq_flush(void) {
+    return blkq_sync(0, 0, 0, ATA_OP_FLUSH);
+}
+
+void blkq_set_elevator(int on) {
+    uint32_t flags = irq_save();
+    struct blk_request *r = waiting;
+
+    // Re-sort whatever is waiting under the new policy
+    waiting = 0;
+    elevator = on;
+    while (r) {
+        struct blk_request *next = r->next;
+        blkq_insert(r);
+        r = next;
+    }
+    irq_restore(flags);
+}
+
+const struct blkq_stats *blkq_get_stats(void) {
+    return &stats;
+}
+
+static struct blk_request bench_reqs[BLKQ_BENCH_MAXREQ];
+
+// Run the first n bench requests, queued all at once or one after another
+static int blkq_bench_submit(unsigned int n, int queued) {
+    int rc = ATA_OK;
+
+    if (!queued) {
+        for (unsigned int i = 0; i < n && rc == ATA_OK; i++)
+            rc = blkq_read(bench_reqs[i].lba, bench_reqs[i].buf, bench_reqs[i].count);
+        return rc;
+    }
+    for (unsigned int i = 0; i < n && rc == ATA_OK; i++)
+        rc = blkq_submit(&bench_reqs[i]);
+    for (unsigned int i = 0; i < n; i++) {
+        int r = blkq_wait(&bench_reqs[i]);
+        if (rc == ATA_OK)
+            rc = r;
+    }
+    return rc;
+}
+
+static void blkq_bench_run(const char *name, int queued, unsigned int n) {
+    struct blkq_stats before = stats;
+    uint64_t t0;
+    uint32_t us;
+    int rc;
+
+    t0 = rdtsc();
+    rc = blkq_bench_submit(n, queued);
+    us = tsc_to_us(rdtsc() - t0);
+    if (us == 0)
+        us = 1;
+    if (rc != ATA_OK) {
+        esp_printf(kputc, "%s: read failed: %d\n", name, rc);
+        return;
+    }
+    esp_printf(kputc, "%s: %d reads in %d us, %d IOPS, %d commands, %d merged, %d sweeps\n",
+               name, n, us, div64_32((uint64_t)n * 1000000, us), stats.commands - before.commands,
+               stats.merged - before.merged, stats.sweeps - before.sweeps);
+}
+
+static uint32_t xorshift(uint32_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+void blkq_bench(unsigned int nrequests) {
+    uint32_t seed = 2463534242u;
+    struct ppage *frame;
+    int old_elevator = elevator;
+
+    if (!dev || dev->sectors < BLKQ_BENCH_LBA + BLKQ_BENCH_SPAN) {
+        esp_printf(kputc, "no disk to bench\n");
+        return;
+    }
+    if (nrequests > BLKQ_BENCH_MAXREQ)
+        nrequests = BLKQ_BENCH_MAXREQ;
+    if (!(frame = allocate_physical_pages(1))) {
+        esp_printf(kputc, "no free frame for the bench buffers\n");
+        return;
+    }
+
+    // The same sequence of 1..8 sector reads for every run
+    for (unsigned int i = 0; i < nrequests; i++) {
+        struct blk_request *r = &bench_reqs[i];
+
+        xorshift(&seed);
+        r->count = 1 + (seed >> 8) % BLKQ_BENCH_SECTORS;
+        r->lba = BLKQ_BENCH_LBA + (seed >> 12) % (BLKQ_BENCH_SPAN - BLKQ_BENCH_SECTORS);
+        r->buf = (uint8_t *)frame->physical_addr + i * BLKQ_BENCH_SECTORS * ATA_SECTOR_SIZE;
+        r->op = ATA_OP_READ;
+        r->done = 0;
+    }
+
+    esp_printf(kputc, "%s:\n", dev->name);
+    blkq_bench_run("one at a time", 0, nrequests);
+    blkq_set_elevator(0);
+    blkq_bench_run("queued fifo  ", 1, nrequests);
+    blkq_set_elevator(1);
+    blkq_bench_run("elevator     ", 1, nrequests);
+
+    blkq_set_elevator(old_elevator);
+    free_physical_pages(frame);
+}
+
+// Sequential reads of nsectors from LBA 0, then random 4 KiB reads over the
+// whole disk, keeping the queue full in both
+static void blkq_bench_device(uint8_t *buf, unsigned int nsectors) {
+    uint32_t per_frame = BLKQ_BENCH_MAXREQ * BLKQ_BENCH_SECTORS / BLKQ_MAX_SECTORS;
+    uint32_t seed = 88172645u, done = 0, seq_us, rand_us, commands;
+    uint64_t t0;
+    int rc = ATA_OK;
+
+    if (nsectors > dev->sectors)
+        nsectors = dev->sectors;
+    t0 = rdtsc();
+    while (done < nsectors && rc == ATA_OK) {
+        unsigned int n = 0;
+
+        for (; n < per_frame && done < nsectors; n++) {
+            struct blk_request *r = &bench_reqs[n];
+
+            r->lba = done;
+            r->count = nsectors - done < BLKQ_MAX_SECTORS ? nsectors - done : BLKQ_MAX_SECTORS;
+            r->buf = buf + n * BLKQ_STAGE_SIZE;
+            r->op = ATA_OP_READ;
+            r->done = 0;
+            done += r->count;
+        }
+        rc = blkq_bench_submit(n, 1);
+    }
+    seq_us = tsc_to_us(rdtsc() - t0);
+
+    for (unsigned int i = 0; i < BLKQ_BENCH_MAXREQ; i++) {
+        struct blk_request *r = &bench_reqs[i];
+
+        r->lba = xorshift(&seed) % (dev->sectors / BLKQ_BENCH_SECTORS) * BLKQ_BENCH_SECTORS;
+        r->count = BLKQ_BENCH_SECTORS;
+        r->buf = buf + i * BLKQ_BENCH_SECTORS * ATA_SECTOR_SIZE;
+        r->op = ATA_OP_READ;
+        r->done = 0;
+    }
+    commands = stats.commands;
+    t0 = rdtsc();
+    if (rc == ATA_OK)
+        rc = blkq_bench_submit(BLKQ_BENCH_MAXREQ, 1);
+    rand_us = tsc_to_us(rdtsc() - t0);
+    commands = stats.commands - commands;
+
+    if (rc != ATA_OK) {
+        esp_printf(kputc, "%s: read failed: %d\n", dev->name, rc);
+        return;
+    }
+    if (seq_us == 0)
+        seq_us = 1;
+    if (rand_us == 0)
+        rand_us = 1;
+    esp_printf(kputc, "%s: sequential %d KiB/s, random 4 KiB %d IOPS (%d commands, depth %d)\n",
+               dev->name, div64_32((uint64_t)nsectors * 500000, seq_us),
+               div64_32((uint64_t)BLKQ_BENCH_MAXREQ * 1000000, rand_us), commands,
+               dev->depth < BLKQ_DEPTH ? dev->depth : BLKQ_DEPTH);
+}
+
+void blkq_bench_devices(unsigned int nsectors) {
+    struct blkdev *old = dev, *d;
+    struct ppage *frame;
+
+    if (!(frame = allocate_physical_pages(1))) {
+        esp_printf(kputc, "no free frame for the bench buffers\n");
+        return;
+    }
+    for (int i = 0; (d = blkdev_get(i)); i++) {
+        blkq_set_device(d);
+        blkq_bench_device(frame->physical_addr, nsectors);
+    }
+    blkq_set_device(old);
+    free_physical_pages(frame);
+}
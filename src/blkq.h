@@ -0,0 +1,73 @@
+#ifndef BLKQ_H
+#define BLKQ_H
+
+#include <stdint.h>
+#include "blkdev.h"
+
+/*
+ * Asynchronous block request queue with an elevator, in front of one
+ * registered block device.
+ *
+ * Submitted requests wait in a list sorted by LBA, and the device is kept
+ * as many commands deep as it accepts (up to BLKQ_DEPTH). Each time the
+ * device can take a command, the elevator picks the first request at or
+ * past the end of the last command, wrapping to the lowest LBA when there
+ * is none (C-LOOK). Requests that follow it in the list are merged into the
+ * same command while they are adjacent, of the same op and fit in
+ * BLKQ_MAX_SECTORS. A merged read lands in a staging buffer and is copied
+ * out unless the buffers happen to be contiguous.
+ *
+ * ATA_OP_FLUSH is a barrier: everything submitted before it goes to the
+ * device first, and nothing submitted after it does until it completes.
+ * Otherwise requests for overlapping sectors may complete in any order, so
+ * a caller that cares waits for the first before submitting the second.
+ */
+
+#define BLKQ_MAX_SECTORS  128         // per merged command, 64 KiB
+#define BLKQ_DEPTH        8           // commands in flight, at most
+
+struct blkq_stats {
+    uint32_t requests;
+    uint32_t merged;                  // requests that shared another's command
+    uint32_t commands;                // commands issued to the device
+    uint32_t sectors;
+    uint32_t staged;                  // commands that went through a staging buffer
+    uint32_t sweeps;                  // C-LOOK wraps back to the lowest LBA
+    uint32_t depth;                   // requests queued right now
+    uint32_t max_depth;
+};
+
+// Take the staging buffers and queue to the first registered device. Call
+// once the disk drivers have registered.
+void blkq_init(void);
+
+// Wait for everything queued to finish, then queue to dev from now on.
+// Callers above blkq must not hold cached data for the old device.
+void blkq_set_device(struct blkdev *dev);
+struct blkdev *blkq_get_device(void);
+
+// Queue req; its status is ATA_PENDING until done. Returns ATA_ENODEV
+// without a device and ATA_EINVAL if the range is out of the disk.
+int blkq_submit(struct blk_request *req);
+
+// Sleep until req completes and return its status
+int blkq_wait(struct blk_request *req);
+
+// Synchronous helpers that go through the queue
+int blkq_read(uint32_t lba, uint8_t *buf, uint32_t count);
+int blkq_write(uint32_t lba, const uint8_t *buf, uint32_t count);
+int blkq_flush(void);
+
+// With the elevator off requests go out one per command in submission order
+void blkq_set_elevator(int on);
+
+const struct blkq_stats *blkq_get_stats(void);
+
+// Random reads issued one at a time, then queued FIFO, then through the
+// elevator
+void blkq_bench(unsigned int nrequests);
+
+// Sequential MB/s and random 4 KiB IOPS on every registered device
+void blkq_bench_devices(unsigned int nsectors);
+
+#endif
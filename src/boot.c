@@ -0,0 +1,61 @@
+// boot.c
+//
+// The boot-phase table. Steps are recorded in the order main() runs them;
+// the total is from main() to boot_done(), so it includes anything main()
+// does between steps as well.
+
+#include <stdint.h>
+#include "boot.h"
+#include "tsc.h"
+#include "rprintf.h"
+#include "serial.h"
+
+static struct boot_step steps[BOOT_STEPS];
+static int nsteps;
+static uint64_t t_main;                   // TSC on entry to main(), since reset
+static uint64_t t_done;
+
+void boot_start(void) {
+    t_main = rdtsc();
+}
+
+void boot_record(const char *name, uint64_t cycles) {
+    if (nsteps < BOOT_STEPS) {
+        steps[nsteps].name = name;
+        steps[nsteps].cycles = cycles;
+        nsteps++;
+    }
+}
+
+void boot_done(void) {
+    t_done = rdtsc();
+    boot_report(serial_putc);
+}
+
+static void boot_line(putc_fn_t fn, const char *name, uint64_t cycles, uint64_t total) {
+    int pad = 16;
+
+    esp_printf(fn, "boot: %s", name);
+    for (const char *s = name; *s && pad > 1; s++)
+        pad--;
+    while (pad--)
+        fn(' ');
+    esp_printf(fn, "%d us", tsc_to_us(cycles));
+    if (total)
+        esp_printf(fn, ", %d%c", div64_32(cycles * 100, total), '%');
+    esp_printf(fn, "\n");
+}
+
+void boot_report(putc_fn_t fn) {
+    uint64_t total = t_done - t_main, steps_total = 0;
+
+    if (!t_done)
+        return;
+    boot_line(fn, "before main", t_main, 0);
+    for (int i = 0; i < nsteps; i++) {
+        boot_line(fn, steps[i].name, steps[i].cycles, total);
+        steps_total += steps[i].cycles;
+    }
+    boot_line(fn, "between steps", total - steps_total, total);
+    esp_printf(fn, "boot: total %d ms (%d us)\n", tsc_to_ms(total), tsc_to_us(total));
+}
@@ -0,0 +1,42 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdint.h>
+#include "console.h"
+#include "tsc.h"
+
+/*
+ * Where boot time goes. main() runs each init step through BOOT_STEP, which
+ * records the TSC cycles it took, and calls boot_report() at the end to
+ * print the table over COM1. Cycles are kept raw, so steps that run before
+ * tsc_calibrate() are converted the same way as the rest.
+ *
+ * Every line of the table starts with "boot: ", which lets `make boot-check`
+ * pick it out of a capture that also carries trace records.
+ */
+
+#define BOOT_STEPS 32
+
+// Run stmt as the init step called name: BOOT_STEP("ata", rc = ata_init());
+#define BOOT_STEP(name, stmt) do { \
+        uint64_t boot_t0_ = rdtsc(); \
+        stmt; \
+        boot_record((name), rdtsc() - boot_t0_); \
+    } while (0)
+
+struct boot_step {
+    const char *name;
+    uint64_t cycles;
+};
+
+// First thing in main(): the TSC here is what GRUB and the firmware took
+void boot_start(void);
+void boot_record(const char *name, uint64_t cycles);
+
+// Stop the clock and print the table over COM1
+void boot_done(void);
+
+// The table again, on any console. Nothing before boot_done().
+void boot_report(putc_fn_t fn);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+typedef int (*putc_fn_t)(int c);
+
+// Print one character on the active console (framebuffer or VGA text)
+int kputc(int data);
+
+// Draw anything the framebuffer console is still holding back
+void kflush(void);
+
+// Time printing lines through each console and report cycles per line
+void console_bench(int lines);
+
+#endif
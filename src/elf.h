@@ -0,0 +1,75 @@
+#ifndef ELF_H
+#define ELF_H
+
+#include <stdint.h>
+
+// The parts of ELF32 a static i386 executable needs
+
+#define ELF_MAGIC        0x464C457F   // "\x7fELF" read as a uint32
+#define ELF_CLASS32      1
+#define ELF_DATA2LSB     1
+#define ELF_ET_EXEC      2
+#define ELF_EM_386       3
+
+#define ELF_PT_LOAD      1
+
+// Section and symbol types, for tools/profdump
+#define ELF_SHT_SYMTAB   2
+#define ELF_STT_FUNC     2
+
+// Segment flags
+#define ELF_PF_X         0x1
+#define ELF_PF_W         0x2
+#define ELF_PF_R         0x4
+
+struct elf32_ehdr {
+    uint8_t  ident[16];               // magic, class, data, version, padding
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint32_t entry;
+    uint32_t phoff;                   // program headers, from the start of the file
+    uint32_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} __attribute__((packed));
+
+struct elf32_phdr {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t filesz;
+    uint32_t memsz;                   // the part past filesz is zeros
+    uint32_t flags;
+    uint32_t align;
+} __attribute__((packed));
+
+struct elf32_shdr {
+    uint32_t name;
+    uint32_t type;
+    uint32_t flags;
+    uint32_t addr;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t link;                    // a symbol table's string table
+    uint32_t info;
+    uint32_t addralign;
+    uint32_t entsize;
+} __attribute__((packed));
+
+struct elf32_sym {
+    uint32_t name;                    // offset into the linked string table
+    uint32_t value;
+    uint32_t size;
+    uint8_t  info;                    // type in the low four bits
+    uint8_t  other;
+    uint16_t shndx;
+} __attribute__((packed));
+
+#endif
@@ -0,0 +1,1781 @@
+// fat.c
+//
+// FAT16 and FAT32, grown out of the fstest.c prototype. A directory is
+// named by its first cluster, 0 standing for FAT16's fixed root region,
+// and an entry by its directory and its index there. Paths are resolved a
+// component at a time through the dentry cache: FAT_DCACHE entries chained
+// into FAT_DCACHE_HASH buckets on the directory and the case-folded name,
+// each holding a copy of the directory entry, or nothing for a name known
+// to be missing. A miss scans the directory, putting long names together
+// on the way, and caches what it found. Entries are recycled least recently used first; creating,
+// changing or removing an entry updates every cached name for it.
+//
+// Extent lists live in FAT_MAPS fixed-size maps, in one page-allocator
+// frame taken at the first mount, keyed by first cluster and recycled least
+// recently used first. An open file points at its map but
+// doesn't pin it, so it checks the key before each use and asks again if
+// the map went to another file.
+//
+// Writers share a node per open file. A node's delayed data is a list of
+// FAT_PAGE_SIZE pages from a pool in a second frame, covering the file from
+// the end of its last cluster on. The free-cluster bitmap is exact from
+// mount on: allocation clears bits as it takes clusters and freeing sets
+// them. FAT changes collect in fat_buf one sector at a time and go to every
+// copy of the FAT when the next sector is needed or the operation ends.
+
+#include <stdint.h>
+#include "fat.h"
+#include "ide.h"
+#include "bcache.h"
+#include "klib.h"
+#include "page.h"
+#include "tsc.h"
+#include "writeback.h"
+#include "rprintf.h"
+#include "console.h"
+
+#define FAT_NONE  0xFFFF            // end of a bucket chain
+#define FAT_POOL_PAGES  512         // delayed data pages, one 2 MiB frame
+#define FAT_DIRENTS_PER_SECTOR  (ATA_SECTOR_SIZE / sizeof(struct root_directory_entry))
+#define FAT_BENCH_PATHS  256        // paths fat_bench() collects
+#define FAT_BENCH_PATH   96         // longest of them
+
+// A directory entry and where it lives
+struct fat_dent {
+    struct root_directory_entry de;
+    uint32_t dir;                   // first cluster of the directory, 0 for the root
+    uint32_t index;                 // entry number in the directory
+    uint32_t first;                 // its first long-name entry, index if none
+};
+
+struct fat_dentry {
+    uint32_t parent;                // directory looked in
+    uint32_t hash;                  // of the folded name
+    uint32_t used;                  // dcache_clock at the last hit, 0 if free
+    uint16_t hnext;                 // next entry in the bucket
+    uint8_t len;
+    uint8_t negative;               // the name isn't there
+    char name[FAT_DCACHE_NAME];     // as looked up, not as on disk
+    struct fat_dent d;
+};
+
+static int mounted = 0;
+static int fat32;                   // else FAT16
+static uint32_t fat_lba;            // the FAT read: the first, or FAT32's active one
+static uint32_t fat_per_sector;     // entries in a FAT sector
+static uint32_t fat_end;            // what we write at the end of a chain
+static uint32_t root_lba;           // FAT16's root region
+static uint32_t root_sectors;       // 0 on FAT32
+static uint32_t root_dir;           // the root's directory number
+static uint32_t fsinfo_lba;         // 0 if there is no usable FSInfo
+static int fsinfo_dirty;            // free count changed since it was written
+static uint32_t data_lba;           // cluster 2
+static uint32_t spc;                // sectors per cluster
+static uint32_t nfats;              // copies written
+static uint32_t fat_sectors;        // per copy of the FAT
+static struct fat_info info;
+static struct fat_stats stats;
+
+struct fat_extmap {
+    uint32_t start;                 // first cluster, 0 if unused
+    uint32_t used;                  // map_clock at the last open
+    uint32_t n;
+    int complete;                   // n extents reach the end of the chain
+    struct fat_extent ext[FAT_MAP_EXTENTS];
+};
+
+struct fat_node {
+    uint16_t refs;                  // opens; 0 if the node is free
+    uint32_t dir, index;            // directory entry
+    uint32_t start;                 // first cluster, 0 while there is none
+    uint32_t clusters;              // in the chain
+    uint32_t tail;                  // last cluster of the chain
+    uint32_t size;
+    uint32_t gen;                   // bumped when clusters go away
+    int dirty;                      // directory entry out of date
+    uint32_t npages;
+    uint16_t page[FAT_DELAY_PAGES]; // delayed data from clusters * cluster size on
+};
+
+static struct fat_dentry dcache[FAT_DCACHE];
+static uint16_t buckets[FAT_DCACHE_HASH];
+static uint32_t dcache_clock = 0;
+static int use_dcache = 1;          // off only to benchmark directory scans
+
+static struct fat_node nodes[FAT_NODES];
+static int delay_alloc = 1;         // off only to benchmark eager allocation
+
+// A set bit per free cluster. FAT16's fits in free_map_small; a FAT32
+// volume's goes in a frame, which caps it at eight clusters per byte of it.
+static uint32_t free_map_small[(FAT16_MAX_CLUSTERS + 2 + 31) / 32];
+static uint32_t *free_map_frame = 0;
+static uint32_t *free_map = free_map_small;
+static int free_map_built = 0;
+static uint32_t alloc_hint = 2;     // where the next search starts
+
+static uint8_t *pool = 0;
+static uint16_t pool_free[FAT_POOL_PAGES];
+static uint32_t pool_nfree = 0;
+
+// The FAT sector being changed; fat_buf_lba is 0 when there is none, as a
+// FAT never starts at sector 0
+static uint8_t fat_buf[ATA_SECTOR_SIZE];
+static uint32_t fat_buf_lba = 0;
+
+static struct fat_extmap *maps = 0;
+static uint32_t map_clock = 0;
+static int use_extents = 1;         // off only to benchmark chain walks
+
+static char fat_upper(char c) {
+    return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+// FNV-1a over the folded name
+static uint32_t fat_hash(const char *name, uint32_t len) {
+    uint32_t h = 2166136261u;
+
+    for (uint32_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)fat_upper(name[i])) * 16777619u;
+    return h;
+}
+
+static int fat_name_eq(const char *a, uint32_t len, const char *b) {
+    for (uint32_t i = 0; i < len; i++)
+        if (fat_upper(a[i]) != fat_upper(b[i]))
+            return 0;
+    return b[len] == '\0';
+}
+
+// "readme.txt" -> "README  TXT". 0 if the len bytes at name can't be an
+// 8.3 name.
+static int fat_make_key(const char *name, uint32_t len, char *key) {
+    const char *end = name + len;
+    int n = 0;
+
+    for (int i = 0; i < 11; i++)
+        key[i] = ' ';
+    if (name == end || *name == '.')
+        return 0;
+    for (; name < end && *name != '.'; name++) {
+        if (n == 8 || *name == '/' || *name == ' ')
+            return 0;
+        key[n++] = fat_upper(*name);
+    }
+    if (name < end) {
+        name++;
+        if (name == end)
+            return 0;
+        for (n = 8; name < end; name++) {
+            if (n == 11 || *name == '.' || *name == '/' || *name == ' ')
+                return 0;
+            key[n++] = fat_upper(*name);
+        }
+    }
+    if ((uint8_t)key[0] == FAT_DELETED)
+        key[0] = FAT_KANJI_E5;
+    return 1;
+}
+
+// The FAT_NT_LOWER_* flags for an 8.3 name typed as the len bytes at name:
+// a part gets one if it has lower case letters and no upper case ones
+static uint8_t fat_case_flags(const char *name, uint32_t len) {
+    uint8_t lower = 0, upper = 0, part = FAT_NT_LOWER_BASE;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (name[i] == '.')
+            part = FAT_NT_LOWER_EXT;
+        else if (name[i] >= 'a' && name[i] <= 'z')
+            lower |= part;
+        else if (name[i] >= 'A' && name[i] <= 'Z')
+            upper |= part;
+    }
+    return lower & ~upper;
+}
+
+// An entry's first cluster. The ".." of a directory just under the root
+// says 0, which on FAT32 isn't where the root is.
+static uint32_t fat_dent_cluster(const struct root_directory_entry *de) {
+    uint32_t c = de->cluster | (fat32 ? (uint32_t)de->cluster_hi << 16 : 0);
+
+    return c == 0 && (de->attribute & FAT_ATTR_DIRECTORY) ? root_dir : c;
+}
+
+static void fat_set_dent_cluster(struct root_directory_entry *de, uint32_t c) {
+    de->cluster = c;
+    if (fat32)
+        de->cluster_hi = c >> 16;
+}
+
+static void fat_fill_stat(const struct fat_dent *d, struct fat_stat *st) {
+    const struct root_directory_entry *de = &d->de;
+
+    st->ino = (uint64_t)d->dir << 32 | d->index;
+    st->size = de->file_size;
+    st->cluster = fat_dent_cluster(de);
+    st->attr = de->attribute;
+    st->mtime = de->last_modified_time;
+    st->mdate = de->last_modified_date;
+}
+
+static int fat_build_free_map(void);
+static void fat_read_fsinfo(void);
+static int fat_valid_cluster(uint32_t cluster);
+
+int fat_mount(void) {
+    struct boot_sector bs;
+    struct fat_geometry g;
+    struct pfa_stats pst;
+    struct ppage *frame;
+    struct bbuf *b;
+    uint32_t lba = 0, clusters;
+    int rc;
+
+    // Files still open on the old volume lose their delayed data otherwise
+    if (mounted)
+        fat_flush();
+    mounted = 0;
+    info.clusters = 0;
+    fat_buf_lba = 0;
+    pfa_get_stats(&pst);
+    if (!maps || !pool) {
+        // Without the frames every seek walks the chain, and every write
+        // allocates its clusters straight away
+        if (!maps && pst.frame_size >= FAT_MAPS * sizeof(struct fat_extmap) &&
+            (frame = allocate_physical_pages(1)))
+            maps = frame->physical_addr;
+        if (!pool && pst.frame_size >= FAT_POOL_PAGES * FAT_PAGE_SIZE &&
+            (frame = allocate_physical_pages(1)))
+            pool = frame->physical_addr;
+    }
+    for (int i = 0; maps && i < FAT_MAPS; i++) {
+        maps[i].start = 0;
+        maps[i].used = 0;
+    }
+    for (int i = 0; i < FAT_DCACHE; i++)
+        dcache[i].used = 0;
+    for (int i = 0; i < FAT_DCACHE_HASH; i++)
+        buckets[i] = FAT_NONE;
+    for (int i = 0; i < FAT_NODES; i++)
+        nodes[i].refs = 0;
+    pool_nfree = 0;
+    for (int i = FAT_POOL_PAGES - 1; pool && i >= 0; i--)
+        pool_free[pool_nfree++] = i;
+    if (!(b = bcache_get(0)))
+        return ATA_EIO;
+    memcpy(&bs, bcache_sector(b, 0), sizeof(bs));
+    bcache_put(b);
+    if (!fat_is_boot_sector(&bs)) {
+        // A partitioned disk: take the first MBR entry that's in use
+        if ((rc = fat_find_partition(&bs, &lba)) != ATA_OK)
+            return rc;
+        if (!(b = bcache_get(lba)))
+            return ATA_EIO;
+        memcpy(&bs, bcache_sector(b, lba), sizeof(bs));
+        bcache_put(b);
+    }
+    if ((rc = fat_parse_boot(&bs, lba, &g)) != ATA_OK)
+        return rc;
+
+    fat32 = g.fat32;
+    spc = g.spc;
+    fat_lba = g.fat_lba;
+    fat_per_sector = ATA_SECTOR_SIZE / (fat32 ? 4 : 2);
+    root_lba = g.root_lba;
+    root_sectors = g.root_sectors;
+    data_lba = g.data_lba;
+    clusters = g.clusters;
+    info.type = fat32 ? 32 : 16;
+    info.lba = lba;
+    info.clusters = clusters;
+    info.cluster_size = spc * ATA_SECTOR_SIZE;
+    info.root_entries = g.root_entries;
+    memcpy(info.label, g.label, sizeof(info.label));
+    nfats = g.nfats;
+    fat_sectors = g.fat_sectors;
+    fat_end = fat32 ? FAT32_END : FAT16_END;
+    root_dir = g.root_dir;
+    fsinfo_lba = g.fsinfo_lba;
+
+    free_map = free_map_small;
+    if (clusters + 2 > sizeof(free_map_small) * 8) {
+        if (!free_map_frame && pst.frame_size * 8 >= clusters + 2 &&
+            (frame = allocate_physical_pages(1)))
+            free_map_frame = frame->physical_addr;
+        // Free space we can't track is space we can't allocate from
+        if (!free_map_frame || pst.frame_size * 8 < clusters + 2)
+            return FAT_EBADFS;
+        free_map = free_map_frame;
+    }
+    free_map_built = 0;
+    fsinfo_dirty = 0;
+    stats.free_clusters = FSINFO_UNKNOWN;
+    alloc_hint = 2;
+    if (fsinfo_lba)
+        fat_read_fsinfo();
+    if (stats.free_clusters == FSINFO_UNKNOWN && (rc = fat_build_free_map()) != ATA_OK)
+        return rc;
+    mounted = 1;
+    return ATA_OK;
+}
+
+// cluster's entry in the FAT sector holding it
+static uint32_t fat_entry(const uint8_t *sector, uint32_t cluster) {
+    uint32_t i = cluster % fat_per_sector;
+
+    return fat32 ? ((const uint32_t *)sector)[i] & FAT32_MASK : ((const uint16_t *)sector)[i];
+}
+
+static int fat_next_cluster(uint32_t cluster, uint32_t *next) {
+    uint32_t lba = fat_lba + cluster / fat_per_sector;
+    struct bbuf *b;
+
+    stats.chain_steps++;
+    if (lba == fat_buf_lba) {
+        *next = fat_entry(fat_buf, cluster);
+        return ATA_OK;
+    }
+    if (!(b = bcache_get(lba)))
+        return ATA_EIO;
+    *next = fat_entry(bcache_sector(b, lba), cluster);
+    bcache_put(b);
+    return ATA_OK;
+}
+
+static int fat_valid_cluster(uint32_t cluster) {
+    return cluster >= 2 && cluster < info.clusters + 2;
+}
+
+// Write the sector in fat_buf to every copy of the FAT
+static int fat_buf_flush(void) {
+    int rc = ATA_OK;
+
+    for (uint32_t i = 0; fat_buf_lba && i < nfats && rc == ATA_OK; i++)
+        rc = bcache_write(fat_buf_lba + i * fat_sectors, fat_buf, 1);
+    fat_buf_lba = 0;
+    return rc;
+}
+
+static int fat_set(uint32_t cluster, uint32_t value) {
+    uint32_t lba = fat_lba + cluster / fat_per_sector;
+    int rc;
+
+    if (lba != fat_buf_lba) {
+        struct bbuf *b;
+
+        if ((rc = fat_buf_flush()) != ATA_OK)
+            return rc;
+        if (!(b = bcache_get(lba)))
+            return ATA_EIO;
+        memcpy(fat_buf, bcache_sector(b, lba), ATA_SECTOR_SIZE);
+        bcache_put(b);
+        fat_buf_lba = lba;
+    }
+    if (fat32) {
+        uint32_t *e = (uint32_t *)fat_buf + cluster % fat_per_sector;
+
+        *e = (*e & ~FAT32_MASK) | value;
+    } else {
+        ((uint16_t *)fat_buf)[cluster % fat_per_sector] = value;
+    }
+    return ATA_OK;
+}
+
+// Read the whole FAT into the free-cluster bitmap; this also makes the free
+// count exact, whatever FSInfo said
+static int fat_build_free_map(void) {
+    uint32_t end = info.clusters + 2;
+
+    for (uint32_t i = 0; i < (end + 31) / 32; i++)
+        free_map[i] = 0;
+    stats.free_clusters = 0;
+    stats.fat_scans++;
+    for (uint32_t s = 0; s * fat_per_sector < end; s++) {
+        struct bbuf *b = bcache_get(fat_lba + s);
+        const uint8_t *sector;
+
+        if (!b)
+            return ATA_EIO;
+        sector = bcache_sector(b, fat_lba + s);
+        for (uint32_t i = 0; i < fat_per_sector; i++) {
+            uint32_t c = s * fat_per_sector + i;
+
+            if (c >= 2 && c < end && fat_entry(sector, c) == 0) {
+                free_map[c / 32] |= 1u << (c % 32);
+                stats.free_clusters++;
+            }
+        }
+        bcache_put(b);
+    }
+    free_map_built = 1;
+    fsinfo_dirty = 1;
+    return ATA_OK;
+}
+
+// The bitmap, from the FAT if this is the first cluster wanted since mount
+static int fat_need_free_map(void) {
+    return free_map_built ? ATA_OK : fat_build_free_map();
+}
+
+// Take the free count and search hint from FSInfo, if it has them
+static void fat_read_fsinfo(void) {
+    struct bbuf *b = bcache_get(fsinfo_lba);
+    const struct fat32_fsinfo *fi;
+
+    if (!b) {
+        fsinfo_lba = 0;
+        return;
+    }
+    fi = (const struct fat32_fsinfo *)bcache_sector(b, fsinfo_lba);
+    if (fi->lead_signature != FSINFO_LEAD_SIG || fi->struct_signature != FSINFO_STRUCT_SIG ||
+        fi->trail_signature != FSINFO_TRAIL_SIG) {
+        // Not ours to write over either
+        fsinfo_lba = 0;
+    } else if (fi->free_count <= info.clusters) {
+        stats.free_clusters = fi->free_count;
+        if (fat_valid_cluster(fi->next_free))
+            alloc_hint = fi->next_free;
+    }
+    bcache_put(b);
+}
+
+static int fat_write_fsinfo(void) {
+    uint8_t sector[ATA_SECTOR_SIZE];
+    struct fat32_fsinfo *fi = (struct fat32_fsinfo *)sector;
+    struct bbuf *b;
+    int rc;
+
+    if (!fsinfo_lba || !fsinfo_dirty)
+        return ATA_OK;
+    if (!(b = bcache_get(fsinfo_lba)))
+        return ATA_EIO;
+    memcpy(sector, bcache_sector(b, fsinfo_lba), ATA_SECTOR_SIZE);
+    bcache_put(b);
+    fi->free_count = stats.free_clusters;
+    fi->next_free = alloc_hint;
+    if ((rc = bcache_write(fsinfo_lba, sector, 1)) == ATA_OK)
+        fsinfo_dirty = 0;
+    return rc;
+}
+
+static int fat_is_free(uint32_t c) {
+    return (free_map[c / 32] >> (c % 32)) & 1;
+}
+
+// Length of the free run at c, up to max
+static uint32_t fat_free_run(uint32_t c, uint32_t max) {
+    uint32_t n = 0;
+
+    while (n < max && c + n < info.clusters + 2 && fat_is_free(c + n))
+        n++;
+    return n;
+}
+
+/*
+ * Clusters for want more of a file whose chain ends at tail (0 if it has
+ * none): right after tail if that's free, else the first run long enough
+ * from alloc_hint on, else the longest run there is. Returns the first
+ * cluster, with the run's length in *got, or 0 if the volume is full.
+ */
+static uint32_t fat_find_run(uint32_t tail, uint32_t want, uint32_t *got) {
+    uint32_t end = info.clusters + 2, c = alloc_hint, best = 0, best_len = 0, n;
+
+    if (tail && (n = fat_free_run(tail + 1, want))) {
+        *got = n;
+        return tail + 1;
+    }
+    for (uint32_t scanned = 0; scanned < end - 2; ) {
+        if (c >= end)
+            c = 2;
+        if (c % 32 == 0 && free_map[c / 32] == 0) {
+            c += 32;
+            scanned += 32;
+            continue;
+        }
+        if (!fat_is_free(c)) {
+            c++;
+            scanned++;
+            continue;
+        }
+        n = fat_free_run(c, want);
+        if (n == want) {
+            *got = n;
+            return c;
+        }
+        if (n > best_len) {
+            best = c;
+            best_len = n;
+        }
+        c += n;
+        scanned += n;
+    }
+    *got = best_len;
+    return best;
+}
+
+static void fat_take(uint32_t first, uint32_t n) {
+    for (uint32_t c = first; c < first + n; c++)
+        free_map[c / 32] &= ~(1u << (c % 32));
+    stats.free_clusters -= n;
+    alloc_hint = first + n;
+    fsinfo_dirty = 1;
+}
+
+// Free the chain from cluster on, at most limit clusters of it
+static int fat_free_chain(uint32_t cluster, uint32_t limit) {
+    uint32_t next;
+    int rc;
+
+    while (fat_valid_cluster(cluster) && limit--) {
+        if ((rc = fat_next_cluster(cluster, &next)) != ATA_OK ||
+            (rc = fat_set(cluster, 0)) != ATA_OK)
+            return rc;
+        if (!free_map_built) {
+            // The FSInfo count until the bitmap is built
+            stats.free_clusters++;
+        } else if (!fat_is_free(cluster)) {
+            free_map[cluster / 32] |= 1u << (cluster % 32);
+            stats.free_clusters++;
+        }
+        fsinfo_dirty = 1;
+        cluster = next;
+    }
+    return ATA_OK;
+}
+
+// Walk the chain from start into m, merging consecutive clusters
+static int fat_map_build(struct fat_extmap *m, uint32_t start) {
+    uint32_t cluster = start, index = 0;
+    int rc;
+
+    m->start = 0;
+    m->n = 0;
+    m->complete = 0;
+    stats.map_builds++;
+    // A chain can't be longer than the volume, whatever loops it contains
+    while (index < info.clusters) {
+        struct fat_extent *e = m->n ? &m->ext[m->n - 1] : 0;
+
+        if (e && e->cluster + e->count == cluster) {
+            e->count++;
+        } else if (m->n == FAT_MAP_EXTENTS) {
+            break;
+        } else {
+            e = &m->ext[m->n++];
+            e->index = index;
+            e->cluster = cluster;
+            e->count = 1;
+        }
+        index++;
+        if ((rc = fat_next_cluster(cluster, &cluster)) != ATA_OK)
+            return rc;
+        if (!fat_valid_cluster(cluster)) {
+            // End of chain, or a broken one; fat_locate() reports the latter
+            m->complete = 1;
+            break;
+        }
+    }
+    m->start = start;
+    return ATA_OK;
+}
+
+// The extent map for the chain starting at start, built if need be
+static struct fat_extmap *fat_map_get(uint32_t start) {
+    struct fat_extmap *victim = &maps[0];
+
+    if (!maps || !use_extents || !fat_valid_cluster(start))
+        return 0;
+    for (int i = 0; i < FAT_MAPS; i++) {
+        if (maps[i].start == start) {
+            maps[i].used = ++map_clock;
+            stats.map_hits++;
+            return &maps[i];
+        }
+        if (maps[i].used < victim->used)
+            victim = &maps[i];
+    }
+    if (fat_map_build(victim, start) != ATA_OK)
+        return 0;
+    victim->used = ++map_clock;
+    return victim;
+}
+
+// The extent holding file cluster index, by binary search. 0 if the map
+// doesn't reach that far.
+static struct fat_extent *fat_map_find(struct fat_extmap *m, uint32_t index) {
+    uint32_t lo = 0, hi = m->n;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        struct fat_extent *e = &m->ext[mid];
+
+        if (index < e->index)
+            hi = mid;
+        else if (index >= e->index + e->count)
+            lo = mid + 1;
+        else
+            return e;
+    }
+    return 0;
+}
+
+// Drop the map of a chain that is about to change
+static void fat_map_forget(uint32_t start) {
+    for (int i = 0; maps && start && i < FAT_MAPS; i++)
+        if (maps[i].start == start)
+            maps[i].start = 0;
+}
+
+// f's map, if it still belongs to f
+static struct fat_extmap *fat_file_map(struct fat_file *f) {
+    if (!f->map || f->map->start != f->node->start)
+        f->map = fat_map_get(f->node->start);
+    return f->map;
+}
+
+// The sector holding entry index of dir. FAT_ENOENT past the end of the
+// directory.
+static int fat_dir_lba(uint32_t dir, uint32_t index, uint32_t *lba) {
+    uint32_t per_cluster = info.cluster_size / sizeof(struct root_directory_entry);
+    uint32_t want = index / per_cluster, cluster = dir;
+    struct fat_extmap *m;
+    struct fat_extent *e;
+    int rc;
+
+    if (dir == 0) {
+        if (index >= info.root_entries)
+            return FAT_ENOENT;
+        *lba = root_lba + index / FAT_DIRENTS_PER_SECTOR;
+        return ATA_OK;
+    }
+    // Most directories fit in their first cluster
+    if (want && (m = fat_map_get(dir)) && (e = fat_map_find(m, want))) {
+        cluster = e->cluster + (want - e->index);
+    } else {
+        for (uint32_t i = 0; i < want; i++) {
+            if ((rc = fat_next_cluster(cluster, &cluster)) != ATA_OK)
+                return rc;
+            if (!fat_valid_cluster(cluster))
+                return FAT_ENOENT;
+        }
+    }
+    *lba = data_lba + (cluster - 2) * spc + (index % per_cluster) / FAT_DIRENTS_PER_SECTOR;
+    return ATA_OK;
+}
+
+static int fat_get_entry(uint32_t dir, uint32_t index, struct root_directory_entry *de) {
+    uint32_t lba;
+    struct bbuf *b;
+    int rc;
+
+    if ((rc = fat_dir_lba(dir, index, &lba)) != ATA_OK)
+        return rc;
+    if (!(b = bcache_get(lba)))
+        return ATA_EIO;
+    memcpy(de, bcache_sector(b, lba) + index % FAT_DIRENTS_PER_SECTOR * sizeof(*de), sizeof(*de));
+    bcache_put(b);
+    return ATA_OK;
+}
+
+static int fat_put_entry(uint32_t dir, uint32_t index, const struct root_directory_entry *de) {
+    uint8_t sector[ATA_SECTOR_SIZE];
+    uint32_t lba;
+    struct bbuf *b;
+    int rc;
+
+    if ((rc = fat_dir_lba(dir, index, &lba)) != ATA_OK)
+        return rc;
+    if (!(b = bcache_get(lba)))
+        return ATA_EIO;
+    memcpy(sector, bcache_sector(b, lba), ATA_SECTOR_SIZE);
+    bcache_put(b);
+    memcpy(sector + index % FAT_DIRENTS_PER_SECTOR * sizeof(*de), de, sizeof(*de));
+    return bcache_write(lba, sector, 1);
+}
+
+struct fat_dir_iter {
+    uint32_t dir;
+    uint32_t index;                 // next entry to look at
+    uint32_t lba;                   // sector in buf, 0 if none
+    uint8_t buf[ATA_SECTOR_SIZE];
+};
+
+/*
+ * The next live entry from it->index on, with its long name in name if it
+ * has one whose parts are all there and match its checksum, else its 8.3
+ * name. Returns 1 with it->index past the entry, 0 at the end of the
+ * directory, or a negative error.
+ */
+static int fat_dir_next(struct fat_dir_iter *it, struct fat_dent *d, char *name) {
+    struct fat_lfn_state lfn = { -1, 0, 0 };
+    int rc;
+
+    for (;;) {
+        uint32_t index = it->index++, lba = it->lba;
+        const struct root_directory_entry *de;
+
+        if (!lba || index % FAT_DIRENTS_PER_SECTOR == 0) {
+            struct bbuf *b;
+
+            if ((rc = fat_dir_lba(it->dir, index, &lba)) != ATA_OK)
+                return rc == FAT_ENOENT ? 0 : rc;
+            if (!(b = bcache_get(lba)))
+                return ATA_EIO;
+            memcpy(it->buf, bcache_sector(b, lba), ATA_SECTOR_SIZE);
+            bcache_put(b);
+            it->lba = lba;
+        }
+        de = (const struct root_directory_entry *)it->buf + index % FAT_DIRENTS_PER_SECTOR;
+        stats.dirents_read++;
+        switch (fat_dirent_step(&lfn, de, index, name, &d->first)) {
+        case FAT_DIRENT_END:
+            it->index = index;
+            return 0;
+        case FAT_DIRENT_FILE:
+            d->de = *de;
+            d->dir = it->dir;
+            d->index = index;
+            return 1;
+        }
+    }
+}
+
+// Scan dir for the entry called name, by its long name or its 8.3 one
+static int fat_dir_find(uint32_t dir, const char *name, uint32_t len, struct fat_dent *d) {
+    struct fat_dir_iter it;
+    char found[FAT_NAME_MAX + 1], alias[13];
+    int rc;
+
+    it.dir = dir;
+    it.index = 0;
+    it.lba = 0;
+    while ((rc = fat_dir_next(&it, d, found)) == 1) {
+        if (fat_name_eq(name, len, found))
+            return ATA_OK;
+        if (d->first != d->index) {
+            fat_key_name(&d->de, alias);
+            if (fat_name_eq(name, len, alias))
+                return ATA_OK;
+        }
+    }
+    return rc == 0 ? FAT_ENOENT : rc;
+}
+
+static uint32_t fat_dcache_bucket(uint32_t parent, uint32_t hash) {
+    return (hash ^ parent * 2654435761u) & (FAT_DCACHE_HASH - 1);
+}
+
+static struct fat_dentry *fat_dcache_find(uint32_t parent, const char *name, uint32_t len,
+                                          uint32_t hash) {
+    for (uint16_t i = buckets[fat_dcache_bucket(parent, hash)]; i != FAT_NONE; i = dcache[i].hnext) {
+        struct fat_dentry *e = &dcache[i];
+
+        if (e->parent == parent && e->hash == hash && e->len == len &&
+            fat_name_eq(name, len, e->name))
+            return e;
+    }
+    return 0;
+}
+
+// Remember name in parent as d, or as missing if d is 0
+static void fat_dcache_add(uint32_t parent, const char *name, uint32_t len, uint32_t hash,
+                           const struct fat_dent *d) {
+    struct fat_dentry *e;
+    uint16_t *p;
+
+    if (len >= FAT_DCACHE_NAME)
+        return;
+    if (!(e = fat_dcache_find(parent, name, len, hash))) {
+        e = &dcache[0];
+        for (int i = 0; i < FAT_DCACHE && e->used; i++)
+            if (dcache[i].used < e->used)
+                e = &dcache[i];
+        if (e->used) {
+            for (p = &buckets[fat_dcache_bucket(e->parent, e->hash)]; *p != e - dcache;
+                 p = &dcache[*p].hnext)
+                ;
+            *p = e->hnext;
+            stats.dcache_evictions++;
+        }
+        e->parent = parent;
+        e->hash = hash;
+        e->len = len;
+        memcpy(e->name, name, len);
+        e->name[len] = '\0';
+        p = &buckets[fat_dcache_bucket(parent, hash)];
+        e->hnext = *p;
+        *p = e - dcache;
+    }
+    e->used = ++dcache_clock;
+    e->negative = !d;
+    if (d)
+        e->d = *d;
+}
+
+// Bring every name cached for the entry at d's place up to date, or with
+// gone set, mark them all missing
+static void fat_dcache_update(const struct fat_dent *d, int gone) {
+    for (int i = 0; i < FAT_DCACHE; i++) {
+        struct fat_dentry *e = &dcache[i];
+
+        if (e->used && !e->negative && e->d.dir == d->dir && e->d.index == d->index) {
+            if (gone)
+                e->negative = 1;
+            else
+                e->d.de = d->de;
+        }
+    }
+}
+
+static int fat_dir_lookup(uint32_t dir, const char *name, uint32_t len, struct fat_dent *d) {
+    uint32_t hash = fat_hash(name, len);
+    struct fat_dentry *e;
+    int rc;
+
+    if (use_dcache && (e = fat_dcache_find(dir, name, len, hash))) {
+        e->used = ++dcache_clock;
+        stats.dcache_hits++;
+        if (e->negative) {
+            stats.dcache_negative++;
+            return FAT_ENOENT;
+        }
+        *d = e->d;
+        return ATA_OK;
+    }
+    if (use_dcache)
+        stats.dcache_misses++;
+    rc = fat_dir_find(dir, name, len, d);
+    if (use_dcache && (rc == ATA_OK || rc == FAT_ENOENT))
+        fat_dcache_add(dir, name, len, hash, rc == ATA_OK ? d : 0);
+    return rc;
+}
+
+// The root has no entry of its own; this stands in for one
+static void fat_root_dent(struct fat_dent *d) {
+    for (int i = 0; i < sizeof(d->de); i++)
+        ((uint8_t *)&d->de)[i] = 0;
+    d->de.attribute = FAT_ATTR_DIRECTORY;
+    fat_set_dent_cluster(&d->de, root_dir);
+    d->dir = 0;
+    d->index = d->first = 0xFFFFFFFF;
+}
+
+/*
+ * Resolve path from the root into *d. With leaf set, stop before the last
+ * component and return it in *leaf and *leaf_len instead, with *d the
+ * directory it belongs in.
+ */
+static int fat_walk(const char *path, struct fat_dent *d, const char **leaf, uint32_t *leaf_len) {
+    int rc;
+
+    if (!mounted)
+        return ATA_ENODEV;
+    stats.lookups++;
+    fat_root_dent(d);
+    for (;;) {
+        const char *name, *rest;
+        uint32_t len = 0;
+
+        while (*path == '/')
+            path++;
+        name = path;
+        while (name[len] && name[len] != '/')
+            len++;
+        path += len;
+        for (rest = path; *rest == '/'; rest++)
+            ;
+        if (leaf && !*rest) {
+            *leaf = name;
+            *leaf_len = len;
+            return ATA_OK;
+        }
+        if (len == 0)
+            return ATA_OK;
+        if (!(d->de.attribute & FAT_ATTR_DIRECTORY))
+            return FAT_ENOTDIR;
+        if (len == 1 && name[0] == '.')
+            continue;
+        if (len == 2 && name[0] == '.' && name[1] == '.' && fat_dent_cluster(&d->de) == root_dir) {
+            // The root's parent is the root, and there's no entry saying so
+            fat_root_dent(d);
+            continue;
+        }
+        rc = len > FAT_NAME_MAX ? FAT_ENOENT : fat_dir_lookup(fat_dent_cluster(&d->de), name, len, d);
+        if (rc != ATA_OK) {
+            if (rc == FAT_ENOENT)
+                stats.misses++;
+            return rc;
+        }
+    }
+}
+
+static int fat_lookup(const char *path, struct fat_dent *d) {
+    return fat_walk(path, d, 0, 0);
+}
+
+// A free entry in dir, adding a zeroed cluster to it if it's full
+static int fat_dir_slot(uint32_t dir, uint32_t *index) {
+    static const uint8_t zero[ATA_SECTOR_SIZE];
+    uint32_t i, lba, last = dir, next, got, first;
+    int rc;
+
+    for (i = 0; (rc = fat_dir_lba(dir, i, &lba)) == ATA_OK; i += FAT_DIRENTS_PER_SECTOR) {
+        struct bbuf *b = bcache_get(lba);
+        const struct root_directory_entry *de;
+
+        if (!b)
+            return ATA_EIO;
+        de = (const struct root_directory_entry *)bcache_sector(b, lba);
+        for (int k = 0; k < FAT_DIRENTS_PER_SECTOR; k++) {
+            if (de[k].file_name[0] == 0 || (uint8_t)de[k].file_name[0] == FAT_DELETED) {
+                bcache_put(b);
+                *index = i + k;
+                return ATA_OK;
+            }
+        }
+        bcache_put(b);
+    }
+    if (rc != FAT_ENOENT)
+        return rc;
+    if (dir == 0)
+        return FAT_ENOSPC;
+
+    // i is the first entry past the end of the chain
+    for (uint32_t n = 0; n < info.clusters; n++) {
+        if ((rc = fat_next_cluster(last, &next)) != ATA_OK)
+            return rc;
+        if (!fat_valid_cluster(next))
+            break;
+        last = next;
+    }
+    if ((rc = fat_need_free_map()) != ATA_OK)
+        return rc;
+    first = stats.free_clusters ? fat_find_run(last, 1, &got) : 0;
+    if (!first)
+        return FAT_ENOSPC;
+    for (uint32_t s = 0; s < spc; s++)
+        if ((rc = bcache_write(data_lba + (first - 2) * spc + s, zero, 1)) != ATA_OK)
+            return rc;
+    fat_take(first, 1);
+    stats.allocations++;
+    stats.clusters_allocated++;
+    fat_map_forget(dir);
+    rc = fat_set(last, first);
+    if (rc == ATA_OK)
+        rc = fat_set(first, fat_end);
+    if (fat_buf_flush() != ATA_OK && rc == ATA_OK)
+        rc = ATA_EIO;
+    *index = i;
+    return rc;
+}
+
+// Find the real end of n's chain, which may run past what the size needs
+static int fat_node_tail(struct fat_node *n) {
+    struct fat_extmap *m = fat_map_get(n->start);
+    uint32_t next;
+    int rc;
+
+    n->clusters = 0;
+    n->tail = 0;
+    if (!fat_valid_cluster(n->start))
+        return ATA_OK;
+    n->tail = n->start;
+    n->clusters = 1;
+    if (m) {
+        struct fat_extent *e = &m->ext[m->n - 1];
+
+        n->tail = e->cluster + e->count - 1;
+        n->clusters = e->index + e->count;
+        if (m->complete)
+            return ATA_OK;
+    }
+    while (n->clusters <= info.clusters) {
+        if ((rc = fat_next_cluster(n->tail, &next)) != ATA_OK)
+            return rc;
+        if (!fat_valid_cluster(next))
+            return ATA_OK;
+        n->tail = next;
+        n->clusters++;
+    }
+    return ATA_EIO;
+}
+
+static struct fat_node *fat_node_find(uint32_t dir, uint32_t index) {
+    for (int i = 0; i < FAT_NODES; i++)
+        if (nodes[i].refs && nodes[i].dir == dir && nodes[i].index == index)
+            return &nodes[i];
+    return 0;
+}
+
+static int fat_node_get(struct fat_dent *d, struct fat_node **out) {
+    struct fat_node *n = fat_node_find(d->dir, d->index);
+    int rc;
+
+    if (n) {
+        n->refs++;
+        *out = n;
+        return ATA_OK;
+    }
+    for (n = nodes; n < nodes + FAT_NODES && n->refs; n++)
+        ;
+    if (n == nodes + FAT_NODES)
+        return FAT_EMFILE;
+    n->dir = d->dir;
+    n->index = d->index;
+    n->start = fat_dent_cluster(&d->de);
+    n->size = d->de.file_size;
+    n->gen = 0;
+    n->dirty = 0;
+    n->npages = 0;
+    if ((rc = fat_node_tail(n)) != ATA_OK)
+        return rc;
+    n->refs = 1;
+    *out = n;
+    return ATA_OK;
+}
+
+static int fat_page_alloc(void) {
+    uint32_t *p;
+    uint16_t page;
+
+    if (!pool_nfree)
+        return -1;
+    page = pool_free[--pool_nfree];
+    // Zeroed, so the tail of the last sector is written as zeroes
+    p = (uint32_t *)(pool + page * FAT_PAGE_SIZE);
+    for (int i = 0; i < FAT_PAGE_SIZE / 4; i++)
+        p[i] = 0;
+    return page;
+}
+
+// Give back n's delayed pages from keep on
+static void fat_drop_pages(struct fat_node *n, uint32_t keep) {
+    while (n->npages > keep)
+        pool_free[pool_nfree++] = n->page[--n->npages];
+}
+
+static uint8_t *fat_page_data(struct fat_node *n, uint32_t off) {
+    return pool + n->page[off / FAT_PAGE_SIZE] * FAT_PAGE_SIZE + off % FAT_PAGE_SIZE;
+}
+
+// Bring n's directory entry up to date with its first cluster and size
+static int fat_put_dirent(struct fat_node *n) {
+    struct fat_dent d;
+    int rc;
+
+    if ((rc = fat_get_entry(n->dir, n->index, &d.de)) != ATA_OK)
+        return rc;
+    fat_set_dent_cluster(&d.de, n->start);
+    d.de.file_size = n->size;
+    d.de.attribute |= FAT_ATTR_ARCHIVE;
+    if ((rc = fat_put_entry(n->dir, n->index, &d.de)) != ATA_OK)
+        return rc;
+    d.dir = n->dir;
+    d.index = n->index;
+    fat_dcache_update(&d, 0);
+    n->dirty = 0;
+    return ATA_OK;
+}
+
+// Write delayed bytes off .. off + count clusters of n (counted from where
+// the pages start, and clipped to len) to the run of clusters at first
+static int fat_write_pages(struct fat_node *n, uint32_t off, uint32_t len,
+                           uint32_t first, uint32_t count) {
+    uint32_t lba = data_lba + (first - 2) * spc;
+    uint32_t end = off + count * info.cluster_size;
+    int rc;
+
+    if (end > len)
+        end = len;
+    while (off < end) {
+        uint32_t chunk = FAT_PAGE_SIZE - off % FAT_PAGE_SIZE;
+
+        if (chunk > end - off)
+            chunk = end - off;
+        // Whole sectors: a short last one goes out with the page's zeroes
+        if ((rc = bcache_write(lba, fat_page_data(n, off),
+                               (chunk + ATA_SECTOR_SIZE - 1) / ATA_SECTOR_SIZE)) != ATA_OK)
+            return rc;
+        lba += chunk / ATA_SECTOR_SIZE;
+        off += chunk;
+    }
+    return ATA_OK;
+}
+
+// Allocate clusters for n's delayed data, as few runs as the free space
+// allows, and write the data, the FAT and the directory entry
+static int fat_node_flush(struct fat_node *n) {
+    uint32_t cs = info.cluster_size, have = n->clusters * cs;
+    uint32_t need, len, off = 0;
+    int rc = ATA_OK;
+
+    if (n->size > have) {
+        need = (n->size - have + cs - 1) / cs;
+        len = n->size - have;
+        if ((rc = fat_need_free_map()) != ATA_OK)
+            return rc;
+        if (need > stats.free_clusters)
+            return FAT_ENOSPC;
+        stats.node_flushes++;
+        while (need && rc == ATA_OK) {
+            uint32_t got, first = fat_find_run(n->tail, need, &got);
+
+            fat_take(first, got);
+            stats.allocations++;
+            stats.clusters_allocated += got;
+            if (n->clusters)
+                rc = fat_set(n->tail, first);
+            else
+                n->start = first;
+            for (uint32_t i = 0; i < got && rc == ATA_OK; i++)
+                rc = fat_set(first + i, i + 1 < got ? first + i + 1 : fat_end);
+            if (rc == ATA_OK)
+                rc = fat_write_pages(n, off, len, first, got);
+            off += got * cs;
+            n->clusters += got;
+            n->tail = first + got - 1;
+            need -= got;
+        }
+        if (fat_buf_flush() != ATA_OK && rc == ATA_OK)
+            rc = ATA_EIO;
+        fat_drop_pages(n, 0);
+        fat_map_forget(n->start);
+        n->dirty = 1;
+    }
+    if (n->dirty && rc == ATA_OK)
+        rc = fat_put_dirent(n);
+    return rc;
+}
+
+static int fat_open_dent(struct fat_dent *d, struct fat_file *f) {
+    struct fat_node *n;
+    int rc;
+
+    if (d->de.attribute & FAT_ATTR_DIRECTORY)
+        return FAT_EISDIR;
+    if ((rc = fat_node_get(d, &n)) != ATA_OK)
+        return rc;
+    f->node = n;
+    f->gen = n->gen;
+    f->pos = 0;
+    f->cluster = n->start;
+    f->cluster_index = 0;
+    f->map = fat_map_get(n->start);
+    f->ra_last = 0;
+    f->ra_pos = 0;
+    return ATA_OK;
+}
+
+int fat_open(const char *path, struct fat_file *f) {
+    struct fat_dent d;
+    int rc;
+
+    if ((rc = fat_lookup(path, &d)) != ATA_OK)
+        return rc;
+    return fat_open_dent(&d, f);
+}
+
+int fat_create(const char *path, struct fat_file *f) {
+    struct fat_dent d;
+    const char *leaf;
+    char key[11];
+    uint32_t len, dir;
+    int rc;
+
+    if ((rc = fat_walk(path, &d, &leaf, &len)) != ATA_OK)
+        return rc;
+    if (!(d.de.attribute & FAT_ATTR_DIRECTORY))
+        return FAT_ENOTDIR;
+    if (len == 0)
+        return FAT_EISDIR;
+    dir = fat_dent_cluster(&d.de);
+    if ((rc = fat_dir_lookup(dir, leaf, len, &d)) != FAT_ENOENT)
+        return rc == ATA_OK ? FAT_EEXIST : rc;
+    if (!fat_make_key(leaf, len, key))
+        return ATA_EINVAL;
+    if ((rc = fat_dir_slot(dir, &d.index)) != ATA_OK)
+        return rc;
+
+    for (int i = 0; i < sizeof(d.de); i++)
+        ((uint8_t *)&d.de)[i] = 0;
+    memcpy(d.de.file_name, key, 11);
+    d.de.attribute = FAT_ATTR_ARCHIVE;
+    d.de.reserved1 = fat_case_flags(leaf, len);
+    if ((rc = fat_put_entry(dir, d.index, &d.de)) != ATA_OK)
+        return rc;
+    d.dir = dir;
+    d.first = d.index;
+    // Replaces the negative entry the lookup above left
+    fat_dcache_add(dir, leaf, len, fat_hash(leaf, len), &d);
+    return fat_open_dent(&d, f);
+}
+
+int fat_close(struct fat_file *f) {
+    struct fat_node *n = f->node;
+    int rc = ATA_OK;
+
+    if (!n)
+        return ATA_OK;
+    f->node = 0;
+    if (n->refs == 1) {
+        rc = fat_node_flush(n);
+        // Whatever couldn't be written goes with the node
+        fat_drop_pages(n, 0);
+    }
+    n->refs--;
+    return rc;
+}
+
+int fat_seek(struct fat_file *f, uint32_t pos) {
+    if (pos > f->node->size)
+        return ATA_EINVAL;
+    f->pos = pos;
+    return ATA_OK;
+}
+
+uint32_t fat_size(struct fat_file *f) {
+    return f->node->size;
+}
+
+// Point f->cluster at the cluster holding f->pos: from the extent map if it
+// reaches that far, else walking forward from where the last read left off
+// or from the last mapped cluster, or from the start if pos went backwards.
+static int fat_locate(struct fat_file *f) {
+    uint32_t want = f->pos / info.cluster_size;
+    struct fat_extmap *m;
+    int rc;
+
+    if (f->gen != f->node->gen || !fat_valid_cluster(f->cluster)) {
+        // Clusters went away under us, or there were none at the last look
+        f->gen = f->node->gen;
+        f->cluster = f->node->start;
+        f->cluster_index = 0;
+    }
+    if (want == f->cluster_index && fat_valid_cluster(f->cluster))
+        return ATA_OK;
+    if ((m = fat_file_map(f))) {
+        struct fat_extent *e = fat_map_find(m, want);
+
+        if (e) {
+            f->cluster = e->cluster + (want - e->index);
+            f->cluster_index = want;
+            stats.extent_seeks++;
+            return ATA_OK;
+        }
+        if (m->complete)
+            return ATA_EIO;
+        e = &m->ext[m->n - 1];
+        if (f->cluster_index < e->index + e->count - 1 || want < f->cluster_index) {
+            f->cluster = e->cluster + e->count - 1;
+            f->cluster_index = e->index + e->count - 1;
+        }
+    }
+    if (want < f->cluster_index) {
+        f->cluster = f->node->start;
+        f->cluster_index = 0;
+    }
+    while (f->cluster_index < want) {
+        if (!fat_valid_cluster(f->cluster))
+            return ATA_EIO;
+        if ((rc = fat_next_cluster(f->cluster, &f->cluster)) != ATA_OK)
+            return rc;
+        f->cluster_index++;
+    }
+    // A chain shorter than the size says, or one through a bad cluster
+    return fat_valid_cluster(f->cluster) ? ATA_OK : ATA_EIO;
+}
+
+// Prefetch the file up to FAT_RA_BYTES past f->pos, one run of sectors per
+// extent, for a reader that carries on where its last read ended
+static void fat_readahead(struct fat_file *f) {
+    struct fat_extmap *m;
+    uint32_t pos, end, have = f->node->clusters * info.cluster_size;
+
+    if (f->pos != f->ra_last) {
+        // Random access: start over from here next time
+        f->ra_pos = f->pos;
+        return;
+    }
+    if (f->ra_pos < f->pos)
+        f->ra_pos = f->pos;
+    // Top up once the reader is halfway into what's already prefetched
+    if (f->ra_pos - f->pos > FAT_RA_BYTES / 2 || !(m = fat_file_map(f)))
+        return;
+    end = f->node->size - f->pos > FAT_RA_BYTES ? f->pos + FAT_RA_BYTES : f->node->size;
+    if (end > have)
+        end = have;
+    for (pos = f->ra_pos; pos < end; ) {
+        uint32_t index = pos / info.cluster_size;
+        struct fat_extent *e = fat_map_find(m, index);
+        uint32_t run_end, first, last;
+
+        if (!e)
+            break;
+        // Up to the end of this extent or of the window, whichever is first
+        run_end = (e->index + e->count) * info.cluster_size;
+        if (run_end > end)
+            run_end = end;
+        first = data_lba + (e->cluster + index - e->index - 2) * spc +
+                (pos % info.cluster_size) / ATA_SECTOR_SIZE;
+        last = first + (run_end - 1) / ATA_SECTOR_SIZE - pos / ATA_SECTOR_SIZE;
+        bcache_prefetch(first, last - first + 1);
+        stats.ra_sectors += last - first + 1;
+        pos = run_end;
+    }
+    if (pos > f->ra_pos)
+        f->ra_pos = pos;
+}
+
+int fat_read(struct fat_file *f, void *buf, uint32_t len) {
+    struct fat_node *n = f->node;
+    uint8_t *dst = buf;
+    uint32_t done = 0;
+    int rc;
+
+    if (!mounted)
+        return ATA_ENODEV;
+    if (f->pos >= n->size)
+        return 0;
+    if (len > n->size - f->pos)
+        len = n->size - f->pos;
+    fat_readahead(f);
+    while (done < len) {
+        uint32_t have = n->clusters * info.cluster_size;
+        uint32_t in_cluster, lba, off, chunk;
+        struct bbuf *b;
+
+        if (f->pos >= have) {
+            // Delayed data, with no clusters behind it yet
+            off = f->pos - have;
+            chunk = FAT_PAGE_SIZE - off % FAT_PAGE_SIZE;
+            if (chunk > len - done)
+                chunk = len - done;
+            memcpy(dst + done, fat_page_data(n, off), chunk);
+            f->pos += chunk;
+            done += chunk;
+            continue;
+        }
+        if ((rc = fat_locate(f)) != ATA_OK)
+            return done ? done : rc;
+        in_cluster = f->pos % info.cluster_size;
+        lba = data_lba + (f->cluster - 2) * spc + in_cluster / ATA_SECTOR_SIZE;
+        off = f->pos % ATA_SECTOR_SIZE;
+        chunk = ATA_SECTOR_SIZE - off;
+        if (chunk > len - done)
+            chunk = len - done;
+        if (!(b = bcache_get(lba)))
+            return done ? done : ATA_EIO;
+        memcpy(dst + done, bcache_sector(b, lba) + off, chunk);
+        bcache_put(b);
+        f->pos += chunk;
+        done += chunk;
+    }
+    f->ra_last = f->pos;
+    return done;
+}
+
+// Overwrite data that already has clusters, up to the end of the cluster
+// holding f->pos. Returns the bytes written or a negative error.
+static int fat_write_in_place(struct fat_file *f, const uint8_t *src, uint32_t len) {
+    uint32_t lba, off, left;
+    uint8_t sector[ATA_SECTOR_SIZE];
+    struct bbuf *b;
+    int rc;
+
+    if ((rc = fat_locate(f)) != ATA_OK)
+        return rc;
+    lba = data_lba + (f->cluster - 2) * spc + (f->pos % info.cluster_size) / ATA_SECTOR_SIZE;
+    off = f->pos % ATA_SECTOR_SIZE;
+    left = info.cluster_size - f->pos % info.cluster_size;
+    if (off == 0 && len >= ATA_SECTOR_SIZE) {
+        uint32_t n = (len < left ? len : left) / ATA_SECTOR_SIZE;
+
+        rc = bcache_write(lba, src, n);
+        return rc == ATA_OK ? n * ATA_SECTOR_SIZE : rc;
+    }
+    // Part of one sector: merge with what's there
+    if (len > ATA_SECTOR_SIZE - off)
+        len = ATA_SECTOR_SIZE - off;
+    if (!(b = bcache_get(lba)))
+        return ATA_EIO;
+    memcpy(sector, bcache_sector(b, lba), ATA_SECTOR_SIZE);
+    bcache_put(b);
+    memcpy(sector + off, src, len);
+    rc = bcache_write(lba, sector, 1);
+    return rc == ATA_OK ? len : rc;
+}
+
+// One more cluster on the end of n's chain
+static int fat_node_grow(struct fat_node *n) {
+    uint32_t got, first;
+    int rc;
+
+    if ((rc = fat_need_free_map()) != ATA_OK)
+        return rc;
+    first = stats.free_clusters ? fat_find_run(n->tail, 1, &got) : 0;
+    if (!first)
+        return FAT_ENOSPC;
+    fat_take(first, 1);
+    stats.allocations++;
+    stats.clusters_allocated++;
+    fat_map_forget(n->start);
+    if (n->clusters)
+        rc = fat_set(n->tail, first);
+    else
+        n->start = first;
+    if (rc == ATA_OK)
+        rc = fat_set(first, fat_end);
+    if (fat_buf_flush() != ATA_OK && rc == ATA_OK)
+        rc = ATA_EIO;
+    n->clusters++;
+    n->tail = first;
+    n->dirty = 1;
+    return rc;
+}
+
+int fat_write(struct fat_file *f, const void *buf, uint32_t len) {
+    struct fat_node *n = f->node;
+    const uint8_t *src = buf;
+    uint32_t done = 0;
+    int rc = ATA_OK;
+
+    if (!mounted)
+        return ATA_ENODEV;
+    // File sizes are 32 bits
+    if (len > 0xFFFFFFFF - f->pos)
+        len = 0xFFFFFFFF - f->pos;
+    while (done < len) {
+        uint32_t have = n->clusters * info.cluster_size, chunk, off;
+        int page;
+
+        if (f->pos < have) {
+            if ((rc = fat_write_in_place(f, src + done, len - done)) < 0)
+                break;
+            chunk = rc;
+        } else {
+            off = f->pos - have;
+            if (!pool) {
+                // Nowhere to delay the data: allocate as we go
+                if ((rc = fat_node_grow(n)) != ATA_OK)
+                    break;
+                continue;
+            }
+            if (off / FAT_PAGE_SIZE >= FAT_DELAY_PAGES) {
+                // As much delayed data as a file may hold: allocate for it
+                if ((rc = fat_node_flush(n)) != ATA_OK)
+                    break;
+                continue;
+            }
+            if (off / FAT_PAGE_SIZE == n->npages) {
+                if ((page = fat_page_alloc()) < 0) {
+                    // The pool is shared; flushing every file empties it
+                    if ((rc = fat_flush()) != ATA_OK)
+                        break;
+                    continue;
+                }
+                n->page[n->npages++] = page;
+            }
+            chunk = FAT_PAGE_SIZE - off % FAT_PAGE_SIZE;
+            if (chunk > len - done)
+                chunk = len - done;
+            memcpy(fat_page_data(n, off), src + done, chunk);
+            stats.delayed_bytes += chunk;
+        }
+        f->pos += chunk;
+        done += chunk;
+        if (f->pos > n->size) {
+            n->size = f->pos;
+            n->dirty = 1;
+        }
+    }
+    if (!delay_alloc && rc >= 0)
+        rc = fat_node_flush(n);
+    return done ? (int)done : rc;
+}
+
+int fat_truncate(struct fat_file *f, uint32_t size) {
+    struct fat_node *n = f->node;
+    uint32_t cs = info.cluster_size, have = n->clusters * cs;
+    uint32_t keep = (size + cs - 1) / cs, cut, pos = f->pos;
+    int rc;
+
+    if (!mounted)
+        return ATA_ENODEV;
+    if (size > n->size)
+        return ATA_EINVAL;
+    if (size <= have)
+        fat_drop_pages(n, 0);
+    else
+        fat_drop_pages(n, (size - have + FAT_PAGE_SIZE - 1) / FAT_PAGE_SIZE);
+    if (keep < n->clusters) {
+        if (keep == 0) {
+            cut = n->start;
+            n->start = 0;
+            n->tail = 0;
+        } else {
+            // Find the new last cluster through f, then put f back
+            f->pos = (keep - 1) * cs;
+            rc = fat_locate(f);
+            f->pos = pos;
+            if (rc != ATA_OK ||
+                (rc = fat_next_cluster(f->cluster, &cut)) != ATA_OK ||
+                (rc = fat_set(f->cluster, fat_end)) != ATA_OK)
+                return rc;
+            n->tail = f->cluster;
+        }
+        fat_map_forget(keep ? n->start : cut);
+        rc = fat_free_chain(cut, n->clusters - keep);
+        if (fat_buf_flush() != ATA_OK && rc == ATA_OK)
+            rc = ATA_EIO;
+        n->clusters = keep;
+        n->gen++;
+        if (rc != ATA_OK)
+            return rc;
+    }
+    n->size = size;
+    if (f->pos > size)
+        f->pos = size;
+    return fat_put_dirent(n);
+}
+
+int fat_unlink(const char *path) {
+    struct root_directory_entry de;
+    struct fat_dent d;
+    int rc;
+
+    if ((rc = fat_lookup(path, &d)) != ATA_OK)
+        return rc;
+    if (d.de.attribute & FAT_ATTR_DIRECTORY)
+        return FAT_EISDIR;
+    if (fat_node_find(d.dir, d.index))
+        return FAT_EBUSY;
+
+    fat_map_forget(fat_dent_cluster(&d.de));
+    rc = fat_free_chain(fat_dent_cluster(&d.de), info.clusters);
+    if (fat_buf_flush() != ATA_OK && rc == ATA_OK)
+        rc = ATA_EIO;
+    // The 8.3 entry and the long name in front of it
+    for (uint32_t i = d.first; i <= d.index && rc == ATA_OK; i++) {
+        if ((rc = fat_get_entry(d.dir, i, &de)) != ATA_OK)
+            break;
+        de.file_name[0] = FAT_DELETED;
+        rc = fat_put_entry(d.dir, i, &de);
+    }
+    fat_dcache_update(&d, 1);
+    return rc;
+}
+
+int fat_flush(void) {
+    int rc = ATA_OK, r;
+
+    for (int i = 0; i < FAT_NODES; i++)
+        if (nodes[i].refs && (r = fat_node_flush(&nodes[i])) != ATA_OK && rc == ATA_OK)
+            rc = r;
+    if (mounted && (r = fat_write_fsinfo()) != ATA_OK && rc == ATA_OK)
+        rc = r;
+    return rc;
+}
+
+int fat_stat(const char *path, struct fat_stat *st) {
+    struct fat_dent d;
+    struct fat_node *n;
+    int rc;
+
+    if ((rc = fat_lookup(path, &d)) != ATA_OK)
+        return rc;
+    fat_fill_stat(&d, st);
+    // An open file may have grown since its entry was written
+    if ((n = fat_node_find(d.dir, d.index))) {
+        st->size = n->size;
+        st->cluster = n->start;
+    }
+    return ATA_OK;
+}
+
+int fat_readdir(const char *path, uint32_t *cookie, char *name, struct fat_stat *st) {
+    struct fat_dir_iter it;
+    struct fat_dent d;
+    int rc;
+
+    if ((rc = fat_lookup(path, &d)) != ATA_OK)
+        return rc;
+    if (!(d.de.attribute & FAT_ATTR_DIRECTORY))
+        return FAT_ENOTDIR;
+    it.dir = fat_dent_cluster(&d.de);
+    it.index = *cookie;
+    it.lba = 0;
+    if ((rc = fat_dir_next(&it, &d, name)) != 1)
+        return rc;
+    *cookie = it.index;
+    fat_fill_stat(&d, st);
+    return 1;
+}
+
+const struct fat_info *fat_get_info(void) {
+    return mounted ? &info : 0;
+}
+
+const struct fat_stats *fat_get_stats(void) {
+    return &stats;
+}
+
+// Random sector reads across the largest file, walking its chain and then
+// through its extents
+static void fat_bench_seek(const char *name, unsigned int nreads) {
+    struct fat_file f;
+    uint8_t sector[ATA_SECTOR_SIZE];
+    uint32_t seed = 1, steps;
+    uint64_t t0, elapsed;
+
+    for (use_extents = 0; use_extents < 2; use_extents++) {
+        if (fat_open(name, &f) != ATA_OK)
+            break;
+        steps = stats.chain_steps;
+        t0 = rdtsc();
+        for (uint32_t i = 0; i < nreads; i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            fat_seek(&f, seed % fat_size(&f) & ~(ATA_SECTOR_SIZE - 1));
+            if (fat_read(&f, sector, sizeof(sector)) <= 0)
+                break;
+        }
+        elapsed = rdtsc() - t0;
+        fat_close(&f);
+        esp_printf(kputc, "%s: %d random reads in %d us, %d cycles each, %d FAT links followed\n",
+                   use_extents ? "extents" : "chain  ", nreads, tsc_to_us(elapsed),
+                   div64_32(elapsed, nreads), stats.chain_steps - steps);
+    }
+    use_extents = 1;
+}
+
+void fat_bench(unsigned int nlookups) {
+    // The volume's paths breadth first, as many as fit, then one that isn't
+    // there; paths[0] is the root
+    static char paths[FAT_BENCH_PATHS + 1][FAT_BENCH_PATH];
+    static char name[FAT_NAME_MAX + 1];
+    struct fat_stat st;
+    uint32_t n = 1, depth = 0, largest = 0, largest_size = 0, misses[2], hits, asked;
+    uint64_t t0, elapsed[2];
+
+    if (!mounted) {
+        esp_printf(kputc, "no FAT volume mounted\n");
+        return;
+    }
+    paths[0][0] = '\0';
+    for (uint32_t q = 0; q < n && n < FAT_BENCH_PATHS; q++) {
+        uint32_t cookie = 0, plen = strlen(paths[q]), d = 1;
+
+        if (fat_stat(paths[q], &st) != ATA_OK || !(st.attr & FAT_ATTR_DIRECTORY))
+            continue;
+        for (uint32_t i = 0; i < plen; i++)
+            d += paths[q][i] == '/';
+        while (n < FAT_BENCH_PATHS && fat_readdir(paths[q], &cookie, name, &st) > 0) {
+            uint32_t len = strlen(name);
+
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+                plen + 1 + len >= FAT_BENCH_PATH)
+                continue;
+            memcpy(paths[n], paths[q], plen);
+            paths[n][plen] = '/';
+            memcpy(paths[n] + plen + 1, name, len + 1);
+            if (!(st.attr & FAT_ATTR_DIRECTORY) && st.size > largest_size) {
+                largest = n;
+                largest_size = st.size;
+            }
+            if (d > depth)
+                depth = d;
+            n++;
+        }
+    }
+    memcpy(paths[n++], "/NOSUCH.FIL", 12);
+    if (nlookups == 0)
+        nlookups = 1;
+
+    for (use_dcache = 0; use_dcache < 2; use_dcache++) {
+        misses[use_dcache] = 0;
+        hits = stats.dcache_hits;
+        asked = stats.dcache_hits + stats.dcache_misses;
+        t0 = rdtsc();
+        for (uint32_t i = 0; i < nlookups; i++)
+            if (fat_stat(paths[1 + i % (n - 1)], &st) != ATA_OK)
+                misses[use_dcache]++;
+        elapsed[use_dcache] = rdtsc() - t0;
+    }
+    use_dcache = 1;
+    hits = stats.dcache_hits - hits;
+    asked = stats.dcache_hits + stats.dcache_misses - asked;
+    esp_printf(kputc, "%d paths, %d levels deep, %d lookups each way\n", n - 2, depth, nlookups);
+    esp_printf(kputc, "scan:   %d us, %d cycles per lookup, %d misses\n",
+               tsc_to_us(elapsed[0]), div64_32(elapsed[0], nlookups), misses[0]);
+    esp_printf(kputc, "dcache: %d us, %d cycles per lookup, %d misses, hit rate %d%c\n",
+               tsc_to_us(elapsed[1]), div64_32(elapsed[1], nlookups), misses[1],
+               asked ? div64_32((uint64_t)hits * 100, asked) : 0, '%');
+    if (largest_size) {
+        esp_printf(kputc, "%s, %d bytes:\n", paths[largest], largest_size);
+        fat_bench_seek(paths[largest], nlookups < 1000 ? nlookups : 1000);
+    }
+}
+
+// Extents in name's chain, as the map sees them
+static uint32_t fat_count_extents(const char *name) {
+    struct fat_extmap *m;
+    struct fat_dent d;
+
+    if (fat_lookup(name, &d) != ATA_OK || !(m = fat_map_get(fat_dent_cluster(&d.de))))
+        return 0;
+    return m->n;
+}
+
+void fat_bench_write(unsigned int kib) {
+    static const char *names[2] = { "BENCH0.DAT", "BENCH1.DAT" };
+    static uint8_t chunk[FAT_PAGE_SIZE];
+    struct fat_file f[2];
+    uint64_t t0;
+    uint32_t us;
+    int rc = ATA_OK;
+
+    if (!mounted) {
+        esp_printf(kputc, "no FAT volume mounted\n");
+        return;
+    }
+    for (int i = 0; i < FAT_PAGE_SIZE; i++)
+        chunk[i] = i;
+    for (delay_alloc = 0; delay_alloc < 2 && rc == ATA_OK; delay_alloc++) {
+        for (int i = 0; i < 2; i++) {
+            fat_unlink(names[i]);
+            if ((rc = fat_create(names[i], &f[i])) != ATA_OK) {
+                esp_printf(kputc, "create %s failed: %d\n", names[i], rc);
+                if (i)
+                    fat_close(&f[0]);
+                goto out;
+            }
+        }
+        t0 = rdtsc();
+        // Appends to the two files in turn, the way two logs grow
+        for (uint32_t k = 0; k < kib / (FAT_PAGE_SIZE / 1024) && rc == ATA_OK; k++)
+            for (int i = 0; i < 2 && rc == ATA_OK; i++)
+                if ((rc = fat_write(&f[i], chunk, FAT_PAGE_SIZE)) == FAT_PAGE_SIZE)
+                    rc = ATA_OK;
+        for (int i = 0; i < 2; i++)
+            if (fat_close(&f[i]) != ATA_OK && rc == ATA_OK)
+                rc = ATA_EIO;
+        if (rc == ATA_OK)
+            rc = wb_sync();
+        us = tsc_to_us(rdtsc() - t0);
+        if (us == 0)
+            us = 1;
+        if (rc != ATA_OK) {
+            esp_printf(kputc, "append failed: %d\n", rc);
+            break;
+        }
+        esp_printf(kputc, "%s allocation: 2 x %d KiB in %d us, %d KiB/s, %d and %d extents\n",
+                   delay_alloc ? "delayed" : "eager  ", kib, us,
+                   div64_32((uint64_t)2 * kib * 1000000, us),
+                   fat_count_extents(names[0]), fat_count_extents(names[1]));
+    }
+out:
+    for (int i = 0; i < 2; i++)
+        fat_unlink(names[i]);
+    delay_alloc = 1;
+    wb_sync();
+}
@@ -0,0 +1,374 @@
+#ifndef FAT_H
+#define FAT_H
+
+#include <stdint.h>
+
+/*
+ * FAT16 and FAT32 on-disk structures, shared by fstest.c on the host and
+ * the kernel driver in fat.c. The driver's parsing of them is in
+ * fat_parse.c, which is also built for the host (see `make hostlib`).
+ *
+ * The driver mounts the volume on the block queue's current device: the
+ * disk itself if sector 0 is a FAT boot sector, otherwise the first MBR
+ * partition (rootfs.img puts it at LBA 2048). Everything it reads goes
+ * through the buffer cache. The cluster count decides between FAT16 and
+ * FAT32, as the specification says; a FAT32 root directory is a cluster
+ * chain like any other directory.
+ *
+ * Names are paths from the root, '/'-separated, matched without regard to
+ * case against both the VFAT long name of an entry and its 8.3 alias. Each
+ * component found, or found missing, goes into a dentry cache keyed by the
+ * directory's first cluster and a hash of the name, so opening the same
+ * deep path again costs one hash probe per component instead of a scan of
+ * every directory on the way.
+ *
+ * Opening a file also turns its cluster chain into a list of extents (runs
+ * of consecutive clusters), kept for the FAT_MAPS most recently opened
+ * files. A seek is then a binary search of the list rather than a walk of
+ * the chain, and a sequential reader has the next FAT_RA_BYTES of the file
+ * prefetched extent by extent, across fragment boundaries the buffer
+ * cache's own read-ahead can't see.
+ *
+ * Writes go through a per-file node shared by everyone who has the file
+ * open. Overwrites land in the buffer cache straight away, but data past
+ * the file's last cluster waits in RAM pages with no clusters behind it
+ * until the node is flushed (on the last close, on fat_flush(), or when the
+ * pages run out). The flush then allocates every cluster the file needs in
+ * one go, from a free-cluster bitmap built at mount, so a file written in
+ * small pieces still ends up in one contiguous run. FAT and directory
+ * sectors are modified in the buffer cache and reach the disk through the
+ * write-back layer with everything else; wb_sync() is the durability point.
+ *
+ * A FAT32 volume's FSInfo sector gives the free cluster count, so mount
+ * doesn't read the whole FAT to find it; the free-cluster bitmap is only
+ * built from the FAT when something first needs a cluster. fat_flush()
+ * writes the count back.
+ */
+
+struct boot_sector {
+    uint8_t code[3];                 // jump over the BPB
+    char os_name[8];
+    uint16_t bytes_per_sector;
+    uint8_t num_sectors_per_cluster;
+    uint16_t num_reserved_sectors;
+    uint8_t num_fat_tables;
+    uint16_t num_root_dir_entries;
+    uint16_t total_sectors;          // 0 if it doesn't fit, see total_sectors_in_fs
+    uint8_t media_descriptor;
+    uint16_t num_sectors_per_fat;
+    uint16_t num_sectors_per_track;
+    uint16_t num_heads;
+    uint32_t num_hidden_sectors;
+    uint32_t total_sectors_in_fs;
+    uint8_t logical_drive_num;
+    uint8_t reserved;
+    uint8_t extended_signature;
+    uint32_t serial_number;
+    char volume_label[11];
+    char fs_type[8];                 // "FAT16   ", informational only
+    uint8_t boot_code[448];
+    uint16_t boot_signature;         // 0xAA55
+} __attribute__((packed));
+
+// What follows total_sectors_in_fs on FAT32 instead of the FAT16 fields
+struct fat32_bpb {
+    uint32_t num_sectors_per_fat;    // the 16-bit field is 0
+    uint16_t ext_flags;              // FAT32_NO_MIRROR, active FAT in bits 0-3
+    uint16_t fs_version;             // 0
+    uint32_t root_cluster;
+    uint16_t fsinfo_sector;          // from the volume's first sector
+    uint16_t backup_boot_sector;
+    uint8_t reserved[12];
+    uint8_t logical_drive_num;
+    uint8_t reserved1;
+    uint8_t extended_signature;
+    uint32_t serial_number;
+    char volume_label[11];
+    char fs_type[8];                 // "FAT32   ", informational only
+} __attribute__((packed));
+
+#define FAT32_BPB_OFFSET    36
+#define FAT32_NO_MIRROR     0x80     // in ext_flags: only the active FAT is kept
+
+struct fat32_fsinfo {
+    uint32_t lead_signature;         // FSINFO_LEAD_SIG
+    uint8_t reserved[480];
+    uint32_t struct_signature;       // FSINFO_STRUCT_SIG
+    uint32_t free_count;             // 0xFFFFFFFF if unknown
+    uint32_t next_free;              // where to start looking, 0xFFFFFFFF if unknown
+    uint8_t reserved2[12];
+    uint32_t trail_signature;        // FSINFO_TRAIL_SIG
+} __attribute__((packed));
+
+#define FSINFO_LEAD_SIG     0x41615252
+#define FSINFO_STRUCT_SIG   0x61417272
+#define FSINFO_TRAIL_SIG    0xAA550000
+#define FSINFO_UNKNOWN      0xFFFFFFFF
+
+struct root_directory_entry {
+    char file_name[8];               // space padded; 0xE5 deleted, 0 end of directory
+    char file_extension[3];
+    uint8_t attribute;               // FAT_ATTR_*
+    uint8_t reserved1;               // FAT_NT_LOWER_*
+    uint8_t creation_time_tenths;
+    uint16_t creation_time;
+    uint16_t creation_date;
+    uint16_t last_access_date;
+    uint16_t cluster_hi;             // high half of cluster on FAT32, 0 on FAT16
+    uint16_t last_modified_time;
+    uint16_t last_modified_date;
+    uint16_t cluster;
+    uint32_t file_size;
+} __attribute__((packed));
+
+#define FAT_ATTR_READONLY   0x01
+#define FAT_ATTR_HIDDEN     0x02
+#define FAT_ATTR_SYSTEM     0x04
+#define FAT_ATTR_VOLUME     0x08
+#define FAT_ATTR_DIRECTORY  0x10
+#define FAT_ATTR_ARCHIVE    0x20
+#define FAT_ATTR_LFN        0x0F     // a long-name fragment, not a file
+
+// Set by Windows and Linux for an 8.3 name that was typed in lower case
+#define FAT_NT_LOWER_BASE   0x08
+#define FAT_NT_LOWER_EXT    0x10
+
+#define FAT_DELETED         0xE5
+#define FAT_KANJI_E5        0x05     // a name really starting with 0xE5
+
+// 13 characters of a VFAT long name, in UCS-2. A name's entries sit just
+// before its 8.3 entry, last part first.
+struct fat_lfn_entry {
+    uint8_t seq;                     // part number from 1, FAT_LFN_LAST on the last
+    uint16_t name1[5];
+    uint8_t attribute;               // FAT_ATTR_LFN
+    uint8_t type;                    // 0
+    uint8_t checksum;                // of the 8.3 name it belongs to
+    uint16_t name2[6];
+    uint16_t cluster;                // 0
+    uint16_t name3[2];
+} __attribute__((packed));
+
+#define FAT_LFN_LAST        0x40
+#define FAT_LFN_CHARS       13
+#define FAT_LFN_MAX_PARTS   20       // 255 characters
+#define FAT_NAME_MAX        255
+
+// One of the four primary entries at offset 446 of the MBR
+struct mbr_partition {
+    uint8_t status;
+    uint8_t chs_first[3];
+    uint8_t type;
+    uint8_t chs_last[3];
+    uint32_t lba_first;
+    uint32_t num_sectors;
+} __attribute__((packed));
+
+#define MBR_PARTITION_OFFSET 446
+
+// FAT16 values at and above this end a chain; 0xFFF7 marks a bad cluster
+#define FAT16_EOC           0xFFF8
+#define FAT16_END           0xFFFF   // what we write at the end of a chain
+#define FAT16_BAD           0xFFF7
+#define FAT16_MIN_CLUSTERS  4085     // fewer means FAT12
+#define FAT16_MAX_CLUSTERS  65524    // more means FAT32
+
+// FAT32 entries are 28 bits; the top four are kept as they are
+#define FAT32_MASK          0x0FFFFFFF
+#define FAT32_END           0x0FFFFFFF
+#define FAT32_MAX_CLUSTERS  0x0FFFFFF5
+
+#define FAT_DCACHE          512      // names cached, found or not
+#define FAT_DCACHE_HASH     256      // must be a power of two
+#define FAT_DCACHE_NAME     48       // longer names aren't cached
+
+#define FAT_MAPS            64       // files with a cached extent list
+#define FAT_MAP_EXTENTS     2048     // past these the chain is walked
+#define FAT_RA_BYTES        (128 * 1024)
+
+#define FAT_NODES           16       // files open at once
+#define FAT_PAGE_SIZE       4096
+#define FAT_DELAY_PAGES     64       // unallocated data per file, 256 KiB
+
+// Return codes on top of the ATA_* ones, which pass through unchanged
+#define FAT_ENOENT     -5
+#define FAT_EBADFS     -6            // not a FAT volume we can mount
+#define FAT_EISDIR     -7
+#define FAT_ENOSPC     -8
+#define FAT_EEXIST     -9
+#define FAT_EBUSY      -10           // the file is open
+#define FAT_EMFILE     -11           // FAT_NODES files already open
+#define FAT_ENOTDIR    -12           // a path goes through a file
+
+struct fat_stat {
+    uint64_t ino;                    // directory << 32 | index of the entry
+    uint32_t size;
+    uint32_t cluster;                // first cluster, 0 for an empty file
+    uint8_t attr;
+    uint16_t mtime, mdate;           // FAT-packed
+};
+
+// File clusters index .. index + count - 1 are disk clusters cluster ..
+struct fat_extent {
+    uint32_t index;
+    uint32_t cluster;
+    uint32_t count;
+};
+
+struct fat_extmap;
+struct fat_node;
+
+// An open file. Remembers the cluster under the last position read, so a
+// read past the mapped extents follows each FAT link once.
+struct fat_file {
+    struct fat_node *node;
+    uint32_t gen;                    // node->gen when cluster was looked up
+    uint32_t pos;
+    uint32_t cluster;                // cluster number cluster_index of the chain
+    uint32_t cluster_index;
+    struct fat_extmap *map;          // checked against the first cluster before use
+    uint32_t ra_last;                // where the last read ended
+    uint32_t ra_pos;                 // prefetched up to here
+};
+
+struct fat_info {
+    uint32_t type;                   // 16 or 32
+    uint32_t lba;                    // first sector of the volume
+    uint32_t clusters;
+    uint32_t cluster_size;           // bytes
+    uint32_t root_entries;           // 0 on FAT32, where the root can grow
+    char label[12];
+};
+
+struct fat_stats {
+    uint32_t lookups;                // paths resolved
+    uint32_t misses;                 // lookups of names that aren't there
+    uint32_t dcache_hits;            // components found in the dentry cache
+    uint32_t dcache_negative;        // of which cached as missing
+    uint32_t dcache_misses;          // components looked for on disk
+    uint32_t dcache_evictions;
+    uint32_t dirents_read;           // directory entries parsed by those scans
+    uint32_t chain_steps;            // FAT links followed
+    uint32_t map_builds;
+    uint32_t map_hits;               // opens that found the extents cached
+    uint32_t extent_seeks;           // positions found by binary search
+    uint32_t ra_sectors;             // sectors prefetched along extents
+    uint32_t free_clusters;          // an FSInfo hint until the bitmap is built
+    uint32_t fat_scans;              // full reads of the FAT to build the bitmap
+    uint32_t node_flushes;
+    uint32_t allocations;            // contiguous runs handed out
+    uint32_t clusters_allocated;
+    uint32_t delayed_bytes;          // written into pages ahead of allocation
+};
+
+// A volume's layout, from fat_parse_boot()
+struct fat_geometry {
+    uint32_t lba;                    // first sector of the volume
+    uint32_t fat_lba;                // the FAT read: the first, or FAT32's active one
+    uint32_t fat_sectors;            // per copy of the FAT
+    uint32_t nfats;                  // copies written
+    uint32_t root_lba;               // FAT16's root region
+    uint32_t root_sectors;           // 0 on FAT32
+    uint32_t root_entries;           // 0 on FAT32
+    uint32_t root_dir;               // FAT32's root cluster, 0 on FAT16
+    uint32_t data_lba;               // cluster 2
+    uint32_t spc;                    // sectors per cluster
+    uint32_t clusters;
+    uint32_t fsinfo_lba;             // 0 if there is no usable FSInfo
+    int fat32;                       // else FAT16
+    char label[12];
+};
+
+// What fat_dirent_step() carries from one entry of a directory to the next.
+// Start with want = -1.
+struct fat_lfn_state {
+    int want;                        // long-name part expected next; 0 all there
+    uint32_t first;                  // entry the long name started at
+    uint8_t sum;                     // its checksum
+};
+
+#define FAT_DIRENT_END      0        // the end-of-directory marker
+#define FAT_DIRENT_FILE     1        // a live entry, named
+#define FAT_DIRENT_SKIP     2        // deleted, a volume label, or part of a long name
+
+// Whether bs looks like a FAT boot sector with 512-byte sectors
+int fat_is_boot_sector(const struct boot_sector *bs);
+
+// The first sector of the first partition in use in an MBR, or FAT_EBADFS
+int fat_find_partition(const struct boot_sector *mbr, uint32_t *lba);
+
+// Check the boot sector of a volume starting at lba and fill in g.
+// FAT_EBADFS for anything the driver wouldn't mount.
+int fat_parse_boot(const struct boot_sector *bs, uint32_t lba, struct fat_geometry *g);
+
+// An 8.3 name's long-name checksum
+uint8_t fat_lfn_checksum(const char *key);
+
+// de's 8.3 name as "readme.txt"; name holds at least 13 bytes
+void fat_key_name(const struct root_directory_entry *de, char *name);
+
+// Feed a directory's entries in order. For FAT_DIRENT_FILE, name (at least
+// FAT_NAME_MAX + 1 bytes, also used between calls) has the long name if
+// every part of it was there, else the 8.3 name, and *first is the entry
+// the name starts at.
+int fat_dirent_step(struct fat_lfn_state *s, const struct root_directory_entry *de, uint32_t index,
+                    char *name, uint32_t *first);
+
+// Find and check the volume on the current block device. Anything cached
+// from a previous mount is dropped.
+int fat_mount(void);
+
+int fat_open(const char *path, struct fat_file *f);
+
+// Create an empty file and open it. FAT_EEXIST if the name is taken;
+// ATA_EINVAL unless the last component is a valid 8.3 name, as long names
+// are only read.
+int fat_create(const char *path, struct fat_file *f);
+
+// Flush f's node if this was the last open of it
+int fat_close(struct fat_file *f);
+
+// Read up to len bytes at f->pos. Returns the count, 0 at end of file, or
+// a negative error.
+int fat_read(struct fat_file *f, void *buf, uint32_t len);
+
+// Write len bytes at f->pos, growing the file if needed. Returns the count
+// written or a negative error.
+int fat_write(struct fat_file *f, const void *buf, uint32_t len);
+
+// Positions past the end of the file are refused, so files have no holes
+int fat_seek(struct fat_file *f, uint32_t pos);
+
+uint32_t fat_size(struct fat_file *f);
+
+// Shrink the file to size bytes, freeing the clusters past it
+int fat_truncate(struct fat_file *f, uint32_t size);
+
+// Remove a file that nobody has open, and its long name
+int fat_unlink(const char *path);
+
+// Allocate clusters for every open file's delayed data and write it, and
+// on FAT32 the free count, into the write-back layer
+int fat_flush(void);
+
+int fat_stat(const char *path, struct fat_stat *st);
+
+// Walk the directory at path. Start *cookie at 0; returns 1 and fills name
+// (at least FAT_NAME_MAX + 1 bytes, the long name if there is one) and st
+// per entry, 0 at the end, or a negative error.
+int fat_readdir(const char *path, uint32_t *cookie, char *name, struct fat_stat *st);
+
+// Geometry of the mounted volume, 0 if nothing is mounted
+const struct fat_info *fat_get_info(void);
+const struct fat_stats *fat_get_stats(void);
+
+// Lookups of every path on the volume by scanning each directory on the
+// way, against lookups through the dentry cache; then random reads in the
+// largest file by walking its chain against through its extents
+void fat_bench(unsigned int nlookups);
+
+// Two files appended to in turn, kib KiB each, with clusters allocated on
+// every write and then with delayed allocation
+void fat_bench_write(unsigned int kib);
+
+#endif
@@ -0,0 +1,176 @@
+// fat_parse.c
+//
+// The parts of the FAT driver that only look at bytes already in memory:
+// checking a boot sector and working out the volume's layout from it, and
+// turning a directory's entries into names. Nothing here does I/O or keeps
+// state, so the same file builds into the kernel and into the host library
+// that tools/fatfuzz runs against.
+
+#include <stdint.h>
+#include "fat.h"
+#include "ide.h"
+
+static char fat_lower(char c, int yes) {
+    return yes && c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+int fat_is_boot_sector(const struct boot_sector *bs) {
+    uint8_t n = bs->num_sectors_per_cluster;
+
+    // FAT32 keeps the sectors per FAT elsewhere, so that's checked later
+    return bs->boot_signature == 0xAA55 && bs->bytes_per_sector == ATA_SECTOR_SIZE &&
+           n && !(n & (n - 1)) && bs->num_fat_tables && bs->num_reserved_sectors;
+}
+
+int fat_find_partition(const struct boot_sector *mbr, uint32_t *lba) {
+    const struct mbr_partition *p = (const struct mbr_partition *)((const uint8_t *)mbr + MBR_PARTITION_OFFSET);
+    int i = 0;
+
+    if (mbr->boot_signature != 0xAA55)
+        return FAT_EBADFS;
+    while (i < 4 && (p[i].type == 0 || p[i].num_sectors == 0))
+        i++;
+    if (i == 4)
+        return FAT_EBADFS;
+    *lba = p[i].lba_first;
+    return ATA_OK;
+}
+
+int fat_parse_boot(const struct boot_sector *bs, uint32_t lba, struct fat_geometry *g) {
+    const struct fat32_bpb *bpb = (const struct fat32_bpb *)((const uint8_t *)bs + FAT32_BPB_OFFSET);
+    uint32_t total, spf, per_sector;
+
+    if (!fat_is_boot_sector(bs))
+        return FAT_EBADFS;
+    total = bs->total_sectors ? bs->total_sectors : bs->total_sectors_in_fs;
+    spf = bs->num_sectors_per_fat ? bs->num_sectors_per_fat : bpb->num_sectors_per_fat;
+    if (spf == 0)
+        return FAT_EBADFS;
+    g->lba = lba;
+    g->spc = bs->num_sectors_per_cluster;
+    g->fat_lba = lba + bs->num_reserved_sectors;
+    g->fat_sectors = spf;
+    g->nfats = bs->num_fat_tables;
+    g->root_lba = g->fat_lba + g->nfats * spf;
+    g->root_sectors = (bs->num_root_dir_entries * sizeof(struct root_directory_entry) +
+                       ATA_SECTOR_SIZE - 1) / ATA_SECTOR_SIZE;
+    g->root_entries = bs->num_root_dir_entries;
+    g->data_lba = g->root_lba + g->root_sectors;
+    // Sums of 32-bit fields from the disk; a wrap would pass the checks below
+    if ((uint64_t)lba + bs->num_reserved_sectors + (uint64_t)g->nfats * spf + g->root_sectors != g->data_lba)
+        return FAT_EBADFS;
+    if (total <= g->data_lba - lba)
+        return FAT_EBADFS;
+    g->clusters = (total - (g->data_lba - lba)) / g->spc;
+    // The cluster count alone decides the FAT type; fs_type is a label
+    if (g->clusters < FAT16_MIN_CLUSTERS || g->clusters > FAT32_MAX_CLUSTERS)
+        return FAT_EBADFS;
+    g->fat32 = g->clusters > FAT16_MAX_CLUSTERS;
+    per_sector = ATA_SECTOR_SIZE / (g->fat32 ? 4 : 2);
+    if ((uint64_t)spf * per_sector < g->clusters + 2 || g->fat32 != (bs->num_root_dir_entries == 0))
+        return FAT_EBADFS;
+
+    for (int i = 0; i < 11; i++)
+        g->label[i] = g->fat32 ? bpb->volume_label[i] : bs->volume_label[i];
+    g->label[11] = '\0';
+    g->root_dir = 0;
+    g->fsinfo_lba = 0;
+    if (g->fat32) {
+        g->root_dir = bpb->root_cluster;
+        if (g->root_dir < 2 || g->root_dir >= g->clusters + 2)
+            return FAT_EBADFS;
+        if (bpb->ext_flags & FAT32_NO_MIRROR) {
+            // Only the active copy is kept up to date
+            if ((bpb->ext_flags & 0x0F) >= g->nfats)
+                return FAT_EBADFS;
+            g->fat_lba += (bpb->ext_flags & 0x0F) * spf;
+            g->nfats = 1;
+        }
+        if (bpb->fsinfo_sector && bpb->fsinfo_sector < bs->num_reserved_sectors)
+            g->fsinfo_lba = lba + bpb->fsinfo_sector;
+    }
+    return ATA_OK;
+}
+
+uint8_t fat_lfn_checksum(const char *key) {
+    uint8_t sum = 0;
+
+    for (int i = 0; i < 11; i++)
+        sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)key[i];
+    return sum;
+}
+
+void fat_key_name(const struct root_directory_entry *de, char *name) {
+    int k = 0;
+
+    for (int i = 0; i < 8 && de->file_name[i] != ' '; i++)
+        name[k++] = fat_lower(de->file_name[i], de->reserved1 & FAT_NT_LOWER_BASE);
+    if (k && (uint8_t)name[0] == FAT_KANJI_E5)
+        name[0] = (char)FAT_DELETED;
+    if (de->file_extension[0] != ' ') {
+        name[k++] = '.';
+        for (int i = 0; i < 3 && de->file_extension[i] != ' '; i++)
+            name[k++] = fat_lower(de->file_extension[i], de->reserved1 & FAT_NT_LOWER_EXT);
+    }
+    name[k] = '\0';
+}
+
+// One long-name entry's characters into name from pos on. Anything outside
+// printable ASCII becomes '?'.
+static void fat_lfn_part(const struct fat_lfn_entry *l, char *name, uint32_t pos) {
+    uint16_t c[FAT_LFN_CHARS];
+
+    for (int i = 0; i < 5; i++)
+        c[i] = l->name1[i];
+    for (int i = 0; i < 6; i++)
+        c[5 + i] = l->name2[i];
+    for (int i = 0; i < 2; i++)
+        c[11 + i] = l->name3[i];
+    for (uint32_t i = 0; i < FAT_LFN_CHARS && pos + i < FAT_NAME_MAX; i++) {
+        if (c[i] == 0) {
+            name[pos + i] = '\0';
+            return;
+        }
+        name[pos + i] = c[i] >= 0x20 && c[i] < 0x7F ? c[i] : '?';
+    }
+}
+
+int fat_dirent_step(struct fat_lfn_state *s, const struct root_directory_entry *de, uint32_t index,
+                    char *name, uint32_t *first) {
+    const struct fat_lfn_entry *l = (const struct fat_lfn_entry *)de;
+
+    if (de->file_name[0] == 0)
+        return FAT_DIRENT_END;
+    if ((uint8_t)de->file_name[0] == FAT_DELETED) {
+        s->want = -1;
+    } else if ((de->attribute & FAT_ATTR_LFN) == FAT_ATTR_LFN) {
+        int seq = l->seq & 0x1F;
+
+        if (l->seq & FAT_LFN_LAST) {
+            if (seq == 0 || seq > FAT_LFN_MAX_PARTS) {
+                s->want = -1;
+                return FAT_DIRENT_SKIP;
+            }
+            s->first = index;
+            s->sum = l->checksum;
+            name[seq * FAT_LFN_CHARS < FAT_NAME_MAX ? seq * FAT_LFN_CHARS : FAT_NAME_MAX] = '\0';
+        } else if (s->want <= 0 || seq != s->want || l->checksum != s->sum) {
+            s->want = -1;
+            return FAT_DIRENT_SKIP;
+        }
+        fat_lfn_part(l, name, (seq - 1) * FAT_LFN_CHARS);
+        s->want = seq - 1;
+    } else if (de->attribute & FAT_ATTR_VOLUME) {
+        s->want = -1;
+    } else {
+        if (s->want == 0 && name[0] && fat_lfn_checksum(de->file_name) == s->sum) {
+            *first = s->first;
+        } else {
+            *first = index;
+            fat_key_name(de, name);
+        }
+        s->want = -1;
+        return FAT_DIRENT_FILE;
+    }
+    return FAT_DIRENT_SKIP;
+}
@@ -0,0 +1,200 @@
+// fbcon.c
+//
+// Text console on the linear framebuffer GRUB sets up for us.
+//
+// Characters go into a shadow grid of glyph indices and only the dirty
+// rectangle of that grid is drawn. Drawing a cell copies eight rows of eight
+// pre-rendered 32-bit pixels out of glyph_cache, so there is no per-pixel
+// bit testing on the output path. Scrolling copies whole rows of the grid
+// and the repaint is batched over several lines.
+
+#include <stdint.h>
+#include "fbcon.h"
+#include "font8x8.h"
+#include "multiboot2.h"
+
+// Repaint at most every this many lines while output is scrolling
+#define FB_FLUSH_LINES 8
+
+static uint8_t *fb = 0;
+static uint32_t fb_pitch;          // bytes per scanline
+static int active = 0;
+static int cols, rows;
+static int cursor_row = 0;
+static int cursor_col = 0;
+
+// Shadow grid of glyph indices (character - FONT_FIRST)
+static uint8_t cells[FB_MAX_ROWS][FB_MAX_COLS] __attribute__((aligned(4)));
+
+// Every glyph expanded to 32 bpp in the current colours
+static uint32_t glyph_cache[FONT_GLYPHS][FONT_HEIGHT][FONT_WIDTH];
+
+// Dirty rectangle in cells, [x0, x1) x [y0, y1). Empty when x0 >= x1.
+static int dirty_x0, dirty_y0, dirty_x1, dirty_y1;
+static int scrolled = 0;          // grid scrolled since the last flush
+static int pending_lines = 0;
+
+static uint32_t rgb(struct mb2_tag_framebuffer *t, uint8_t r, uint8_t g, uint8_t b) {
+    return ((uint32_t)(r >> (8 - t->red_size)) << t->red_pos) |
+           ((uint32_t)(g >> (8 - t->green_size)) << t->green_pos) |
+           ((uint32_t)(b >> (8 - t->blue_size)) << t->blue_pos);
+}
+
+static void render_glyph_cache(uint32_t fg, uint32_t bg) {
+    for (int g = 0; g < FONT_GLYPHS; g++) {
+        for (int y = 0; y < FONT_HEIGHT; y++) {
+            uint8_t bits = font8x8_basic[g][y];
+            for (int x = 0; x < FONT_WIDTH; x++)
+                glyph_cache[g][y][x] = (bits & (1 << x)) ? fg : bg;
+        }
+    }
+}
+
+static void mark_dirty(int x0, int y0, int x1, int y1) {
+    if (dirty_x0 >= dirty_x1) {
+        dirty_x0 = x0;
+        dirty_y0 = y0;
+        dirty_x1 = x1;
+        dirty_y1 = y1;
+        return;
+    }
+    if (x0 < dirty_x0) dirty_x0 = x0;
+    if (y0 < dirty_y0) dirty_y0 = y0;
+    if (x1 > dirty_x1) dirty_x1 = x1;
+    if (y1 > dirty_y1) dirty_y1 = y1;
+}
+
+static void blit_cell(int row, int col) {
+    const uint32_t *src = &glyph_cache[cells[row][col]][0][0];
+    uint32_t *dst = (uint32_t *)(fb + row * FONT_HEIGHT * fb_pitch) + col * FONT_WIDTH;
+
+    for (int y = 0; y < FONT_HEIGHT; y++) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = src[3];
+        dst[4] = src[4];
+        dst[5] = src[5];
+        dst[6] = src[6];
+        dst[7] = src[7];
+        src += FONT_WIDTH;
+        dst = (uint32_t *)((uint8_t *)dst + fb_pitch);
+    }
+}
+
+void fbcon_flush(void) {
+    if (!active || dirty_x0 >= dirty_x1)
+        return;
+
+    for (int r = dirty_y0; r < dirty_y1; r++)
+        for (int c = dirty_x0; c < dirty_x1; c++)
+            blit_cell(r, c);
+
+    dirty_x0 = dirty_x1 = 0;
+    scrolled = 0;
+    pending_lines = 0;
+}
+
+static void clear_row(int row) {
+    uint32_t *p = (uint32_t *)cells[row];
+    // Glyph 0 is the space
+    for (int i = 0; i < FB_MAX_COLS / 4; i++)
+        p[i] = 0;
+}
+
+static void scroll(void) {
+    // Whole-row copies, a word at a time
+    for (int r = 1; r < rows; r++) {
+        uint32_t *dst = (uint32_t *)cells[r - 1];
+        uint32_t *src = (uint32_t *)cells[r];
+        for (int i = 0; i < FB_MAX_COLS / 4; i++)
+            dst[i] = src[i];
+    }
+    clear_row(rows - 1);
+    mark_dirty(0, 0, cols, rows);
+    scrolled = 1;
+}
+
+int fbcon_putc(int data) {
+    if (!active)
+        return data;
+
+    if (data == '\n') {
+        cursor_col = 0;
+        cursor_row++;
+    } else if (data == '\r') {
+        cursor_col = 0;
+    } else if (data == '\b') {
+        if (cursor_col > 0) {
+            cursor_col--;
+            cells[cursor_row][cursor_col] = 0;
+            mark_dirty(cursor_col, cursor_row, cursor_col + 1, cursor_row + 1);
+        }
+    } else {
+        uint8_t c = data;
+        if (c < FONT_FIRST || c >= FONT_FIRST + FONT_GLYPHS)
+            c = '?';
+        cells[cursor_row][cursor_col] = c - FONT_FIRST;
+        mark_dirty(cursor_col, cursor_row, cursor_col + 1, cursor_row + 1);
+        cursor_col++;
+        if (cursor_col >= cols) {
+            cursor_col = 0;
+            cursor_row++;
+        }
+    }
+
+    if (cursor_row >= rows) {
+        scroll();
+        cursor_row = rows - 1;
+        cursor_col = 0;
+    }
+
+    // A line that didn't scroll only dirtied itself, so draw it right away.
+    // Once we're scrolling every flush repaints the screen; batch those.
+    if (data == '\n') {
+        if (!scrolled || ++pending_lines >= FB_FLUSH_LINES)
+            fbcon_flush();
+    }
+    return data;
+}
+
+int fbcon_active(void) {
+    return active;
+}
+
+int fbcon_cols(void) {
+    return cols;
+}
+
+int fbcon_rows(void) {
+    return rows;
+}
+
+int fbcon_init(void) {
+    struct mb2_tag_framebuffer *t;
+
+    t = (struct mb2_tag_framebuffer *)mb2_find_tag(MB2_TAG_FRAMEBUFFER);
+    if (!t || t->fb_type != MB2_FRAMEBUFFER_TYPE_RGB || t->bpp != 32 || (t->addr >> 32))
+        return -1;
+
+    fb = (uint8_t *)(uint32_t)t->addr;
+    fb_pitch = t->pitch;
+    cols = t->width / FONT_WIDTH;
+    rows = t->height / FONT_HEIGHT;
+    if (cols > FB_MAX_COLS)
+        cols = FB_MAX_COLS;
+    if (rows > FB_MAX_ROWS)
+        rows = FB_MAX_ROWS;
+
+    // Light grey on black, like the VGA text console's attribute 0x07
+    render_glyph_cache(rgb(t, 0xAA, 0xAA, 0xAA), rgb(t, 0, 0, 0));
+
+    for (int r = 0; r < rows; r++)
+        clear_row(r);
+    cursor_row = cursor_col = 0;
+    active = 1;
+
+    mark_dirty(0, 0, cols, rows);
+    fbcon_flush();
+    return 0;
+}
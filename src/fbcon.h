@@ -0,0 +1,32 @@
+#ifndef FBCON_H
+#define FBCON_H
+
+#include <stdint.h>
+
+// Mode requested from GRUB in the multiboot2 header
+#define FB_WANT_WIDTH   1024
+#define FB_WANT_HEIGHT  768
+#define FB_WANT_DEPTH   32
+
+// Largest text grid we keep a shadow copy of (1920x1200 with 8x8 glyphs)
+#define FB_MAX_COLS     240
+#define FB_MAX_ROWS     150
+
+// Take over the framebuffer GRUB set up. Returns 0 on success, -1 if there
+// is no usable 32 bpp linear framebuffer (we stay on VGA text then).
+int fbcon_init(void);
+
+// Nonzero once fbcon_init() succeeded
+int fbcon_active(void);
+
+// Text grid size in characters
+int fbcon_cols(void);
+int fbcon_rows(void);
+
+// Same contract as kputc()
+int fbcon_putc(int c);
+
+// Push every dirty cell out to the framebuffer
+void fbcon_flush(void);
+
+#endif
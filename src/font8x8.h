@@ -0,0 +1,13 @@
+#ifndef FONT8X8_H
+#define FONT8X8_H
+
+#include <stdint.h>
+
+#define FONT_WIDTH  8
+#define FONT_HEIGHT 8
+#define FONT_FIRST  0x20                      // first glyph in the table (space)
+#define FONT_GLYPHS (0x7F - FONT_FIRST)       // printable ASCII
+
+extern const uint8_t font8x8_basic[FONT_GLYPHS][FONT_HEIGHT];
+
+#endif
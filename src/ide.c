@@ -0,0 +1,739 @@
+/*
+ * ide.c
+ *
+ * ATA PIO driver for the primary master, replacing the polled ide.s.
+ *
+ * In ATA_MODE_IRQ the drive's interrupt is enabled and the submitter sleeps
+ * with hlt while the drive seeks; IRQ14 moves each DRQ block and completes
+ * the request. ATA_MODE_POLL keeps the old behaviour of spinning on the
+ * status register, for comparison in ata_bench().
+ *
+ * Writes take the same path in the other direction. ata_flush_cache() queues
+ * a FLUSH CACHE behind them for callers that need the data on the medium.
+ *
+ * Commands use LBA48 when the transfer runs past the 28-bit limit or is
+ * longer than 256 sectors, and READ/WRITE MULTIPLE so each interrupt moves
+ * info.multiple sectors instead of one.
+ *
+ * ATA_MODE_DMA hands the whole command to the PIIX bus-master engine found
+ * by pci_scan(): the drive writes straight into the request's buffer and
+ * IRQ14 fires once at the end.
+ *
+ * The block layer sees the drive as ata0, one request deep: the drive has
+ * no command queueing, so there is nothing to gain from handing it more.
+ */
+
+#include <stdint.h>
+#include "ide.h"
+#include "interrupt.h"
+#include "timer.h"
+#include "tsc.h"
+#include "trace.h"
+#include "rprintf.h"
+#include "console.h"
+#include "pci.h"
+#include "page.h"
+#include "blkdev.h"
+
+#define ATA_BENCH_CHUNK  256
+
+static struct ata_info info;
+static struct ata_stats stats;
+static uint16_t identify[256];
+static enum ata_mode mode = ATA_MODE_POLL;
+static int use_multiple = 1;
+
+// Request queue. The head is the request the drive is working on.
+static struct ata_request *queue_head = 0;
+static struct ata_request *queue_tail = 0;
+static uint32_t chunk_left;        // sectors left in the command on the wire
+static uint32_t cur_multiple;      // DRQ block size of that command, 0 = single
+static int cur_dma;                // that command is a bus-master transfer
+static uint32_t inflight;          // write sectors sent but not yet acked
+static uint32_t started_tick;      // timer tick of the last progress
+static int head_issued;            // queue_head has been put on the wire
+
+// Indexed by [write][lba48][multiple]
+static const uint8_t ata_commands[2][2][2] = {
+    { { ATA_CMD_READ_PIO,      ATA_CMD_READ_MULTIPLE },
+      { ATA_CMD_READ_PIO_EXT,  ATA_CMD_READ_MULTIPLE_EXT } },
+    { { ATA_CMD_WRITE_PIO,     ATA_CMD_WRITE_MULTIPLE },
+      { ATA_CMD_WRITE_PIO_EXT, ATA_CMD_WRITE_MULTIPLE_EXT } },
+};
+
+// Indexed by [write][lba48]
+static const uint8_t ata_dma_commands[2][2] = {
+    { ATA_CMD_READ_DMA,  ATA_CMD_READ_DMA_EXT },
+    { ATA_CMD_WRITE_DMA, ATA_CMD_WRITE_DMA_EXT },
+};
+
+// Aligned so the table itself never crosses a 64 KiB boundary
+static struct ata_prd prdt[ATA_PRD_MAX] __attribute__((aligned(sizeof(struct ata_prd) * ATA_PRD_MAX)));
+
+static void ata_delay400(void) {
+    // Each alternate status read takes ~100ns
+    for (int i = 0; i < 4; i++)
+        inb(ATA_ALTSTATUS);
+}
+
+static uint8_t devctl_bits(void) {
+    return (mode == ATA_MODE_POLL) ? ATA_DC_NIEN : 0;
+}
+
+/*
+ * Spin until BSY clears and, if want_data, one of DRQ, ERR or DF is set.
+ * The deadline is on the TSC because this also runs from IRQ14, where
+ * timer_ticks doesn't move. Returns the last status, or -1 on timeout.
+ */
+static int ata_spin(int want_data) {
+    uint64_t deadline = rdtsc() + (uint64_t)tsc_khz * ATA_TIMEOUT_MS;
+    uint8_t st;
+
+    while (((st = inb(ATA_ALTSTATUS)) & ATA_SR_BSY) ||
+           (want_data && !(st & (ATA_SR_DRQ | ATA_SR_ERR | ATA_SR_DF)))) {
+        if (rdtsc() > deadline)
+            return -1;
+    }
+    return st;
+}
+
+static void ata_reset(void) {
+    if (info.bm_base)
+        outb(info.bm_base + BM_COMMAND, 0);
+    outb(ATA_DEVCTL, ATA_DC_SRST | ATA_DC_NIEN);
+    ata_delay400();
+    outb(ATA_DEVCTL, devctl_bits());
+    ata_spin(0);
+}
+
+/*
+ * Move the next DRQ block of r, given the status that announced it. For
+ * writes, the status also acknowledges the block sent before, and the
+ * command is finished once nothing is left to send.
+ */
+static int ata_pio_step(struct ata_request *r, uint8_t st) {
+    uint8_t *p;
+    uint32_t n;
+
+    if (st & (ATA_SR_ERR | ATA_SR_DF)) {
+        r->error = inb(ATA_ERROR);
+        return ATA_EIO;
+    }
+    if (r->op == ATA_OP_WRITE) {
+        r->done += inflight;
+        chunk_left -= inflight;
+        stats.sectors += inflight;
+        inflight = 0;
+        if (!chunk_left)
+            return ATA_OK;
+    }
+    if (!(st & ATA_SR_DRQ))
+        return ATA_EIO;
+
+    n = cur_multiple ? cur_multiple : 1;
+    if (n > chunk_left)
+        n = chunk_left;
+    p = r->buf + r->done * ATA_SECTOR_SIZE;
+    stats.blocks++;
+    if (r->op == ATA_OP_WRITE) {
+        outsw(ATA_DATA, p, n * ATA_SECTOR_SIZE / 2);
+        inflight = n;
+    } else {
+        insw(ATA_DATA, p, n * ATA_SECTOR_SIZE / 2);
+        r->done += n;
+        chunk_left -= n;
+        stats.sectors += n;
+    }
+    return ATA_OK;
+}
+
+// Describe bytes at buf in the PRD table, splitting at 64 KiB boundaries
+static int ata_dma_setup(uint8_t *buf, uint32_t bytes) {
+    uint32_t addr = (uint32_t)buf;
+    int i = 0;
+
+    if (addr & 1)
+        return ATA_EINVAL;
+    while (bytes) {
+        uint32_t len = 0x10000 - (addr & 0xFFFF);
+        if (len > bytes)
+            len = bytes;
+        if (i == ATA_PRD_MAX)
+            return ATA_EINVAL;
+        prdt[i].addr = addr;
+        prdt[i].bytes = len & 0xFFFF;
+        prdt[i].flags = 0;
+        addr += len;
+        bytes -= len;
+        i++;
+    }
+    prdt[i - 1].flags = ATA_PRD_EOT;
+    return ATA_OK;
+}
+
+// Complete a bus-master command, given the drive and engine status
+static int ata_dma_step(struct ata_request *r, uint8_t st, uint8_t bm_st) {
+    if ((st & (ATA_SR_ERR | ATA_SR_DF)) || (bm_st & BM_SR_ERR)) {
+        r->error = inb(ATA_ERROR);
+        return ATA_EIO;
+    }
+    r->done += chunk_left;
+    stats.sectors += chunk_left;
+    stats.blocks++;
+    chunk_left = 0;
+    return ATA_OK;
+}
+
+// FLUSH CACHE has no data phase; the drive interrupts once it's done
+static int ata_issue_flush(void) {
+    cur_dma = 0;
+    if (ata_spin(0) < 0)
+        return ATA_ETIMEOUT;
+    outb(ATA_DRIVE, 0xE0);
+    ata_delay400();
+    outb(ATA_COMMAND, info.lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+    chunk_left = 0;
+    inflight = 0;
+    started_tick = timer_ticks;
+    return ATA_OK;
+}
+
+// Put the next chunk of r on the wire
+static int ata_issue(struct ata_request *r) {
+    uint32_t lba = r->lba + r->done;
+    uint32_t n = r->count - r->done;
+    int write = (r->op == ATA_OP_WRITE);
+    uint8_t bm_dir = write ? 0 : BM_CMD_READ;
+    int lba48;
+    int st;
+
+    if (r->op == ATA_OP_FLUSH)
+        return ata_issue_flush();
+
+    cur_dma = (mode == ATA_MODE_DMA);
+    if (cur_dma && n > ATA_DMA_MAX_COUNT)
+        n = ATA_DMA_MAX_COUNT;
+    if (n > ATA_LBA48_MAX_COUNT)
+        n = ATA_LBA48_MAX_COUNT;
+    if (!info.lba48 && n > ATA_LBA28_MAX_COUNT)
+        n = ATA_LBA28_MAX_COUNT;
+    // The 28-bit form is two fewer port writes, so keep it where it fits
+    lba48 = n > ATA_LBA28_MAX_COUNT || (uint64_t)lba + n > ATA_LBA28_LIMIT;
+    cur_multiple = use_multiple ? info.multiple : 0;
+
+    if (ata_spin(0) < 0)
+        return ATA_ETIMEOUT;
+
+    if (cur_dma) {
+        int rc = ata_dma_setup(r->buf + r->done * ATA_SECTOR_SIZE, n * ATA_SECTOR_SIZE);
+        if (rc != ATA_OK)
+            return rc;
+        outb(info.bm_base + BM_COMMAND, 0);
+        outb(info.bm_base + BM_STATUS, BM_SR_IRQ | BM_SR_ERR);
+        outl(info.bm_base + BM_PRDT, (uint32_t)prdt);
+        outb(info.bm_base + BM_COMMAND, bm_dir);
+    }
+
+    if (lba48) {
+        outb(ATA_DRIVE, 0x40);                          // LBA mode, master
+        ata_delay400();
+        // High-order bytes first; a count of 0 means 65536
+        outb(ATA_COUNT, (n >> 8) & 0xFF);
+        outb(ATA_LBA_LO, (lba >> 24) & 0xFF);
+        outb(ATA_LBA_MID, 0);
+        outb(ATA_LBA_HI, 0);
+    } else {
+        outb(ATA_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));   // LBA mode, master
+        ata_delay400();
+    }
+    outb(ATA_COUNT, n & 0xFF);
+    outb(ATA_LBA_LO, lba & 0xFF);
+    outb(ATA_LBA_MID, (lba >> 8) & 0xFF);
+    outb(ATA_LBA_HI, (lba >> 16) & 0xFF);
+    if (cur_dma)
+        outb(ATA_COMMAND, ata_dma_commands[write][lba48]);
+    else
+        outb(ATA_COMMAND, ata_commands[write][lba48][cur_multiple != 0]);
+
+    chunk_left = n;
+    inflight = 0;
+    started_tick = timer_ticks;
+
+    if (cur_dma) {
+        outb(info.bm_base + BM_COMMAND, bm_dir | BM_CMD_START);
+        return ATA_OK;
+    }
+
+    // The first block of a write goes out without an interrupt
+    if (write) {
+        ata_delay400();
+        if ((st = ata_spin(1)) < 0)
+            return ATA_ETIMEOUT;
+        return ata_pio_step(r, st);
+    }
+    return ATA_OK;
+}
+
+// Complete the head request and unlink it. Runs with interrupts off.
+static void ata_finish(int status) {
+    struct ata_request *r = queue_head;
+
+    queue_head = r->next;
+    if (!queue_head)
+        queue_tail = 0;
+    r->next = 0;
+    head_issued = 0;
+
+    if (status == ATA_EIO)
+        stats.errors++;
+    else if (status == ATA_ETIMEOUT)
+        stats.timeouts++;
+    TRACE2(TRACE_ATA_DONE, r->lba, status);
+    r->status = status;
+    if (r->complete)
+        r->complete(r);
+}
+
+// Start the head request, unless a complete callback already has
+static void ata_start_next(void) {
+    while (queue_head && !head_issued) {
+        int rc = ata_issue(queue_head);
+        if (rc == ATA_OK) {
+            head_issued = 1;
+            return;
+        }
+        ata_reset();
+        ata_finish(rc);
+    }
+}
+
+// Polled transfer of the whole request, for ATA_MODE_POLL
+static int ata_poll_transfer(struct ata_request *r) {
+    if (r->op == ATA_OP_FLUSH) {
+        int rc = ata_issue(r), st;
+        if (rc != ATA_OK)
+            return rc;
+        ata_delay400();
+        if ((st = ata_spin(0)) < 0) {
+            ata_reset();
+            return ATA_ETIMEOUT;
+        }
+        return (st & (ATA_SR_ERR | ATA_SR_DF)) ? ATA_EIO : ATA_OK;
+    }
+
+    while (r->done < r->count) {
+        int rc = ata_issue(r);
+        if (rc != ATA_OK)
+            return rc;
+
+        while (chunk_left) {
+            int st;
+
+            ata_delay400();
+            // Writes wait for the block to be taken, reads for data
+            if ((st = ata_spin(r->op == ATA_OP_READ)) < 0) {
+                ata_reset();
+                return ATA_ETIMEOUT;
+            }
+            rc = ata_pio_step(r, st);
+            if (rc != ATA_OK)
+                return rc;
+        }
+    }
+    return ATA_OK;
+}
+
+void ata_irq(void) {
+    struct ata_request *r = queue_head;
+    uint8_t st, bm_st = 0;
+    int rc;
+
+    stats.irqs++;
+    if (r && cur_dma) {
+        // Only stop the engine once it says the transfer is over
+        bm_st = inb(info.bm_base + BM_STATUS);
+        if (!(bm_st & BM_SR_IRQ)) {
+            inb(ATA_STATUS);
+            stats.spurious_irqs++;
+            return;
+        }
+        outb(info.bm_base + BM_COMMAND, 0);
+        outb(info.bm_base + BM_STATUS, BM_SR_IRQ | BM_SR_ERR);
+    }
+
+    st = inb(ATA_STATUS);   // reading STATUS acks the drive's interrupt
+    if (!r || mode == ATA_MODE_POLL || (st & ATA_SR_BSY) ||
+        (!cur_dma && r->op == ATA_OP_READ && !(st & (ATA_SR_DRQ | ATA_SR_ERR | ATA_SR_DF)))) {
+        stats.spurious_irqs++;
+        return;
+    }
+
+    if (r->op == ATA_OP_FLUSH)
+        rc = (st & (ATA_SR_ERR | ATA_SR_DF)) ? ATA_EIO : ATA_OK;
+    else if (cur_dma)
+        rc = ata_dma_step(r, st, bm_st);
+    else
+        rc = ata_pio_step(r, st);
+    started_tick = timer_ticks;
+    if (rc != ATA_OK) {
+        ata_reset();
+        ata_finish(rc);
+        ata_start_next();
+        return;
+    }
+    if (chunk_left)
+        return;
+
+    if (r->done == r->count) {
+        ata_finish(ATA_OK);
+        ata_start_next();
+    } else if ((rc = ata_issue(r)) != ATA_OK) {
+        ata_reset();
+        ata_finish(rc);
+        ata_start_next();
+    }
+}
+
+int ata_submit(struct ata_request *req) {
+    uint32_t flags;
+
+    if (!info.present)
+        return ATA_ENODEV;
+    if (req->op == ATA_OP_FLUSH) {
+        req->count = 0;
+    } else if (req->count == 0 || req->lba >= info.sectors ||
+               req->count > info.sectors - req->lba) {
+        return ATA_EINVAL;
+    }
+
+    req->done = 0;
+    req->error = 0;
+    req->next = 0;
+    req->status = ATA_PENDING;
+    stats.requests++;
+    TRACE3(TRACE_ATA_START, req->lba, req->count, req->op);
+
+    if (mode == ATA_MODE_POLL) {
+        // Nothing is ever left queued in this mode
+        flags = irq_save();
+        queue_head = queue_tail = req;
+        ata_finish(ata_poll_transfer(req));
+        irq_restore(flags);
+        return ATA_OK;
+    }
+
+    flags = irq_save();
+    if (queue_tail)
+        queue_tail->next = req;
+    else
+        queue_head = req;
+    queue_tail = req;
+    if (queue_head == req)
+        ata_start_next();
+    irq_restore(flags);
+    return ATA_OK;
+}
+
+// Abort the request on the wire if the drive has gone quiet for too long
+static void ata_check_timeout(void) {
+    uint32_t flags = irq_save();
+
+    if (queue_head && timer_ticks - started_tick > timer_ms_to_ticks(ATA_TIMEOUT_MS)) {
+        ata_reset();
+        ata_finish(ATA_ETIMEOUT);
+        ata_start_next();
+    }
+    irq_restore(flags);
+}
+
+int ata_wait(struct ata_request *req) {
+    while (req->status == ATA_PENDING) {
+        ata_check_timeout();
+        // Same lost-wakeup dance as kgetchar(): test with interrupts off,
+        // then sti;hlt so IRQ14 can't slip in between.
+        asm volatile("cli");
+        if (req->status == ATA_PENDING) {
+            uint64_t t0 = rdtsc();
+            asm volatile("sti\n hlt");
+            stats.idle_cycles += rdtsc() - t0;
+        } else {
+            asm volatile("sti");
+        }
+    }
+    return req->status;
+}
+
+int ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors) {
+    struct ata_request req = {
+        .lba = lba,
+        .buf = buffer,
+        .count = numsectors,
+        .op = ATA_OP_READ,
+    };
+    int rc = ata_submit(&req);
+
+    if (rc != ATA_OK)
+        return rc;
+    return ata_wait(&req);
+}
+
+int ata_lba_write(unsigned int lba, const unsigned char *buffer, unsigned int numsectors) {
+    struct ata_request req = {
+        .lba = lba,
+        .buf = (uint8_t *)buffer,
+        .count = numsectors,
+        .op = ATA_OP_WRITE,
+    };
+    int rc = ata_submit(&req);
+
+    if (rc != ATA_OK)
+        return rc;
+    return ata_wait(&req);
+}
+
+int ata_flush_cache(void) {
+    struct ata_request req = {
+        .op = ATA_OP_FLUSH,
+    };
+    int rc = ata_submit(&req);
+
+    if (rc != ATA_OK)
+        return rc;
+    return ata_wait(&req);
+}
+
+int ata_set_mode(enum ata_mode m) {
+    if (m == ATA_MODE_DMA && !info.bm_base)
+        return ATA_ENODEV;
+    // Let anything in flight finish under the mode it started in
+    while (queue_head)
+        ata_wait(queue_head);
+    mode = m;
+    outb(ATA_DEVCTL, devctl_bits());
+    return ATA_OK;
+}
+
+enum ata_mode ata_get_mode(void) {
+    return mode;
+}
+
+void ata_set_multiple(int on) {
+    while (queue_head)
+        ata_wait(queue_head);
+    use_multiple = on;
+}
+
+const struct ata_info *ata_get_info(void) {
+    return &info;
+}
+
+const struct ata_stats *ata_get_stats(void) {
+    return &stats;
+}
+
+// ata0 for the block layer: one ata_request carries the one blk_request
+static struct ata_request blk_cmd;
+
+static void ata_blk_complete(struct ata_request *r) {
+    struct blk_request *req = r->priv;
+
+    req->status = r->status;
+    if (req->done)
+        req->done(req);
+}
+
+static int ata_blk_submit(struct blkdev *dev, struct blk_request *req) {
+    blk_cmd.lba = req->lba;
+    blk_cmd.buf = req->buf;
+    blk_cmd.count = req->count;
+    blk_cmd.op = req->op;
+    blk_cmd.complete = ata_blk_complete;
+    blk_cmd.priv = req;
+    return ata_submit(&blk_cmd);
+}
+
+static void ata_blk_idle(struct blkdev *dev) {
+    ata_check_timeout();
+}
+
+static struct blkdev ata_blkdev = {
+    .name = "ata0",
+    .depth = 1,
+    .max_sectors = ATA_LBA28_MAX_COUNT,
+    .submit = ata_blk_submit,
+    .idle = ata_blk_idle,
+};
+
+// SET MULTIPLE MODE, polled. Returns the block size in effect, 0 if refused.
+static uint32_t ata_init_multiple(void) {
+    uint32_t max = identify[47] & 0xFF;
+    int st;
+
+    if (max == 0)
+        return 0;
+    if (max > ATA_MULTIPLE_MAX)
+        max = ATA_MULTIPLE_MAX;
+    // The drive only accepts powers of two
+    while (max & (max - 1))
+        max &= max - 1;
+
+    outb(ATA_DRIVE, 0xE0);
+    ata_delay400();
+    outb(ATA_COUNT, max);
+    outb(ATA_COMMAND, ATA_CMD_SET_MULTIPLE);
+    ata_delay400();
+    st = ata_spin(0);
+    if (st < 0 || (st & (ATA_SR_ERR | ATA_SR_DF)))
+        return 0;
+    return max;
+}
+
+/*
+ * Find the IDE controller's bus-master engine (BAR4) and let it master the
+ * bus. Returns its I/O base, or 0 if there is none or the drive can't DMA.
+ */
+static uint16_t ata_init_busmaster(void) {
+    struct pci_device *d = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE);
+    uint16_t base;
+
+    // Word 49 bit 8: DMA supported
+    if (!d || !(identify[49] & 0x100))
+        return 0;
+    // prog-if bit 7: bus mastering capable
+    if (!(d->prog_if & 0x80) || !(base = pci_bar_io(d, 4)))
+        return 0;
+    pci_enable(d, PCI_CMD_IO | PCI_CMD_MASTER);
+    outb(base + BM_COMMAND, 0);
+    outb(base + BM_STATUS, BM_SR_IRQ | BM_SR_ERR);
+    return base;
+}
+
+int ata_init(void) {
+    uint8_t st;
+    int s;
+
+    info.present = 0;
+    outb(ATA_DEVCTL, ATA_DC_NIEN);
+    outb(ATA_DRIVE, 0xA0);
+    ata_delay400();
+    outb(ATA_COUNT, 0);
+    outb(ATA_LBA_LO, 0);
+    outb(ATA_LBA_MID, 0);
+    outb(ATA_LBA_HI, 0);
+    outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+
+    st = inb(ATA_STATUS);
+    if (st == 0 || st == 0xFF)          // nothing on the bus
+        return ATA_ENODEV;
+    if (ata_spin(0) < 0)
+        return ATA_ETIMEOUT;
+    if (inb(ATA_LBA_MID) || inb(ATA_LBA_HI))   // ATAPI or SATA signature
+        return ATA_ENODEV;
+    s = ata_spin(1);
+    if (s < 0)
+        return ATA_ETIMEOUT;
+    st = s;
+    if (st & (ATA_SR_ERR | ATA_SR_DF))
+        return ATA_EIO;
+
+    insw(ATA_DATA, identify, 256);
+
+    // Word 83 bit 10: 48-bit address feature set
+    info.lba48 = (identify[83] >> 10) & 1;
+    if (info.lba48) {
+        if (identify[102] || identify[103])
+            info.sectors = 0xFFFFFFFF;
+        else
+            info.sectors = identify[100] | ((uint32_t)identify[101] << 16);
+    } else {
+        info.sectors = identify[60] | ((uint32_t)identify[61] << 16);
+    }
+
+    // The model string is stored as byte-swapped words
+    for (int i = 0; i < 20; i++) {
+        info.model[2 * i] = identify[27 + i] >> 8;
+        info.model[2 * i + 1] = identify[27 + i] & 0xFF;
+    }
+    info.model[40] = '\0';
+    for (int i = 39; i >= 0 && info.model[i] == ' '; i--)
+        info.model[i] = '\0';
+
+    info.multiple = ata_init_multiple();
+    info.bm_base = ata_init_busmaster();
+    info.present = 1;
+
+    IRQ_clear_mask(2);      // cascade from the slave PIC
+    IRQ_clear_mask(14);
+    ata_set_mode(info.bm_base ? ATA_MODE_DMA : ATA_MODE_IRQ);
+
+    ata_blkdev.sectors = info.sectors;
+    blkdev_register(&ata_blkdev);
+    return ATA_OK;
+}
+
+static void ata_bench_run(const char *name, uint8_t *buf, unsigned int nsectors) {
+    uint64_t t0, elapsed, idle0, idle;
+    uint32_t us, busy_us, irqs0, done = 0;
+
+    idle0 = stats.idle_cycles;
+    irqs0 = stats.irqs;
+    t0 = rdtsc();
+    while (done < nsectors) {
+        uint32_t n = nsectors - done;
+        if (n > ATA_BENCH_CHUNK)
+            n = ATA_BENCH_CHUNK;
+        int rc = ata_lba_read(done, buf, n);
+        if (rc != ATA_OK) {
+            esp_printf(kputc, "read at lba %d failed: %d\n", done, rc);
+            break;
+        }
+        done += n;
+    }
+    elapsed = rdtsc() - t0;
+    idle = stats.idle_cycles - idle0;
+
+    us = tsc_to_us(elapsed);
+    busy_us = tsc_to_us(elapsed - idle);
+    if (us == 0)
+        us = 1;
+    esp_printf(kputc, "%s: %d sectors in %d us, %d KiB/s, %d irqs, cpu busy %d%c\n",
+               name, done, us, div64_32((uint64_t)done * 500000, us),
+               stats.irqs - irqs0, div64_32((uint64_t)busy_us * 100, us), '%');
+}
+
+void ata_bench(unsigned int nsectors) {
+    enum ata_mode old_mode = mode;
+    int old_multiple = use_multiple;
+    struct ppage *frame;
+    uint8_t *buf;
+
+    if (!info.present) {
+        esp_printf(kputc, "no ATA drive\n");
+        return;
+    }
+    if (nsectors > info.sectors)
+        nsectors = info.sectors;
+
+    // Every mode reads into the same frame, so DMA is measured zero-copy
+    if (!(frame = allocate_physical_pages(1))) {
+        esp_printf(kputc, "no free frame for the bench buffer\n");
+        return;
+    }
+    buf = frame->physical_addr;
+
+    ata_set_multiple(0);
+    ata_set_mode(ATA_MODE_POLL);
+    ata_bench_run("poll    ", buf, nsectors);
+    ata_set_mode(ATA_MODE_IRQ);
+    ata_bench_run("irq     ", buf, nsectors);
+    if (info.multiple) {
+        ata_set_multiple(1);
+        ata_bench_run("irq mult", buf, nsectors);
+    }
+    if (ata_set_mode(ATA_MODE_DMA) == ATA_OK)
+        ata_bench_run("dma     ", buf, nsectors);
+
+    ata_set_multiple(old_multiple);
+    ata_set_mode(old_mode);
+    free_physical_pages(frame);
+}
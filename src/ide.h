@@ -2,7 +2,183 @@
 #ifndef __IDE_H__
 #define __IDE_H__
 
+#include <stdint.h>
+
+#define ATA_SECTOR_SIZE 512
+
+// Primary channel task file
+#define ATA_DATA        0x1F0
+#define ATA_ERROR       0x1F1
+#define ATA_FEATURES    0x1F1
+#define ATA_COUNT       0x1F2
+#define ATA_LBA_LO      0x1F3
+#define ATA_LBA_MID     0x1F4
+#define ATA_LBA_HI      0x1F5
+#define ATA_DRIVE       0x1F6
+#define ATA_STATUS      0x1F7
+#define ATA_COMMAND     0x1F7
+#define ATA_ALTSTATUS   0x3F6
+#define ATA_DEVCTL      0x3F6
+
+// Status register bits
+#define ATA_SR_ERR      0x01
+#define ATA_SR_DRQ      0x08
+#define ATA_SR_DF       0x20
+#define ATA_SR_DRDY     0x40
+#define ATA_SR_BSY      0x80
+
+// Device control bits
+#define ATA_DC_NIEN     0x02   // mask the drive's interrupt
+#define ATA_DC_SRST     0x04   // software reset
+
+// Commands
+#define ATA_CMD_READ_PIO          0x20
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_READ_PIO_EXT      0x24
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_PIO         0x30
+#define ATA_CMD_WRITE_PIO_EXT     0x34
+#define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_MULTIPLE     0xC4
+#define ATA_CMD_WRITE_MULTIPLE    0xC5
+#define ATA_CMD_SET_MULTIPLE      0xC6
+#define ATA_CMD_FLUSH_CACHE       0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT   0xEA
+#define ATA_CMD_READ_DMA          0xC8
+#define ATA_CMD_WRITE_DMA         0xCA
+#define ATA_CMD_IDENTIFY          0xEC
+
+// Sectors one command can move
+#define ATA_LBA28_MAX_COUNT   256
+#define ATA_LBA48_MAX_COUNT   65536
+#define ATA_LBA28_LIMIT       0x10000000   // first sector LBA28 can't address
+
+// Bus-master IDE registers, relative to BAR4 of the IDE function
+#define BM_COMMAND      0x00
+#define BM_STATUS       0x02
+#define BM_PRDT         0x04
+
+#define BM_CMD_START    0x01
+#define BM_CMD_READ     0x08   // bus master writes to memory (disk read)
+
+#define BM_SR_ACTIVE    0x01
+#define BM_SR_ERR       0x02
+#define BM_SR_IRQ       0x04   // write 1 to clear, as for BM_SR_ERR
+
+// Physical region descriptor. A region may not cross a 64 KiB boundary.
+struct ata_prd {
+    uint32_t addr;
+    uint16_t bytes;              // 0 means 64 KiB
+    uint16_t flags;
+};
+
+#define ATA_PRD_EOT     0x8000
+#define ATA_PRD_MAX     8
+
+// Sectors one DMA command moves. 256 KiB needs at most 5 PRDs.
+#define ATA_DMA_MAX_COUNT     512
+
+// Upper bound on the DRQ block size we ask SET MULTIPLE MODE for
+#define ATA_MULTIPLE_MAX      16
+
+// Return codes. ATA_PENDING is only ever seen in ata_request.status.
+#define ATA_OK          0
+#define ATA_PENDING     1
+#define ATA_EIO        -1   // drive set ERR or DF
+#define ATA_ETIMEOUT   -2   // no completion within ATA_TIMEOUT_MS
+#define ATA_ENODEV     -3   // no drive, or ata_init() not called
+#define ATA_EINVAL     -4   // request out of range
+
+#define ATA_TIMEOUT_MS  2000
+
+enum ata_mode {
+    ATA_MODE_POLL,     // spin on the status register, drive interrupt masked
+    ATA_MODE_IRQ,      // sleep until IRQ14 signals each data block
+    ATA_MODE_DMA,      // bus-master DMA, one IRQ14 per command
+};
+
+enum ata_op {
+    ATA_OP_READ,
+    ATA_OP_WRITE,
+    ATA_OP_FLUSH,      // FLUSH CACHE; lba, buf and count are ignored
+};
+
+/*
+ * One transfer. Requests are queued in submission order and completed from
+ * IRQ14; the submitter waits on its own request's status, or sets complete
+ * to be called once the status is final. complete runs with interrupts off,
+ * from IRQ14 or from inside ata_submit() in ATA_MODE_POLL, and may submit
+ * more requests.
+ *
+ * buf must be 2-byte aligned, and at an identity-mapped address outside
+ * VM_MAP_BASE..VM_MAP_END, so that its virtual address is also the
+ * physical address the DMA engine is given.
+ */
+struct ata_request {
+    uint32_t lba;
+    uint8_t *buf;
+    uint32_t count;              // sectors
+    enum ata_op op;
+    uint32_t done;               // sectors transferred so far
+    volatile int status;         // ATA_PENDING until the request completes
+    uint8_t error;               // error register when status is ATA_EIO
+    void (*complete)(struct ata_request *req);
+    void *priv;                  // for the complete callback
+    struct ata_request *next;
+};
+
+struct ata_stats {
+    uint32_t requests;
+    uint32_t sectors;
+    uint32_t errors;
+    uint32_t timeouts;
+    uint32_t blocks;             // DRQ blocks moved through the data port
+    uint32_t irqs;
+    uint32_t spurious_irqs;
+    uint64_t idle_cycles;       // time spent halted waiting for the drive
+};
+
+struct ata_info {
+    int present;
+    int lba48;                   // 48-bit commands supported
+    uint32_t sectors;            // capacity, clamped to 2^32-1 (2 TiB)
+    uint32_t multiple;           // sectors per DRQ block, 0 if SET MULTIPLE failed
+    uint16_t bm_base;            // bus-master I/O base, 0 if DMA is unavailable
+    char model[41];
+};
+
+// Identify the primary master, switch to interrupt-driven mode and register
+// it with the block layer as ata0
+int ata_init(void);
+
+// Returns ATA_ENODEV for ATA_MODE_DMA without a bus-master controller
+int ata_set_mode(enum ata_mode mode);
+enum ata_mode ata_get_mode(void);
+
+// Use READ/WRITE MULTIPLE when the drive supports it (the default)
+void ata_set_multiple(int on);
+
+// Queue a request. Completion is signalled through req->status.
+int ata_submit(struct ata_request *req);
+
+// Sleep until req completes and return its status
+int ata_wait(struct ata_request *req);
+
+// IRQ14 handler body
+void ata_irq(void);
+
 int ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors);
+int ata_lba_write(unsigned int lba, const unsigned char *buffer, unsigned int numsectors);
 
-#endif
+// Commit the drive's write cache to the medium
+int ata_flush_cache(void);
 
+const struct ata_info *ata_get_info(void);
+const struct ata_stats *ata_get_stats(void);
+
+// Read nsectors polled, per-sector IRQ, multiple-sector IRQ and DMA into a
+// page-allocator frame, and report throughput, interrupts and CPU use for each
+void ata_bench(unsigned int nsectors);
+
+#endif
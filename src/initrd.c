@@ -0,0 +1,220 @@
+// initrd.c
+//
+// The initrd is a ustar archive: each member is a 512-byte header block
+// followed by its data padded to a block, and two zero blocks end it. The
+// headers are read once at boot into a table of names and data pointers;
+// the data itself is never copied.
+
+#include <stdint.h>
+#include "initrd.h"
+#include "multiboot2.h"
+#include "ide.h"
+#include "fat.h"
+#include "klib.h"
+
+#define TAR_BLOCK 512
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];                    // "ustar\0", or "ustar " from GNU tar
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} __attribute__((packed));
+
+static struct initrd_file entries[INITRD_FILES];
+static struct initrd_file root = { "", 0, 0, 1 };
+static char names[INITRD_NAMES];
+static uint32_t names_used;
+static struct initrd_info info;
+static int mounted = 0;
+
+static uint32_t octal(const char *s, int n) {
+    uint32_t v = 0;
+
+    for (; n && *s == ' '; s++, n--)
+        ;
+    for (; n && *s >= '0' && *s <= '7'; s++, n--)
+        v = v * 8 + (*s - '0');
+    return v;
+}
+
+// The checksum is the sum of the header's bytes with its own field as spaces
+static int header_ok(const struct tar_header *h) {
+    const uint8_t *b = (const uint8_t *)h;
+    uint32_t sum = 0;
+
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : b[i];
+    return memcmp(h->magic, "ustar", 5) == 0 && sum == octal(h->chksum, sizeof(h->chksum));
+}
+
+static int zero_block(const uint8_t *b) {
+    for (int i = 0; i < TAR_BLOCK; i++)
+        if (b[i])
+            return 0;
+    return 1;
+}
+
+// Append the components of s, at most n bytes of it, to out, dropping empty
+// and "." ones. Returns the new length, or -1 if it won't fit in max.
+static int append_path(char *out, int len, int max, const char *s, int n) {
+    int i = 0;
+
+    while (i < n && s[i]) {
+        int start, clen;
+
+        while (i < n && s[i] == '/')
+            i++;
+        for (start = i; i < n && s[i] && s[i] != '/'; i++)
+            ;
+        clen = i - start;
+        if (clen == 0 || (clen == 1 && s[start] == '.'))
+            continue;
+        if (len + (len != 0) + clen >= max)
+            return -1;
+        if (len)
+            out[len++] = '/';
+        memcpy(out + len, s + start, clen);
+        len += clen;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// Index the header h at data, whose entry would be the next in the table
+static void add_entry(const struct tar_header *h, const uint8_t *data, uint32_t size) {
+    struct initrd_file *e = &entries[info.files + info.dirs];
+    char *name = names + names_used;
+    int max = INITRD_NAMES - names_used, len;
+
+    if (h->typeflag != '0' && h->typeflag != '\0' && h->typeflag != '5') {
+        info.skipped++;
+        return;
+    }
+    if (info.files + info.dirs == INITRD_FILES || max <= 0) {
+        info.skipped++;
+        return;
+    }
+    if ((len = append_path(name, 0, max, h->prefix, sizeof(h->prefix))) < 0 ||
+        (len = append_path(name, len, max, h->name, sizeof(h->name))) < 0) {
+        info.skipped++;
+        return;
+    }
+    if (len == 0)                     // "./" itself: the root is built in
+        return;
+
+    names_used += len + 1;
+    e->name = name;
+    e->data = data;
+    e->size = size;
+    e->dir = h->typeflag == '5';
+    if (e->dir) {
+        e->size = 0;
+        info.dirs++;
+    } else {
+        info.files++;
+        info.bytes += size;
+    }
+}
+
+int initrd_init(void) {
+    struct mb2_tag *t;
+    struct mb2_tag_module *m = 0;
+    const uint8_t *p, *end;
+
+    for (t = mb2_find_tag(MB2_TAG_MODULE); t; t = mb2_next_tag(t)) {
+        struct mb2_tag_module *mt = (struct mb2_tag_module *)t;
+
+        if (!m || strcmp(mt->cmdline, "initrd") == 0)
+            m = mt;
+    }
+    if (!m)
+        return ATA_ENODEV;
+
+    info.start = m->mod_start;
+    info.end = m->mod_end;
+    p = (const uint8_t *)m->mod_start;
+    end = (const uint8_t *)m->mod_end;
+    while (p + TAR_BLOCK <= end && !zero_block(p)) {
+        const struct tar_header *h = (const struct tar_header *)p;
+        uint32_t size = octal(h->size, sizeof(h->size));
+
+        if (!header_ok(h) || size > (uint32_t)(end - p) - TAR_BLOCK)
+            break;
+        add_entry(h, p + TAR_BLOCK, size);
+        p += TAR_BLOCK + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+    // An archive ends with zero blocks; anything else means a bad header
+    if (p + TAR_BLOCK <= end && !zero_block(p))
+        return FAT_EBADFS;
+    mounted = 1;
+    return ATA_OK;
+}
+
+const char *initrd_path(const char *path) {
+    static char buf[INITRD_PATH_MAX];
+    int n = strlen(INITRD_MOUNT);
+
+    if (!mounted || memcmp(path, INITRD_MOUNT, n) != 0 || (path[n] && path[n] != '/'))
+        return 0;
+    if (append_path(buf, 0, sizeof(buf), path + n, INITRD_PATH_MAX) < 0)
+        return 0;
+    return buf;
+}
+
+const struct initrd_file *initrd_lookup(const char *rel) {
+    if (!rel)
+        return 0;
+    if (!*rel)
+        return &root;
+    for (uint32_t i = 0; i < info.files + info.dirs; i++)
+        if (strcmp(entries[i].name, rel) == 0)
+            return &entries[i];
+    return 0;
+}
+
+// Whether name lies directly in the directory dir
+static int in_dir(const char *name, const char *dir) {
+    int n = strlen(dir);
+
+    if (n) {
+        if (memcmp(name, dir, n) != 0 || name[n] != '/')
+            return 0;
+        name += n + 1;
+    }
+    for (; *name; name++)
+        if (*name == '/')
+            return 0;
+    return 1;
+}
+
+const struct initrd_file *initrd_readdir(const char *rel, uint32_t *cookie) {
+    while (*cookie < info.files + info.dirs) {
+        const struct initrd_file *e = &entries[(*cookie)++];
+
+        if (in_dir(e->name, rel))
+            return e;
+    }
+    return 0;
+}
+
+uint32_t initrd_index(const struct initrd_file *f) {
+    return f == &root ? INITRD_FILES : (uint32_t)(f - entries);
+}
+
+const struct initrd_info *initrd_get_info(void) {
+    return mounted ? &info : 0;
+}
@@ -0,0 +1,64 @@
+#ifndef INITRD_H
+#define INITRD_H
+
+#include <stdint.h>
+
+/*
+ * The initial ramdisk: a ustar archive GRUB loads next to the kernel with
+ *
+ *     module2 /boot/initrd.tar initrd
+ *
+ * It is read in place, so the files under INITRD_MOUNT cost no disk I/O
+ * at all. Its frames are kept from the page allocator by
+ * mb2_reserve_frames(). At boot the archive's headers are indexed once;
+ * after that a lookup is a scan of INITRD_FILES names in memory. The
+ * archive is read-only.
+ */
+
+#define INITRD_MOUNT      "/initrd"
+#define INITRD_FILES      128         // entries indexed; the rest are skipped
+#define INITRD_NAMES      8192        // bytes for their paths
+#define INITRD_PATH_MAX   256
+
+// Inode numbers for the VFS: entry i is INITRD_INO | i. No FAT directory
+// cluster reaches the top 32 bits.
+#define INITRD_INO        0xFFFFFFFF00000000ull
+
+struct initrd_file {
+    const char *name;                 // path in the archive, no '/' at either end
+    const uint8_t *data;
+    uint32_t size;
+    uint8_t dir;
+};
+
+struct initrd_info {
+    uint32_t start, end;              // the module in physical memory
+    uint32_t files;
+    uint32_t dirs;
+    uint32_t bytes;                   // file data
+    uint32_t skipped;                 // links, devices, or past INITRD_FILES
+};
+
+// Find the module whose command line is "initrd", or else the first one,
+// and index it. ATA_ENODEV without a module, FAT_EBADFS if it isn't a
+// ustar archive.
+int initrd_init(void);
+
+// The part of path below INITRD_MOUNT, with no '/' at either end, or 0 if
+// path isn't under it. The result is only good until the next call.
+const char *initrd_path(const char *path);
+
+// The entry at rel, from initrd_path(); "" is the root. 0 if there's none.
+const struct initrd_file *initrd_lookup(const char *rel);
+
+// Entries directly under the directory rel. Start *cookie at 0; returns
+// each in turn, then 0.
+const struct initrd_file *initrd_readdir(const char *rel, uint32_t *cookie);
+
+// Index of an entry, for its inode number
+uint32_t initrd_index(const struct initrd_file *f);
+
+// 0 if there is no initrd
+const struct initrd_info *initrd_get_info(void);
+
+#endif
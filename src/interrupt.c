@@ -19,90 +19,23 @@
 #include <stdint.h>
 #include "interrupt.h"
 #include "rprintf.h"
-#include "keylogger.h"
+#include "kbd.h"
+#include "trace.h"
+#include "serial.h"
+#include "timer.h"
+#include "ide.h"
+#include "proc.h"
+#include "prof.h"
+#include "tsc.h"
 
 struct idt_entry idt_entries[256];
 struct idt_ptr   idt_ptr;
 struct tss_entry tss_ent;
+volatile uint32_t irq_count[16];
+volatile uint32_t bench_isr_count;
 
-unsigned char keyboard_map[128] =
-{
-   0,  27, '1', '2', '3', '4', '5', '6', '7', '8',     /* 9 */
- '9', '0', '-', '=', '\b',     /* Backspace */
- '\t',                 /* Tab */
- 'q', 'w', 'e', 'r',   /* 19 */
- 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n', /* Enter key */
-   0,                  /* 29   - Control */
- 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';',     /* 39 */
-'\'', '`',   0,                /* Left shift */
-'\\', 'z', 'x', 'c', 'v', 'b', 'n',                    /* 49 */
- 'm', ',', '.', '/',   0,                              /* Right shift */
- '*',
-   0,  /* Alt */
- ' ',  /* Space bar */
-   0,  /* Caps lock */
-   0,  /* 59 - F1 key ... > */
-   0,   0,   0,   0,   0,   0,   0,   0,  
-   0,  /* < ... F10 */
-   0,  /* 69 - Num lock*/
-   0,  /* Scroll Lock */
-   0,  /* Home key */
-   0,  /* Up Arrow */
-   0,  /* Page Up */
- '-',
-   0,  /* Left Arrow */
-   0,  
-   0,  /* Right Arrow */
- '+',
-   0,  /* 79 - End key*/
-   0,  /* Down Arrow */
-   0,  /* Page Down */
-   0,  /* Insert Key */
-   0,  /* Delete Key */
-   0,   0,   0,  
-   0,  /* F11 Key */
-   0,  /* F12 Key */
-   0,  /* All other keys are undefined */
-};
-
-unsigned char keyboard_map_shift[128] =
-{
-   0,  27, '!', '@', '#', '$', '%', '^', '&', '*',     
- '(', ')', '_', '+', '\b',
- '\t',
- 'Q', 'W', 'E', 'R',
- 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n',
-   0,
- 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':',
- '"', '~',   0,
- '|', 'Z', 'X', 'C', 'V', 'B', 'N',
- 'M', '<', '>', '?',   0,
- '*',
-   0,
- ' ',
-   0,
-   0,0,0,0,0,0,0,0,
-   0,
-   0,
-   0,
-   0,
-   0,
- '-',
-   0,
-   0,
-   0,
- '+',
-   0,
-   0,
-   0,
-   0,
-   0,
-   0, 0, 0,
-   0,
-   0,
-   0
-};
-
+// Drivers on shared PCI lines, see irq_install()
+static void (*pci_irq_handlers[16])(void);
 
 /*
  * outb
@@ -121,6 +54,36 @@ uint8_t inb (uint16_t _port) {
 	return ret;
 }
 
+void outw (uint16_t _port, uint16_t val) {
+    __asm__ __volatile__ ("outw %0, %1" : : "a" (val),  "dN" (_port) );
+}
+
+uint16_t inw (uint16_t _port) {
+	uint16_t ret;
+	__asm__ volatile ("inw %1, %0" : "=a"(ret) : "Nd"(_port));
+	return ret;
+}
+
+// Read count 16-bit words from port into buf (rep insw)
+void insw (uint16_t _port, void *buf, uint32_t count) {
+    __asm__ volatile ("cld\n rep insw" : "+D"(buf), "+c"(count) : "d"(_port) : "memory");
+}
+
+// Write count 16-bit words from buf to port (rep outsw)
+void outsw (uint16_t _port, const void *buf, uint32_t count) {
+    __asm__ volatile ("cld\n rep outsw" : "+S"(buf), "+c"(count) : "d"(_port) : "memory");
+}
+
+void outl (uint16_t _port, uint32_t val) {
+    __asm__ __volatile__ ("outl %0, %1" : : "a" (val),  "dN" (_port) );
+}
+
+uint32_t inl (uint16_t _port) {
+	uint32_t ret;
+	__asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(_port));
+	return ret;
+}
+
 void memset(char *s, char c, unsigned int n) {
     for(int k = 0; k < n ; k++) {
         s[k] = c;
@@ -241,12 +204,12 @@ void load_gdt() {
         "lgdt [gdt_desc]\n"     // Load the new GDT
         "ljmp $0x8,$gdt_flush\n"   // Far jump to update the CS
 "gdt_flush:\n"
-        "mov %%eax, 0x10\n"       // set data segments to data selector (0x10)
-        "mov %%ds, %%eax\n"
-        "mov %%ss, %%eax\n"
-        "mov %%es, %%eax\n"
-        "mov %%fs, %%eax\n"
-        "mov %%gs, %%eax\n" : : : "eax");
+        "mov $0x10, %%eax\n"      // set data segments to data selector (0x10)
+        "mov %%eax, %%ds\n"
+        "mov %%eax, %%ss\n"
+        "mov %%eax, %%es\n"
+        "mov %%eax, %%fs\n"
+        "mov %%eax, %%gs\n" : : : "eax");
 
 }
 
@@ -255,8 +218,7 @@ void load_gdt() {
 void write_tss(struct gdt_entry_bits *g) {
     // Firstly, let's compute the base and limit of our entry into the GDT.
     uint32_t base = (uint32_t) &tss_ent;
-    uint32_t limit = base + sizeof(struct tss_entry);
-    extern uint32_t stack_top;
+    uint32_t limit = sizeof(struct tss_entry) - 1;
 
     // Now, add our TSS descriptor's address to the GDT.
     g->limit_low = limit & 0xFFFF;
@@ -285,10 +247,15 @@ void write_tss(struct gdt_entry_bits *g) {
     tss_ent.cs   = 0x0b;
     tss_ent.ss = tss_ent.ds = tss_ent.es = tss_ent.fs = tss_ent.gs = 0x13;
     //note that CS is loaded from the IDT entry and should be the regular kernel code segment
+    tss_ent.iomap_base = sizeof(tss_ent); // no I/O permission bitmap: ring 3 gets no ports
 
     tss_flush(0x2b);
 }
 
+void tss_set_kernel_stack(uint32_t esp0) {
+    tss_ent.esp0 = esp0;
+}
+
 
 
 
@@ -340,6 +307,9 @@ void idt_flush(struct idt_ptr *idt){
 __attribute__((interrupt)) void divide_error_handler(struct interrupt_frame* frame)
 {
     asm("cli");
+    TRACE2(TRACE_EXCEPTION, 0, frame->eip);
+    if (frame->cs & 3)
+        proc_kill(0, frame->eip);
     /* do something */
     while(1);
 }
@@ -375,6 +345,8 @@ __attribute__((interrupt)) void bound_check_handler(struct interrupt_frame* fram
 __attribute__((interrupt)) void invalid_opcode_handler(struct interrupt_frame* frame)
 {
     asm("cli");
+    if (frame->cs & 3)
+        proc_kill(0, frame->eip);
     /* do something */
 //    while(1);
 }
@@ -426,16 +398,27 @@ __attribute__((interrupt)) void stack_exception_handler(struct interrupt_frame*
 }
 
 
-//__attribute__((interrupt)) void general_protection_handler(struct interrupt_frame* frame)
-void general_protection_handler(struct interrupt_frame* frame)
+__attribute__((interrupt)) void general_protection_handler(struct interrupt_frame* frame, uint32_t error)
 {
     asm("cli");
+    TRACE2(TRACE_EXCEPTION, 13, error);
+    // A program running privileged instructions or poking at ports
+    if (frame->cs & 3)
+        proc_kill(0, frame->eip);
     /* do something */
     while(1);
 }
-//void page_fault_handler(struct interrupt_frame* frame)
-void page_fault_handler(struct process_context_with_error* ctx)
+
+__attribute__((interrupt)) void page_fault_handler(struct interrupt_frame* frame, uint32_t error)
 {
+    uint32_t cr2;
+
+    asm volatile("mov %%cr2, %0" : "=r"(cr2));
+    TRACE2(TRACE_EXCEPTION, 14, cr2);
+    // A program's page that isn't there yet. A bad access kills the program
+    // and doesn't come back.
+    if (proc_fault(cr2, error, frame->eip))
+        return;
     asm("cli");
     while(1);
 }
@@ -455,67 +438,87 @@ __attribute__((interrupt)) void stub_isr(struct interrupt_frame* frame)
     while(1);
 }
 
-__attribute__((interrupt)) void pit_handler(struct interrupt_frame* frame)
+__attribute__((interrupt)) void bench_isr(struct interrupt_frame* frame)
 {
-    asm("cli");
-    /* do something */
-    while(1);
+    bench_isr_count++;
 }
 
-extern int kputc(int);
-static int shift_pressed = 0;
+__attribute__((interrupt)) void pit_handler(struct interrupt_frame* frame)
+{
+    irq_count[0]++;
+    // Our own frame's saved EBP is the interrupted code's
+    if (prof_running)
+        prof_sample(frame->eip, frame->cs, *(uint32_t *)__builtin_frame_address(0));
+    timer_irq();
+    outb(0x20, 0x20);
+}
 
 __attribute__((interrupt)) void keyboard_handler(struct interrupt_frame* frame)
 {
+    // Decoding happens in kbd.c on the consumer side
+    uint64_t tsc = rdtsc();
     uint8_t scancode = inb(0x60);
-    uint8_t code = scancode & 0x7F;
-    int released = scancode & 0x80;
-
-    // SHIFT HANDLING
-    if (code == 0x2A || code == 0x36) {   // left or right shift
-        if (!released)
-            shift_pressed = 1;   // key down
-        else
-            shift_pressed = 0;   // key up
-
-        outb(0x20, 0x20);
-        return;
-    }
+    TRACE2(TRACE_IRQ_ENTER, 1, scancode);
+    irq_count[1]++;
+    kbd_ring_push(scancode, tsc);
+    outb(0x20, 0x20);
+    TRACE2(TRACE_IRQ_EXIT, 1, 0);
+}
 
-    // F12 dump stays the same
-    if (!released && code == 0x58) {
-        keylog_dump();
-        outb(0x20, 0x20);
-        return;
-    }
+__attribute__((interrupt)) void serial_handler(struct interrupt_frame* frame)
+{
+    TRACE2(TRACE_IRQ_ENTER, 4, 0);
+    irq_count[4]++;
+    serial_rx_drain();
+    outb(0x20, 0x20);
+    TRACE2(TRACE_IRQ_EXIT, 4, 0);
+}
 
-    // CHARACTER TYPING
-    if (!released) {
-        unsigned char c;
+__attribute__((interrupt)) void ide_handler(struct interrupt_frame* frame)
+{
+    TRACE2(TRACE_IRQ_ENTER, 14, 0);
+    irq_count[14]++;
+    ata_irq();
+    PIC_sendEOI(14);
+    TRACE2(TRACE_IRQ_EXIT, 14, 0);
+}
 
-        if (shift_pressed)
-            c = keyboard_map_shift[code];
-        else
-            c = keyboard_map[code];
+static void pci_irq(uint8_t irq)
+{
+    TRACE2(TRACE_IRQ_ENTER, irq, 0);
+    irq_count[irq]++;
+    if (pci_irq_handlers[irq])
+        pci_irq_handlers[irq]();
+    PIC_sendEOI(irq);
+    TRACE2(TRACE_IRQ_EXIT, irq, 0);
+}
 
-        if (c) {
-            esp_printf(kputc, "%c", c);
-            keylog_add_char(c);
-        }
-    }
+__attribute__((interrupt)) void irq9_handler(struct interrupt_frame* frame)
+{
+    pci_irq(9);
+}
 
-    // EOI
-    outb(0x20, 0x20);
+__attribute__((interrupt)) void irq10_handler(struct interrupt_frame* frame)
+{
+    pci_irq(10);
 }
 
+__attribute__((interrupt)) void irq11_handler(struct interrupt_frame* frame)
+{
+    pci_irq(11);
+}
 
-__attribute__((interrupt)) void syscall_handler(struct interrupt_frame* frame)
+int irq_install(uint8_t irq, void (*fn)(void))
 {
-    asm("cli");
-    /* do something */
-    while(1);
+    if (irq < 9 || irq > 11)
+        return -1;
+    pci_irq_handlers[irq] = fn;
+    IRQ_clear_mask(2);
+    IRQ_clear_mask(irq);
+    return 0;
 }
 
+
 static void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags)
 {
    idt_entries[num].base_lo = base & 0xFFFF;
@@ -523,9 +526,9 @@ static void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags
 
    idt_entries[num].sel     = sel;
    idt_entries[num].always0 = 0;
-   // We must uncomment the OR below when we get to using user-mode.
-   // It sets the interrupt gate's privilege level to 3.
-   idt_entries[num].flags   = flags /* | 0x60 */;
+   // The privilege level is in flags: only the int 0x80 gate is DPL 3, so
+   // that's the only vector ring 3 can raise itself
+   idt_entries[num].flags   = flags;
 }
 
 void init_idt() {
@@ -562,8 +565,14 @@ void init_idt() {
 //    idt_set_gate(15, (uint32_t)coprocessor_error_handler, 0x08, 0x8e);
 
     idt_set_gate(0x21, (uint32_t)keyboard_handler,0x08, 0x8e);
-    idt_set_gate(0x80, (uint32_t)syscall_handler,0x08, 0xee); // Set flags to EE, making DPL = 3 so it is accessible from userspace
+    idt_set_gate(0x24, (uint32_t)serial_handler,0x08, 0x8e);
+    idt_set_gate(0x29, (uint32_t)irq9_handler,0x08, 0x8e);
+    idt_set_gate(0x2a, (uint32_t)irq10_handler,0x08, 0x8e);
+    idt_set_gate(0x2b, (uint32_t)irq11_handler,0x08, 0x8e);
+    idt_set_gate(0x2e, (uint32_t)ide_handler,0x08, 0x8e);
+    idt_set_gate(0x80, (uint32_t)syscall_entry,0x08, 0xee); // Set flags to EE, making DPL = 3 so it is accessible from userspace
     idt_set_gate(32,   (uint32_t)pit_handler, 0x08, 0x8e);
+    idt_set_gate(BENCH_VECTOR, (uint32_t)bench_isr, 0x08, 0x8e);
     idt_flush(&idt_ptr);
 }
 
@@ -581,9 +590,9 @@ void remap_pic(void)
     outb(PIC_1_DATA, 0x20);
     outb(PIC_2_DATA, 0x28);
 
-    /* ICW3 - setup cascading */
-    outb(PIC_1_DATA, 0x00);
-    outb(PIC_2_DATA, 0x00);
+    /* ICW3 - setup cascading: slave on master IRQ2, slave identity 2 */
+    outb(PIC_1_DATA, 0x04);
+    outb(PIC_2_DATA, 0x02);
 
     /* ICW4 - environment info */
     outb(PIC_1_DATA, 0x01);
@@ -20,8 +20,35 @@
 #define PIC_1_DATA 0x21
 #define PIC_2_DATA 0xA1
 
+// Number of times each PIC line has fired, for the shell's irqstat
+extern volatile uint32_t irq_count[16];
+
+// A vector whose handler only counts, so `int $BENCH_VECTOR` times the
+// bare trip through the IDT and back
+#define BENCH_VECTOR 0x81
+extern volatile uint32_t bench_isr_count;
+
 uint8_t inb(uint16_t port);
 void outb(uint16_t port, uint8_t value);
+uint16_t inw(uint16_t port);
+void outw(uint16_t port, uint16_t value);
+void insw(uint16_t port, void *buf, uint32_t count);
+void outsw(uint16_t port, const void *buf, uint32_t count);
+uint32_t inl(uint16_t port);
+void outl(uint16_t port, uint32_t value);
+
+// Disable interrupts and return the previous EFLAGS for irq_restore()
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    asm volatile("pushf\n pop %0\n cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Re-enable interrupts if they were on when irq_save() was called
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200)
+        asm volatile("sti" : : : "memory");
+}
 
 // A struct describing an interrupt gate.
 struct idt_entry
@@ -153,8 +180,16 @@ struct gdt_entry_bits
 void PIC_sendEOI(unsigned char irq);
 void IRQ_clear_mask(unsigned char IRQline);
 void IRQ_set_mask(unsigned char IRQline);
+
+// Run fn on the PCI interrupt line irq and unmask it. Only lines 9-11, the
+// ones the PIIX routes PCI INTx to, have an ISR. Returns -1 for any other.
+int irq_install(uint8_t irq, void (*fn)(void));
+
 void init_idt();
 void tss_flush (uint16_t tss);
+
+// Where the CPU switches the stack to on a trap from ring 3
+void tss_set_kernel_stack(uint32_t esp0);
 void load_gdt();
 void remap_pic(void);
 #endif
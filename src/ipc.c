@@ -0,0 +1,252 @@
+// ipc.c
+//
+// Ports and the two ways a message's data gets across. A port holds at
+// most one posted receive; a send fills it in and marks it done. Words are
+// copied into the receiver's message, pages are handed over by
+// paging_remap().
+
+#include <stdint.h>
+#include "ipc.h"
+#include "paging.h"
+#include "page.h"
+#include "vfs.h"
+#include "ide.h"
+#include "klib.h"
+#include "tsc.h"
+#include "rprintf.h"
+#include "console.h"
+
+struct ipc_port {
+    uint8_t used;
+    uint8_t posted;                   // a receive is waiting
+    uint8_t done;                     // and has been sent to
+    struct ipc_space *sp;
+    struct ipc_msg *msg;
+    void *dst;
+    uint32_t max_pages;
+};
+
+static struct ipc_port ports[IPC_PORTS];
+static struct ipc_stats stats;
+
+static struct ipc_port *port_get(int port) {
+    return port >= 0 && port < IPC_PORTS && ports[port].used ? &ports[port] : 0;
+}
+
+int ipc_port(void) {
+    for (int i = 0; i < IPC_PORTS; i++) {
+        if (!ports[i].used) {
+            ports[i].used = 1;
+            ports[i].posted = 0;
+            ports[i].done = 0;
+            return i;
+        }
+    }
+    return VFS_EMFILE;
+}
+
+void ipc_close(int port) {
+    struct ipc_port *p = port_get(port);
+
+    if (p)
+        p->used = 0;
+}
+
+int ipc_recv(int port, struct ipc_space *sp, struct ipc_msg *msg, void *dst, uint32_t max_pages) {
+    struct ipc_port *p = port_get(port);
+
+    if (!p || (max_pages && (uint32_t)dst % PAGE_SIZE))
+        return ATA_EINVAL;
+    p->sp = sp;
+    p->msg = msg;
+    p->dst = dst;
+    p->max_pages = max_pages;
+    p->done = 0;
+    p->posted = 1;
+    return ATA_OK;
+}
+
+int ipc_wait(int port) {
+    struct ipc_port *p = port_get(port);
+
+    if (!p)
+        return ATA_EINVAL;
+    return p->done ? ATA_OK : IPC_EAGAIN;
+}
+
+int ipc_send(int port, struct ipc_space *sp, const struct ipc_msg *msg) {
+    struct ipc_port *p = port_get(port);
+    int keep = (msg->flags & IPC_SHARE) != 0;
+    struct ipc_msg *out;
+
+    if (!p)
+        return ATA_EINVAL;
+    if (!p->posted) {
+        stats.refused++;
+        return IPC_EAGAIN;
+    }
+    if (msg->npages > p->max_pages)
+        return ATA_EINVAL;
+    // A shared page stays writable only where it came from
+    if (msg->npages &&
+        ((uint32_t)msg->pages % PAGE_SIZE ||
+         !paging_remap(sp->pd, msg->pages, p->sp->pd, p->dst, msg->npages,
+                       p->sp->prot | (keep ? 0 : MAP_RW), keep)))
+        return ATA_EINVAL;
+
+    out = p->msg;
+    for (int i = 0; i < IPC_WORDS; i++)
+        out->w[i] = msg->w[i];
+    out->pages = msg->npages ? p->dst : 0;
+    out->npages = msg->npages;
+    out->flags = msg->flags;
+    p->posted = 0;
+    p->done = 1;
+
+    stats.sends++;
+    if (keep)
+        stats.pages_shared += msg->npages;
+    else
+        stats.pages_moved += msg->npages;
+    return ATA_OK;
+}
+
+const struct ipc_stats *ipc_get_stats(void) {
+    return &stats;
+}
+
+// Where the bench keeps its buffers: A's to send, where B receives them,
+// and B's own for the copying run. Each is 4 MiB apart, a page table each.
+#define BENCH_PAGES   256
+#define BENCH_A       ((uint8_t *)VM_MAP_BASE)
+#define BENCH_B       ((uint8_t *)VM_MAP_BASE + 0x400000)
+#define BENCH_B_COPY  ((uint8_t *)VM_MAP_BASE + 0x800000)
+
+// What the kernel would have to do without remapping: copy from the
+// current space into another one, through the identity map of its frames
+static void copy_to(struct ipc_space *to, uint8_t *dst, const uint8_t *src, uint32_t npages) {
+    for (uint32_t i = 0; i < npages; i++)
+        memcpy(paging_lookup(to->pd, dst + i * PAGE_SIZE), src + i * PAGE_SIZE, PAGE_SIZE);
+}
+
+static void ipc_bench_report(const char *what, uint32_t npages, int rounds, uint64_t cycles) {
+    uint32_t us = tsc_to_us(cycles);
+    uint64_t bytes = (uint64_t)npages * PAGE_SIZE * 2 * rounds;
+
+    if (us == 0)
+        us = 1;
+    // 1000000 / 2^20 = 15625 / 2^14
+    esp_printf(kputc, "%d KiB %s %d cycles per message, %d MiB/s\n", npages * PAGE_SIZE / 1024, what,
+               div64_32(cycles, 2 * rounds), div64_32((bytes * 15625) >> 14, us));
+}
+
+void ipc_bench(int rounds) {
+    static struct ppage pages[2 * BENCH_PAGES];
+    static const uint32_t sizes[] = { 1, 16, BENCH_PAGES };
+    struct ipc_space a = { 0, 0 }, b = { 0, 0 };
+    struct ipc_msg msg, ma, mb;
+    struct ppage *frame = 0;
+    uint64_t t0;
+    int pa, pb, bad = 0;
+
+    if (rounds < 1)
+        rounds = 1;
+    pa = ipc_port();
+    pb = ipc_port();
+    a.pd = paging_new_directory();
+    b.pd = paging_new_directory();
+    if (pa >= 0 && pb >= 0 && a.pd && b.pd && (frame = allocate_physical_pages(1))) {
+        // A gets the first half of the frame, B the second for copying into
+        for (int i = 0; i < 2 * BENCH_PAGES; i++) {
+            pages[i].physical_addr = (uint8_t *)frame->physical_addr + i * PAGE_SIZE;
+            pages[i].next = i + 1 == BENCH_PAGES || i + 1 == 2 * BENCH_PAGES ? 0 : &pages[i + 1];
+        }
+        *(uint32_t *)frame->physical_addr = 0;
+        if (!map_pages(BENCH_A, &pages[0], a.pd) || !map_pages(BENCH_B_COPY, &pages[BENCH_PAGES], b.pd)) {
+            free_physical_pages(frame);
+            frame = 0;
+        }
+    }
+    if (!frame) {
+        esp_printf(kputc, "ipc bench: out of ports or memory\n");
+        goto out;
+    }
+    msg.pages = 0;
+    msg.npages = 0;
+    msg.flags = 0;
+    esp_printf(kputc, "ipc, %d round trips between two address spaces:\n", rounds);
+
+    // Register-sized messages, switching address space for each side
+    t0 = rdtsc();
+    for (int r = 0; r < rounds; r++) {
+        ipc_recv(pb, &b, &mb, 0, 0);
+        loadPageDirectory(a.pd);
+        msg.w[0] = r;
+        ipc_send(pb, &a, &msg);
+        ipc_recv(pa, &a, &ma, 0, 0);
+        loadPageDirectory(b.pd);
+        msg.w[0] = mb.w[0] + 1;
+        ipc_send(pa, &b, &msg);
+        bad |= ma.w[0] != (uint32_t)r + 1;
+    }
+    loadPageDirectory(pd);
+    esp_printf(kputc, "words:  %d cycles per message\n", div64_32(rdtsc() - t0, 2 * rounds));
+
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint32_t n = sizes[s];
+
+        // The pages themselves go to B and back; B bumps a counter in them
+        t0 = rdtsc();
+        for (int r = 0; r < rounds; r++) {
+            ipc_recv(pb, &b, &mb, BENCH_B, n);
+            loadPageDirectory(a.pd);
+            msg.pages = BENCH_A;
+            msg.npages = n;
+            bad |= ipc_send(pb, &a, &msg) != ATA_OK;
+            ipc_recv(pa, &a, &ma, BENCH_A, n);
+            loadPageDirectory(b.pd);
+            ((volatile uint32_t *)mb.pages)[0]++;
+            msg.pages = mb.pages;
+            bad |= ipc_send(pa, &b, &msg) != ATA_OK;
+        }
+        loadPageDirectory(pd);
+        ipc_bench_report("remap:", n, rounds, rdtsc() - t0);
+
+        // The same bytes copied across instead, with a word message to say so
+        msg.pages = 0;
+        msg.npages = 0;
+        t0 = rdtsc();
+        for (int r = 0; r < rounds; r++) {
+            ipc_recv(pb, &b, &mb, 0, 0);
+            loadPageDirectory(a.pd);
+            copy_to(&b, BENCH_B_COPY, BENCH_A, n);
+            ipc_send(pb, &a, &msg);
+            ipc_recv(pa, &a, &ma, 0, 0);
+            loadPageDirectory(b.pd);
+            copy_to(&a, BENCH_A, BENCH_B_COPY, n);
+            ipc_send(pa, &b, &msg);
+        }
+        loadPageDirectory(pd);
+        ipc_bench_report("copy: ", n, rounds, rdtsc() - t0);
+    }
+
+    // A has its pages back, with every one of B's increments in them
+    if (bad || paging_lookup(a.pd, BENCH_A) != frame->physical_addr ||
+        *(uint32_t *)frame->physical_addr != (uint32_t)rounds * (sizeof(sizes) / sizeof(sizes[0])))
+        esp_printf(kputc, "ipc bench: pages or messages went astray\n");
+
+out:
+    if (a.pd) {
+        unmap_pages(BENCH_A, BENCH_PAGES, a.pd);
+        paging_free_directory(a.pd);
+    }
+    if (b.pd) {
+        unmap_pages(BENCH_B, BENCH_PAGES, b.pd);
+        unmap_pages(BENCH_B_COPY, BENCH_PAGES, b.pd);
+        paging_free_directory(b.pd);
+    }
+    if (frame)
+        free_physical_pages(frame);
+    ipc_close(pa);
+    ipc_close(pb);
+}
@@ -0,0 +1,70 @@
+#ifndef IPC_H
+#define IPC_H
+
+#include <stdint.h>
+#include "paging.h"
+
+/*
+ * Message passing between address spaces, through numbered ports. A
+ * message is IPC_WORDS register-sized words, which are copied, and
+ * optionally a run of whole pages, which are not. The pages are remapped
+ * with paging_remap(): moved out of the sender's window into the
+ * receiver's, or with IPC_SHARE mapped read-only into the receiver's as
+ * well. The cost is per page table entry, however many bytes are sent.
+ *
+ * Sends are synchronous, but with no scheduler there is nothing to block
+ * on. Instead, the receiver posts its receive first, saying where in its
+ * window pages may go, and a send completes it there and then. A send to
+ * a port with no receive posted fails with IPC_EAGAIN.
+ */
+
+#define IPC_PORTS     8
+#define IPC_WORDS     4
+
+// ipc_msg flags
+#define IPC_SHARE     0x01            // the sender keeps its pages; the receiver can't write them
+
+// Errors, following on from PROC_*
+#define IPC_EAGAIN    -19             // nobody waiting on the port, or not sent to yet
+
+struct ipc_space {
+    struct page_directory_entry *pd;
+    int prot;                         // MAP_USER for a program's space, else 0
+};
+
+struct ipc_msg {
+    uint32_t w[IPC_WORDS];
+    void *pages;                      // sent from here; received, where they are now
+    uint32_t npages;
+    uint32_t flags;                   // IPC_*
+};
+
+struct ipc_stats {
+    uint32_t sends;
+    uint32_t pages_moved;
+    uint32_t pages_shared;
+    uint32_t refused;                 // IPC_EAGAIN
+};
+
+// A free port, or VFS_EMFILE
+int ipc_port(void);
+void ipc_close(int port);
+
+// Post a receive on port into msg, allowing up to max_pages pages at dst in
+// sp's window, which must be unmapped. msg is filled in by the send.
+int ipc_recv(int port, struct ipc_space *sp, struct ipc_msg *msg, void *dst, uint32_t max_pages);
+
+// ATA_OK once the posted receive on port has been sent to, else IPC_EAGAIN
+int ipc_wait(int port);
+
+// Send msg from sp to whoever waits on port. ATA_EINVAL if it has more
+// pages than the receiver allowed, or they aren't all mapped.
+int ipc_send(int port, struct ipc_space *sp, const struct ipc_msg *msg);
+
+const struct ipc_stats *ipc_get_stats(void);
+
+// Ping-pong between two address spaces: word messages, then buffers of
+// a few sizes by remapping and by copying
+void ipc_bench(int rounds);
+
+#endif
@@ -0,0 +1,314 @@
+// kbd.c
+//
+// Keyboard input. The ISR only pushes raw scancodes, stamped with the TSC,
+// into kbd_ring; all the decoding (shift, caps lock, ctrl, 0xE0 extended
+// codes) happens here on the consumer side.
+
+#include <stdint.h>
+#include "kbd.h"
+#include "keylogger.h"
+#include "console.h"
+#include "serial.h"
+#include "timer.h"
+
+volatile struct kbd_event kbd_ring[KBD_RING_SIZE];
+volatile uint8_t kbd_head = 0;
+volatile uint8_t kbd_tail = 0;
+volatile uint32_t kbd_dropped = 0;
+
+unsigned char keyboard_map[128] =
+{
+   0,  27, '1', '2', '3', '4', '5', '6', '7', '8',     /* 9 */
+ '9', '0', '-', '=', '\b',     /* Backspace */
+ '\t',                 /* Tab */
+ 'q', 'w', 'e', 'r',   /* 19 */
+ 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n', /* Enter key */
+   0,                  /* 29   - Control */
+ 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';',     /* 39 */
+'\'', '`',   0,                /* Left shift */
+'\\', 'z', 'x', 'c', 'v', 'b', 'n',                    /* 49 */
+ 'm', ',', '.', '/',   0,                              /* Right shift */
+ '*',
+   0,  /* Alt */
+ ' ',  /* Space bar */
+   0,  /* Caps lock */
+   0,  /* 59 - F1 key ... > */
+   0,   0,   0,   0,   0,   0,   0,   0,
+   0,  /* < ... F10 */
+   0,  /* 69 - Num lock*/
+   0,  /* Scroll Lock */
+   0,  /* Home key */
+   0,  /* Up Arrow */
+   0,  /* Page Up */
+ '-',
+   0,  /* Left Arrow */
+   0,
+   0,  /* Right Arrow */
+ '+',
+   0,  /* 79 - End key*/
+   0,  /* Down Arrow */
+   0,  /* Page Down */
+   0,  /* Insert Key */
+   0,  /* Delete Key */
+   0,   0,   0,
+   0,  /* F11 Key */
+   0,  /* F12 Key */
+   0,  /* All other keys are undefined */
+};
+
+unsigned char keyboard_map_shift[128] =
+{
+   0,  27, '!', '@', '#', '$', '%', '^', '&', '*',
+ '(', ')', '_', '+', '\b',
+ '\t',
+ 'Q', 'W', 'E', 'R',
+ 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n',
+   0,
+ 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':',
+ '"', '~',   0,
+ '|', 'Z', 'X', 'C', 'V', 'B', 'N',
+ 'M', '<', '>', '?',   0,
+ '*',
+   0,
+ ' ',
+   0,
+   0,0,0,0,0,0,0,0,
+   0,
+   0,
+   0,
+   0,
+   0,
+ '-',
+   0,
+   0,
+   0,
+ '+',
+   0,
+   0,
+   0,
+   0,
+   0,
+   0, 0, 0,
+   0,
+   0,
+   0
+};
+
+// Decoder state. Only touched by the consumer.
+static int shift_state = 0;   // bit 0 = left shift, bit 1 = right shift
+static int ctrl_state = 0;    // bit 0 = left ctrl, bit 1 = right ctrl
+static int alt_state = 0;
+static int caps_lock = 0;
+static int extended = 0;      // last byte was 0xE0
+static int pause_skip = 0;    // bytes left in an 0xE1 pause sequence
+
+// Handlers for F1-F12 that run instead of returning the key
+static void (*hotkeys[12])(void);
+
+void kbd_init(void) {
+    kbd_head = 0;
+    kbd_tail = 0;
+    kbd_dropped = 0;
+    shift_state = ctrl_state = alt_state = caps_lock = 0;
+    extended = pause_skip = 0;
+}
+
+int kbd_modifiers(void) {
+    int mods = 0;
+    if (shift_state) mods |= KBD_MOD_SHIFT;
+    if (ctrl_state)  mods |= KBD_MOD_CTRL;
+    if (alt_state)   mods |= KBD_MOD_ALT;
+    if (caps_lock)   mods |= KBD_MOD_CAPS;
+    return mods;
+}
+
+// Map the second byte of an 0xE0 sequence to a key code
+static int decode_extended(uint8_t code) {
+    switch (code) {
+    case 0x1C: return '\n';        // keypad enter
+    case 0x35: return '/';         // keypad slash
+    case 0x47: return KEY_HOME;
+    case 0x48: return KEY_UP;
+    case 0x49: return KEY_PGUP;
+    case 0x4B: return KEY_LEFT;
+    case 0x4D: return KEY_RIGHT;
+    case 0x4F: return KEY_END;
+    case 0x50: return KEY_DOWN;
+    case 0x51: return KEY_PGDN;
+    case 0x52: return KEY_INSERT;
+    case 0x53: return KEY_DELETE;
+    }
+    return -1;
+}
+
+/*
+ * Feed one scancode through the decoder. Returns a key code, or -1 if the
+ * scancode only changed decoder state (modifier, release, prefix byte).
+ */
+static int decode(uint8_t scancode) {
+    uint8_t code = scancode & 0x7F;
+    int released = scancode & 0x80;
+    int is_ext = extended;
+    unsigned char c;
+
+    extended = 0;
+
+    if (pause_skip) {
+        pause_skip--;
+        return -1;
+    }
+    if (scancode == 0xE0) {
+        extended = 1;
+        return -1;
+    }
+    if (scancode == 0xE1) {
+        pause_skip = 5;
+        return -1;
+    }
+
+    // Modifiers. Right ctrl/alt are E0-prefixed versions of the left ones.
+    if (code == 0x1D) {
+        int bit = is_ext ? 2 : 1;
+        ctrl_state = released ? (ctrl_state & ~bit) : (ctrl_state | bit);
+        return -1;
+    }
+    if (code == 0x38) {
+        int bit = is_ext ? 2 : 1;
+        alt_state = released ? (alt_state & ~bit) : (alt_state | bit);
+        return -1;
+    }
+    if (code == 0x2A || code == 0x36) {
+        // E0 2A / E0 36 are fake shifts sent around the grey keys
+        if (is_ext)
+            return -1;
+        int bit = (code == 0x2A) ? 1 : 2;
+        shift_state = released ? (shift_state & ~bit) : (shift_state | bit);
+        return -1;
+    }
+
+    if (released)
+        return -1;
+
+    if (code == 0x3A) {
+        caps_lock = !caps_lock;
+        return -1;
+    }
+    if (is_ext)
+        return decode_extended(code);
+    if (code >= 0x3B && code <= 0x44)
+        return KEY_F1 + (code - 0x3B);
+    if (code == 0x57)
+        return KEY_F11;
+    if (code == 0x58)
+        return KEY_F12;
+
+    c = shift_state ? keyboard_map_shift[code] : keyboard_map[code];
+    if (!c)
+        return -1;
+
+    // Caps lock only affects letters, and shift inverts it
+    if (caps_lock) {
+        if (c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+        else if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+    }
+
+    if (ctrl_state) {
+        if (c >= 'a' && c <= 'z')
+            return c - 'a' + 1;
+        if (c >= 'A' && c <= 'Z')
+            return c - 'A' + 1;
+    }
+    return c;
+}
+
+void kbd_set_hotkey(int key, void (*fn)(void)) {
+    if (key >= KEY_F1 && key <= KEY_F12)
+        hotkeys[key - KEY_F1] = fn;
+}
+
+int kbd_poll(void) {
+    int c;
+
+    while (kbd_tail != kbd_head) {
+        uint8_t t = kbd_tail;
+        uint8_t scancode = kbd_ring[t].scancode;
+        uint64_t tsc = kbd_ring[t].tsc;
+        kbd_tail = t + 1;
+
+        int key = decode(scancode);
+        keylog_add_scancode(scancode, key, kbd_modifiers(), tsc);
+        if (key < 0)
+            continue;
+        if (key >= KEY_F1 && key <= KEY_F12 && hotkeys[key - KEY_F1]) {
+            hotkeys[key - KEY_F1]();
+            continue;
+        }
+        return key;
+    }
+
+    // Characters typed on the serial line arrive already decoded
+    c = serial_read();
+    if (c == '\r')
+        c = '\n';
+    else if (c == 0x7f)
+        c = '\b';
+    return c;
+}
+
+int kgetchar(void) {
+    int key;
+
+    while ((key = kbd_poll()) < 0) {
+        kflush();
+        timer_run_pending();
+        // Check for an empty ring with interrupts off so a scancode can't
+        // sneak in between the test and the hlt. sti only takes effect after
+        // the next instruction, so "sti; hlt" can't miss the wakeup.
+        asm volatile("cli");
+        if (kbd_tail == kbd_head && !serial_rx_pending())
+            asm volatile("sti\n hlt");
+        else
+            asm volatile("sti");
+    }
+    return key;
+}
+
+int kreadline(char *buf, int size) {
+    int len = 0;
+
+    if (size <= 0)
+        return 0;
+
+    while (1) {
+        int c = kgetchar();
+
+        if (c == '\n' || c == '\r') {
+            kputc('\n');
+            break;
+        }
+        if (c == '\b') {
+            if (len > 0) {
+                len--;
+                kputc('\b');
+            }
+            continue;
+        }
+        if (c == 0x15) { // ctrl-U, kill the line
+            while (len > 0) {
+                len--;
+                kputc('\b');
+            }
+            continue;
+        }
+        if (c < 0x20 || c > 0x7e)
+            continue;
+        if (len < size - 1) {
+            buf[len++] = c;
+            kputc(c);
+        }
+    }
+    buf[len] = '\0';
+    return len;
+}
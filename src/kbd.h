@@ -0,0 +1,90 @@
+#ifndef KBD_H
+#define KBD_H
+
+#include <stdint.h>
+
+// Size of the raw scancode ring. Must be 256 so the 8-bit head/tail
+// indices wrap for free.
+#define KBD_RING_SIZE 256
+
+// Key codes returned by kgetchar() for keys that have no ASCII value.
+#define KEY_F1       0x101
+#define KEY_F2       0x102
+#define KEY_F3       0x103
+#define KEY_F4       0x104
+#define KEY_F5       0x105
+#define KEY_F6       0x106
+#define KEY_F7       0x107
+#define KEY_F8       0x108
+#define KEY_F9       0x109
+#define KEY_F10      0x10A
+#define KEY_F11      0x10B
+#define KEY_F12      0x10C
+#define KEY_UP       0x110
+#define KEY_DOWN     0x111
+#define KEY_LEFT     0x112
+#define KEY_RIGHT    0x113
+#define KEY_HOME     0x114
+#define KEY_END      0x115
+#define KEY_PGUP     0x116
+#define KEY_PGDN     0x117
+#define KEY_INSERT   0x118
+#define KEY_DELETE   0x119
+
+// Modifier bits, see kbd_modifiers()
+#define KBD_MOD_SHIFT 0x01
+#define KBD_MOD_CTRL  0x02
+#define KBD_MOD_ALT   0x04
+#define KBD_MOD_CAPS  0x08
+
+/*
+ * Single-producer/single-consumer scancode ring. The keyboard ISR is the
+ * only writer of kbd_head and the consumer (kgetchar) is the only writer of
+ * kbd_tail, so neither side needs a lock. Each scancode carries the TSC at
+ * the interrupt, so the keylog times keys by when they arrived rather than
+ * when the shell got round to decoding them.
+ */
+struct kbd_event {
+    uint64_t tsc;
+    uint8_t scancode;
+};
+
+extern volatile struct kbd_event kbd_ring[KBD_RING_SIZE];
+extern volatile uint8_t kbd_head;
+extern volatile uint8_t kbd_tail;
+extern volatile uint32_t kbd_dropped;
+
+// Called from the keyboard ISR. Drops the scancode if the ring is full.
+static inline void kbd_ring_push(uint8_t scancode, uint64_t tsc) {
+    uint8_t h = kbd_head;
+    if ((uint8_t)(h + 1) == kbd_tail) {
+        kbd_dropped++;
+        return;
+    }
+    kbd_ring[h].tsc = tsc;
+    kbd_ring[h].scancode = scancode;
+    kbd_head = h + 1;
+}
+
+// Reset the ring and the decoder state
+void kbd_init(void);
+
+// Current modifier state (KBD_MOD_* bits)
+int kbd_modifiers(void);
+
+// Run fn from kbd_poll() whenever the given F1-F12 key is pressed, instead of
+// returning the key. Pass 0 to go back to returning it.
+void kbd_set_hotkey(int key, void (*fn)(void));
+
+// Decode pending scancodes, then serial input, without blocking.
+// Returns a key or -1.
+int kbd_poll(void);
+
+// Block (hlt) until a key is available on the keyboard or COM1 and return it
+int kgetchar(void);
+
+// Read a line with echo and backspace editing. The newline is not stored.
+// Returns the number of characters placed in buf (always NUL-terminated).
+int kreadline(char *buf, int size);
+
+#endif
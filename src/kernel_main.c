@@ -6,25 +6,74 @@
 #include "page.h"
 #include "paging.h"
 #include "keylogger.h"
+#include "kbd.h"
+#include "tsc.h"
+#include "trace.h"
+#include "multiboot2.h"
+#include "fbcon.h"
+#include "console.h"
+#include "serial.h"
+#include "shell.h"
+#include "timer.h"
+#include "ide.h"
+#include "pci.h"
+#include "writeback.h"
+#include "bcache.h"
+#include "blkq.h"
+#include "virtio_blk.h"
+#include "fat.h"
+#include "vfs.h"
+#include "initrd.h"
+#include "boot.h"
+#include "bench.h"
 
 #define MEMORY 0xB8000
 #define WIDTH  80
 #define HEIGHT 25
-#define MULTIBOOT2_HEADER_MAGIC        0xe85250d6
+#define MULTIBOOT2_HEADER_LENGTH 48
 
-const unsigned int multiboot_header[]  __attribute__((section(".multiboot"))) = {MULTIBOOT2_HEADER_MAGIC, 0, 16, -(16+MULTIBOOT2_HEADER_MAGIC), 0, 12};
+// Ask for a linear framebuffer. The tag is optional, so GRUB falls back to
+// text mode if it can't set the mode and kputc() keeps using 0xB8000.
+const unsigned int multiboot_header[]  __attribute__((section(".multiboot"), aligned(8))) = {
+    MULTIBOOT2_HEADER_MAGIC, 0, MULTIBOOT2_HEADER_LENGTH, -(MULTIBOOT2_HEADER_LENGTH+MULTIBOOT2_HEADER_MAGIC),
+    MB2_HEADER_TAG_FRAMEBUFFER | (MB2_HEADER_TAG_OPTIONAL << 16), 20, FB_WANT_WIDTH, FB_WANT_HEIGHT, FB_WANT_DEPTH,
+    0,                          // pad the end tag to 8 bytes
+    MB2_HEADER_TAG_END, 8,
+};
+
+/*
+ * Entry point. GRUB leaves the multiboot2 magic in EAX and the boot
+ * information address in EBX, and makes no promises about ESP, so set up
+ * our own stack and hand both registers to main().
+ */
+static uint8_t boot_stack[16384] __attribute__((aligned(16), used));
+
+asm(".text\n"
+    ".global _start\n"
+    "_start:\n"
+    "    mov $boot_stack + 16384, %esp\n"
+    "    push %ebx\n"
+    "    push %eax\n"
+    "    call main\n"
+    "1:  hlt\n"
+    "    jmp 1b\n");
 
 static int cursor_row = 0;
 static int cursor_col = 0;
 static const uint8_t vga_color = 0x07;
 
-int kputc(int data) { //Deliverable 1.
+static int vga_putc(int data) { //Deliverable 1.
     volatile uint16_t *vram = (uint16_t*)MEMORY;
     if (data == '\n') {
         cursor_col = 0; 
         cursor_row++; 
     } else if (data == '\r') { 
         cursor_col = 0; 
+    } else if (data == '\b') {
+        if (cursor_col > 0) {
+            cursor_col--;
+            vram[cursor_row * WIDTH + cursor_col] = (vga_color << 8) | ' ';
+        }
     } else {
         int pos = cursor_row * WIDTH + cursor_col;
         vram[pos] = (vga_color << 8) | (uint8_t)data;
@@ -47,20 +96,99 @@ int kputc(int data) { //Deliverable 1.
     return data;
 }
 
-void main() {
-    remap_pic();
-    load_gdt();
-    init_idt();
+int kputc(int data) {
+    if (fbcon_active())
+        return fbcon_putc(data);
+    return vga_putc(data);
+}
+
+void kflush(void) {
+    fbcon_flush();
+}
+
+static int bench_putc(putc_fn_t fn, int lines) {
+    uint32_t t0, t1;
+
+    t0 = (uint32_t)rdtsc();
+    for (int i = 0; i < lines; i++)
+        esp_printf(fn, "Line %d: This is a test of the terminal scroll.\n", i);
+    if (fn == fbcon_putc)
+        fbcon_flush();
+    t1 = (uint32_t)rdtsc();
+    return (t1 - t0) / lines;
+}
+
+/*
+ * The scroll test from Deliverable 3, timed. Prints the same lines through
+ * the VGA text console and, if we have one, the framebuffer console.
+ */
+void console_bench(int lines) {
+    int vga, fb;
+
+    if (lines < 1)
+        lines = 1;
+    vga = bench_putc(vga_putc, lines);
+    fb = fbcon_active() ? bench_putc(fbcon_putc, lines) : 0;
+
+    esp_printf(kputc, "console bench, %d lines, cycles/line: vga %d", lines, vga);
+    if (fbcon_active())
+        esp_printf(kputc, ", fb %d (%dx%d chars)", fb, fbcon_cols(), fbcon_rows());
+    esp_printf(kputc, "\n");
+}
+
+void main(uint32_t mb_magic, uint32_t mb_info) {
+    int rc;
+
+    boot_start();
+    BOOT_STEP("mb2_init", mb2_init(mb_magic, mb_info));
+    BOOT_STEP("fbcon_init", fbcon_init());
+    BOOT_STEP("remap_pic", remap_pic());
+    BOOT_STEP("load_gdt", load_gdt());
+    BOOT_STEP("init_idt", init_idt());
+    BOOT_STEP("tsc_calibrate", tsc_calibrate());
+    BOOT_STEP("trace_init", trace_init());
     esp_printf(kputc, "Initializing interrupts...\n");
-    keylog_init();
+    BOOT_STEP("keylog_init", keylog_init());
+    BOOT_STEP("kbd_init", kbd_init());
+    kbd_set_hotkey(KEY_F12, keylog_dump);
+    BOOT_STEP("serial_init", serial_init());
+    BOOT_STEP("timer_init", timer_init(TIMER_HZ));
     asm("sti");
     esp_printf(kputc, "Kernel initialized.\n");
+    BOOT_STEP("pci_scan", pci_scan());
+    BOOT_STEP("init_pfa_list", init_pfa_list());
+    BOOT_STEP("mb2_reserve", mb2_reserve_frames());
+    BOOT_STEP("paging_init", paging_init());
+    BOOT_STEP("ata_init", rc = ata_init());
+    if (rc == ATA_OK)
+        esp_printf(kputc, "ata0: %s, %d sectors\n", ata_get_info()->model, ata_get_info()->sectors);
+    BOOT_STEP("virtio_blk_init", rc = virtio_blk_init());
+    if (rc == ATA_OK)
+        esp_printf(kputc, "vda: virtio-blk\n");
+    BOOT_STEP("blkq_init", blkq_init());
+    BOOT_STEP("wb_init", wb_init());
+    BOOT_STEP("bcache_init", bcache_init());
+    BOOT_STEP("fat_mount", rc = fat_mount());
+    if (rc == ATA_OK)
+        esp_printf(kputc, "fat%d: %d clusters of %d bytes at lba %d\n", fat_get_info()->type,
+                   fat_get_info()->clusters, fat_get_info()->cluster_size, fat_get_info()->lba);
+    BOOT_STEP("vfs_init", vfs_init());
+    if (rc == ATA_OK) {
+        BOOT_STEP("keylog_open", rc = keylog_open(KEYLOG_PATH));
+        if (rc != ATA_OK)
+            esp_printf(kputc, "keylog: can't open %s: %d\n", KEYLOG_PATH, rc);
+    }
+    BOOT_STEP("initrd_init", rc = initrd_init());
+    if (rc == ATA_OK)
+        esp_printf(kputc, "initrd: %d files, %d KiB at 0x%x\n", initrd_get_info()->files,
+                   (initrd_get_info()->end - initrd_get_info()->start) / 1024, initrd_get_info()->start);
     esp_printf(kputc, "Current execution level: %d\n", 0); // Prints current execution. Deliverable 2.
     //for (int i = 0; i < 30; i++) { // THIS IS FOR TESTING SCROLL. Deliverable 3.
         //esp_printf(putc, "Line %d: This is a test of the terminal scroll.\n", i);
     //}
-    init_pfa_list();
     struct ppage *alloc = allocate_physical_pages(3);
     free_physical_pages(alloc);
-    while(1) { }
+    boot_done();
+    bench_boot();
+    shell_run();
 }
@@ -2,72 +2,229 @@
 #include <stdint.h>
 #include "rprintf.h"
 #include "keylogger.h"
-#include "serial.h"    
+#include "serial.h"
+#include "vfs.h"
+#include "writeback.h"
+#include "timer.h"
+#include "ide.h"
 
 extern int kputc(int); // VGA output
 
-#define KEYLOG_BUF_SIZE 1024
+#define KEYLOG_SECTORS 64   // 32 KiB of history kept in RAM
 
-static char keylog_buf[KEYLOG_BUF_SIZE];
-static uint16_t keylog_head = 0;   // next write position
-static uint8_t  keylog_full = 0;   // has buffer wrapped?
+_Static_assert(sizeof(struct keylog_sector) == KEYLOG_SECTOR_SIZE, "keylog sector must be 512 bytes");
 
-void keylog_init(void) {
-    keylog_head = 0;
-    keylog_full = 0;
-    for (uint16_t i = 0; i < KEYLOG_BUF_SIZE; i++) {
-        keylog_buf[i] = 0;
+static struct keylog_sector keylog_buf[KEYLOG_SECTORS];
+static uint32_t keylog_seq = 0;       // next record number
+static uint32_t keylog_cur = 0;       // seqno of the sector being filled
+static uint32_t keylog_flushed = 0;   // sectors below this seqno reached the sink
+static keylog_sink_t keylog_sink = 0;
+static int keylog_fd = -1;            // KEYLOG_PATH once keylog_open() has it
+static uint32_t keylog_synced = 0;    // keylog_seq at the last timed sync
+static uint32_t keylog_base;          // where this log starts in the file, in bytes
+static uint32_t keylog_first;         // the sector that goes at keylog_base
+static struct timer_work sync_work;
+
+/*
+ * Default sink: stream the sectors over COM1. The sector header starts with
+ * KEYLOG_MAGIC, so tools/keylogdump can pick them out of a serial capture
+ * that also contains other output.
+ */
+static int keylog_serial_sink(uint32_t seqno, const void *sectors, unsigned int nsectors) {
+    serial_write_buf(sectors, nsectors * KEYLOG_SECTOR_SIZE);
+    return 0;
+}
+
+/*
+ * File sink: this boot's log follows the earlier ones in the file. Sector
+ * seqno goes at keylog_base + (seqno - keylog_first) * 512, so a partial
+ * sector pushed by keylog_sync() is overwritten in place once it fills. Files have no holes,
+ * so gaps are left as zeros, which keylogdump skips as having no magic.
+ */
+static int keylog_file_sink(uint32_t seqno, const void *sectors, unsigned int nsectors) {
+    static const struct keylog_sector zero;
+    uint32_t at = keylog_base + (seqno - keylog_first) * KEYLOG_SECTOR_SIZE;
+    struct vfs_stat st;
+
+    keylog_serial_sink(seqno, sectors, nsectors);
+    if (vfs_fstat(keylog_fd, &st) != ATA_OK)
+        return -1;
+    for (uint32_t pos = st.size, n; pos < at; pos += n) {
+        n = at - pos < KEYLOG_SECTOR_SIZE ? at - pos : KEYLOG_SECTOR_SIZE;
+        if (vfs_seek(keylog_fd, pos) != ATA_OK || vfs_write(keylog_fd, &zero, n) != (int)n)
+            return -1;
     }
+    if (vfs_seek(keylog_fd, at) != ATA_OK ||
+        vfs_write(keylog_fd, sectors, nsectors * KEYLOG_SECTOR_SIZE) != (int)(nsectors * KEYLOG_SECTOR_SIZE))
+        return -1;
+    return 0;
+}
+
+static struct keylog_sector *keylog_slot(uint32_t seqno) {
+    return &keylog_buf[seqno % KEYLOG_SECTORS];
+}
+
+static void keylog_open_sector(uint32_t seqno) {
+    struct keylog_sector *s = keylog_slot(seqno);
+    uint8_t *p = (uint8_t *)s;
+
+    for (unsigned int i = 0; i < sizeof(*s); i++)
+        p[i] = 0;
+    s->magic = KEYLOG_MAGIC;
+    s->seqno = seqno;
+    s->version = KEYLOG_VERSION;
+}
+
+void keylog_init(void) {
+    keylog_seq = 0;
+    keylog_cur = 0;
+    keylog_flushed = 0;
+    keylog_sink = keylog_serial_sink;
+    keylog_open_sector(0);
+}
+
+void keylog_set_sink(keylog_sink_t sink) {
+    keylog_sink = sink;
 }
 
 /*
- * Log one character:
- * 1. Save to ring buffer (for F12 dumping)
- * 2. Send out so QEMU writes it to host log file
+ * The FAT driver holds file data as delayed pages until a sync, so sectors
+ * the sink has taken aren't on the disk yet. Nothing else syncs unless the
+ * shell is told to, hence this.
  */
-void keylog_add_char(char c) {
+static void keylog_sync_work(void) {
+    if (keylog_fd < 0 || keylog_seq == keylog_synced)
+        return;
+    keylog_synced = keylog_seq;
+    keylog_sync();
+    if (vfs_sync() == ATA_OK)
+        wb_sync();
+}
+
+int keylog_open(const char *path) {
+    struct vfs_stat st;
+    int fd, rc;
+
+    keylog_close();
+    fd = vfs_open(path, VFS_O_WRITE | VFS_O_CREAT);
+    if (fd < 0)
+        return fd;
+    // Earlier boots' logs stay; this one goes after them
+    if ((rc = vfs_fstat(fd, &st)) != ATA_OK) {
+        vfs_close(fd);
+        return rc;
+    }
+    keylog_base = (st.size + KEYLOG_SECTOR_SIZE - 1) / KEYLOG_SECTOR_SIZE * KEYLOG_SECTOR_SIZE;
+    keylog_first = keylog_flushed;
+    keylog_fd = fd;
+    keylog_sink = keylog_file_sink;
+    if (!sync_work.fn)
+        timer_every(&sync_work, KEYLOG_SYNC_MS, keylog_sync_work);
+    return ATA_OK;
+}
+
+void keylog_close(void) {
+    if (keylog_fd < 0)
+        return;
+    vfs_close(keylog_fd);
+    keylog_fd = -1;
+    keylog_sink = keylog_serial_sink;
+}
 
-    // Filter out non-printable characters except newline
-    if ((c < 0x20 || c > 0x7e) && c != '\n' && c != '\r') {
+/*
+ * Hand sectors [keylog_flushed, upto) to the sink. The RAM buffer is a ring,
+ * so the range is split into at most two contiguous batches.
+ */
+static void keylog_push(uint32_t upto) {
+    if (!keylog_sink)
         return;
+
+    // Sectors that were overwritten before they could be flushed are lost.
+    // The slot of the sector being filled doesn't hold an old one anymore.
+    if (upto - keylog_flushed > KEYLOG_SECTORS - 1)
+        keylog_flushed = upto - (KEYLOG_SECTORS - 1);
+
+    while (keylog_flushed < upto) {
+        uint32_t idx = keylog_flushed % KEYLOG_SECTORS;
+        uint32_t n = upto - keylog_flushed;
+        if (n > KEYLOG_SECTORS - idx)
+            n = KEYLOG_SECTORS - idx;
+
+        if (keylog_sink(keylog_flushed, &keylog_buf[idx], n) != 0)
+            return;
+        keylog_flushed += n;
     }
+}
+
+void keylog_flush(void) {
+    keylog_push(keylog_cur);
+}
 
-    // 1. Save to ring buffer
-    keylog_buf[keylog_head] = c;
-    keylog_head++;
+void keylog_sync(void) {
+    struct keylog_sector *s = keylog_slot(keylog_cur);
 
-    if (keylog_head >= KEYLOG_BUF_SIZE) {
-        keylog_head = 0;
-        keylog_full = 1;
+    keylog_flush();
+    if (keylog_sink && s->count > 0 && keylog_flushed == keylog_cur)
+        keylog_sink(keylog_cur, s, 1);
+}
+
+/*
+ * Log one scancode. Records accumulate in RAM and only go out to the sink
+ * once a whole sector is full, instead of one serial write per key.
+ */
+void keylog_add_scancode(uint8_t scancode, int key, int modifiers, uint64_t tsc) {
+    struct keylog_sector *s = keylog_slot(keylog_cur);
+    struct keylog_record *r = &s->rec[s->count];
+
+    r->tsc = tsc;
+    r->seq = keylog_seq++;
+    r->key = (key > 0) ? key : 0;
+    r->scancode = scancode;
+    r->modifiers = modifiers;
+
+    if (++s->count == KEYLOG_RECS_PER_SECTOR) {
+        keylog_cur++;
+        keylog_open_sector(keylog_cur);
+        keylog_flush();
     }
+}
+
+// Print the typed characters held in one sector
+static void keylog_dump_sector(struct keylog_sector *s) {
+    struct keylog_record *r = s->rec;
+    struct keylog_record *end = s->rec + s->count;
 
-    serial_write(c);
+    for (; r < end; r++) {
+        uint16_t k = r->key;
+        if ((k >= 0x20 && k <= 0x7e) || k == '\n')
+            kputc(k);
+    }
 }
 
 void keylog_dump(void) {
-    uint16_t start, count;
+    uint32_t first;
 
-    if (!keylog_full && keylog_head == 0) {
+    if (keylog_seq == 0) {
         esp_printf(kputc, "Keylog is empty.\n");
         return;
     }
 
-    if (keylog_full) {
-        start = keylog_head;
-        count = KEYLOG_BUF_SIZE;
-    } else {
-        start = 0;
-        count = keylog_head;
-    }
+    // Oldest sector still held in RAM. The current sector's slot is reused,
+    // so at most KEYLOG_SECTORS - 1 complete sectors are available.
+    first = (keylog_cur >= KEYLOG_SECTORS - 1) ? keylog_cur - (KEYLOG_SECTORS - 1) : 0;
 
     esp_printf(kputc, "=== KEYLOG START ===\n");
 
-    for (uint16_t i = 0; i < count; i++) {
-        uint16_t idx = (start + i) % KEYLOG_BUF_SIZE;
-        char c = keylog_buf[idx];
-        if (c == 0 || c == '\r') continue;
-        kputc(c);
-    }
+    // Walk the ring as two contiguous spans rather than wrapping per record
+    uint32_t start = first % KEYLOG_SECTORS;
+    uint32_t n = keylog_cur - first + 1;
+    uint32_t span = (n < KEYLOG_SECTORS - start) ? n : KEYLOG_SECTORS - start;
+    struct keylog_sector *s, *end;
+
+    for (s = &keylog_buf[start], end = s + span; s < end; s++)
+        keylog_dump_sector(s);
+    for (s = &keylog_buf[0], end = s + (n - span); s < end; s++)
+        keylog_dump_sector(s);
 
     esp_printf(kputc, "\n=== KEYLOG END ===\n");
 }
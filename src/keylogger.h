@@ -3,11 +3,66 @@
 
 #include <stdint.h>
 
-// Initialize/reset the buffer (optional but nice to have)
+#define KEYLOG_MAGIC    0x474F4C4B   // "KLOG" in little endian
+#define KEYLOG_VERSION  1
+#define KEYLOG_SECTOR_SIZE 512
+#define KEYLOG_RECS_PER_SECTOR 31
+#define KEYLOG_PATH     "/KEYLOG.BIN" // on the FAT volume, for mcopy and tools/keylogdump
+#define KEYLOG_SYNC_MS  2000          // how often new records are written out to KEYLOG_PATH
+
+// One raw scancode as seen by the keyboard decoder
+struct keylog_record {
+    uint64_t tsc;        // rdtsc() in the keyboard ISR that read the scancode
+    uint32_t seq;        // running record number, for spotting gaps
+    uint16_t key;        // decoded key (ASCII or KEY_*), 0 if none
+    uint8_t  scancode;   // raw set 1 scancode, including 0xE0 prefixes
+    uint8_t  modifiers;  // KBD_MOD_* bits after this scancode
+} __attribute__((packed));
+
+/*
+ * Records are batched into whole 512-byte sectors. A sector may be handed
+ * to the sink more than once while it is still filling up; the copy with
+ * the highest count for a given seqno is the newest one.
+ */
+struct keylog_sector {
+    uint32_t magic;      // KEYLOG_MAGIC
+    uint32_t seqno;      // sector number within the log, 0-based
+    uint16_t count;      // valid records in rec[]
+    uint16_t version;    // KEYLOG_VERSION
+    uint32_t reserved;
+    struct keylog_record rec[KEYLOG_RECS_PER_SECTOR];
+} __attribute__((packed));
+
+/*
+ * Where flushed sectors go. The sectors passed are consecutive, starting at
+ * sector number seqno, so a file-backed sink can write them at byte offset
+ * seqno * 512. Returns 0 on success.
+ */
+typedef int (*keylog_sink_t)(uint32_t seqno, const void *sectors, unsigned int nsectors);
+
+// Initialize/reset the buffer and select the default (serial) sink
 void keylog_init(void);
 
-// Log a single character (printable or not – you can filter later)
-void keylog_add_char(char c);
+// Log one raw scancode along with its decoded key, modifier state and the
+// TSC when it arrived
+void keylog_add_scancode(uint8_t scancode, int key, int modifiers, uint64_t tsc);
+
+// Replace the sink. Passing 0 keeps sectors in RAM until a sink is set.
+void keylog_set_sink(keylog_sink_t sink);
+
+// Add this boot's log to the end of the file at path, through the VFS, and
+// send sectors there as well as over COM1. Every KEYLOG_SYNC_MS, if keys came in, the current
+// sector is pushed and the file synced to the disk.
+int keylog_open(const char *path);
+
+// Close the log file and go back to COM1 alone, before the volume changes
+void keylog_close(void);
+
+// Push every full sector that hasn't reached the sink yet
+void keylog_flush(void);
+
+// keylog_flush() plus the partially filled current sector
+void keylog_sync(void);
 
 // Dump the contents of the log to the screen
 void keylog_dump(void);
@@ -0,0 +1,45 @@
+// klib.c
+//
+// Freestanding replacements for the libc string routines. gcc may also emit
+// calls to memcpy for struct copies, so the name has to exist.
+
+#include <stdint.h>
+#include "klib.h"
+
+void *memcpy(void *dst, const void *src, uint32_t n) {
+    void *d = dst;
+    uint32_t words = n >> 2, bytes = n & 3;
+
+    // Dwords first, then the tail
+    asm volatile("cld\n rep movsl\n mov %3, %%ecx\n rep movsb"
+                 : "+D"(d), "+S"(src), "+c"(words)
+                 : "r"(bytes)
+                 : "memory");
+    return dst;
+}
+
+int memcmp(const void *a, const void *b, uint32_t n) {
+    const uint8_t *p = a, *q = b;
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (p[i] != q[i])
+            return p[i] - q[i];
+    }
+    return 0;
+}
+
+uint32_t strlen(const char *s) {
+    uint32_t n = 0;
+
+    while (s[n])
+        n++;
+    return n;
+}
+
+int strcmp(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return (uint8_t)*a - (uint8_t)*b;
+}
@@ -0,0 +1,13 @@
+#ifndef KLIB_H
+#define KLIB_H
+
+#include <stdint.h>
+
+// The few libc string routines the kernel needs. memset lives in interrupt.c.
+
+void *memcpy(void *dst, const void *src, uint32_t n);
+int memcmp(const void *a, const void *b, uint32_t n);
+uint32_t strlen(const char *s);
+int strcmp(const char *a, const char *b);
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include "multiboot2.h"
+#include "page.h"
+
+// Boot information is a uint32 total size, a reserved uint32, then tags
+// padded to 8 bytes, terminated by an MB2_TAG_END tag.
+static uint8_t *mb2_info = 0;
+
+void mb2_init(uint32_t magic, uint32_t info) {
+    mb2_info = (magic == MULTIBOOT2_BOOTLOADER_MAGIC) ? (uint8_t *)info : 0;
+}
+
+static struct mb2_tag *mb2_advance(struct mb2_tag *tag) {
+    return (struct mb2_tag *)((uint8_t *)tag + ((tag->size + 7) & ~7));
+}
+
+static struct mb2_tag *mb2_scan(struct mb2_tag *tag, uint32_t type) {
+    for (; tag->type != MB2_TAG_END; tag = mb2_advance(tag)) {
+        if (tag->type == type)
+            return tag;
+    }
+    return 0;
+}
+
+struct mb2_tag *mb2_find_tag(uint32_t type) {
+    if (!mb2_info)
+        return 0;
+    return mb2_scan((struct mb2_tag *)(mb2_info + 8), type);
+}
+
+struct mb2_tag *mb2_next_tag(struct mb2_tag *prev) {
+    return mb2_scan(mb2_advance(prev), prev->type);
+}
+
+const char *mb2_cmdline(void) {
+    struct mb2_tag *t = mb2_find_tag(MB2_TAG_CMDLINE);
+
+    return t ? ((struct mb2_tag_cmdline *)t)->string : "";
+}
+
+const char *mb2_cmdline_arg(const char *key, uint32_t *len) {
+    const char *s = mb2_cmdline();
+
+    while (*s) {
+        const char *k = key;
+
+        while (*s == ' ')
+            s++;
+        while (*k && *s == *k) {
+            s++;
+            k++;
+        }
+        if (!*k && *s == '=') {
+            const char *v = ++s;
+
+            while (*s && *s != ' ')
+                s++;
+            *len = s - v;
+            return v;
+        }
+        while (*s && *s != ' ')
+            s++;
+    }
+    return 0;
+}
+
+void mb2_reserve_frames(void) {
+    struct mb2_tag *t;
+
+    if (!mb2_info)
+        return;
+    pfa_reserve((uint32_t)mb2_info, (uint32_t)mb2_info + *(uint32_t *)mb2_info);
+    for (t = mb2_find_tag(MB2_TAG_MODULE); t; t = mb2_next_tag(t)) {
+        struct mb2_tag_module *m = (struct mb2_tag_module *)t;
+
+        pfa_reserve(m->mod_start, m->mod_end);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef MULTIBOOT2_H
+#define MULTIBOOT2_H
+
+#include <stdint.h>
+
+#define MULTIBOOT2_HEADER_MAGIC      0xe85250d6
+#define MULTIBOOT2_BOOTLOADER_MAGIC  0x36d76289
+
+// Header tags (in the kernel image)
+#define MB2_HEADER_TAG_END           0
+#define MB2_HEADER_TAG_FRAMEBUFFER   5
+#define MB2_HEADER_TAG_OPTIONAL      1
+
+// Boot information tags (handed to us by GRUB in EBX)
+#define MB2_TAG_END                  0
+#define MB2_TAG_CMDLINE              1
+#define MB2_TAG_MODULE               3
+#define MB2_TAG_MMAP                 6
+#define MB2_TAG_FRAMEBUFFER          8
+
+#define MB2_FRAMEBUFFER_TYPE_RGB     1
+
+struct mb2_tag {
+    uint32_t type;
+    uint32_t size;
+} __attribute__((packed));
+
+struct mb2_tag_framebuffer {
+    uint32_t type;
+    uint32_t size;
+    uint64_t addr;
+    uint32_t pitch;
+    uint32_t width;
+    uint32_t height;
+    uint8_t  bpp;
+    uint8_t  fb_type;
+    uint16_t reserved;
+    // Only valid for MB2_FRAMEBUFFER_TYPE_RGB
+    uint8_t  red_pos;
+    uint8_t  red_size;
+    uint8_t  green_pos;
+    uint8_t  green_size;
+    uint8_t  blue_pos;
+    uint8_t  blue_size;
+} __attribute__((packed));
+
+// A file GRUB loaded for us with module2, page-aligned in physical memory
+struct mb2_tag_module {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mod_start;
+    uint32_t mod_end;                // one past the last byte
+    char cmdline[];                  // the rest of the module2 line
+} __attribute__((packed));
+
+// The kernel's own command line, from the multiboot2 line in grub.cfg
+struct mb2_tag_cmdline {
+    uint32_t type;
+    uint32_t size;
+    char string[];
+} __attribute__((packed));
+
+// Remember the boot information pointer if magic says GRUB passed one
+void mb2_init(uint32_t magic, uint32_t info);
+
+// First boot information tag of the given type, or 0
+struct mb2_tag *mb2_find_tag(uint32_t type);
+
+// Next tag of the same type after prev, or 0
+struct mb2_tag *mb2_next_tag(struct mb2_tag *prev);
+
+// The kernel command line, or "" if GRUB didn't pass one
+const char *mb2_cmdline(void);
+
+// The value of key=value on the command line, up to the next space, or 0
+// if it isn't there. *len gets the value's length.
+const char *mb2_cmdline_arg(const char *key, uint32_t *len);
+
+// Keep the page allocator off the boot information and every module.
+// Call after init_pfa_list(), before the first allocation.
+void mb2_reserve_frames(void);
+
+#endif
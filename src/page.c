@@ -1,18 +1,48 @@
+#include <stdint.h>
 #include "page.h"
+#include "trace.h"
 
 #define PAGE_SIZE_MB 2
 #define NUM_PAGES 128   // or however many your assignment specifies
+#define FRAME_SIZE (PAGE_SIZE_MB * 1024 * 1024)
 
 static struct ppage physical_page_array[NUM_PAGES];
 static struct ppage *free_page_list = 0;
+static unsigned int reserved_frames = 0;
+static unsigned int extra_reserved = 0;   // by pfa_reserve()
 
 void init_pfa_list(void) {
-    for (int i = 0; i < NUM_PAGES; i++) {
-        physical_page_array[i].physical_addr = (void *)(i * PAGE_SIZE_MB * 1024 * 1024);
-        physical_page_array[i].prev = (i > 0) ? &physical_page_array[i - 1] : 0;
-        physical_page_array[i].next = (i < NUM_PAGES - 1) ? &physical_page_array[i + 1] : 0;
+    extern int _end_kernel;
+
+    // Frames holding the kernel image (and the BIOS area below it) are
+    // never handed out; DMA into them would overwrite the running kernel.
+    reserved_frames = ((uintptr_t)&_end_kernel + FRAME_SIZE - 1) / FRAME_SIZE;
+
+    for (unsigned int i = 0; i < NUM_PAGES; i++) {
+        int listed = i >= reserved_frames;
+        physical_page_array[i].physical_addr = (void *)(uintptr_t)(i * FRAME_SIZE);
+        physical_page_array[i].prev = (listed && i > reserved_frames) ? &physical_page_array[i - 1] : 0;
+        physical_page_array[i].next = (listed && i < NUM_PAGES - 1) ? &physical_page_array[i + 1] : 0;
+    }
+    free_page_list = &physical_page_array[reserved_frames];
+}
+
+void pfa_reserve(uint32_t start, uint32_t end) {
+    for (uint32_t i = start / FRAME_SIZE; i < NUM_PAGES && i * FRAME_SIZE < end; i++) {
+        struct ppage *p = &physical_page_array[i];
+
+        // Already off the list: the kernel's, or reserved before
+        if (i < reserved_frames || (!p->prev && free_page_list != p))
+            continue;
+        if (p->prev)
+            p->prev->next = p->next;
+        else
+            free_page_list = p->next;
+        if (p->next)
+            p->next->prev = p->prev;
+        p->next = p->prev = 0;
+        extra_reserved++;
     }
-    free_page_list = &physical_page_array[0];
 }
 
 struct ppage *allocate_physical_pages(unsigned int npages) {
@@ -30,6 +60,7 @@ struct ppage *allocate_physical_pages(unsigned int npages) {
         free_page_list->prev = 0;
 
     iter->next = 0;
+    TRACE2(TRACE_PAGE_ALLOC, npages, allocd_list->physical_addr);
     return allocd_list;
 }
 
@@ -37,8 +68,12 @@ void free_physical_pages(struct ppage *ppage_list) {
     if (!ppage_list) return;
 
     struct ppage *tail = ppage_list;
-    while (tail->next)
+    unsigned int npages = 1;
+    while (tail->next) {
         tail = tail->next;
+        npages++;
+    }
+    TRACE2(TRACE_PAGE_FREE, npages, ppage_list->physical_addr);
 
     // attach freed pages back to the head of the free list
     tail->next = free_page_list;
@@ -48,3 +83,14 @@ void free_physical_pages(struct ppage *ppage_list) {
     free_page_list = ppage_list;
 }
 
+
+void pfa_get_stats(struct pfa_stats *st) {
+    unsigned int n = 0;
+
+    for (struct ppage *p = free_page_list; p; p = p->next)
+        n++;
+    st->total = NUM_PAGES;
+    st->free = n;
+    st->reserved = reserved_frames + extra_reserved;
+    st->frame_size = FRAME_SIZE;
+}
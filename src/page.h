@@ -1,19 +1,35 @@
 #ifndef PAGE_H
 #define PAGE_H
 
+#include <stdint.h>
+
 struct ppage {
     struct ppage *next;
     struct ppage *prev;
     void *physical_addr;
 };
 
+struct pfa_stats {
+    unsigned int total;        // frames managed by the allocator
+    unsigned int free;         // frames currently on the free list
+    unsigned int reserved;     // frames under the kernel image or boot modules, never allocated
+    unsigned int frame_size;   // bytes per frame
+};
+
 // Initializes the list of free physical pages
 void init_pfa_list(void);
 
+// Take the frames overlapping physical addresses start up to end off the
+// free list for good. Call before anything is allocated.
+void pfa_reserve(uint32_t start, uint32_t end);
+
 // Allocates npages from free list and returns a linked list of allocated pages
 struct ppage *allocate_physical_pages(unsigned int npages);
 
 // Frees a list of physical pages (returns to free list)
 void free_physical_pages(struct ppage *ppage_list);
 
+// Snapshot of the allocator state (walks the free list)
+void pfa_get_stats(struct pfa_stats *st);
+
 #endif
@@ -2,98 +2,327 @@
 #include <stdint.h>
 #include <string.h> // for memset if available in your freestanding env
 #include "page.h"
+#include "trace.h"
+#include "rprintf.h"
 
 // Globals required by the assignment: aligned to 4096 and global (not on stack)
 struct page_directory_entry pd[1024] __attribute__((aligned(4096)));
-struct page pt[1024] __attribute__((aligned(4096)));
+
+// Page tables for the mapping window and directories for programs, carved
+// out of one frame on first use. Freed ones go on a list for reuse; the
+// frame itself is never given back.
+static struct page *pt_pool = 0;
+static uint32_t pt_pool_used = 0, pt_pool_size = 0;
+static struct page *pt_free_list = 0;
+
+static uint32_t pde_index(uintptr_t va) {
+    return (va >> 22) & 0x3FF;
+}
+
+static uint32_t pte_index(uintptr_t va) {
+    return (va >> 12) & 0x3FF;
+}
+
+static int in_window(uintptr_t va) {
+    return va >= VM_MAP_BASE && va < VM_MAP_END;
+}
+
+static struct page *pt_alloc(void) {
+    struct page *t;
+
+    if (pt_free_list) {
+        t = pt_free_list;
+        pt_free_list = *(struct page **)t;
+    } else {
+        if (!pt_pool) {
+            struct pfa_stats pst;
+            struct ppage *frame;
+
+            if (!(frame = allocate_physical_pages(1)))
+                return 0;
+            pfa_get_stats(&pst);
+            pt_pool = frame->physical_addr;
+            pt_pool_size = pst.frame_size / PAGE_SIZE;
+        }
+        if (pt_pool_used == pt_pool_size)
+            return 0;
+        t = pt_pool + 1024 * pt_pool_used++;
+    }
+    for (int i = 0; i < 1024; i++)
+        *(uint32_t *)&t[i] = 0;
+    return t;
+}
+
+static void pt_free(struct page *t) {
+    *(struct page **)t = pt_free_list;
+    pt_free_list = t;
+}
+
+// The table covering va, making one if create is set. 0 outside the window.
+static struct page *page_table(struct page_directory_entry *pd_ptr, uintptr_t va, int create)
+{
+    struct page_directory_entry *e = &pd_ptr[pde_index(va)];
+    struct page *t;
+
+    if (!in_window(va))
+        return 0;
+    if (e->present)
+        return (struct page *)(e->frame << 12);
+    if (!create || !(t = pt_alloc()))
+        return 0;
+    // The table's entries decide; the directory entry allows everything
+    e->rw = 1;
+    e->user = 1;
+    e->frame = (uint32_t)t >> 12;
+    e->present = 1;
+    return t;
+}
+
+static void flush_page(struct page_directory_entry *pd_ptr, uintptr_t va)
+{
+    uint32_t cr3;
+
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    if (cr3 == (uint32_t)pd_ptr)
+        asm volatile("invlpg (%0)" : : "r"(va) : "memory");
+}
 
 /*
- * map_pages:
+ * map_pages_prot:
  *   Maps the linked list of physical pages (pglist) starting at virtual address vaddr
- *   using the page-directory 'pd'. Returns the original vaddr mapped.
- *
- * NOTE: This implementation places a single second-level page table (pt) into the
- * directory at the directory index of vaddr. It only maps entries that lie within
- * that single 4 MiB directory slot. If the requested mapping crosses a 4 MiB boundary,
- * you must extend this implementation to allocate more page tables and add them
- * to the page directory.
+ *   using the page-directory 'pd', one 4 KiB page per list entry. Page tables are
+ *   allocated as the mapping crosses into 4 MiB slots that don't have one yet.
+ *   Only the mapping window can be mapped this way; the rest is the identity map.
  */
-void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd_ptr)
+void *map_pages_prot(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd_ptr, int prot)
 {
     uintptr_t va = (uintptr_t)vaddr;
     uintptr_t start_va = va;
     struct ppage *cur = pglist;
 
-    // compute directory index for the starting virtual address
-    uint32_t dir_idx = (va >> 22) & 0x3FF;
-
-    // If directory entry not present, point it to our single 'pt' array.
-    if (!pd_ptr[dir_idx].present) {
-        // clear the page table before use
-        for (int i = 0; i < 1024; ++i) {
-            pt[i].present = 0;
-            pt[i].rw = 0;
-            pt[i].user = 0;
-            pt[i].accessed = 0;
-            pt[i].dirty = 0;
-            pt[i].unused = 0;
-            pt[i].frame = 0;
+    TRACE2(TRACE_MAP_BEGIN, va, pd_ptr);
+
+    for (; cur; cur = cur->next, va += PAGE_SIZE) {
+        struct page *tbl = page_table(pd_ptr, va, 1);
+        struct page *e;
+
+        if (!tbl) {
+            // Out of the window, or out of tables: undo what's done
+            unmap_pages((void *)start_va, (va - start_va) / PAGE_SIZE, pd_ptr);
+            TRACE2(TRACE_MAP_END, start_va, 0);
+            return 0;
         }
+        e = &tbl[pte_index(va)];
+        *(uint32_t *)e = 0;
+        e->rw = (prot & MAP_RW) != 0;
+        e->user = (prot & MAP_USER) != 0;
+        e->frame = (uint32_t)cur->physical_addr >> 12;
+        e->present = 1;
+        flush_page(pd_ptr, va);
+    }
 
-        pd_ptr[dir_idx].present = 1;
-        pd_ptr[dir_idx].rw = 1;    // writable
-        pd_ptr[dir_idx].user = 0;  // supervisor
-        pd_ptr[dir_idx].writethru = 0;
-        pd_ptr[dir_idx].cachedisabled = 0;
-        pd_ptr[dir_idx].accessed = 0;
-        pd_ptr[dir_idx].pagesize = 0; // points to 4KB page table
-        pd_ptr[dir_idx].frame = ((uint32_t)pt) >> 12;
-    } else {
-        // if present, ensure it actually points to `pt` in our simple model
-        // (in a more complete implementation you'd locate the correct table)
+    TRACE2(TRACE_MAP_END, start_va, (va - start_va) >> 12);
+    return (void*)start_va;
+}
+
+void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd_ptr)
+{
+    return map_pages_prot(vaddr, pglist, pd_ptr, MAP_RW);
+}
+
+void unmap_pages(void *vaddr, uint32_t npages, struct page_directory_entry *pd_ptr)
+{
+    uintptr_t va = (uintptr_t)vaddr;
+
+    for (uint32_t i = 0; i < npages; i++, va += PAGE_SIZE) {
+        struct page *tbl = page_table(pd_ptr, va, 0);
+
+        if (tbl && tbl[pte_index(va)].present) {
+            *(uint32_t *)&tbl[pte_index(va)] = 0;
+            flush_page(pd_ptr, va);
+        }
+    }
+}
+
+void *paging_remap(struct page_directory_entry *from, void *src, struct page_directory_entry *to,
+                   void *dst, uint32_t npages, int prot, int keep)
+{
+    uintptr_t s = (uintptr_t)src, d = (uintptr_t)dst;
+
+    // Check everything, and get the tables, before touching anything, so
+    // a failure leaves both sides as they were
+    for (uint32_t i = 0; i < npages; i++) {
+        struct page *st = page_table(from, s + i * PAGE_SIZE, 0);
+        struct page *dt = page_table(to, d + i * PAGE_SIZE, 1);
+
+        if (!st || !st[pte_index(s + i * PAGE_SIZE)].present ||
+            !dt || dt[pte_index(d + i * PAGE_SIZE)].present)
+            return 0;
     }
 
-    // Map each page from the pglist into successive 4KB pages starting at vaddr
-    while (cur) {
-        uint32_t tbl_idx = (va >> 12) & 0x3FF;
+    TRACE2(TRACE_MAP_BEGIN, d, to);
+    for (uint32_t i = 0; i < npages; i++, s += PAGE_SIZE, d += PAGE_SIZE) {
+        struct page *se = &page_table(from, s, 0)[pte_index(s)];
+        struct page *de = &page_table(to, d, 0)[pte_index(d)];
 
-        // If mapping crosses directory boundary - stop (or handle allocating new page table)
-        uint32_t cur_dir_idx = (va >> 22) & 0x3FF;
-        if (cur_dir_idx != dir_idx) {
-            // This simple implementation only maps inside the same 4MB directory entry.
-            // Caller must ensure mappings are inside same 4MB boundary or extend this function.
-            break;
+        *(uint32_t *)de = 0;
+        de->rw = (prot & MAP_RW) != 0;
+        de->user = (prot & MAP_USER) != 0;
+        de->frame = se->frame;
+        de->present = 1;
+        flush_page(to, d);
+        if (!keep) {
+            *(uint32_t *)se = 0;
+            flush_page(from, s);
         }
+    }
+    TRACE2(TRACE_MAP_END, dst, npages);
+    return dst;
+}
+
+void *paging_lookup(struct page_directory_entry *pd_ptr, void *vaddr)
+{
+    uintptr_t va = (uintptr_t)vaddr;
+    struct page_directory_entry *e = &pd_ptr[pde_index(va)];
+    struct page *tbl;
 
-        // fill page table entry
-        uint32_t phys = (uint32_t) cur->physical_addr;
-        pt[tbl_idx].present = 1;
-        pt[tbl_idx].rw = 1;      // read-write
-        pt[tbl_idx].user = 0;    // supervisor
-        pt[tbl_idx].accessed = 0;
-        pt[tbl_idx].dirty = 0;
-        pt[tbl_idx].unused = 0;
-        pt[tbl_idx].frame = phys >> 12;
-
-        // advance
-        va += 4096;
-        cur = cur->next;
+    if (!e->present)
+        return 0;
+    if (e->pagesize)
+        return (void *)((e->frame << 12) + (va & 0x3FFFFF));
+    tbl = (struct page *)(e->frame << 12);
+    if (!tbl[pte_index(va)].present)
+        return 0;
+    return (void *)((tbl[pte_index(va)].frame << 12) + (va & 0xFFF));
+}
+
+void *paging_find_free(struct page_directory_entry *pd_ptr, uint32_t npages)
+{
+    uintptr_t va = VM_MAP_BASE, start = VM_MAP_BASE;
+
+    while (va < VM_MAP_END && (va - start) / PAGE_SIZE < npages) {
+        struct page *tbl = page_table(pd_ptr, va, 0);
+
+        if (!tbl) {
+            // No table, so nothing mapped in the whole 4 MiB
+            va = (va & ~0x3FFFFF) + 0x400000;
+        } else if (tbl[pte_index(va)].present) {
+            va += PAGE_SIZE;
+            start = va;
+        } else {
+            va += PAGE_SIZE;
+        }
     }
+    if (npages == 0 || (va - start) / PAGE_SIZE < npages)
+        return 0;
+    return (void *)start;
+}
 
-    return (void*)start_va;
+struct page_directory_entry *paging_new_directory(void)
+{
+    struct page_directory_entry *d = (struct page_directory_entry *)pt_alloc();
+
+    if (!d)
+        return 0;
+    for (uint32_t i = 0; i < 1024; i++)
+        if (!in_window(i << 22))
+            d[i] = pd[i];
+    return d;
+}
+
+void paging_free_directory(struct page_directory_entry *d)
+{
+    for (uint32_t va = VM_MAP_BASE; va < VM_MAP_END; va += 0x400000)
+        if (d[pde_index(va)].present)
+            pt_free((struct page *)(d[pde_index(va)].frame << 12));
+    pt_free((struct page *)d);
+}
+
+void paging_init(void)
+{
+    for (uint32_t i = 0; i < 1024; i++) {
+        uint32_t va = i << 22;
+
+        *(uint32_t *)&pd[i] = 0;
+        if (in_window(va))
+            continue;
+        pd[i].rw = 1;
+        pd[i].pagesize = 1;
+        pd[i].frame = va >> 12;
+        pd[i].present = 1;
+    }
+    // 4 MiB pages need CR4.PSE
+    asm volatile(
+        "mov %%cr4, %%eax\n"
+        "or $0x10, %%eax\n"
+        "mov %%eax, %%cr4\n"
+        : : : "eax"
+    );
+    loadPageDirectory(pd);
+    enable_paging();
 }
 
 void loadPageDirectory(struct page_directory_entry *pd_ptr) {
-    asm("mov %0,%%cr3" : : "r"(pd_ptr) : );
+    asm volatile("mov %0,%%cr3" : : "r"(pd_ptr) : "memory");
 }
 
 void enable_paging(void) {
     // Set CR0.PG (bit 31) and CR0.PE (bit 0) if PE is not already set.
     // Typically PE is already set when in protected mode; we OR both bits to be safe.
+    // CR0.WP (bit 16) makes read-only pages read-only for the kernel too.
     asm volatile (
         "mov %%cr0, %%eax\n"
-        "or $0x80000001, %%eax\n"
+        "or $0x80010001, %%eax\n"
         "mov %%eax, %%cr0\n"
         : : : "eax"
     );
 }
+
+void paging_dump(struct page_directory_entry *pd_ptr, int (*out)(int))
+{
+    int any = 0;
+
+    for (int d = 0; d < 1024; d++) {
+        if (!pd_ptr[d].present)
+            continue;
+        any = 1;
+
+        uint32_t base = (uint32_t)d << 22;
+        if (pd_ptr[d].pagesize) {
+            // The identity map is hundreds of these; print a run as one line
+            int start = d;
+            while (d + 1 < 1024 && pd_ptr[d + 1].present && pd_ptr[d + 1].pagesize &&
+                   pd_ptr[d + 1].frame == pd_ptr[d].frame + 1024 &&
+                   pd_ptr[d + 1].rw == pd_ptr[start].rw && pd_ptr[d + 1].user == pd_ptr[start].user)
+                d++;
+            esp_printf(out, "pde %d-%d: 0x%08x-0x%08x 4M pages -> 0x%08x\n", start, d, base,
+                       ((uint32_t)d << 22) + 0x3FFFFF, pd_ptr[start].frame << 12);
+            continue;
+        }
+
+        struct page *tbl = (struct page *)(pd_ptr[d].frame << 12);
+        esp_printf(out, "pde %d: 0x%08x table at 0x%08x %s%s\n", d, base, (uint32_t)tbl,
+                   pd_ptr[d].rw ? "rw" : "ro", pd_ptr[d].user ? " user" : "");
+
+        // Collapse consecutive virtual pages that map consecutive frames
+        int i = 0;
+        while (i < 1024) {
+            if (!tbl[i].present) {
+                i++;
+                continue;
+            }
+            int start = i;
+            while (i + 1 < 1024 && tbl[i + 1].present &&
+                   tbl[i + 1].frame == tbl[i].frame + 1 &&
+                   tbl[i + 1].rw == tbl[start].rw && tbl[i + 1].user == tbl[start].user)
+                i++;
+            esp_printf(out, "  0x%08x-0x%08x -> 0x%08x %d pages %s%s\n",
+                       base + (start << 12), base + ((i + 1) << 12) - 1,
+                       tbl[start].frame << 12, i - start + 1,
+                       tbl[start].rw ? "rw" : "ro", tbl[start].user ? " user" : "");
+            i++;
+        }
+    }
+    if (!any)
+        esp_printf(out, "no page directory entries present\n");
+}
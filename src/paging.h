@@ -12,8 +12,9 @@ struct page_directory_entry
    uint32_t writethru     : 1;
    uint32_t cachedisabled : 1;
    uint32_t accessed      : 1;
-   uint32_t pagesize      : 1;
-   uint32_t ignored       : 2;
+   uint32_t dirty         : 1;   // 4 MiB pages only
+   uint32_t pagesize      : 1;   // a 4 MiB page rather than a table
+   uint32_t global        : 1;
    uint32_t os_specific   : 3;
    uint32_t frame         : 20;
 };
@@ -23,14 +24,64 @@ struct page
    uint32_t present    : 1;
    uint32_t rw         : 1;
    uint32_t user       : 1;
+   uint32_t writethru  : 1;
+   uint32_t cachedisabled : 1;
    uint32_t accessed   : 1;
    uint32_t dirty      : 1;
-   uint32_t unused     : 7;
+   uint32_t unused     : 5;
    uint32_t frame      : 20;
 };
 
+#define PAGE_SIZE   4096
+
+/*
+ * Every page directory maps the address space 1:1 with 4 MiB pages, so
+ * the kernel keeps running on physical addresses and sees the framebuffer
+ * and PCI memory where they are. VM_MAP_BASE up to VM_MAP_END is left
+ * out; map_pages() fills it with 4 KiB pages, taking the page tables from
+ * a frame of its own.
+ */
+#define VM_MAP_BASE 0x40000000
+#define VM_MAP_END  0x80000000
+
+// map_pages_prot() flags
+#define MAP_RW      0x01
+#define MAP_USER    0x02
+
+// Build the identity map in pd and turn paging on
+void paging_init(void);
+
+// Map each page of pglist in turn from vaddr, read-write. Returns vaddr, or
+// 0 if a page table couldn't be had or vaddr is in the identity map.
 void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd);
+void *map_pages_prot(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd, int prot);
+void unmap_pages(void *vaddr, uint32_t npages, struct page_directory_entry *pd);
+
+// Map the frames behind npages of from at src into to at dst with prot,
+// moving them, or with keep set sharing them. Nothing is copied. Every
+// source page must be mapped and every destination page free. Returns
+// dst, or 0 having changed nothing.
+void *paging_remap(struct page_directory_entry *from, void *src, struct page_directory_entry *to,
+                   void *dst, uint32_t npages, int prot, int keep);
+
+// Physical address vaddr maps to, or 0 if it isn't mapped
+void *paging_lookup(struct page_directory_entry *pd, void *vaddr);
+
+// npages unmapped pages in a row in the mapping window, or 0
+void *paging_find_free(struct page_directory_entry *pd, uint32_t npages);
+
+// A directory for a program: the identity map as in pd, supervisor only,
+// and an empty window. Free it once it's no longer loaded and everything
+// mapped in it has been dealt with; its page tables go with it.
+struct page_directory_entry *paging_new_directory(void);
+void paging_free_directory(struct page_directory_entry *d);
+
 void loadPageDirectory(struct page_directory_entry *pd);
 void enable_paging(void);
 
+// Print every present directory entry and the runs of mapped pages under it
+void paging_dump(struct page_directory_entry *pd, int (*out)(int));
+
+extern struct page_directory_entry pd[1024];
+
 #endif // PAGING_H
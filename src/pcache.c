@@ -0,0 +1,220 @@
+// pcache.c
+//
+// Page cache. See pcache.h for the policy; like the buffer cache this
+// keeps its pages on a hash for lookup, an LRU list of every page holding
+// file data and a free list.
+
+#include <stdint.h>
+#include "pcache.h"
+#include "vfs.h"
+#include "page.h"
+#include "klib.h"
+
+static struct pcpage pages[PCACHE_PAGES];
+static struct pcpage *hash[PCACHE_HASH];
+static struct pcpage *lru_head = 0, *lru_tail = 0;
+static struct pcpage *free_list = 0;
+static uint8_t *page_base = 0;
+static struct pcache_stats stats;
+
+static uint32_t bucket(uint64_t ino, uint32_t index) {
+    return ((uint32_t)ino * 2654435761u ^ (uint32_t)(ino >> 32) ^ index) & (PCACHE_HASH - 1);
+}
+
+static struct pcpage *lookup(uint64_t ino, uint32_t index) {
+    struct pcpage *p = hash[bucket(ino, index)];
+
+    while (p && (p->ino != ino || p->index != index))
+        p = p->hnext;
+    return p;
+}
+
+static void hash_remove(struct pcpage *p) {
+    struct pcpage **pp = &hash[bucket(p->ino, p->index)];
+
+    while (*pp != p)
+        pp = &(*pp)->hnext;
+    *pp = p->hnext;
+}
+
+static void lru_unlink(struct pcpage *p) {
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        lru_head = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    else
+        lru_tail = p->prev;
+}
+
+static void lru_push_front(struct pcpage *p) {
+    p->prev = 0;
+    p->next = lru_head;
+    if (lru_head)
+        lru_head->prev = p;
+    else
+        lru_tail = p;
+    lru_head = p;
+}
+
+static void pcache_free(struct pcpage *p) {
+    p->flags = 0;
+    p->next = free_list;
+    free_list = p;
+}
+
+// Take p out of the cache. A pinned page goes when its last pin does.
+static void pcache_drop(struct pcpage *p) {
+    if (p->flags & PC_ORPHAN)
+        return;
+    hash_remove(p);
+    lru_unlink(p);
+    if (p->pins)
+        p->flags |= PC_ORPHAN;
+    else
+        pcache_free(p);
+}
+
+int pcache_init(void) {
+    struct ppage *frame;
+    struct pfa_stats pst;
+
+    pfa_get_stats(&pst);
+    if (pst.frame_size < PCACHE_PAGES * PAGE_SIZE)
+        return -1;
+    if (!(frame = allocate_physical_pages(1)))
+        return -1;
+
+    page_base = frame->physical_addr;
+    for (int i = 0; i < PCACHE_HASH; i++)
+        hash[i] = 0;
+    free_list = 0;
+    for (int i = PCACHE_PAGES - 1; i >= 0; i--) {
+        pages[i].data = page_base + i * PAGE_SIZE;
+        pages[i].pins = 0;
+        pcache_free(&pages[i]);
+    }
+    lru_head = lru_tail = 0;
+    return 0;
+}
+
+struct pcpage *pcache_get(struct inode *ip, uint32_t index) {
+    struct pcpage *p;
+    int n;
+
+    if (!page_base)
+        return 0;
+    stats.lookups++;
+    if ((p = lookup(ip->ino, index))) {
+        stats.hits++;
+        lru_unlink(p);
+        lru_push_front(p);
+        p->pins++;
+        return p;
+    }
+
+    stats.misses++;
+    if ((p = free_list)) {
+        free_list = p->next;
+    } else {
+        for (p = lru_tail; p && p->pins; p = p->prev)
+            ;
+        if (!p)
+            return 0;
+        hash_remove(p);
+        lru_unlink(p);
+        stats.evictions++;
+    }
+    p->ino = ip->ino;
+    p->index = index;
+    p->flags = 0;
+    p->pins = 1;
+    p->hnext = hash[bucket(p->ino, index)];
+    hash[bucket(p->ino, index)] = p;
+    lru_push_front(p);
+
+    n = ip->ops->read(ip, index * PAGE_SIZE, p->data, PAGE_SIZE);
+    if (n < 0) {
+        p->pins = 0;
+        pcache_drop(p);
+        return 0;
+    }
+    for (; n < PAGE_SIZE; n++)
+        p->data[n] = 0;
+    p->flags |= PC_VALID;
+    return p;
+}
+
+struct pcpage *pcache_page(void *data) {
+    uint32_t i = ((uint8_t *)data - page_base) / PAGE_SIZE;
+
+    return page_base && (uint8_t *)data >= page_base && i < PCACHE_PAGES ? &pages[i] : 0;
+}
+
+void pcache_put(struct pcpage *p) {
+    if (!p || !p->pins)
+        return;
+    if (--p->pins == 0 && (p->flags & PC_ORPHAN))
+        pcache_free(p);
+}
+
+void pcache_write(uint64_t ino, uint32_t pos, const uint8_t *buf, uint32_t len) {
+    while (len) {
+        uint32_t off = pos % PAGE_SIZE;
+        uint32_t n = PAGE_SIZE - off;
+        struct pcpage *p = lookup(ino, pos / PAGE_SIZE);
+
+        if (n > len)
+            n = len;
+        if (p) {
+            memcpy(p->data + off, buf, n);
+            stats.updates++;
+        }
+        pos += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+void pcache_truncate(uint64_t ino, uint32_t size) {
+    for (int i = 0; i < PCACHE_PAGES; i++) {
+        struct pcpage *p = &pages[i];
+        uint32_t start = p->index * PAGE_SIZE;
+
+        if (!(p->flags & PC_VALID) || (p->flags & PC_ORPHAN) || p->ino != ino ||
+            start + PAGE_SIZE <= size)
+            continue;
+        if (start >= size && !p->pins) {
+            pcache_drop(p);
+            continue;
+        }
+        // Still mapped, or straddling the new end: what's past it reads as 0
+        for (uint32_t k = start < size ? size - start : 0; k < PAGE_SIZE; k++)
+            p->data[k] = 0;
+    }
+}
+
+void pcache_forget(uint64_t ino) {
+    for (int i = 0; i < PCACHE_PAGES; i++)
+        if ((pages[i].flags & PC_VALID) && pages[i].ino == ino)
+            pcache_drop(&pages[i]);
+}
+
+void pcache_invalidate(void) {
+    for (int i = 0; i < PCACHE_PAGES; i++)
+        if (pages[i].flags & PC_VALID)
+            pcache_drop(&pages[i]);
+}
+
+void pcache_get_stats(struct pcache_stats *st) {
+    *st = stats;
+    st->pages = page_base ? PCACHE_PAGES : 0;
+    st->cached = 0;
+    st->pinned = 0;
+    for (struct pcpage *p = lru_head; p; p = p->next) {
+        st->cached++;
+        if (p->pins)
+            st->pinned++;
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef PCACHE_H
+#define PCACHE_H
+
+#include <stdint.h>
+#include "paging.h"
+
+/*
+ * Page cache: file data in PAGE_SIZE pages keyed by inode number and page
+ * index, in front of the filesystem. A miss reads the whole page through
+ * the inode's read op, zero-filling past the end of the file; after that
+ * a read is a copy straight out of the page and mmap() maps the page
+ * itself. Writes go to the filesystem and are copied into whichever of
+ * their pages are cached, so cached pages are never dirty.
+ *
+ * Pages are pinned while a reader copies out of them and for as long as
+ * they are mapped. Eviction takes the least recently used unpinned page.
+ * A page outlives its inode, so a file opened again finds its data still
+ * cached.
+ */
+
+#define PCACHE_PAGES      512         // one 2 MiB frame
+#define PCACHE_HASH       256         // must be a power of two
+
+struct inode;
+
+struct pcpage {
+    uint64_t ino;
+    uint32_t index;                   // file offset / PAGE_SIZE
+    uint8_t *data;
+    uint16_t pins;                    // readers copying out, plus mappings
+    uint8_t flags;                    // PC_*
+    struct pcpage *hnext;
+    struct pcpage *prev, *next;       // LRU list, most recent first; free list
+};
+
+#define PC_VALID  0x01
+#define PC_ORPHAN 0x02                // dropped while pinned; freed on the last put
+
+struct pcache_stats {
+    uint32_t lookups;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t updates;                 // cached pages written through
+    uint32_t pages;
+    uint32_t cached;                  // pages holding file data
+    uint32_t pinned;
+};
+
+// Take a frame from the page allocator for the pages
+int pcache_init(void);
+
+// Pin page index of ip, reading it if needed. 0 on I/O error or if every
+// page is pinned.
+struct pcpage *pcache_get(struct inode *ip, uint32_t index);
+
+// The page whose data is at the physical address data, for undoing a mapping
+struct pcpage *pcache_page(void *data);
+
+void pcache_put(struct pcpage *p);
+
+// Copy len bytes written at pos into the cached pages they fall in
+void pcache_write(uint64_t ino, uint32_t pos, const uint8_t *buf, uint32_t len);
+
+// Zero everything past size in ino's pages, dropping those wholly past it
+void pcache_truncate(uint64_t ino, uint32_t size);
+
+// Drop every page of ino, or of every file with pcache_invalidate(). Pinned
+// pages are only unhooked, so they can't be found again.
+void pcache_forget(uint64_t ino);
+void pcache_invalidate(void);
+
+void pcache_get_stats(struct pcache_stats *st);
+
+#endif
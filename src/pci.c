@@ -0,0 +1,121 @@
+// pci.c
+//
+// PCI configuration space access through mechanism #1 (ports 0xCF8/0xCFC)
+// and a brute-force scan of every bus, device and function at boot.
+
+#include <stdint.h>
+#include "pci.h"
+#include "interrupt.h"
+#include "rprintf.h"
+
+static struct pci_device devices[PCI_MAX_DEVICES];
+static int ndevices = 0;
+
+static void pci_select(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+    outl(PCI_CONFIG_ADDRESS, 0x80000000 | ((uint32_t)bus << 16) |
+         ((uint32_t)(dev & 0x1F) << 11) | ((uint32_t)(fn & 0x07) << 8) | (off & 0xFC));
+}
+
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+    pci_select(bus, dev, fn, off);
+    return inl(PCI_CONFIG_DATA);
+}
+
+uint16_t pci_read16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+    return pci_read32(bus, dev, fn, off) >> ((off & 2) * 8);
+}
+
+uint8_t pci_read8(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+    return pci_read32(bus, dev, fn, off) >> ((off & 3) * 8);
+}
+
+void pci_write32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint32_t val) {
+    pci_select(bus, dev, fn, off);
+    outl(PCI_CONFIG_DATA, val);
+}
+
+void pci_write16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint16_t val) {
+    uint32_t shift = (off & 2) * 8;
+    uint32_t v = pci_read32(bus, dev, fn, off);
+
+    v = (v & ~(0xFFFFu << shift)) | ((uint32_t)val << shift);
+    pci_write32(bus, dev, fn, off, v);
+}
+
+static void pci_add(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t vendor) {
+    struct pci_device *d;
+    uint32_t cr;
+
+    if (ndevices == PCI_MAX_DEVICES)
+        return;
+    d = &devices[ndevices++];
+    d->bus = bus;
+    d->dev = dev;
+    d->fn = fn;
+    d->vendor = vendor;
+    d->device = pci_read16(bus, dev, fn, PCI_DEVICE_ID);
+    cr = pci_read32(bus, dev, fn, PCI_CLASS_REVISION);
+    d->class = cr >> 24;
+    d->subclass = cr >> 16;
+    d->prog_if = cr >> 8;
+    d->irq = pci_read8(bus, dev, fn, PCI_INTERRUPT_LINE);
+    for (int i = 0; i < 6; i++)
+        d->bar[i] = pci_read32(bus, dev, fn, PCI_BAR0 + 4 * i);
+}
+
+void pci_scan(void) {
+    ndevices = 0;
+    for (int bus = 0; bus < 256; bus++) {
+        for (int dev = 0; dev < 32; dev++) {
+            uint16_t vendor = pci_read16(bus, dev, 0, PCI_VENDOR_ID);
+            int nfn;
+
+            if (vendor == 0xFFFF)
+                continue;
+            // Bit 7 of the header type marks a multi-function device
+            nfn = (pci_read8(bus, dev, 0, PCI_HEADER_TYPE) & 0x80) ? 8 : 1;
+            for (int fn = 0; fn < nfn; fn++) {
+                if (fn)
+                    vendor = pci_read16(bus, dev, fn, PCI_VENDOR_ID);
+                if (vendor != 0xFFFF)
+                    pci_add(bus, dev, fn, vendor);
+            }
+        }
+    }
+}
+
+struct pci_device *pci_find_class(uint8_t class, uint8_t subclass) {
+    for (int i = 0; i < ndevices; i++) {
+        if (devices[i].class == class && devices[i].subclass == subclass)
+            return &devices[i];
+    }
+    return 0;
+}
+
+struct pci_device *pci_find_device(uint16_t vendor, uint16_t device) {
+    for (int i = 0; i < ndevices; i++) {
+        if (devices[i].vendor == vendor && devices[i].device == device)
+            return &devices[i];
+    }
+    return 0;
+}
+
+uint16_t pci_bar_io(struct pci_device *d, int bar) {
+    if (!(d->bar[bar] & 1))
+        return 0;
+    return d->bar[bar] & 0xFFFC;
+}
+
+void pci_enable(struct pci_device *d, uint16_t bits) {
+    uint16_t cmd = pci_read16(d->bus, d->dev, d->fn, PCI_COMMAND);
+    pci_write16(d->bus, d->dev, d->fn, PCI_COMMAND, cmd | bits);
+}
+
+void pci_dump(int (*out)(int)) {
+    for (int i = 0; i < ndevices; i++) {
+        struct pci_device *d = &devices[i];
+        esp_printf(out, "%02x:%02x.%d %04x:%04x class %02x.%02x.%02x irq %d\n",
+                   d->bus, d->dev, d->fn, d->vendor, d->device,
+                   d->class, d->subclass, d->prog_if, d->irq);
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// Configuration space offsets
+#define PCI_VENDOR_ID      0x00
+#define PCI_DEVICE_ID      0x02
+#define PCI_COMMAND        0x04
+#define PCI_STATUS         0x06
+#define PCI_CLASS_REVISION 0x08
+#define PCI_HEADER_TYPE    0x0E
+#define PCI_BAR0           0x10
+#define PCI_CAPABILITIES   0x34
+#define PCI_INTERRUPT_LINE 0x3C
+
+// Command register bits
+#define PCI_CMD_IO         0x0001
+#define PCI_CMD_MEMORY     0x0002
+#define PCI_CMD_MASTER     0x0004
+
+#define PCI_CLASS_STORAGE  0x01
+#define PCI_SUBCLASS_IDE   0x01
+
+#define PCI_MAX_DEVICES    32
+
+struct pci_device {
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t fn;
+    uint8_t irq;                 // interrupt line as the firmware set it up
+    uint16_t vendor;
+    uint16_t device;
+    uint8_t class;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint32_t bar[6];             // raw BAR values, bit 0 set for I/O space
+};
+
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off);
+uint16_t pci_read16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off);
+uint8_t pci_read8(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off);
+void pci_write32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint32_t val);
+void pci_write16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint16_t val);
+
+// Enumerate every bus and function into the device table
+void pci_scan(void);
+
+// First device with the given class and subclass, or 0
+struct pci_device *pci_find_class(uint8_t class, uint8_t subclass);
+
+// First device with the given vendor and device id, or 0
+struct pci_device *pci_find_device(uint16_t vendor, uint16_t device);
+
+// Base of an I/O-space BAR, or 0 if the BAR is memory or unset
+uint16_t pci_bar_io(struct pci_device *d, int bar);
+
+// Set bits in the command register, e.g. PCI_CMD_IO | PCI_CMD_MASTER
+void pci_enable(struct pci_device *d, uint16_t bits);
+
+// Print the device table
+void pci_dump(int (*out)(int));
+
+#endif
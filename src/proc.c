@@ -0,0 +1,458 @@
+// proc.c
+//
+// Loading and running a user program. See proc.h for its address space;
+// this keeps the running program's segments, the frames its private pages
+// are carved from, and the kernel context proc_exec() goes back to when
+// the program exits or is killed.
+
+#include <stdint.h>
+#include "proc.h"
+#include "elf.h"
+#include "vfs.h"
+#include "pcache.h"
+#include "page.h"
+#include "paging.h"
+#include "interrupt.h"
+#include "ide.h"
+#include "fat.h"
+#include "tsc.h"
+#include "trace.h"
+#include "console.h"
+#include "klib.h"
+
+// Page fault error code bits
+#define PF_PRESENT  0x1               // a protection fault, not a missing page
+#define PF_WRITE    0x2
+#define PF_USER     0x4
+
+#define PAGE_MASK   (PAGE_SIZE - 1)
+
+struct proc_seg {
+    uint32_t vaddr, memsz;
+    uint32_t offset, filesz;
+    uint32_t flags;                   // ELF_PF_*
+};
+
+// Callee-saved registers and where to carry on, for proc_save()
+struct kcontext {
+    uint32_t ebx, esi, edi, ebp, esp, eip;
+};
+
+// What int 0x80 pushes, lowest address first
+struct syscall_regs {
+    uint32_t eax, ebx, ecx, edx, esi, edi, ebp;
+    uint32_t es, ds;
+};
+
+struct proc {
+    struct page_directory_entry *pd;
+    struct inode *ip;
+    struct proc_seg segs[PROC_SEGS];
+    int nsegs;
+    struct ppage *frames[PROC_FRAMES];
+    uint32_t frame_pages;             // PAGE_SIZE pages per frame
+    uint32_t pages_used;              // private pages handed out so far
+    int status;
+    int killed;
+    struct kcontext kctx;
+};
+
+static struct proc proc;
+static struct proc *current = 0;
+static struct proc_stats stats;
+static uint64_t run_start;
+static uint8_t kstack[PROC_KSTACK] __attribute__((aligned(16)));
+
+// Like setjmp(): 0 on the way in, 1 when proc_resume() comes back to it
+int proc_save(struct kcontext *c) __attribute__((returns_twice));
+void proc_resume(struct kcontext *c) __attribute__((noreturn));
+
+// iret to ring 3 at eip, with the stack at esp and interrupts on
+void proc_enter_user(uint32_t eip, uint32_t esp) __attribute__((noreturn));
+
+asm(".text\n"
+    ".global proc_save\n"
+    "proc_save:\n"
+    "    mov 4(%esp), %eax\n"
+    "    mov %ebx, 0(%eax)\n"
+    "    mov %esi, 4(%eax)\n"
+    "    mov %edi, 8(%eax)\n"
+    "    mov %ebp, 12(%eax)\n"
+    "    lea 4(%esp), %ecx\n"
+    "    mov %ecx, 16(%eax)\n"
+    "    mov (%esp), %ecx\n"
+    "    mov %ecx, 20(%eax)\n"
+    "    xor %eax, %eax\n"
+    "    ret\n"
+    ".global proc_resume\n"
+    "proc_resume:\n"
+    "    mov 4(%esp), %eax\n"
+    "    mov 0(%eax), %ebx\n"
+    "    mov 4(%eax), %esi\n"
+    "    mov 8(%eax), %edi\n"
+    "    mov 12(%eax), %ebp\n"
+    "    mov 16(%eax), %esp\n"
+    "    mov 20(%eax), %ecx\n"
+    "    mov $1, %eax\n"
+    "    jmp *%ecx\n"
+    ".global proc_enter_user\n"
+    "proc_enter_user:\n"
+    "    mov 4(%esp), %ecx\n"
+    "    mov 8(%esp), %edx\n"
+    "    mov $0x23, %ax\n"             // USER_DS
+    "    mov %ax, %ds\n"
+    "    mov %ax, %es\n"
+    "    mov %ax, %fs\n"
+    "    mov %ax, %gs\n"
+    "    push $0x23\n"                 // ss
+    "    push %edx\n"                  // esp
+    "    pushf\n"
+    "    orl $0x200, (%esp)\n"         // IF
+    "    push $0x1b\n"                 // cs, USER_CS
+    "    push %ecx\n"                  // eip
+    "    xor %eax, %eax\n"             // nothing of the kernel's for the program to see
+    "    xor %ebx, %ebx\n"
+    "    xor %ecx, %ecx\n"
+    "    xor %edx, %edx\n"
+    "    xor %esi, %esi\n"
+    "    xor %edi, %edi\n"
+    "    xor %ebp, %ebp\n"
+    "    iret\n"
+    // The kernel's data segment for the call, the program's back for iret
+    ".global syscall_entry\n"
+    "syscall_entry:\n"
+    "    push %ds\n"
+    "    push %es\n"
+    "    push %ebp\n"
+    "    push %edi\n"
+    "    push %esi\n"
+    "    push %edx\n"
+    "    push %ecx\n"
+    "    push %ebx\n"
+    "    push %eax\n"
+    "    mov $0x10, %ax\n"
+    "    mov %ax, %ds\n"
+    "    mov %ax, %es\n"
+    "    push %esp\n"
+    "    call syscall_dispatch\n"
+    "    add $4, %esp\n"
+    "    pop %eax\n"
+    "    pop %ebx\n"
+    "    pop %ecx\n"
+    "    pop %edx\n"
+    "    pop %esi\n"
+    "    pop %edi\n"
+    "    pop %ebp\n"
+    "    pop %es\n"
+    "    pop %ds\n"
+    "    iret\n");
+
+static void zero(uint8_t *p, uint32_t n) {
+    while (n--)
+        *p++ = 0;
+}
+
+static uint32_t page_down(uint32_t a) {
+    return a & ~PAGE_MASK;
+}
+
+static uint32_t page_up(uint32_t a) {
+    return (a + PAGE_MASK) & ~PAGE_MASK;
+}
+
+// A private page from the program's frames, taking another if need be
+static uint8_t *page_alloc(struct proc *p) {
+    uint32_t f = p->pages_used / p->frame_pages;
+
+    if (f == PROC_FRAMES)
+        return 0;
+    if (!p->frames[f] && !(p->frames[f] = allocate_physical_pages(1)))
+        return 0;
+    return (uint8_t *)p->frames[f]->physical_addr + p->pages_used++ % p->frame_pages * PAGE_SIZE;
+}
+
+static struct proc_seg *seg_at(struct proc *p, uint32_t va) {
+    for (int i = 0; i < p->nsegs; i++)
+        if (va >= page_down(p->segs[i].vaddr) && va < page_up(p->segs[i].vaddr + p->segs[i].memsz))
+            return &p->segs[i];
+    return 0;
+}
+
+// Text and read-only data are mapped straight from the page cache. A
+// segment with zeros past its file bytes needs a copy of its own.
+static int seg_shared(const struct proc_seg *s) {
+    return !(s->flags & ELF_PF_W) && s->filesz == s->memsz;
+}
+
+static int map_one(struct proc *p, uint32_t va, void *phys, int prot) {
+    struct ppage one = { 0, 0, 0 };
+
+    one.physical_addr = phys;
+    return map_pages_prot((void *)va, &one, p->pd, prot) ? ATA_OK : VFS_ENOMEM;
+}
+
+// Fill in the page at va; how it was done goes to the trace
+static int fault_in(struct proc *p, uint32_t va, int write, int *how) {
+    struct proc_seg *s = seg_at(p, va);
+    struct pcpage *pg;
+    uint32_t start, end, pos;
+    uint8_t *data;
+    int rc;
+
+    if (!s) {
+        if (va < USER_STACK_TOP - USER_STACK_MAX || !(data = page_alloc(p)))
+            return PROC_EFAULT;
+        zero(data, PAGE_SIZE);
+        stats.zeroed++;
+        *how = 0;
+        return map_one(p, va, data, MAP_RW | MAP_USER);
+    }
+    if (write && !(s->flags & ELF_PF_W))
+        return PROC_EFAULT;
+
+    if (seg_shared(s)) {
+        // Congruent offsets make this one whole page of the file
+        pos = page_down(s->offset) + (va - page_down(s->vaddr));
+        if (!(pg = pcache_get(p->ip, pos / PAGE_SIZE)))
+            return PROC_EFAULT;
+        if ((rc = map_one(p, va, pg->data, MAP_USER)) != ATA_OK)
+            pcache_put(pg);
+        stats.shared++;
+        *how = 1;
+        return rc;
+    }
+
+    if (!(data = page_alloc(p)))
+        return PROC_EFAULT;
+    start = va > s->vaddr ? va : s->vaddr;
+    end = s->vaddr + s->filesz < va + PAGE_SIZE ? s->vaddr + s->filesz : va + PAGE_SIZE;
+    if (start < end) {
+        pos = s->offset + (start - s->vaddr);
+        if (!(pg = pcache_get(p->ip, pos / PAGE_SIZE)))
+            return PROC_EFAULT;
+        zero(data, start - va);
+        memcpy(data + (start - va), pg->data + pos % PAGE_SIZE, end - start);
+        zero(data + (end - va), va + PAGE_SIZE - end);
+        pcache_put(pg);
+        stats.copied++;
+        *how = 2;
+    } else {
+        zero(data, PAGE_SIZE);
+        stats.zeroed++;
+        *how = 0;
+    }
+    return map_one(p, va, data, MAP_USER | (s->flags & ELF_PF_W ? MAP_RW : 0));
+}
+
+// Leave the program's address space, give back everything it had, and go
+// back into proc_exec()
+static void __attribute__((noreturn)) proc_end(void) {
+    struct proc *p = current;
+
+    stats.run_cycles = rdtsc() - run_start;
+    loadPageDirectory(pd);
+    current = 0;
+
+    // Unpin the page cache pages mapped in; private pages aren't in it
+    for (int i = 0; i < p->nsegs; i++) {
+        uint32_t end = page_up(p->segs[i].vaddr + p->segs[i].memsz);
+
+        for (uint32_t va = page_down(p->segs[i].vaddr); va < end; va += PAGE_SIZE) {
+            void *phys = paging_lookup(p->pd, (void *)va);
+
+            if (phys)
+                pcache_put(pcache_page(phys));
+        }
+    }
+    paging_free_directory(p->pd);
+    for (int i = 0; i < PROC_FRAMES; i++)
+        if (p->frames[i])
+            free_physical_pages(p->frames[i]);
+    vfs_iput(p->ip);
+    proc_resume(&p->kctx);
+}
+
+int proc_fault(uint32_t addr, uint32_t error, uint32_t eip) {
+    uint64_t t0 = rdtsc();
+    int rc, how = 0;
+
+    if (!current)
+        return 0;
+    if (addr < VM_MAP_BASE || addr >= VM_MAP_END || (error & PF_PRESENT)) {
+        // The kernel's own pages, or writing a read-only one. Only the
+        // program can be blamed for that.
+        if (error & PF_USER)
+            proc_kill(addr, eip);
+        return 0;
+    }
+
+    // Filling the page may wait on the disk
+    asm volatile("sti");
+    TRACE2(TRACE_FAULT, addr, error);
+    rc = fault_in(current, page_down(addr), error & PF_WRITE, &how);
+    TRACE2(TRACE_FAULT_DONE, addr, how);
+    if (rc != ATA_OK)
+        proc_kill(addr, eip);
+    stats.faults++;
+    stats.fault_cycles += rdtsc() - t0;
+    return 1;
+}
+
+void proc_kill(uint32_t addr, uint32_t eip) {
+    if (!current)
+        return;
+    stats.kill_addr = addr;
+    stats.kill_eip = eip;
+    current->killed = 1;
+    current->status = -1;
+    proc_end();
+}
+
+int proc_running(void) {
+    return current != 0;
+}
+
+static int sys_write(uint32_t fd, const char *buf, uint32_t len) {
+    uint32_t a = (uint32_t)buf;
+
+    if (fd != 1 && fd != 2)
+        return VFS_EBADF;
+    if (a < VM_MAP_BASE || a >= VM_MAP_END || len > VM_MAP_END - a)
+        return PROC_EFAULT;
+    // Straight from the program's pages, faulting them in as need be
+    for (uint32_t i = 0; i < len; i++)
+        kputc(buf[i]);
+    kflush();
+    return len;
+}
+
+static void __attribute__((used)) syscall_dispatch(struct syscall_regs *r) {
+    asm volatile("sti");
+    if (!current) {
+        r->eax = ATA_EINVAL;
+        return;
+    }
+    stats.syscalls++;
+    switch (r->eax) {
+    case SYS_EXIT:
+        current->status = r->ebx;
+        proc_end();
+    case SYS_WRITE:
+        r->eax = sys_write(r->ebx, (const char *)r->ecx, r->edx);
+        break;
+    default:
+        r->eax = ATA_EINVAL;
+    }
+}
+
+// Check a PT_LOAD header against the file and the segments so far
+static int seg_ok(struct proc *p, const struct elf32_phdr *ph, uint32_t fsize) {
+    uint32_t lo = page_down(ph->vaddr);
+
+    if (ph->vaddr < VM_MAP_BASE || ph->vaddr >= USER_STACK_TOP - USER_STACK_MAX ||
+        ph->memsz > USER_STACK_TOP - USER_STACK_MAX - ph->vaddr || ph->filesz > ph->memsz ||
+        ph->offset > fsize || ph->filesz > fsize - ph->offset ||
+        (ph->vaddr & PAGE_MASK) != (ph->offset & PAGE_MASK))
+        return 0;
+    // A page belongs to one segment, so a fault knows what to put there
+    for (int i = 0; i < p->nsegs; i++)
+        if (lo < page_up(p->segs[i].vaddr + p->segs[i].memsz) &&
+            page_down(p->segs[i].vaddr) < page_up(ph->vaddr + ph->memsz))
+            return 0;
+    return 1;
+}
+
+// Read the headers of path into p and hold on to its inode
+static int proc_load(struct proc *p, const char *path, uint32_t *entry) {
+    struct elf32_ehdr eh;
+    struct elf32_phdr ph;
+    struct vfs_stat st;
+    int fd, rc = ATA_OK, exec = 0;
+
+    if ((fd = vfs_open(path, VFS_O_READ)) < 0)
+        return fd;
+    vfs_fstat(fd, &st);
+    if (vfs_read(fd, &eh, sizeof(eh)) != sizeof(eh) || *(uint32_t *)eh.ident != ELF_MAGIC ||
+        eh.ident[4] != ELF_CLASS32 || eh.ident[5] != ELF_DATA2LSB || eh.type != ELF_ET_EXEC ||
+        eh.machine != ELF_EM_386 || eh.phentsize != sizeof(ph))
+        rc = PROC_ENOEXEC;
+
+    p->nsegs = 0;
+    for (int i = 0; rc == ATA_OK && i < eh.phnum; i++) {
+        struct proc_seg *s = &p->segs[p->nsegs];
+
+        if (vfs_seek(fd, eh.phoff + i * sizeof(ph)) != ATA_OK ||
+            vfs_read(fd, &ph, sizeof(ph)) != sizeof(ph)) {
+            rc = PROC_ENOEXEC;
+            break;
+        }
+        if (ph.type != ELF_PT_LOAD || ph.memsz == 0)
+            continue;
+        if (p->nsegs == PROC_SEGS || !seg_ok(p, &ph, st.size)) {
+            rc = PROC_ENOEXEC;
+            break;
+        }
+        s->vaddr = ph.vaddr;
+        s->memsz = ph.memsz;
+        s->offset = ph.offset;
+        s->filesz = ph.filesz;
+        s->flags = ph.flags;
+        p->nsegs++;
+        stats.file_pages += (page_up(ph.offset + ph.filesz) - page_down(ph.offset)) / PAGE_SIZE;
+        if ((ph.flags & ELF_PF_X) && eh.entry >= ph.vaddr && eh.entry - ph.vaddr < ph.memsz)
+            exec = 1;
+    }
+    if (rc == ATA_OK && !exec)
+        rc = PROC_ENOEXEC;
+    if (rc == ATA_OK)
+        p->ip = vfs_iget(fd);
+    *entry = eh.entry;
+    vfs_close(fd);
+    return rc;
+}
+
+int proc_exec(const char *path, int *status) {
+    struct proc *p = &proc;
+    struct pfa_stats pst;
+    uint64_t t0 = rdtsc();
+    uint32_t entry, flags;
+    int rc;
+
+    if (current)
+        return FAT_EBUSY;
+    zero((uint8_t *)&stats, sizeof(stats));
+    zero((uint8_t *)p, sizeof(*p));
+    if ((rc = proc_load(p, path, &entry)) != ATA_OK)
+        return rc;
+    pfa_get_stats(&pst);
+    p->frame_pages = pst.frame_size / PAGE_SIZE;
+    if (!(p->pd = paging_new_directory())) {
+        vfs_iput(p->ip);
+        return VFS_ENOMEM;
+    }
+
+    flags = irq_save();
+    if (proc_save(&p->kctx) == 0) {
+        current = p;
+        tss_set_kernel_stack((uint32_t)(kstack + PROC_KSTACK));
+        loadPageDirectory(p->pd);
+        stats.load_cycles = rdtsc() - t0;
+        run_start = rdtsc();
+        proc_enter_user(entry, USER_STACK_TOP);
+    }
+
+    // Back from proc_end(), maybe from an exception, with the program's
+    // data segment still loaded
+    asm volatile("mov $0x10, %%ax\n"
+                 "mov %%ax, %%ds\n"
+                 "mov %%ax, %%es\n"
+                 "mov %%ax, %%fs\n"
+                 "mov %%ax, %%gs\n" : : : "eax");
+    irq_restore(flags);
+    *status = p->status;
+    return p->killed ? PROC_EFAULT : ATA_OK;
+}
+
+const struct proc_stats *proc_get_stats(void) {
+    return &stats;
+}
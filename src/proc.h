@@ -0,0 +1,81 @@
+#ifndef PROC_H
+#define PROC_H
+
+#include <stdint.h>
+#include "paging.h"
+
+/*
+ * User programs. proc_exec() runs a static ELF32 executable from any path
+ * the VFS opens, in ring 3, until it exits, then returns to the caller.
+ * One program runs at a time.
+ *
+ * Only the headers are read up front. The program gets a page directory of
+ * its own with nothing mapped in the window, and the page fault handler
+ * fills each page in on first touch:
+ *
+ *   - A page of a read-only segment is the page cache page itself, mapped
+ *     read-only, so text costs neither a copy nor a frame.
+ *   - A page of a writable segment is a private copy of the file's bytes,
+ *     zero past p_filesz.
+ *   - The stack is zero pages, down to USER_STACK_MAX below its top.
+ *
+ * Starting a large program costs the pages it uses, not its size.
+ *
+ * System calls are int 0x80 with the number in eax and the arguments in
+ * ebx, ecx and edx. The result comes back in eax.
+ */
+
+#define PROC_SEGS        8            // PT_LOAD segments
+#define PROC_FRAMES      2            // frames for private pages
+#define PROC_KSTACK      16384        // kernel stack for traps from ring 3
+#define USER_STACK_TOP   VM_MAP_END
+#define USER_STACK_MAX   (256 * 1024)
+
+// The user code and data descriptors in the GDT, at RPL 3
+#define USER_CS          0x1b
+#define USER_DS          0x23
+
+// System calls, numbered as on Linux
+#define SYS_EXIT         1            // (status)
+#define SYS_WRITE        4            // (fd, buf, len): 1 and 2 are the console
+
+// Errors, following on from VFS_*
+#define PROC_ENOEXEC     -17          // not a static i386 executable we can load
+#define PROC_EFAULT      -18          // killed: a bad access, or no memory for a page
+
+struct proc_stats {
+    uint32_t file_pages;              // pages the segments span in the file
+    uint32_t faults;
+    uint32_t shared;                  // page cache pages mapped as they are
+    uint32_t copied;                  // private pages filled from the file
+    uint32_t zeroed;                  // bss and stack
+    uint32_t syscalls;
+    uint64_t load_cycles;             // proc_exec() up to the first user instruction
+    uint64_t run_cycles;              // from there to the exit
+    uint64_t fault_cycles;            // the part of run_cycles in the fault handler
+    uint32_t kill_addr;               // for PROC_EFAULT: the address touched
+    uint32_t kill_eip;                // and the instruction touching it
+};
+
+// Run the program at path to the end. ATA_OK with its exit status in
+// *status, PROC_EFAULT if it was killed, or an error from loading it.
+int proc_exec(const char *path, int *status);
+
+// The last program's, for the shell
+const struct proc_stats *proc_get_stats(void);
+
+// From the page fault handler: make addr present for the running program.
+// 0 if the fault isn't the program's to handle. A fault that can't be
+// handled kills the program and doesn't return.
+int proc_fault(uint32_t addr, uint32_t error, uint32_t eip);
+
+// Kill the program for an exception it took in ring 3; doesn't return
+void proc_kill(uint32_t addr, uint32_t eip);
+
+// Whether a program is running, so ring 3 exceptions are its
+int proc_running(void);
+
+// The int 0x80 entry point, for the IDT
+void syscall_entry(void);
+
+#endif
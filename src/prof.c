@@ -0,0 +1,120 @@
+// prof.c
+//
+// The sample ring and its dump. prof_sample() runs in the IRQ0 handler, so
+// it only copies words: the backtrace walk checks every frame pointer
+// against the kernel image before reading through it, since every kernel
+// stack is a static array in there.
+
+#include <stdint.h>
+#include "prof.h"
+#include "timer.h"
+#include "serial.h"
+#include "interrupt.h"
+
+struct prof_sample {
+    uint8_t depth;
+    uint8_t user;
+    uint32_t pc[PROF_DEPTH];
+};
+
+volatile int prof_running = 0;
+static struct prof_sample ring[PROF_SAMPLES];
+static uint32_t head;                 // next slot written
+static uint32_t count;                // valid samples, up to PROF_SAMPLES
+static uint32_t dropped;              // overwritten before a dump
+static uint32_t rate;
+
+extern int _end_kernel;
+
+static int in_kernel(uint32_t addr, uint32_t len) {
+    return addr >= 0x100000 && addr + len <= (uint32_t)&_end_kernel;
+}
+
+void prof_start(uint32_t mult) {
+    if (mult < 1)
+        mult = 1;
+    if (mult > PROF_MAX_MULT)
+        mult = PROF_MAX_MULT;
+    prof_running = 0;
+    head = count = dropped = 0;
+    rate = TIMER_HZ * mult;
+    timer_set_multiplier(mult);
+    prof_running = 1;
+}
+
+void prof_stop(void) {
+    prof_running = 0;
+    timer_set_multiplier(1);
+}
+
+void prof_sample(uint32_t eip, uint32_t cs, uint32_t ebp) {
+    struct prof_sample *s = &ring[head];
+    uint32_t depth = 1;
+
+    s->pc[0] = eip;
+    s->user = cs & 3;
+    // Each frame is the caller's EBP and then the return address; frames
+    // only get older going up the stack
+    while (!s->user && depth < PROF_DEPTH && !(ebp & 3) && in_kernel(ebp, 8)) {
+        uint32_t *fp = (uint32_t *)ebp;
+
+        if (!in_kernel(fp[1], 1))
+            break;
+        s->pc[depth++] = fp[1];
+        if (fp[0] <= ebp)
+            break;
+        ebp = fp[0];
+    }
+    s->depth = depth;
+    head = (head + 1) % PROF_SAMPLES;
+    if (count < PROF_SAMPLES)
+        count++;
+    else
+        dropped++;
+}
+
+static uint8_t fold(uint32_t v) {
+    return v ^ (v >> 8) ^ (v >> 16) ^ (v >> 24);
+}
+
+static void prof_emit(uint8_t type, uint32_t nwords, const uint32_t *w) {
+    struct {
+        struct prof_header h;
+        uint32_t w[PROF_DEPTH];
+    } __attribute__((packed)) rec;
+    uint8_t csum = PROF_SYNC ^ type ^ nwords;
+    uint32_t flags;
+
+    rec.h.sync = PROF_SYNC;
+    rec.h.type = type;
+    rec.h.nwords = nwords;
+    for (uint32_t i = 0; i < nwords; i++) {
+        rec.w[i] = w[i];
+        csum ^= fold(w[i]);
+    }
+    rec.h.csum = csum;
+    // Whole records only, as trace_emit() does
+    flags = irq_save();
+    serial_write_buf(&rec, sizeof(rec.h) + nwords * sizeof(uint32_t));
+    irq_restore(flags);
+}
+
+void prof_dump(void) {
+    uint32_t w[3] = { rate, count, dropped };
+
+    prof_stop();
+    prof_emit(PROF_REC_BEGIN, 3, w);
+    // Oldest first
+    for (uint32_t i = 0; i < count; i++) {
+        const struct prof_sample *s = &ring[(head + PROF_SAMPLES - count + i) % PROF_SAMPLES];
+
+        prof_emit(PROF_REC_SAMPLE | (s->user ? PROF_REC_USER : 0), s->depth, s->pc);
+    }
+    prof_emit(PROF_REC_END, 1, &count);
+}
+
+void prof_get_stats(uint32_t *samples, uint32_t *ndropped, uint32_t *hz) {
+    *samples = count;
+    *ndropped = dropped;
+    *hz = rate;
+}
@@ -0,0 +1,61 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdint.h>
+
+/*
+ * Statistical profiler. While it runs, every PIT interrupt records the EIP
+ * it interrupted and a frame-pointer backtrace from there into a ring of
+ * PROF_SAMPLES, overwriting the oldest. prof_start() can raise the PIT rate
+ * to a multiple of TIMER_HZ for more samples; timer_ticks still advances
+ * at TIMER_HZ.
+ *
+ * prof_dump() writes the ring over COM1 as records shaped like trace.h's:
+ *
+ *   sync (0xB5) | type | nwords | csum | words...
+ *
+ * csum is the XOR of every other byte, so tools/profdump can pick them out
+ * of a capture that also carries trace records and text. profdump resolves
+ * the addresses against the kernel ELF into a flat profile and folded
+ * stacks for flame graphs (make profile).
+ *
+ * The backtrace follows saved EBPs, which needs -fno-omit-frame-pointer. A
+ * sample taken in a function's prologue, before it has set up EBP, misses
+ * that function's caller.
+ */
+
+#define PROF_SYNC       0xB5
+#define PROF_SAMPLES    4096
+#define PROF_DEPTH      8             // the EIP and up to 7 return addresses
+#define PROF_MAX_MULT   100           // 10 kHz at TIMER_HZ 100
+
+// Record types
+#define PROF_REC_BEGIN  1             // hz, samples in the dump, samples overwritten
+#define PROF_REC_SAMPLE 2             // EIP, then callers outward
+#define PROF_REC_END    3             // samples in the dump
+#define PROF_REC_USER   0x80          // or'd into a sample taken in ring 3: just the EIP
+
+struct prof_header {
+    uint8_t sync;
+    uint8_t type;
+    uint8_t nwords;
+    uint8_t csum;
+} __attribute__((packed));
+
+// Nonzero while sampling; the IRQ0 handler checks it
+extern volatile int prof_running;
+
+// Clear the ring and sample at TIMER_HZ * mult until prof_stop()
+void prof_start(uint32_t mult);
+void prof_stop(void);
+
+// From the IRQ0 handler: eip and cs from its frame, ebp as interrupted
+void prof_sample(uint32_t eip, uint32_t cs, uint32_t ebp);
+
+// Stop, and write the ring over COM1
+void prof_dump(void);
+
+// Samples in the ring, overwritten ones, and the rate they were taken at
+void prof_get_stats(uint32_t *samples, uint32_t *dropped, uint32_t *hz);
+
+#endif
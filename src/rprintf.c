@@ -24,7 +24,7 @@ static int num1;
 static int num2;
 static char pad_character;
 
-size_t strlen(const char *str) {
+static size_t rp_strlen(const char *str) {
     unsigned int len = 0;
     while(str[len] != '\0') {
         len++;
@@ -74,7 +74,7 @@ static void outs( charptr lp)
    if(lp == NULL)
       lp = "(null)";
    /* pad on left if needed                          */
-   len = strlen( lp);
+   len = rp_strlen( lp);
    padding( !left_flag);
 
    /* Move string to the buffer                      */
@@ -82,7 +82,7 @@ static void outs( charptr lp)
       out_char( *lp++);
 
    /* Pad on right if needed                         */
-   len = strlen( lp);
+   len = rp_strlen( lp);
    padding( left_flag);
    }
 
@@ -118,7 +118,7 @@ static void outnum(unsigned int num, const int base)
 
    /* Move the converted number to the buffer and    */
    /* add in the padding where needed.               */
-   len = strlen(outbuf);
+   len = rp_strlen(outbuf);
    padding( !left_flag);
    while (cp >= outbuf)
       out_char( *cp--);
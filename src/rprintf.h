@@ -5,8 +5,7 @@
 //#include <ctype.h>
 //#include <string.h>
 #include <stdarg.h>
-
-typedef unsigned int  size_t;
+#include <stddef.h>
 
 #ifndef NULL
 #define NULL (void*)0
@@ -3,6 +3,24 @@
 #include "interrupt.h"
 
 #define COM1 0x3F8
+#define SERIAL_IRQ 4
+
+// Receive ring, same single-producer/single-consumer scheme as kbd_ring
+static volatile uint8_t rx_ring[256];
+static volatile uint8_t rx_head = 0;
+static volatile uint8_t rx_tail = 0;
+
+void serial_init(void) {
+    outb(COM1 + 1, 0x00);    // no interrupts while we set it up
+    outb(COM1 + 3, 0x80);    // DLAB on
+    outb(COM1 + 0, 0x01);    // divisor 1 = 115200 baud
+    outb(COM1 + 1, 0x00);
+    outb(COM1 + 3, 0x03);    // DLAB off, 8N1
+    outb(COM1 + 2, 0xC7);    // enable and clear FIFOs, 14-byte threshold
+    outb(COM1 + 4, 0x0B);    // DTR, RTS, OUT2 (routes the IRQ to the PIC)
+    outb(COM1 + 1, 0x01);    // interrupt on received data
+    IRQ_clear_mask(SERIAL_IRQ);
+}
 
 static int serial_is_transmit_empty() {
     return inb(COM1 + 5) & 0x20;
@@ -12,3 +30,52 @@ void serial_write(char c) {
     while (!serial_is_transmit_empty());
     outb(COM1, c);
 }
+
+void serial_write_buf(const void *buf, unsigned int len) {
+    const uint8_t *p = buf;
+    while (len--) {
+        while (!serial_is_transmit_empty());
+        outb(COM1, *p++);
+    }
+}
+
+int serial_putc(int c) {
+    static char line[128];
+    static unsigned int len = 0;
+    uint32_t flags;
+
+    line[len++] = c;
+    if (c == '\n' || len == sizeof(line)) {
+        flags = irq_save();
+        serial_write_buf(line, len);
+        irq_restore(flags);
+        len = 0;
+    }
+    return c;
+}
+
+void serial_rx_drain(void) {
+    while (inb(COM1 + 5) & 0x01) {
+        uint8_t c = inb(COM1);
+        uint8_t h = rx_head;
+        if ((uint8_t)(h + 1) != rx_tail) {
+            rx_ring[h] = c;
+            rx_head = h + 1;
+        }
+    }
+}
+
+int serial_rx_pending(void) {
+    return rx_head != rx_tail;
+}
+
+int serial_read(void) {
+    uint8_t t = rx_tail;
+    int c;
+
+    if (t == rx_head)
+        return -1;
+    c = rx_ring[t];
+    rx_tail = t + 1;
+    return c;
+}
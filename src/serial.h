@@ -1,6 +1,23 @@
 #ifndef SERIAL_H
 #define SERIAL_H
 
+// Program COM1 for 115200 8N1 and enable the receive interrupt (IRQ4)
+void serial_init(void);
+
 void serial_write(char c);
+void serial_write_buf(const void *buf, unsigned int len);
+
+// A putc_fn_t for text. Each line goes out whole at its '\n', so a trace
+// record can't land in the middle of it.
+int serial_putc(int c);
+
+// Called from the IRQ4 handler: move received bytes into the rx ring
+void serial_rx_drain(void);
+
+// Next received byte, or -1 if none is waiting
+int serial_read(void);
+
+// Nonzero if serial_read() would return a byte
+int serial_rx_pending(void);
 
 #endif
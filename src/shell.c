@@ -0,0 +1,520 @@
+// shell.c
+//
+// A small command shell on the console input path, so the running kernel
+// can be inspected and profiled without a rebuild.
+
+#include <stdint.h>
+#include "shell.h"
+#include "rprintf.h"
+#include "console.h"
+#include "kbd.h"
+#include "interrupt.h"
+#include "page.h"
+#include "paging.h"
+#include "keylogger.h"
+#include "trace.h"
+#include "tsc.h"
+#include "ide.h"
+#include "pci.h"
+#include "writeback.h"
+#include "bcache.h"
+#include "blkq.h"
+#include "blkdev.h"
+#include "virtio_blk.h"
+#include "fat.h"
+#include "pcache.h"
+#include "vfs.h"
+#include "initrd.h"
+#include "proc.h"
+#include "ipc.h"
+#include "boot.h"
+#include "bench.h"
+#include "prof.h"
+#include "timer.h"
+#include "klib.h"
+
+#define SHELL_LINE_MAX 128
+#define SHELL_ARGS_MAX 8
+
+struct shell_cmd {
+    const char *name;
+    const char *help;
+    void (*fn)(int argc, char **argv);
+};
+
+static int streq(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+// Decimal or 0x-prefixed hex. Returns def if s is missing or malformed.
+static int parse_int(const char *s, int def) {
+    int base = 10, n = 0;
+
+    if (!s || !*s)
+        return def;
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        base = 16;
+        s += 2;
+    }
+    for (; *s; s++) {
+        int d;
+        if (*s >= '0' && *s <= '9')
+            d = *s - '0';
+        else if (base == 16 && *s >= 'a' && *s <= 'f')
+            d = *s - 'a' + 10;
+        else if (base == 16 && *s >= 'A' && *s <= 'F')
+            d = *s - 'A' + 10;
+        else
+            return def;
+        n = n * base + d;
+    }
+    return n;
+}
+
+static void cmd_help(int argc, char **argv);
+
+static void cmd_meminfo(int argc, char **argv) {
+    struct pfa_stats st;
+    extern int _start_data, _end_bss, _end_kernel;
+
+    pfa_get_stats(&st);
+    esp_printf(kputc, "frames: %d total, %d free, %d used, %d reserved, %d KiB each\n",
+               st.total, st.free, st.total - st.free - st.reserved, st.reserved,
+               st.frame_size >> 10);
+    esp_printf(kputc, "kernel: data 0x%x, bss end 0x%x, image end 0x%x\n",
+               (uint32_t)&_start_data, (uint32_t)&_end_bss, (uint32_t)&_end_kernel);
+}
+
+static void cmd_irqstat(int argc, char **argv) {
+    for (int i = 0; i < 16; i++) {
+        if (irq_count[i])
+            esp_printf(kputc, "irq %d: %d\n", i, irq_count[i]);
+    }
+    esp_printf(kputc, "keyboard ring drops: %d\n", kbd_dropped);
+}
+
+static void cmd_pt(int argc, char **argv) {
+    paging_dump(pd, kputc);
+}
+
+static void bench_alloc(int n) {
+    uint32_t t0, t1;
+
+    if (n < 1)
+        n = 1;
+    t0 = (uint32_t)rdtsc();
+    for (int i = 0; i < n; i++) {
+        struct ppage *p = allocate_physical_pages(1);
+        free_physical_pages(p);
+    }
+    t1 = (uint32_t)rdtsc();
+    esp_printf(kputc, "alloc+free: %d iterations, %d cycles each\n", n, (t1 - t0) / n);
+}
+
+static void cmd_bench(int argc, char **argv) {
+    if (argc < 2) {
+        esp_printf(kputc, "usage: bench console [lines] | alloc [iterations] | ata [sectors] | wb [sectors] | bcache [sectors] | blkq [requests] | disks [sectors] | fat [lookups] | fatwrite [KiB] | vfs [file] | ipc [rounds] | suite [name,...]\n");
+        return;
+    }
+    if (streq(argv[1], "console"))
+        console_bench(parse_int(argv[2], 200));
+    else if (streq(argv[1], "alloc"))
+        bench_alloc(parse_int(argv[2], 10000));
+    else if (streq(argv[1], "ata"))
+        ata_bench(parse_int(argv[2], 2048));
+    else if (streq(argv[1], "wb"))
+        wb_bench(parse_int(argv[2], 64));
+    else if (streq(argv[1], "bcache"))
+        bcache_bench(parse_int(argv[2], 2048));
+    else if (streq(argv[1], "blkq"))
+        blkq_bench(parse_int(argv[2], 256));
+    else if (streq(argv[1], "disks"))
+        blkq_bench_devices(parse_int(argv[2], 16384));
+    else if (streq(argv[1], "fat"))
+        fat_bench(parse_int(argv[2], 10000));
+    else if (streq(argv[1], "fatwrite")) {
+        fat_bench_write(parse_int(argv[2], 1024));
+        // Its files come and go behind the page cache's back
+        pcache_invalidate();
+    } else if (streq(argv[1], "vfs"))
+        vfs_bench(argc > 2 ? argv[2] : "/kernel");
+    else if (streq(argv[1], "ipc"))
+        ipc_bench(parse_int(argv[2], 1000));
+    else if (streq(argv[1], "suite"))
+        bench_suite(argc > 2 ? argv[2] : "all", argc > 2 ? strlen(argv[2]) : 3);
+    else
+        esp_printf(kputc, "unknown benchmark: %s\n", argv[1]);
+}
+
+static void cmd_trace(int argc, char **argv) {
+    if (argc == 2 && streq(argv[1], "on"))
+        trace_set(1);
+    else if (argc == 2 && streq(argv[1], "off"))
+        trace_set(0);
+    else
+        esp_printf(kputc, "usage: trace on|off\n");
+}
+
+static void cmd_keylog(int argc, char **argv) {
+    if (argc == 2 && streq(argv[1], "sync")) {
+        // Out to KEYLOG.BIN, then the file out to the disk
+        keylog_sync();
+        if (vfs_sync() == ATA_OK)
+            wb_sync();
+    } else {
+        keylog_dump();
+    }
+}
+
+static void cmd_ata(int argc, char **argv) {
+    const struct ata_info *info = ata_get_info();
+    const struct ata_stats *st = ata_get_stats();
+
+    if (argc == 2 && streq(argv[1], "poll")) {
+        ata_set_mode(ATA_MODE_POLL);
+        return;
+    }
+    if (argc == 2 && streq(argv[1], "irq")) {
+        ata_set_mode(ATA_MODE_IRQ);
+        return;
+    }
+    if (argc == 2 && streq(argv[1], "dma")) {
+        if (ata_set_mode(ATA_MODE_DMA) != ATA_OK)
+            esp_printf(kputc, "no bus-master DMA controller\n");
+        return;
+    }
+    if (!info->present) {
+        esp_printf(kputc, "no ATA drive\n");
+        return;
+    }
+    esp_printf(kputc, "ata0: %s, %d sectors, %s, multiple %d, %s mode\n", info->model,
+               info->sectors, info->lba48 ? "lba48" : "lba28", info->multiple,
+               ata_get_mode() == ATA_MODE_DMA ? "dma" :
+               ata_get_mode() == ATA_MODE_IRQ ? "irq" : "poll");
+    esp_printf(kputc, "requests %d, sectors %d in %d blocks, errors %d, timeouts %d\n",
+               st->requests, st->sectors, st->blocks, st->errors, st->timeouts);
+    esp_printf(kputc, "irqs %d (%d spurious), idle %d ms\n",
+               st->irqs, st->spurious_irqs, tsc_to_ms(st->idle_cycles));
+}
+
+static void cmd_sync(int argc, char **argv) {
+    const struct wb_stats *st = wb_get_stats();
+    int rc = vfs_sync();
+
+    if (rc == ATA_OK)
+        rc = wb_sync();
+    if (rc != ATA_OK)
+        esp_printf(kputc, "sync failed: %d\n", rc);
+    esp_printf(kputc, "write-back: %d sectors in, %d absorbed, %d read hits, %d dirty\n",
+               st->writes, st->absorbed, st->read_hits, st->dirty);
+    esp_printf(kputc, "%d flushes wrote %d sectors in %d runs, %d syncs, %d errors\n",
+               st->flushes, st->sectors, st->runs, st->syncs, st->errors);
+}
+
+static void cmd_bcache(int argc, char **argv) {
+    struct bcache_stats st;
+
+    if (argc == 2 && streq(argv[1], "drop")) {
+        bcache_invalidate();
+        return;
+    }
+    bcache_get_stats(&st);
+    esp_printf(kputc, "%d lookups, %d hits, %d misses, hit rate %d%c, %d waits on reads\n",
+               st.lookups, st.hits, st.misses,
+               st.lookups ? div64_32((uint64_t)st.hits * 100, st.lookups) : 0, '%', st.io_waits);
+    esp_printf(kputc, "read-ahead: %d blocks, %d used, %d wasted\n",
+               st.ra_blocks, st.ra_used, st.ra_wasted);
+    esp_printf(kputc, "%d/%d buffers in use, %d pinned, %d evictions, %d KiB footprint\n",
+               st.cached, st.buffers, st.pinned, st.evictions, st.bytes >> 10);
+}
+
+static void cmd_disk(int argc, char **argv) {
+    const struct blkq_stats *q = blkq_get_stats();
+    struct blkdev *d;
+    int rc;
+
+    if (argc == 2) {
+        if (!(d = blkdev_find(argv[1]))) {
+            esp_printf(kputc, "no disk %s\n", argv[1]);
+            return;
+        }
+        // Nothing cached above the queue may outlive the switch
+        keylog_close();
+        vfs_sync();
+        wb_sync();
+        bcache_invalidate();
+        blkq_set_device(d);
+        rc = fat_mount();
+        vfs_remount();
+        if (rc != ATA_OK)
+            esp_printf(kputc, "%s: no FAT volume\n", d->name);
+        else
+            keylog_open(KEYLOG_PATH);
+        return;
+    }
+    for (int i = 0; (d = blkdev_get(i)); i++)
+        esp_printf(kputc, "%c %s: %d sectors, depth %d\n",
+                   d == blkq_get_device() ? '*' : ' ', d->name, d->sectors, d->depth);
+    esp_printf(kputc, "queue: %d requests, %d merged, %d commands, %d staged, max depth %d\n",
+               q->requests, q->merged, q->commands, q->staged, q->max_depth);
+    if (blkdev_find("vda")) {
+        const struct virtio_blk_stats *v = virtio_blk_get_stats();
+        esp_printf(kputc, "vda: queue size %d, %s descriptors, irq %d, %d requests, %d notifies, %d irqs, max in flight %d, %d errors\n",
+                   v->queue_size, v->indirect ? "indirect" : "direct", v->irq, v->requests,
+                   v->notifies, v->irqs, v->max_inflight, v->errors);
+    }
+}
+
+static const char *fs_error(int rc) {
+    return rc == FAT_ENOENT ? "not found" : rc == FAT_ENOTDIR ? "not a directory" :
+           rc == FAT_EISDIR ? "is a directory" : rc == FAT_EBUSY ? "in use" :
+           rc == FAT_EEXIST ? "exists" : rc == FAT_ENOSPC ? "no space" :
+           rc == FAT_EMFILE || rc == VFS_EMFILE ? "too many open files" :
+           rc == VFS_EROFS ? "read-only file system" :
+           rc == PROC_ENOEXEC ? "not an executable" : rc == VFS_ENOMEM ? "out of memory" :
+           rc == ATA_EINVAL ? "invalid name" : "I/O error";
+}
+
+static void cmd_ls(int argc, char **argv) {
+    const struct fat_info *info = fat_get_info();
+    const struct fat_stats *fs = fat_get_stats();
+    const char *path = argc > 1 ? argv[1] : "/";
+    struct vfs_stat st;
+    static char name[FAT_NAME_MAX + 1];
+    uint32_t cookie = 0, asked = fs->dcache_hits + fs->dcache_misses;
+    int rc, on_fat = !initrd_path(path);
+
+    if (on_fat && !info) {
+        esp_printf(kputc, "no FAT volume mounted\n");
+        return;
+    }
+    while ((rc = vfs_readdir(path, &cookie, name, &st)) > 0)
+        esp_printf(kputc, "%s%c %d\n", name, st.attr & FAT_ATTR_DIRECTORY ? '/' : ' ', st.size);
+    if (rc < 0)
+        esp_printf(kputc, "%s: %s\n", path, fs_error(rc));
+    if (!on_fat)
+        return;
+    esp_printf(kputc, "%d KiB free; %d lookups, %d misses; dentry cache hit rate %d%c, %d negative, %d evictions\n",
+               div64_32((uint64_t)fs->free_clusters * info->cluster_size, 1024),
+               fs->lookups, fs->misses,
+               asked ? div64_32((uint64_t)fs->dcache_hits * 100, asked) : 0, '%',
+               fs->dcache_negative, fs->dcache_evictions);
+}
+
+static void cmd_cat(int argc, char **argv) {
+    char buf[ATA_SECTOR_SIZE];
+    int fd, n;
+
+    if (argc != 2) {
+        esp_printf(kputc, "usage: cat <file>\n");
+        return;
+    }
+    if ((fd = vfs_open(argv[1], VFS_O_READ)) < 0) {
+        esp_printf(kputc, "%s: %s\n", argv[1], fs_error(fd));
+        return;
+    }
+    while ((n = vfs_read(fd, buf, sizeof(buf))) > 0)
+        for (int i = 0; i < n; i++)
+            kputc(buf[i]);
+    if (n < 0)
+        esp_printf(kputc, "\n%s: read failed: %d\n", argv[1], n);
+    vfs_close(fd);
+}
+
+static void cmd_append(int argc, char **argv) {
+    int fd, rc = 0;
+
+    if (argc < 2) {
+        esp_printf(kputc, "usage: append <file> [words...]\n");
+        return;
+    }
+    if ((fd = vfs_open(argv[1], VFS_O_WRITE | VFS_O_CREAT | VFS_O_APPEND)) < 0) {
+        esp_printf(kputc, "%s: %s\n", argv[1], fs_error(fd));
+        return;
+    }
+    // The words as one line, the way the shell split them
+    for (int i = 2; i < argc && rc >= 0; i++) {
+        rc = vfs_write(fd, argv[i], strlen(argv[i]));
+        if (rc >= 0)
+            rc = vfs_write(fd, i + 1 < argc ? " " : "\n", 1);
+    }
+    if (rc < 0)
+        esp_printf(kputc, "%s: write failed: %d\n", argv[1], rc);
+    if ((rc = vfs_close(fd)) != ATA_OK)
+        esp_printf(kputc, "%s: close failed: %d\n", argv[1], rc);
+}
+
+static void cmd_rm(int argc, char **argv) {
+    int rc;
+
+    if (argc != 2) {
+        esp_printf(kputc, "usage: rm <file>\n");
+        return;
+    }
+    if ((rc = vfs_unlink(argv[1])) != ATA_OK)
+        esp_printf(kputc, "%s: %s\n", argv[1], fs_error(rc));
+}
+
+static void cmd_pcache(int argc, char **argv) {
+    struct pcache_stats st;
+    int inodes, files, maps;
+
+    if (argc == 2 && streq(argv[1], "drop")) {
+        pcache_invalidate();
+        return;
+    }
+    pcache_get_stats(&st);
+    vfs_usage(&inodes, &files, &maps);
+    esp_printf(kputc, "%d lookups, %d hits, %d misses, hit rate %d%c, %d pages written through\n",
+               st.lookups, st.hits, st.misses,
+               st.lookups ? div64_32((uint64_t)st.hits * 100, st.lookups) : 0, '%', st.updates);
+    esp_printf(kputc, "%d/%d pages in use, %d pinned, %d evictions\n",
+               st.cached, st.pages, st.pinned, st.evictions);
+    esp_printf(kputc, "%d inodes, %d open files, %d mappings\n", inodes, files, maps);
+}
+
+static void cmd_initrd(int argc, char **argv) {
+    const struct initrd_info *ri = initrd_get_info();
+    struct pfa_stats pst;
+
+    if (!ri) {
+        esp_printf(kputc, "no initrd\n");
+        return;
+    }
+    pfa_get_stats(&pst);
+    esp_printf(kputc, "module at 0x%x, %d KiB: %d files (%d KiB), %d directories, %d skipped\n",
+               ri->start, (ri->end - ri->start) / 1024, ri->files, ri->bytes / 1024,
+               ri->dirs, ri->skipped);
+    esp_printf(kputc, "%d frames reserved (kernel, boot information and modules)\n", pst.reserved);
+}
+
+static void cmd_exec(int argc, char **argv) {
+    const struct proc_stats *ps;
+    int rc, status = 0;
+
+    if (argc != 2) {
+        esp_printf(kputc, "usage: exec <file>\n");
+        return;
+    }
+    rc = proc_exec(argv[1], &status);
+    ps = proc_get_stats();
+    if (rc != ATA_OK && rc != PROC_EFAULT) {
+        esp_printf(kputc, "%s: %s\n", argv[1], fs_error(rc));
+        return;
+    }
+    if (rc == PROC_EFAULT)
+        esp_printf(kputc, "%s: killed touching 0x%x at eip 0x%x\n", argv[1], ps->kill_addr, ps->kill_eip);
+    else
+        esp_printf(kputc, "%s: exit status %d\n", argv[1], status);
+    esp_printf(kputc, "loaded in %d us, ran %d us (%d us in %d faults), %d system calls\n",
+               tsc_to_us(ps->load_cycles), tsc_to_us(ps->run_cycles),
+               tsc_to_us(ps->fault_cycles), ps->faults, ps->syscalls);
+    esp_printf(kputc, "%d of %d file pages touched: %d shared from the page cache, %d copied; %d zero pages\n",
+               ps->shared + ps->copied, ps->file_pages, ps->shared, ps->copied, ps->zeroed);
+}
+
+static void cmd_prof(int argc, char **argv) {
+    uint32_t samples, dropped, hz;
+
+    if (argc >= 2 && streq(argv[1], "start")) {
+        prof_start(parse_int(argv[2], TIMER_HZ) / TIMER_HZ);
+    } else if (argc == 2 && streq(argv[1], "stop")) {
+        prof_stop();
+    } else if (argc == 2 && streq(argv[1], "dump")) {
+        prof_dump();
+    } else if (argc != 1) {
+        esp_printf(kputc, "usage: prof [start [hz] | stop | dump]\n");
+        return;
+    }
+    prof_get_stats(&samples, &dropped, &hz);
+    esp_printf(kputc, "profiler %s at %d Hz: %d samples, %d overwritten\n",
+               prof_running ? "running" : "stopped", hz, samples, dropped);
+}
+
+static void cmd_boot(int argc, char **argv) {
+    boot_report(kputc);
+}
+
+static void cmd_lspci(int argc, char **argv) {
+    pci_dump(kputc);
+}
+
+static const struct shell_cmd commands[] = {
+    { "help",    "list commands",                       cmd_help },
+    { "meminfo", "frame allocator state",               cmd_meminfo },
+    { "irqstat", "interrupt counts per IRQ line",       cmd_irqstat },
+    { "pt",      "dump the page tables",                cmd_pt },
+    { "bench",   "bench <name> [n]: run a benchmark",   cmd_bench },
+    { "trace",   "trace on|off: binary tracing on COM1", cmd_trace },
+    { "keylog",  "keylog [sync]: dump or flush the keylog", cmd_keylog },
+    { "ata",     "ata [poll|irq|dma]: disk info and stats, or set mode", cmd_ata },
+    { "sync",    "flush dirty sectors and the drive cache", cmd_sync },
+    { "bcache",  "bcache [drop]: block cache counters", cmd_bcache },
+    { "disk",    "disk [name]: list disks, or queue to another", cmd_disk },
+    { "ls",      "ls [dir]: list a directory",          cmd_ls },
+    { "cat",     "cat <file>: print a file",            cmd_cat },
+    { "append",  "append <file> [words]: add a line to a file", cmd_append },
+    { "rm",      "rm <file>: delete a file",            cmd_rm },
+    { "pcache",  "pcache [drop]: page cache counters",  cmd_pcache },
+    { "initrd",  "initial ramdisk contents",            cmd_initrd },
+    { "exec",    "exec <file>: run a program in user mode", cmd_exec },
+    { "prof",    "prof [start [hz] | stop | dump]: sampling profiler", cmd_prof },
+    { "boot",    "time taken by each boot step",        cmd_boot },
+    { "lspci",   "list PCI functions",                  cmd_lspci },
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static void cmd_help(int argc, char **argv) {
+    for (unsigned int i = 0; i < NUM_COMMANDS; i++)
+        esp_printf(kputc, "%s - %s\n", commands[i].name, commands[i].help);
+}
+
+// Split line in place on spaces. argv[argc] is left 0.
+static int split(char *line, char **argv) {
+    int argc = 0;
+
+    while (*line && argc < SHELL_ARGS_MAX - 1) {
+        while (*line == ' ')
+            *line++ = '\0';
+        if (!*line)
+            break;
+        argv[argc++] = line;
+        while (*line && *line != ' ')
+            line++;
+        if (*line)
+            *line++ = '\0';
+    }
+    argv[argc] = 0;
+    return argc;
+}
+
+void shell_exec(char *line) {
+    char *argv[SHELL_ARGS_MAX];
+    int argc = split(line, argv);
+
+    if (argc == 0)
+        return;
+    for (unsigned int i = 0; i < NUM_COMMANDS; i++) {
+        if (streq(argv[0], commands[i].name)) {
+            commands[i].fn(argc, argv);
+            return;
+        }
+    }
+    esp_printf(kputc, "unknown command: %s (try help)\n", argv[0]);
+}
+
+void shell_run(void) {
+    char line[SHELL_LINE_MAX];
+
+    esp_printf(kputc, "Type help for a list of commands.\n");
+    while (1) {
+        esp_printf(kputc, "> ");
+        kreadline(line, sizeof(line));
+        shell_exec(line);
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef SHELL_H
+#define SHELL_H
+
+// Parse and run one command line (modified in place)
+void shell_exec(char *line);
+
+// Prompt, read and execute commands forever
+void shell_run(void);
+
+#endif
@@ -0,0 +1,80 @@
+#include <stdint.h>
+#include "timer.h"
+#include "interrupt.h"
+
+#define PIT_HZ   1193182
+#define PIT_CH0  0x40
+#define PIT_CMD  0x43
+
+volatile uint32_t timer_ticks = 0;
+static uint32_t timer_hz = 0;
+static uint32_t timer_mult = 1;
+static uint32_t timer_sub = 0;         // interrupts since the last tick
+static struct timer_work *work_list = 0;
+static int work_running = 0;
+
+static void timer_program(uint32_t hz) {
+    uint32_t divisor = PIT_HZ / hz;
+
+    outb(PIT_CMD, 0x34);                 // ch0, lo/hi byte, mode 2 (rate generator)
+    outb(PIT_CH0, divisor & 0xFF);
+    outb(PIT_CH0, divisor >> 8);
+}
+
+void timer_init(uint32_t hz) {
+    timer_hz = hz;
+    timer_program(hz);
+    IRQ_clear_mask(0);
+}
+
+void timer_set_multiplier(uint32_t mult) {
+    uint32_t flags = irq_save();
+
+    timer_mult = mult ? mult : 1;
+    timer_sub = 0;
+    timer_program(timer_hz * timer_mult);
+    irq_restore(flags);
+}
+
+void timer_irq(void) {
+    if (++timer_sub >= timer_mult) {
+        timer_sub = 0;
+        timer_ticks++;
+    }
+}
+
+uint32_t timer_ms_to_ticks(uint32_t ms) {
+    return (ms * timer_hz + 999) / 1000;
+}
+
+void timer_sleep_ms(uint32_t ms) {
+    uint32_t start = timer_ticks;
+    uint32_t n = timer_ms_to_ticks(ms);
+
+    while (timer_ticks - start < n)
+        asm volatile("hlt");
+}
+
+void timer_every(struct timer_work *w, uint32_t ms, void (*fn)(void)) {
+    w->fn = fn;
+    w->period = timer_ms_to_ticks(ms);
+    if (w->period == 0)
+        w->period = 1;
+    w->next = timer_ticks + w->period;
+    w->link = work_list;
+    work_list = w;
+}
+
+void timer_run_pending(void) {
+    // Work may itself wait on the disk; don't let it re-enter
+    if (work_running)
+        return;
+    work_running = 1;
+    for (struct timer_work *w = work_list; w; w = w->link) {
+        if ((int32_t)(timer_ticks - w->next) >= 0) {
+            w->next = timer_ticks + w->period;
+            w->fn();
+        }
+    }
+    work_running = 0;
+}
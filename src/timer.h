@@ -0,0 +1,45 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#define TIMER_HZ 100
+
+// Incremented by the IRQ0 handler
+extern volatile uint32_t timer_ticks;
+
+// Program PIT channel 0 to interrupt hz times a second and unmask IRQ0
+void timer_init(uint32_t hz);
+
+// Interrupt mult times per tick, for the profiler. timer_ticks still
+// counts at the rate timer_init() was given.
+void timer_set_multiplier(uint32_t mult);
+
+// From the IRQ0 handler: advance timer_ticks once per mult interrupts
+void timer_irq(void);
+
+// Milliseconds to timer ticks, rounded up
+uint32_t timer_ms_to_ticks(uint32_t ms);
+
+// Sleep (hlt) for at least ms milliseconds
+void timer_sleep_ms(uint32_t ms);
+
+/*
+ * Periodic work that must not run in interrupt context, such as disk I/O.
+ * There are no threads, so it runs from timer_run_pending(), which idle
+ * loops like kgetchar() call between hlts.
+ */
+struct timer_work {
+    void (*fn)(void);
+    uint32_t period;             // ticks
+    uint32_t next;               // tick it is next due
+    struct timer_work *link;
+};
+
+// Run fn every ms milliseconds. w must stay valid.
+void timer_every(struct timer_work *w, uint32_t ms, void (*fn)(void));
+
+// Run whatever periodic work is due
+void timer_run_pending(void);
+
+#endif
@@ -0,0 +1,65 @@
+// trace.c
+//
+// Emits trace records (see trace.h) straight to COM1. Records are written
+// with interrupts off so a tracepoint in an ISR can't split a record that
+// was being written by the code it interrupted.
+
+#include <stdint.h>
+#include "trace.h"
+#include "tsc.h"
+#include "serial.h"
+#include "interrupt.h"
+
+#ifdef CONFIG_TRACE
+
+volatile int trace_enabled = 0;
+
+static uint8_t fold(uint32_t v) {
+    return v ^ (v >> 8) ^ (v >> 16) ^ (v >> 24);
+}
+
+void trace_emit(uint8_t id, uint8_t nargs, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    struct {
+        struct trace_header h;
+        uint32_t args[TRACE_MAX_ARGS];
+    } __attribute__((packed)) rec;
+    uint32_t flags = irq_save();
+    uint64_t now = rdtsc();
+
+    rec.h.sync = TRACE_SYNC;
+    rec.h.id = id;
+    rec.h.nargs = nargs;
+    rec.h.tsc_lo = (uint32_t)now;
+    rec.h.tsc_hi = (uint32_t)(now >> 32);
+    rec.args[0] = a;
+    rec.args[1] = b;
+    rec.args[2] = c;
+    rec.args[3] = d;
+
+    uint8_t csum = TRACE_SYNC ^ id ^ nargs ^ fold(rec.h.tsc_lo) ^ fold(rec.h.tsc_hi);
+    for (int i = 0; i < nargs; i++)
+        csum ^= fold(rec.args[i]);
+    rec.h.csum = csum;
+
+    serial_write_buf(&rec, sizeof(rec.h) + nargs * sizeof(uint32_t));
+    irq_restore(flags);
+}
+
+void trace_init(void) {
+    trace_enabled = 1;
+    // Lets the decoder convert TSC ticks to wall time without being told
+    TRACE2(TRACE_CLOCK, tsc_khz, 0);
+}
+
+void trace_set(int on) {
+    trace_enabled = on;
+    if (on)
+        TRACE2(TRACE_CLOCK, tsc_khz, 0);
+}
+
+#else
+
+void trace_set(int on) {
+}
+
+#endif
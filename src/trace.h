@@ -0,0 +1,80 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Binary event tracing over COM1.
+ *
+ * Each record is a 12-byte header followed by nargs 32-bit arguments:
+ *
+ *   sync (0xA7) | id | nargs | csum | tsc low | tsc high | args...
+ *
+ * csum is the XOR of every other byte in the record, so tools/tracedump can
+ * resynchronise on a capture that also carries text or keylog sectors.
+ *
+ * Tracepoints are the TRACE2/TRACE3/TRACE4 macros. Without CONFIG_TRACE
+ * they expand to nothing and their arguments are not evaluated.
+ */
+
+#define TRACE_SYNC     0xA7
+#define TRACE_MAX_ARGS 4
+
+/*
+ * X(enum name, label, chrome phase)
+ * Events with phase 'B'/'E' are paired by label in the Chrome trace view.
+ */
+#define TRACE_EVENTS(X) \
+    X(TRACE_CLOCK,       "clock",     'M') /* tsc_khz, 0 */ \
+    X(TRACE_MARK,        "mark",      'i') /* user values */ \
+    X(TRACE_IRQ_ENTER,   "irq",       'B') /* irq, data */ \
+    X(TRACE_IRQ_EXIT,    "irq",       'E') /* irq, 0 */ \
+    X(TRACE_EXCEPTION,   "exception", 'i') /* vector, address */ \
+    X(TRACE_PAGE_ALLOC,  "page_alloc",'i') /* npages, physical address */ \
+    X(TRACE_PAGE_FREE,   "page_free", 'i') /* npages, physical address */ \
+    X(TRACE_MAP_BEGIN,   "map_pages", 'B') /* vaddr, page directory */ \
+    X(TRACE_MAP_END,     "map_pages", 'E') /* vaddr, pages mapped */ \
+    X(TRACE_ATA_START,   "ata",       'B') /* lba, sectors, op */ \
+    X(TRACE_ATA_DONE,    "ata",       'E') /* lba, status */ \
+    X(TRACE_FAULT,       "fault",     'B') /* address, error code */ \
+    X(TRACE_FAULT_DONE,  "fault",     'E') /* address, how: 0 zeroed, 1 shared, 2 copied */
+
+#define TRACE_ENUM(id, label, phase) id,
+enum trace_event { TRACE_EVENTS(TRACE_ENUM) TRACE_NUM_EVENTS };
+#undef TRACE_ENUM
+
+struct trace_header {
+    uint8_t  sync;
+    uint8_t  id;
+    uint8_t  nargs;
+    uint8_t  csum;
+    uint32_t tsc_lo;
+    uint32_t tsc_hi;
+} __attribute__((packed));
+
+#ifdef CONFIG_TRACE
+
+extern volatile int trace_enabled;
+
+void trace_init(void);
+void trace_emit(uint8_t id, uint8_t nargs, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+
+#define TRACE2(id, a, b)       do { if (trace_enabled) trace_emit((id), 2, (uint32_t)(a), (uint32_t)(b), 0, 0); } while (0)
+#define TRACE3(id, a, b, c)    do { if (trace_enabled) trace_emit((id), 3, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), 0); } while (0)
+#define TRACE4(id, a, b, c, d) do { if (trace_enabled) trace_emit((id), 4, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), (uint32_t)(d)); } while (0)
+
+#else
+
+// sizeof() keeps variables that only feed tracepoints "used" without
+// generating any code or evaluating the arguments
+#define trace_init()           do { } while (0)
+#define TRACE2(id, a, b)       do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define TRACE3(id, a, b, c)    do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#define TRACE4(id, a, b, c, d) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); (void)sizeof(d); } while (0)
+
+#endif
+
+// Turn tracing on or off at run time. A no-op without CONFIG_TRACE.
+void trace_set(int on);
+
+#endif
@@ -0,0 +1,40 @@
+#include <stdint.h>
+#include "tsc.h"
+#include "interrupt.h"
+
+#define PIT_HZ        1193182
+#define PIT_CH2       0x42
+#define PIT_CMD       0x43
+#define PIT_GATE_PORT 0x61
+#define CALIBRATE_MS  10
+
+uint32_t tsc_khz = 0;
+
+/*
+ * Channel 2 is the speaker channel. Its gate is bit 0 of port 0x61 and its
+ * output can be read back in bit 5, so it can be polled without touching
+ * IRQ0 or the speaker itself (bit 1 stays clear).
+ */
+uint32_t tsc_calibrate(void) {
+    uint16_t count = PIT_HZ * CALIBRATE_MS / 1000;
+    uint8_t gate;
+    uint32_t t0, t1;
+
+    gate = inb(PIT_GATE_PORT) & ~0x02;
+    outb(PIT_GATE_PORT, gate & ~0x01);        // gate low while programming
+
+    outb(PIT_CMD, 0xB0);                      // ch2, lo/hi byte, mode 0, binary
+    outb(PIT_CH2, count & 0xFF);
+    outb(PIT_CH2, count >> 8);
+
+    outb(PIT_GATE_PORT, gate | 0x01);         // start counting
+    t0 = (uint32_t)rdtsc();
+    while (!(inb(PIT_GATE_PORT) & 0x20));     // OUT2 goes high at terminal count
+    t1 = (uint32_t)rdtsc();
+    outb(PIT_GATE_PORT, gate & ~0x01);
+
+    // 10 ms is well under 2^32 cycles on anything we run on, so a 32-bit
+    // difference is enough and avoids pulling in 64-bit division from libgcc.
+    tsc_khz = (t1 - t0) / CALIBRATE_MS;
+    return tsc_khz;
+}
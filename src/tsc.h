@@ -0,0 +1,40 @@
+#ifndef TSC_H
+#define TSC_H
+
+#include <stdint.h>
+
+// TSC frequency in kHz, filled in by tsc_calibrate(). 0 until then.
+extern uint32_t tsc_khz;
+
+// Read the CPU time-stamp counter
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/*
+ * 64-by-32 division with divl. A plain C division of a uint64_t would pull
+ * in __udivdi3 from libgcc, which we don't link. The quotient must fit in
+ * 32 bits.
+ */
+static inline uint32_t div64_32(uint64_t n, uint32_t d) {
+    uint32_t q, r;
+    asm("divl %4" : "=a"(q), "=d"(r) : "a"((uint32_t)n), "d"((uint32_t)(n >> 32)), "rm"(d));
+    return q;
+}
+
+// Convert a cycle count to microseconds. Needs tsc_calibrate() first.
+static inline uint32_t tsc_to_us(uint64_t cycles) {
+    return tsc_khz ? div64_32(cycles * 1000, tsc_khz) : 0;
+}
+
+// Convert a cycle count to milliseconds. Needs tsc_calibrate() first.
+static inline uint32_t tsc_to_ms(uint64_t cycles) {
+    return tsc_khz ? div64_32(cycles, tsc_khz) : 0;
+}
+
+// Measure the TSC rate against a 10 ms one-shot on PIT channel 2
+uint32_t tsc_calibrate(void);
+
+#endif
@@ -0,0 +1,545 @@
+// vfs.c
+//
+// Descriptors, files and inodes over the FAT driver and the initrd. A FAT
+// inode's handle is a struct fat_file kept alongside it; every call seeks
+// it to the position wanted first, so the files sharing an inode each keep
+// their own. An initrd inode's handle is its struct initrd_file.
+
+#include <stdint.h>
+#include "vfs.h"
+#include "pcache.h"
+#include "fat.h"
+#include "initrd.h"
+#include "ide.h"
+#include "klib.h"
+#include "tsc.h"
+#include "rprintf.h"
+#include "console.h"
+
+struct vfs_map {
+    struct page_directory_entry *pd;
+    uint8_t *addr;
+    uint32_t npages;                 // 0 for a free slot
+    struct inode *ip;
+};
+
+static struct inode inodes[VFS_INODES];
+static struct fat_file fat_files[VFS_INODES];
+static struct file files[VFS_FILES];
+static struct vfs_map maps[VFS_MAPS];
+static struct fd_table kernel_fds;
+static struct fd_table *fds = &kernel_fds;
+
+static int vfs_fat_read(struct inode *ip, uint32_t pos, void *buf, uint32_t len) {
+    int rc = fat_seek(ip->priv, pos);
+
+    return rc != ATA_OK ? rc : fat_read(ip->priv, buf, len);
+}
+
+static int vfs_fat_write(struct inode *ip, uint32_t pos, const void *buf, uint32_t len) {
+    int rc = fat_seek(ip->priv, pos);
+
+    return rc != ATA_OK ? rc : fat_write(ip->priv, buf, len);
+}
+
+static int vfs_fat_truncate(struct inode *ip, uint32_t size) {
+    return fat_truncate(ip->priv, size);
+}
+
+static int vfs_fat_release(struct inode *ip) {
+    return fat_close(ip->priv);
+}
+
+static const struct inode_ops fat_inode_ops = {
+    .read = vfs_fat_read,
+    .write = vfs_fat_write,
+    .truncate = vfs_fat_truncate,
+    .release = vfs_fat_release,
+};
+
+static int vfs_initrd_read(struct inode *ip, uint32_t pos, void *buf, uint32_t len) {
+    const struct initrd_file *f = ip->priv;
+
+    if (pos >= f->size)
+        return 0;
+    if (len > f->size - pos)
+        len = f->size - pos;
+    memcpy(buf, f->data + pos, len);
+    return len;
+}
+
+static int vfs_initrd_write(struct inode *ip, uint32_t pos, const void *buf, uint32_t len) {
+    return VFS_EROFS;
+}
+
+static int vfs_initrd_truncate(struct inode *ip, uint32_t size) {
+    return VFS_EROFS;
+}
+
+static int vfs_initrd_release(struct inode *ip) {
+    return ATA_OK;
+}
+
+static const struct inode_ops initrd_inode_ops = {
+    .read = vfs_initrd_read,
+    .write = vfs_initrd_write,
+    .truncate = vfs_initrd_truncate,
+    .release = vfs_initrd_release,
+};
+
+static void initrd_fill_stat(const struct initrd_file *f, struct vfs_stat *st) {
+    st->ino = INITRD_INO | initrd_index(f);
+    st->size = f->size;
+    st->attr = f->dir ? FAT_ATTR_DIRECTORY | FAT_ATTR_READONLY : FAT_ATTR_READONLY;
+}
+
+static struct inode *inode_find(uint64_t ino) {
+    for (int i = 0; i < VFS_INODES; i++)
+        if (inodes[i].refs && inodes[i].ino == ino)
+            return &inodes[i];
+    return 0;
+}
+
+// A free inode with its handle ready to be opened; it stays free until
+// inode_init() gives it a reference
+static struct inode *inode_alloc(void) {
+    for (int i = 0; i < VFS_INODES; i++) {
+        if (!inodes[i].refs) {
+            inodes[i].ops = &fat_inode_ops;
+            inodes[i].priv = &fat_files[i];
+            return &inodes[i];
+        }
+    }
+    return 0;
+}
+
+static void inode_init(struct inode *ip, const struct fat_stat *st) {
+    ip->ino = st->ino;
+    ip->size = st->size;
+    ip->attr = st->attr;
+    ip->refs = 1;
+}
+
+// Open or create path on the FAT volume, sharing its inode if it's open
+static int fat_inode_open(const char *path, int flags, struct inode **ipp) {
+    struct fat_stat st;
+    struct inode *ip;
+    int rc;
+
+    rc = fat_stat(path, &st);
+    if (rc == FAT_ENOENT && (flags & VFS_O_CREAT)) {
+        if (!(ip = inode_alloc()))
+            return VFS_EMFILE;
+        if ((rc = fat_create(path, ip->priv)) != ATA_OK)
+            return rc;
+        if ((rc = fat_stat(path, &st)) != ATA_OK) {
+            fat_close(ip->priv);
+            return rc;
+        }
+        inode_init(ip, &st);
+    } else if (rc != ATA_OK) {
+        return rc;
+    } else if (st.attr & FAT_ATTR_DIRECTORY) {
+        return FAT_EISDIR;
+    } else if ((ip = inode_find(st.ino))) {
+        ip->refs++;
+    } else {
+        if (!(ip = inode_alloc()))
+            return VFS_EMFILE;
+        if ((rc = fat_open(path, ip->priv)) != ATA_OK)
+            return rc;
+        inode_init(ip, &st);
+    }
+    *ipp = ip;
+    return ATA_OK;
+}
+
+// Open f on the initrd, sharing its inode if it's open already
+static int initrd_inode_open(const struct initrd_file *f, int flags, struct inode **ipp) {
+    struct vfs_stat st;
+    struct inode *ip;
+
+    if (flags & (VFS_O_WRITE | VFS_O_CREAT | VFS_O_TRUNC))
+        return VFS_EROFS;
+    if (!f)
+        return FAT_ENOENT;
+    if (f->dir)
+        return FAT_EISDIR;
+    initrd_fill_stat(f, &st);
+    if ((ip = inode_find(st.ino))) {
+        ip->refs++;
+    } else {
+        if (!(ip = inode_alloc()))
+            return VFS_EMFILE;
+        ip->ops = &initrd_inode_ops;
+        ip->priv = (void *)f;
+        ip->ino = st.ino;
+        ip->size = st.size;
+        ip->attr = st.attr;
+        ip->refs = 1;
+    }
+    *ipp = ip;
+    return ATA_OK;
+}
+
+static int inode_put(struct inode *ip) {
+    if (--ip->refs == 0)
+        return ip->ops->release(ip);
+    return ATA_OK;
+}
+
+static struct file *fd_file(int fd) {
+    return fd >= 0 && fd < VFS_FDS ? fds->fd[fd] : 0;
+}
+
+void vfs_init(void) {
+    pcache_init();
+}
+
+void vfs_set_fd_table(struct fd_table *t) {
+    fds = t;
+}
+
+int vfs_open(const char *path, int flags) {
+    struct inode *ip;
+    struct file *f = 0;
+    const char *rel;
+    int fd, rc;
+
+    for (fd = 0; fd < VFS_FDS && fds->fd[fd]; fd++)
+        ;
+    for (int i = 0; i < VFS_FILES && !f; i++)
+        if (!files[i].refs)
+            f = &files[i];
+    if (fd == VFS_FDS || !f)
+        return VFS_EMFILE;
+
+    rel = initrd_path(path);
+    rc = rel ? initrd_inode_open(initrd_lookup(rel), flags, &ip) : fat_inode_open(path, flags, &ip);
+    if (rc != ATA_OK)
+        return rc;
+    if ((flags & VFS_O_TRUNC) && (flags & VFS_O_WRITE) && ip->size) {
+        if ((rc = ip->ops->truncate(ip, 0)) != ATA_OK) {
+            inode_put(ip);
+            return rc;
+        }
+        pcache_truncate(ip->ino, 0);
+        ip->size = 0;
+    }
+    f->ip = ip;
+    f->pos = 0;
+    f->flags = flags;
+    f->refs = 1;
+    fds->fd[fd] = f;
+    return fd;
+}
+
+int vfs_close(int fd) {
+    struct file *f = fd_file(fd);
+
+    if (!f)
+        return VFS_EBADF;
+    fds->fd[fd] = 0;
+    if (--f->refs)
+        return ATA_OK;
+    return inode_put(f->ip);
+}
+
+int vfs_read(int fd, void *buf, uint32_t len) {
+    struct file *f = fd_file(fd);
+    uint8_t *dst = buf;
+    uint32_t done = 0;
+
+    if (!f || !(f->flags & VFS_O_READ))
+        return VFS_EBADF;
+    if (f->pos >= f->ip->size)
+        return 0;
+    if (len > f->ip->size - f->pos)
+        len = f->ip->size - f->pos;
+    while (done < len) {
+        uint32_t off = f->pos % PAGE_SIZE;
+        uint32_t chunk = PAGE_SIZE - off;
+        struct pcpage *p = pcache_get(f->ip, f->pos / PAGE_SIZE);
+
+        if (!p)
+            return done ? done : ATA_EIO;
+        if (chunk > len - done)
+            chunk = len - done;
+        memcpy(dst + done, p->data + off, chunk);
+        pcache_put(p);
+        f->pos += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+int vfs_write(int fd, const void *buf, uint32_t len) {
+    struct file *f = fd_file(fd);
+    struct inode *ip;
+    int n;
+
+    if (!f || !(f->flags & VFS_O_WRITE))
+        return VFS_EBADF;
+    ip = f->ip;
+    if (f->flags & VFS_O_APPEND)
+        f->pos = ip->size;
+    if ((n = ip->ops->write(ip, f->pos, buf, len)) <= 0)
+        return n;
+    pcache_write(ip->ino, f->pos, buf, n);
+    f->pos += n;
+    if (f->pos > ip->size)
+        ip->size = f->pos;
+    return n;
+}
+
+// Past the end is refused, as files have no holes
+int vfs_seek(int fd, uint32_t pos) {
+    struct file *f = fd_file(fd);
+
+    if (!f)
+        return VFS_EBADF;
+    if (pos > f->ip->size)
+        return ATA_EINVAL;
+    f->pos = pos;
+    return ATA_OK;
+}
+
+int vfs_fstat(int fd, struct vfs_stat *st) {
+    struct file *f = fd_file(fd);
+
+    if (!f)
+        return VFS_EBADF;
+    st->ino = f->ip->ino;
+    st->size = f->ip->size;
+    st->attr = f->ip->attr;
+    return ATA_OK;
+}
+
+int vfs_stat(const char *path, struct vfs_stat *st) {
+    const struct initrd_file *f;
+    const char *rel;
+    struct fat_stat fs;
+    int rc;
+
+    if ((rel = initrd_path(path))) {
+        if (!(f = initrd_lookup(rel)))
+            return FAT_ENOENT;
+        initrd_fill_stat(f, st);
+        return ATA_OK;
+    }
+    if ((rc = fat_stat(path, &fs)) != ATA_OK)
+        return rc;
+    st->ino = fs.ino;
+    st->size = fs.size;
+    st->attr = fs.attr;
+    return ATA_OK;
+}
+
+int vfs_unlink(const char *path) {
+    struct fat_stat st;
+    int rc;
+
+    if (initrd_path(path))
+        return VFS_EROFS;
+    if ((rc = fat_stat(path, &st)) != ATA_OK)
+        return rc;
+    if (inode_find(st.ino))
+        return FAT_EBUSY;
+    // The entry's slot may be reused by a new file with the same number
+    if ((rc = fat_unlink(path)) == ATA_OK)
+        pcache_forget(st.ino);
+    return rc;
+}
+
+int vfs_readdir(const char *path, uint32_t *cookie, char *name, struct vfs_stat *st) {
+    const struct initrd_file *f;
+    const char *rel, *base;
+    struct fat_stat fs;
+    int rc;
+
+    if ((rel = initrd_path(path))) {
+        if (!(f = initrd_lookup(rel)))
+            return FAT_ENOENT;
+        if (!f->dir)
+            return FAT_ENOTDIR;
+        if (!(f = initrd_readdir(rel, cookie)))
+            return 0;
+        for (base = f->name; *base; base++)
+            ;
+        while (base > f->name && base[-1] != '/')
+            base--;
+        memcpy(name, base, strlen(base) + 1);
+        initrd_fill_stat(f, st);
+        return 1;
+    }
+    if ((rc = fat_readdir(path, cookie, name, &fs)) <= 0)
+        return rc;
+    st->ino = fs.ino;
+    st->size = fs.size;
+    st->attr = fs.attr;
+    return 1;
+}
+
+int vfs_sync(void) {
+    return fat_flush();
+}
+
+void vfs_remount(void) {
+    pcache_invalidate();
+}
+
+// Unmap npages from addr and let go of the pages that were there
+static void vfs_unmap(struct page_directory_entry *pd, uint8_t *addr, uint32_t npages) {
+    for (uint32_t i = 0; i < npages; i++) {
+        pcache_put(pcache_page(paging_lookup(pd, addr + i * PAGE_SIZE)));
+        unmap_pages(addr + i * PAGE_SIZE, 1, pd);
+    }
+}
+
+int vfs_mmap(struct page_directory_entry *pd, int fd, uint32_t offset, uint32_t len, void **addr) {
+    struct file *f = fd_file(fd);
+    struct vfs_map *m = 0;
+    uint32_t npages, i;
+    uint8_t *va;
+
+    if (!f || !(f->flags & VFS_O_READ))
+        return VFS_EBADF;
+    if (offset % PAGE_SIZE || len == 0 || offset >= f->ip->size || len > f->ip->size - offset)
+        return ATA_EINVAL;
+    for (int k = 0; k < VFS_MAPS && !m; k++)
+        if (!maps[k].npages)
+            m = &maps[k];
+    npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (!m || !(va = paging_find_free(pd, npages)))
+        return VFS_ENOMEM;
+
+    for (i = 0; i < npages; i++) {
+        struct pcpage *p = pcache_get(f->ip, offset / PAGE_SIZE + i);
+        struct ppage one = { 0, 0, 0 };
+
+        if (!p)
+            break;
+        // The cached page itself, not a copy of it
+        one.physical_addr = p->data;
+        if (!map_pages_prot(va + i * PAGE_SIZE, &one, pd, 0)) {
+            pcache_put(p);
+            break;
+        }
+    }
+    if (i < npages) {
+        vfs_unmap(pd, va, i);
+        return VFS_ENOMEM;
+    }
+
+    m->pd = pd;
+    m->addr = va;
+    m->npages = npages;
+    m->ip = f->ip;
+    f->ip->refs++;
+    *addr = va;
+    return ATA_OK;
+}
+
+int vfs_munmap(struct page_directory_entry *pd, void *addr) {
+    for (int k = 0; k < VFS_MAPS; k++) {
+        struct vfs_map *m = &maps[k];
+
+        if (m->npages && m->pd == pd && m->addr == addr) {
+            vfs_unmap(pd, m->addr, m->npages);
+            m->npages = 0;
+            return inode_put(m->ip);
+        }
+    }
+    return ATA_EINVAL;
+}
+
+struct inode *vfs_iget(int fd) {
+    struct file *f = fd_file(fd);
+
+    if (!f || !(f->flags & VFS_O_READ))
+        return 0;
+    f->ip->refs++;
+    return f->ip;
+}
+
+int vfs_iput(struct inode *ip) {
+    return inode_put(ip);
+}
+
+void vfs_usage(int *ninodes, int *nfiles, int *nmaps) {
+    *ninodes = *nfiles = *nmaps = 0;
+    for (int i = 0; i < VFS_INODES; i++)
+        *ninodes += inodes[i].refs != 0;
+    for (int i = 0; i < VFS_FILES; i++)
+        *nfiles += files[i].refs != 0;
+    for (int i = 0; i < VFS_MAPS; i++)
+        *nmaps += maps[i].npages != 0;
+}
+
+static void vfs_bench_report(const char *what, uint64_t cycles, uint32_t size, uint32_t sum) {
+    esp_printf(kputc, "%s %d cycles per KiB, sum 0x%x\n", what,
+               div64_32(cycles * 1024, size), sum);
+}
+
+void vfs_bench(const char *path) {
+    static uint8_t buf[ATA_SECTOR_SIZE];
+    struct fat_file ff;
+    struct vfs_stat st;
+    const uint8_t *va;
+    uint32_t sum, len;
+    uint64_t t0;
+    int fd, n;
+
+    if ((fd = vfs_open(path, VFS_O_READ)) < 0) {
+        esp_printf(kputc, "%s: open failed: %d\n", path, fd);
+        return;
+    }
+    vfs_fstat(fd, &st);
+    if (st.size == 0) {
+        esp_printf(kputc, "%s: nothing to read\n", path);
+        vfs_close(fd);
+        return;
+    }
+    esp_printf(kputc, "%s, %d bytes, read %d bytes at a time:\n", path, st.size, ATA_SECTOR_SIZE);
+
+    // Straight from the buffer cache, a sector at a time; this also warms
+    // it. An initrd file has nothing underneath to compare with.
+    if (!initrd_path(path) && fat_open(path, &ff) == ATA_OK) {
+        sum = 0;
+        t0 = rdtsc();
+        while ((n = fat_read(&ff, buf, sizeof(buf))) > 0)
+            for (int i = 0; i < n; i++)
+                sum += buf[i];
+        vfs_bench_report("fat_read:        ", rdtsc() - t0, st.size, sum);
+        fat_close(&ff);
+    }
+
+    for (int warm = 0; warm < 2; warm++) {
+        if (!warm)
+            pcache_forget(st.ino);
+        vfs_seek(fd, 0);
+        sum = 0;
+        t0 = rdtsc();
+        while ((n = vfs_read(fd, buf, sizeof(buf))) > 0)
+            for (int i = 0; i < n; i++)
+                sum += buf[i];
+        vfs_bench_report(warm ? "vfs_read, warm:  " : "vfs_read, cold:  ", rdtsc() - t0,
+                         st.size, sum);
+    }
+
+    // Leave half the cache unpinned for everyone else
+    len = st.size;
+    if (len > PCACHE_PAGES / 2 * PAGE_SIZE)
+        len = PCACHE_PAGES / 2 * PAGE_SIZE;
+    t0 = rdtsc();
+    if ((n = vfs_mmap(pd, fd, 0, len, (void **)&va)) != ATA_OK) {
+        esp_printf(kputc, "mmap failed: %d\n", n);
+    } else {
+        sum = 0;
+        for (uint32_t i = 0; i < len; i++)
+            sum += va[i];
+        vfs_munmap(pd, (void *)va);
+        vfs_bench_report("mmap and touch:  ", rdtsc() - t0, len, sum);
+    }
+    vfs_close(fd);
+}
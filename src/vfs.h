@@ -0,0 +1,127 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdint.h>
+#include "paging.h"
+#include "fat.h"
+
+/*
+ * Files above the filesystem. A path opens to an inode, one per file in
+ * use however many times it's open, which holds the filesystem's own
+ * handle and is named by the filesystem's inode number. Each open makes a
+ * struct file with its own position and mode, and a descriptor for it in
+ * the current descriptor table; processes get a table each, the kernel
+ * shell has one of its own.
+ *
+ * Reads and writes go through the page cache (pcache.h). vfs_mmap() maps
+ * the cached pages of a file into an address space read-only, so a
+ * mapping sees later writes to the file without anything being copied.
+ * The root filesystem is the FAT volume; paths under INITRD_MOUNT go to
+ * the initrd (initrd.h) instead, which is read-only.
+ */
+
+#define VFS_INODES   FAT_NODES       // files in use, at most one FAT node each
+#define VFS_FILES    32              // opens, shared by every table
+#define VFS_FDS      16              // descriptors per table
+#define VFS_MAPS     16
+
+// vfs_open() flags
+#define VFS_O_READ   0x01
+#define VFS_O_WRITE  0x02
+#define VFS_O_CREAT  0x04
+#define VFS_O_TRUNC  0x08
+#define VFS_O_APPEND 0x10            // every write goes at the end
+
+// Errors, following on from FAT_*
+#define VFS_EBADF    -13             // not a descriptor, or not open for that
+#define VFS_EMFILE   -14             // no descriptor, file or inode left
+#define VFS_ENOMEM   -15             // no page or address space for a mapping
+#define VFS_EROFS    -16             // writing to the initrd
+
+struct inode;
+
+struct inode_ops {
+    // Returns the bytes read, 0 at the end of the file, or an error
+    int (*read)(struct inode *ip, uint32_t pos, void *buf, uint32_t len);
+    int (*write)(struct inode *ip, uint32_t pos, const void *buf, uint32_t len);
+    int (*truncate)(struct inode *ip, uint32_t size);
+    // The last reference went
+    int (*release)(struct inode *ip);
+};
+
+struct inode {
+    uint64_t ino;                    // unique on the volume while the file exists
+    uint32_t size;
+    uint16_t refs;                   // files and mappings
+    uint8_t attr;                    // FAT_ATTR_*
+    const struct inode_ops *ops;
+    void *priv;                      // the filesystem's handle
+};
+
+struct file {
+    struct inode *ip;
+    uint32_t pos;
+    uint16_t flags;                  // VFS_O_*
+    uint16_t refs;                   // descriptors
+};
+
+struct fd_table {
+    struct file *fd[VFS_FDS];
+};
+
+struct vfs_stat {
+    uint64_t ino;
+    uint32_t size;
+    uint8_t attr;                    // FAT_ATTR_*
+};
+
+// Set up the page cache and the kernel's descriptor table
+void vfs_init(void);
+
+// Descriptors index t from now on
+void vfs_set_fd_table(struct fd_table *t);
+
+// Returns a descriptor or a negative error
+int vfs_open(const char *path, int flags);
+int vfs_close(int fd);
+
+// Read or write at the file's position and move it on. Return the count or
+// a negative error.
+int vfs_read(int fd, void *buf, uint32_t len);
+int vfs_write(int fd, const void *buf, uint32_t len);
+
+int vfs_seek(int fd, uint32_t pos);
+int vfs_fstat(int fd, struct vfs_stat *st);
+int vfs_stat(const char *path, struct vfs_stat *st);
+int vfs_unlink(const char *path);
+
+// Walk the directory at path. Start *cookie at 0; returns 1 and fills name
+// (at least FAT_NAME_MAX + 1 bytes) and st per entry, 0 at the end, or a
+// negative error.
+int vfs_readdir(const char *path, uint32_t *cookie, char *name, struct vfs_stat *st);
+
+// Allocate and write out every file's delayed data
+int vfs_sync(void);
+
+// Forget every cached page, once a different volume is mounted
+void vfs_remount(void);
+
+// Map len bytes of fd from offset, a multiple of PAGE_SIZE, into the window
+// of pd, read-only. The range must lie inside the file, though the last
+// page may run past its end and reads as zeros there.
+int vfs_mmap(struct page_directory_entry *pd, int fd, uint32_t offset, uint32_t len, void **addr);
+int vfs_munmap(struct page_directory_entry *pd, void *addr);
+
+// Hold on to the file behind fd so its pages can be had with pcache_get()
+// after fd is closed, as a program's are. 0 if fd isn't open for reading.
+struct inode *vfs_iget(int fd);
+int vfs_iput(struct inode *ip);
+
+// Inodes, files and mappings in use, for the shell
+void vfs_usage(int *inodes, int *files, int *maps);
+
+// Read path with fat_read(), then through the page cache cold and warm,
+// then map it and touch every byte
+void vfs_bench(const char *path);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+
+/*
+ * Legacy (0.9.5) virtio over PCI: the device's registers sit in I/O BAR0
+ * and a virtqueue is one physically contiguous, page-aligned area holding
+ * the descriptor table, the available ring and, on the next page boundary,
+ * the used ring.
+ */
+
+#define VIRTIO_PCI_VENDOR         0x1AF4
+#define VIRTIO_PCI_DEVICE_BLK     0x1001   // transitional block device
+
+// I/O registers, offsets from BAR0
+#define VIRTIO_PCI_HOST_FEATURES  0x00     // 32 bits
+#define VIRTIO_PCI_GUEST_FEATURES 0x04     // 32 bits
+#define VIRTIO_PCI_QUEUE_PFN      0x08     // 32 bits, address >> 12
+#define VIRTIO_PCI_QUEUE_SIZE     0x0C     // 16 bits, read-only
+#define VIRTIO_PCI_QUEUE_SEL      0x0E     // 16 bits
+#define VIRTIO_PCI_QUEUE_NOTIFY   0x10     // 16 bits
+#define VIRTIO_PCI_STATUS         0x12     // 8 bits
+#define VIRTIO_PCI_ISR            0x13     // 8 bits, reading acks the interrupt
+#define VIRTIO_PCI_CONFIG         0x14     // device-specific, without MSI-X
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+#define VIRTIO_RING_F_INDIRECT_DESC  28
+
+#define VIRTQ_ALIGN               4096
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+#define VIRTQ_DESC_F_NEXT         1
+#define VIRTQ_DESC_F_WRITE        2        // device writes, e.g. read data
+#define VIRTQ_DESC_F_INDIRECT     4        // addr points at a descriptor table
+
+struct virtq_avail {
+    uint16_t flags;
+    volatile uint16_t idx;
+    uint16_t ring[];
+};
+
+struct virtq_used_elem {
+    uint32_t id;                           // head of the completed chain
+    uint32_t len;
+};
+
+struct virtq_used {
+    volatile uint16_t flags;
+    volatile uint16_t idx;
+    struct virtq_used_elem ring[];
+};
+
+#define VIRTQ_USED_F_NO_NOTIFY    1
+
+// Layout of a legacy queue of size n: descriptors, available ring, then the
+// used ring on the next VIRTQ_ALIGN boundary
+#define VIRTQ_AVAIL_OFFSET(n)  (16 * (n))
+#define VIRTQ_USED_OFFSET(n)   ((16 * (n) + 6 + 2 * (n) + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1))
+#define VIRTQ_BYTES(n)         (VIRTQ_USED_OFFSET(n) + 6 + 8 * (n))
+
+#endif
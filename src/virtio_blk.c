@@ -0,0 +1,218 @@
+// virtio_blk.c
+//
+// One virtqueue and VIRTIO_BLK_DEPTH request slots. A slot owns its
+// request's header and status byte and, when the device takes indirect
+// descriptors, a three-entry descriptor table, so each request uses one
+// ring descriptor (slot i uses descriptor i). Without them slot i chains
+// ring descriptors 3i..3i+2 instead.
+
+#include <stdint.h>
+#include "virtio.h"
+#include "virtio_blk.h"
+#include "blkdev.h"
+#include "pci.h"
+#include "interrupt.h"
+
+struct vblk_hdr {
+    uint32_t type;                   // VIRTIO_BLK_T_*
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+struct vblk_slot {
+    struct virtq_desc table[3];      // header, data, status
+    struct vblk_hdr hdr;
+    volatile uint8_t status;
+    struct blk_request *req;
+} __attribute__((aligned(16)));
+
+static uint8_t vq_mem[VIRTQ_BYTES(VIRTIO_BLK_QUEUE_MAX)] __attribute__((aligned(VIRTQ_ALIGN)));
+static struct virtq_desc *desc;
+static struct virtq_avail *avail;
+static struct virtq_used *used;
+static uint16_t qsize;
+static uint16_t last_used;           // next used ring entry to look at
+
+static uint16_t io;
+static int has_flush;
+static struct vblk_slot slots[VIRTIO_BLK_DEPTH];
+static uint32_t free_slots;          // bitmap
+static uint32_t inflight;
+static struct virtio_blk_stats stats;
+
+static int vblk_submit(struct blkdev *dev, struct blk_request *req);
+static void vblk_idle(struct blkdev *dev);
+
+static struct blkdev vblk_dev = {
+    .name = "vda",
+    .depth = VIRTIO_BLK_DEPTH,
+    .max_sectors = 256,
+    .submit = vblk_submit,
+    .idle = vblk_idle,
+};
+
+// Hand every request the device has finished back to its owner. Runs with
+// interrupts off.
+static void vblk_complete(void) {
+    while (last_used != used->idx) {
+        struct virtq_used_elem *e = &used->ring[last_used % qsize];
+        int i = stats.indirect ? e->id : e->id / 3;
+        struct blk_request *req = slots[i].req;
+
+        last_used++;
+        free_slots |= 1u << i;
+        inflight--;
+        if (slots[i].status == VIRTIO_BLK_S_OK) {
+            req->status = ATA_OK;
+        } else {
+            stats.errors++;
+            req->status = ATA_EIO;
+        }
+        if (req->done)
+            req->done(req);
+    }
+}
+
+static void vblk_irq(void) {
+    stats.irqs++;
+    inb(io + VIRTIO_PCI_ISR);        // acks and lowers the line
+    vblk_complete();
+}
+
+// Also covers a device whose interrupt line we have no ISR for
+static void vblk_idle(struct blkdev *dev) {
+    uint32_t flags = irq_save();
+
+    vblk_complete();
+    irq_restore(flags);
+}
+
+static int vblk_submit(struct blkdev *dev, struct blk_request *req) {
+    struct vblk_slot *s;
+    struct virtq_desc *t;
+    uint16_t base, head;
+    int i = 0, n = 0;
+
+    if (req->op == ATA_OP_FLUSH && !has_flush) {
+        // Nothing to flush: the device writes through
+        req->status = ATA_OK;
+        if (req->done)
+            req->done(req);
+        return ATA_OK;
+    }
+    if (!free_slots)
+        return ATA_EINVAL;
+    while (!(free_slots & (1u << i)))
+        i++;
+    free_slots &= ~(1u << i);
+    s = &slots[i];
+
+    s->req = req;
+    s->status = 0xFF;
+    s->hdr.type = req->op == ATA_OP_READ ? VIRTIO_BLK_T_IN :
+                  req->op == ATA_OP_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_FLUSH;
+    s->hdr.reserved = 0;
+    s->hdr.sector = req->op == ATA_OP_FLUSH ? 0 : req->lba;
+
+    // Descriptor numbers in a chain are indexes into the table it lives in
+    t = stats.indirect ? s->table : &desc[3 * i];
+    base = stats.indirect ? 0 : 3 * i;
+    t[n].addr = (uint32_t)&s->hdr;
+    t[n].len = sizeof(s->hdr);
+    t[n].flags = VIRTQ_DESC_F_NEXT;
+    t[n].next = base + n + 1;
+    n++;
+    if (req->op != ATA_OP_FLUSH) {
+        t[n].addr = (uint32_t)req->buf;
+        t[n].len = req->count * ATA_SECTOR_SIZE;
+        t[n].flags = VIRTQ_DESC_F_NEXT | (req->op == ATA_OP_READ ? VIRTQ_DESC_F_WRITE : 0);
+        t[n].next = base + n + 1;
+        n++;
+    }
+    t[n].addr = (uint32_t)&s->status;
+    t[n].len = 1;
+    t[n].flags = VIRTQ_DESC_F_WRITE;
+    t[n].next = 0;
+    n++;
+
+    if (stats.indirect) {
+        desc[i].addr = (uint32_t)s->table;
+        desc[i].len = n * sizeof(struct virtq_desc);
+        desc[i].flags = VIRTQ_DESC_F_INDIRECT;
+        head = i;
+    } else {
+        head = base;
+    }
+
+    avail->ring[avail->idx % qsize] = head;
+    // The device may look at idx as soon as it changes, so the ring entry
+    // and descriptors have to be in memory first. x86 keeps stores in
+    // order; this only stops the compiler moving them.
+    asm volatile("" : : : "memory");
+    avail->idx++;
+    asm volatile("" : : : "memory");
+    if (!(used->flags & VIRTQ_USED_F_NO_NOTIFY)) {
+        outw(io + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+        stats.notifies++;
+    }
+
+    stats.requests++;
+    stats.sectors += req->count;
+    if (++inflight > stats.max_inflight)
+        stats.max_inflight = inflight;
+    return ATA_OK;
+}
+
+int virtio_blk_init(void) {
+    struct pci_device *d = pci_find_device(VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE_BLK);
+    uint32_t features, want = 0, lo, hi;
+
+    if (!d || !(io = pci_bar_io(d, 0)))
+        return ATA_ENODEV;
+    pci_enable(d, PCI_CMD_IO | PCI_CMD_MASTER);
+
+    outb(io + VIRTIO_PCI_STATUS, 0);                 // reset
+    outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    features = inl(io + VIRTIO_PCI_HOST_FEATURES);
+    if (features & (1u << VIRTIO_RING_F_INDIRECT_DESC))
+        want |= 1u << VIRTIO_RING_F_INDIRECT_DESC;
+    if (features & (1u << VIRTIO_BLK_F_FLUSH))
+        want |= 1u << VIRTIO_BLK_F_FLUSH;
+    outl(io + VIRTIO_PCI_GUEST_FEATURES, want);
+    stats.indirect = (want >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+    has_flush = (want >> VIRTIO_BLK_F_FLUSH) & 1;
+
+    outw(io + VIRTIO_PCI_QUEUE_SEL, 0);
+    qsize = inw(io + VIRTIO_PCI_QUEUE_SIZE);
+    if (qsize == 0 || qsize > VIRTIO_BLK_QUEUE_MAX ||
+        qsize < (stats.indirect ? VIRTIO_BLK_DEPTH : 3 * VIRTIO_BLK_DEPTH)) {
+        outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return ATA_ENODEV;
+    }
+    // vq_mem is in .bss, so the rings start out zeroed
+    desc = (struct virtq_desc *)vq_mem;
+    avail = (struct virtq_avail *)(vq_mem + VIRTQ_AVAIL_OFFSET(qsize));
+    used = (struct virtq_used *)(vq_mem + VIRTQ_USED_OFFSET(qsize));
+    last_used = 0;
+    outl(io + VIRTIO_PCI_QUEUE_PFN, (uint32_t)vq_mem / VIRTQ_ALIGN);
+    stats.queue_size = qsize;
+    free_slots = (1u << VIRTIO_BLK_DEPTH) - 1;
+
+    // Capacity in 512-byte sectors, clamped like ATA's to 2^32-1
+    lo = inl(io + VIRTIO_PCI_CONFIG);
+    hi = inl(io + VIRTIO_PCI_CONFIG + 4);
+    vblk_dev.sectors = hi ? 0xFFFFFFFF : lo;
+
+    if (irq_install(d->irq, vblk_irq) == 0)
+        stats.irq = d->irq;
+    outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+         VIRTIO_STATUS_DRIVER_OK);
+    blkdev_register(&vblk_dev);
+    return ATA_OK;
+}
+
+const struct virtio_blk_stats *virtio_blk_get_stats(void) {
+    return &stats;
+}
@@ -0,0 +1,44 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+
+/*
+ * virtio-blk over legacy virtio-pci, registered with the block layer as
+ * vda. QEMU provides it with -drive if=virtio.
+ */
+
+// Feature bits
+#define VIRTIO_BLK_F_RO           5
+#define VIRTIO_BLK_F_FLUSH        9
+
+// Request types
+#define VIRTIO_BLK_T_IN           0
+#define VIRTIO_BLK_T_OUT          1
+#define VIRTIO_BLK_T_FLUSH        4
+
+#define VIRTIO_BLK_S_OK           0
+
+// Largest queue we lay out, and how many requests we keep on it
+#define VIRTIO_BLK_QUEUE_MAX      256
+#define VIRTIO_BLK_DEPTH          16
+
+struct virtio_blk_stats {
+    uint32_t requests;
+    uint32_t sectors;
+    uint32_t errors;
+    uint32_t notifies;               // queue kicks
+    uint32_t irqs;
+    uint32_t max_inflight;
+    uint16_t queue_size;
+    uint8_t indirect;                // indirect descriptors negotiated
+    uint8_t irq;                     // PIC line, 0 if completions are polled
+};
+
+// Find the first virtio-blk function, set it up and register it.
+// ATA_ENODEV if there is none.
+int virtio_blk_init(void);
+
+const struct virtio_blk_stats *virtio_blk_get_stats(void);
+
+#endif
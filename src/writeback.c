@@ -0,0 +1,249 @@
+// writeback.c
+//
+// Dirty sectors live in fixed slots found through a small hash on LBA. A
+// flush sorts the dirty slots by LBA, gathers each run of adjacent sectors
+// into a staging buffer and writes it with a single ATA command.
+
+#include <stdint.h>
+#include "writeback.h"
+#include "ide.h"
+#include "blkq.h"
+#include "timer.h"
+#include "tsc.h"
+#include "page.h"
+#include "rprintf.h"
+#include "console.h"
+
+#define WB_NONE  -1
+#define WB_BENCH_LBA 2048           // start of the FAT partition
+
+struct wb_slot {
+    uint32_t lba;
+    int16_t next;                   // hash chain, or free list when unused
+    uint8_t used;
+};
+
+static struct wb_slot slots[WB_SLOTS];
+static uint8_t slot_data[WB_SLOTS][ATA_SECTOR_SIZE];
+static int16_t hash[WB_HASH];
+static int16_t free_slots;
+static uint32_t dirty_since;        // tick the oldest dirty sector was written
+
+static uint8_t run_buf[WB_MAX_RUN * ATA_SECTOR_SIZE];
+static int16_t order[WB_SLOTS];
+
+static struct wb_stats stats;
+static struct timer_work expire_work;
+static void (*flush_hook)(void) = 0;
+
+static void memcpy512(void *dst, const void *src) {
+    uint32_t *d = dst;
+    const uint32_t *s = src;
+
+    for (int i = 0; i < ATA_SECTOR_SIZE / 4; i++)
+        d[i] = s[i];
+}
+
+static int wb_find(uint32_t lba) {
+    int i = hash[lba & (WB_HASH - 1)];
+
+    while (i != WB_NONE && slots[i].lba != lba)
+        i = slots[i].next;
+    return i;
+}
+
+static int wb_alloc(uint32_t lba) {
+    int i = free_slots;
+    int16_t *bucket = &hash[lba & (WB_HASH - 1)];
+
+    if (i == WB_NONE)
+        return WB_NONE;
+    free_slots = slots[i].next;
+    slots[i].lba = lba;
+    slots[i].used = 1;
+    slots[i].next = *bucket;
+    *bucket = i;
+    if (stats.dirty++ == 0)
+        dirty_since = timer_ticks;
+    return i;
+}
+
+static void wb_release(int i) {
+    int16_t *p = &hash[slots[i].lba & (WB_HASH - 1)];
+
+    while (*p != i)
+        p = &slots[*p].next;
+    *p = slots[i].next;
+    slots[i].used = 0;
+    slots[i].next = free_slots;
+    free_slots = i;
+    stats.dirty--;
+}
+
+static void wb_expire(void) {
+    if (stats.dirty && timer_ticks - dirty_since >= timer_ms_to_ticks(WB_EXPIRE_MS))
+        wb_flush();
+}
+
+void wb_init(void) {
+    for (int i = 0; i < WB_HASH; i++)
+        hash[i] = WB_NONE;
+    for (int i = 0; i < WB_SLOTS; i++) {
+        slots[i].used = 0;
+        slots[i].next = (i + 1 < WB_SLOTS) ? i + 1 : WB_NONE;
+    }
+    free_slots = 0;
+    stats.dirty = 0;
+    timer_every(&expire_work, WB_CHECK_MS, wb_expire);
+}
+
+uint32_t wb_overlay(uint32_t lba, uint8_t *buf, uint32_t count) {
+    uint32_t hits = 0;
+
+    if (!stats.dirty)
+        return 0;
+    for (uint32_t k = 0; k < count; k++) {
+        int i = wb_find(lba + k);
+        if (i != WB_NONE) {
+            memcpy512(buf + k * ATA_SECTOR_SIZE, slot_data[i]);
+            hits++;
+        }
+    }
+    stats.read_hits += hits;
+    return hits;
+}
+
+int wb_read(uint32_t lba, uint8_t *buf, uint32_t count) {
+    int rc = blkq_read(lba, buf, count);
+
+    if (rc != ATA_OK)
+        return rc;
+    wb_overlay(lba, buf, count);
+    return ATA_OK;
+}
+
+int wb_write(uint32_t lba, const uint8_t *buf, uint32_t count) {
+    for (uint32_t k = 0; k < count; k++) {
+        int i = wb_find(lba + k);
+        int rc;
+
+        if (i != WB_NONE) {
+            stats.absorbed++;
+        } else if ((i = wb_alloc(lba + k)) == WB_NONE) {
+            if ((rc = wb_flush()) != ATA_OK)
+                return rc;
+            i = wb_alloc(lba + k);
+        }
+        memcpy512(slot_data[i], buf + k * ATA_SECTOR_SIZE);
+        stats.writes++;
+    }
+    return ATA_OK;
+}
+
+int wb_flush(void) {
+    int n = 0;
+
+    if (!stats.dirty)
+        return ATA_OK;
+    stats.flushes++;
+    if (flush_hook)
+        flush_hook();
+
+    // Insertion sort of the dirty slots by LBA; there are at most WB_SLOTS
+    for (int i = 0; i < WB_SLOTS; i++) {
+        int j;
+        if (!slots[i].used)
+            continue;
+        for (j = n; j > 0 && slots[order[j - 1]].lba > slots[i].lba; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+        n++;
+    }
+
+    for (int start = 0; start < n; ) {
+        int len = 1, rc;
+
+        while (start + len < n && len < WB_MAX_RUN &&
+               slots[order[start + len]].lba == slots[order[start]].lba + len)
+            len++;
+        for (int k = 0; k < len; k++)
+            memcpy512(run_buf + k * ATA_SECTOR_SIZE, slot_data[order[start + k]]);
+
+        rc = blkq_write(slots[order[start]].lba, run_buf, len);
+        if (rc != ATA_OK) {
+            // Leave the rest dirty for the next attempt
+            stats.errors++;
+            return rc;
+        }
+        for (int k = 0; k < len; k++)
+            wb_release(order[start + k]);
+        stats.runs++;
+        stats.sectors += len;
+        start += len;
+    }
+    return ATA_OK;
+}
+
+void wb_set_flush_hook(void (*fn)(void)) {
+    flush_hook = fn;
+}
+
+int wb_sync(void) {
+    int rc = wb_flush();
+
+    if (rc != ATA_OK)
+        return rc;
+    stats.syncs++;
+    if ((rc = blkq_flush()) != ATA_OK)
+        stats.errors++;
+    return rc;
+}
+
+const struct wb_stats *wb_get_stats(void) {
+    return &stats;
+}
+
+void wb_bench(unsigned int count) {
+    struct ppage *frame;
+    uint8_t *buf;
+    uint64_t t0, direct, buffered;
+    int rc;
+
+    if (count > WB_SLOTS)
+        count = WB_SLOTS;
+    if (!(frame = allocate_physical_pages(1))) {
+        esp_printf(kputc, "no free frame for the bench buffer\n");
+        return;
+    }
+    buf = frame->physical_addr;
+
+    // Write back what is already there, so the bench never changes the disk
+    wb_sync();
+    if ((rc = blkq_read(WB_BENCH_LBA, buf, count)) != ATA_OK) {
+        esp_printf(kputc, "read failed: %d\n", rc);
+        goto out;
+    }
+
+    t0 = rdtsc();
+    for (unsigned int k = 0; k < count && rc == ATA_OK; k++)
+        rc = blkq_write(WB_BENCH_LBA + k, buf + k * ATA_SECTOR_SIZE, 1);
+    if (rc == ATA_OK)
+        rc = blkq_flush();
+    direct = rdtsc() - t0;
+
+    t0 = rdtsc();
+    for (unsigned int k = 0; k < count && rc == ATA_OK; k++)
+        rc = wb_write(WB_BENCH_LBA + k, buf + k * ATA_SECTOR_SIZE, 1);
+    if (rc == ATA_OK)
+        rc = wb_sync();
+    buffered = rdtsc() - t0;
+
+    if (rc != ATA_OK) {
+        esp_printf(kputc, "write failed: %d\n", rc);
+        goto out;
+    }
+    esp_printf(kputc, "%d single-sector writes + flush: direct %d us, write-back %d us\n",
+               count, tsc_to_us(direct), tsc_to_us(buffered));
+out:
+    free_physical_pages(frame);
+}
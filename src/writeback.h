@@ -0,0 +1,64 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdint.h>
+
+/*
+ * Write-back layer over the block queue. wb_write() only copies the sectors
+ * into dirty slots; they reach the disk when a flush sorts them by LBA and
+ * writes every run of adjacent sectors with one command. Flushes happen
+ * when the slots run out, when dirty data gets older than WB_EXPIRE_MS, and
+ * on wb_sync(), which also issues FLUSH CACHE.
+ *
+ * All functions return ATA_* codes.
+ */
+
+#define WB_SLOTS       128        // dirty sectors held, 64 KiB
+#define WB_HASH        64         // must be a power of two
+#define WB_MAX_RUN     64         // sectors per coalesced write
+#define WB_EXPIRE_MS   1000
+#define WB_CHECK_MS    250        // how often the expiry is checked
+
+struct wb_stats {
+    uint32_t writes;              // sectors passed to wb_write()
+    uint32_t absorbed;            // of those, overwrites of a still-dirty sector
+    uint32_t read_hits;           // sectors wb_read() served from dirty slots
+    uint32_t flushes;
+    uint32_t runs;                // disk writes issued by flushes
+    uint32_t sectors;             // sectors written by flushes
+    uint32_t syncs;               // FLUSH CACHE commands issued
+    uint32_t errors;
+    uint32_t dirty;               // sectors dirty right now
+};
+
+// Set up the slots and the expiry timer. Call after blkq_init().
+void wb_init(void);
+
+// Read through the dirty slots, so callers see their own unflushed writes
+int wb_read(uint32_t lba, uint8_t *buf, uint32_t count);
+
+// Copy any dirty sectors in the range over buf, for callers that read the
+// disk themselves. Returns how many were copied.
+uint32_t wb_overlay(uint32_t lba, uint8_t *buf, uint32_t count);
+
+// Copy count sectors into dirty slots
+int wb_write(uint32_t lba, const uint8_t *buf, uint32_t count);
+
+// Write every dirty sector out, coalescing adjacent ones
+int wb_flush(void);
+
+// Called at the start of every flush, before any dirty sector is dropped.
+// A cache with reads in flight uses it to merge dirty data into them while
+// it's still here.
+void wb_set_flush_hook(void (*fn)(void));
+
+// wb_flush() then FLUSH CACHE: a durability point
+int wb_sync(void);
+
+const struct wb_stats *wb_get_stats(void);
+
+// Rewrite count sectors one command at a time, then through the write-back
+// layer, and report both
+void wb_bench(unsigned int count);
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * fatfuzz.c
+ *
+ * Fuzzes the kernel's FAT parsing (fat_parse.c) with disk images: finds the
+ * volume the way fat_mount() does, checks the geometry fat_parse_boot()
+ * accepts, and walks the root directory through fat_dirent_step(). Anything
+ * that reads outside the image, overruns a name or accepts a layout that
+ * doesn't add up stops the run.
+ *
+ *   fatfuzz [-n runs] [-s seed] image...
+ *
+ * Each image runs as it is, then n times with a few bytes changed in its
+ * MBR, boot sector or root directory, where the parser looks. A failing
+ * input is written to fatfuzz-crash.img. Only the first FUZZ_MAX bytes of
+ * an image are used, so rootfs.img works as a seed.
+ *
+ * Built with -DFUZZ_LIBFUZZER (make fuzz-clang), main() is left to
+ * libFuzzer and the same checks run under its mutator and ASan.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "fat.h"
+#include "ide.h"
+
+#define FUZZ_MAX   (4 * 1024 * 1024)
+#define CANARY     0x5A
+
+static const uint8_t *image;
+static size_t image_size;
+static long mounted, entries;
+
+static const void *sector(uint32_t lba) {
+    if ((uint64_t)(lba + 1ull) * ATA_SECTOR_SIZE > image_size)
+        return NULL;
+    return image + (size_t)lba * ATA_SECTOR_SIZE;
+}
+
+static void fail(const char *why) {
+    FILE *f = fopen("fatfuzz-crash.img", "wb");
+
+    if (f) {
+        fwrite(image, 1, image_size, f);
+        fclose(f);
+    }
+    fflush(stdout);
+    fprintf(stderr, "fatfuzz: %s (input in fatfuzz-crash.img)\n", why);
+    abort();
+}
+
+static void check_geometry(const struct fat_geometry *g) {
+    if (g->fat_lba <= g->lba || g->root_lba < g->fat_lba || g->data_lba < g->root_lba)
+        fail("regions out of order");
+    if (g->clusters < FAT16_MIN_CLUSTERS || g->clusters > FAT32_MAX_CLUSTERS)
+        fail("cluster count out of range");
+    if (g->fat32 != (g->clusters > FAT16_MAX_CLUSTERS) || g->fat32 != (g->root_entries == 0))
+        fail("FAT type doesn't match the layout");
+    if (!g->nfats || !g->spc || (g->spc & (g->spc - 1)))
+        fail("bad FAT count or cluster size");
+    if ((uint64_t)g->fat_sectors * (ATA_SECTOR_SIZE / (g->fat32 ? 4 : 2)) < g->clusters + 2)
+        fail("FAT too small for the clusters");
+    if (g->fat32 && (g->root_dir < 2 || g->root_dir >= g->clusters + 2))
+        fail("root cluster out of range");
+    if (g->fsinfo_lba && (g->fsinfo_lba <= g->lba || g->fsinfo_lba >= g->fat_lba))
+        fail("FSInfo outside the reserved sectors");
+    if (g->label[11] != '\0')
+        fail("label not terminated");
+}
+
+static void walk_root(const struct fat_geometry *g) {
+    const uint32_t per = ATA_SECTOR_SIZE / sizeof(struct root_directory_entry);
+    uint32_t lba = g->fat32 ? g->data_lba + (g->root_dir - 2) * g->spc : g->root_lba;
+    uint32_t n = g->fat32 ? g->spc * per : g->root_entries;
+    struct fat_lfn_state s = { -1, 0, 0 };
+    char name[FAT_NAME_MAX + 1 + 16];
+
+    memset(name, CANARY, sizeof(name));
+    for (uint32_t i = 0; i < n; i++) {
+        const struct root_directory_entry *de = sector(lba + i / per);
+        uint32_t first = ~0u;
+        int rc;
+
+        if (!de)
+            return;
+        rc = fat_dirent_step(&s, de + i % per, i, name, &first);
+        for (size_t k = FAT_NAME_MAX + 1; k < sizeof(name); k++)
+            if ((uint8_t)name[k] != CANARY)
+                fail("name written past FAT_NAME_MAX");
+        if (rc == FAT_DIRENT_END)
+            return;
+        if (rc == FAT_DIRENT_FILE) {
+            if (!memchr(name, 0, FAT_NAME_MAX + 1))
+                fail("name not terminated");
+            if (first > i)
+                fail("name starts after its entry");
+            entries++;
+        } else if (rc != FAT_DIRENT_SKIP) {
+            fail("unknown fat_dirent_step() result");
+        }
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    const struct boot_sector *bs;
+    struct fat_geometry g;
+    uint32_t lba = 0;
+
+    image = data;
+    image_size = size;
+    if (!(bs = sector(0)))
+        return 0;
+    if (!fat_is_boot_sector(bs)) {
+        if (fat_find_partition(bs, &lba) != ATA_OK || !(bs = sector(lba)))
+            return 0;
+    }
+    if (fat_parse_boot(bs, lba, &g) != ATA_OK)
+        return 0;
+    mounted++;
+    check_geometry(&g);
+    walk_root(&g);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+static uint32_t rng = 2463534242u;
+
+static uint32_t xorshift(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// Where the parser reads in the unchanged image: sector 0, the volume's
+// boot sector and the first sectors of its root directory
+static void targets(const uint8_t *data, size_t size, size_t t[3]) {
+    const struct boot_sector *bs = (const struct boot_sector *)data;
+    struct fat_geometry g;
+    uint32_t lba = 0;
+
+    t[0] = t[1] = t[2] = 0;
+    image = data;
+    image_size = size;
+    if (!fat_is_boot_sector(bs) && (fat_find_partition(bs, &lba) != ATA_OK || !(bs = sector(lba))))
+        return;
+    t[1] = (size_t)lba * ATA_SECTOR_SIZE;
+    if (fat_parse_boot(bs, lba, &g) == ATA_OK)
+        t[2] = (size_t)(g.fat32 ? g.data_lba + (g.root_dir - 2) * g.spc : g.root_lba) * ATA_SECTOR_SIZE;
+}
+
+static size_t pick(const size_t t[3], size_t size) {
+    uint32_t r = xorshift();
+    size_t at;
+
+    switch (r % 4) {
+    case 0:  at = t[0] + (r >> 2) % ATA_SECTOR_SIZE; break;
+    case 1:  at = t[1] + (r >> 2) % ATA_SECTOR_SIZE; break;
+    case 2:  at = t[2] + (r >> 2) % (4 * ATA_SECTOR_SIZE); break;
+    default: at = (r >> 2) % size; break;
+    }
+    return at < size ? at : (r >> 2) % size;
+}
+
+int main(int argc, char **argv) {
+    long runs = 100000;
+    int files = 0;
+
+    for (int i = 1; i < argc; i++) {
+        uint8_t *seed;
+        size_t size, t[3], at[8];
+        FILE *f;
+
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            runs = atol(argv[++i]);
+            continue;
+        }
+        if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            rng = strtoul(argv[++i], NULL, 0) | 1;
+            continue;
+        }
+        if (!(f = fopen(argv[i], "rb"))) {
+            perror(argv[i]);
+            return 1;
+        }
+        seed = malloc(FUZZ_MAX);
+        size = fread(seed, 1, FUZZ_MAX, f);
+        fclose(f);
+        if (!size) {
+            fprintf(stderr, "%s: empty\n", argv[i]);
+            return 1;
+        }
+        files++;
+        mounted = entries = 0;
+        LLVMFuzzerTestOneInput(seed, size);
+        printf("%s: %s, %ld root entries\n", argv[i], mounted ? "mounts" : "doesn't mount", entries);
+        targets(seed, size, t);
+        mounted = entries = 0;
+        for (long r = 0; r < runs; r++) {
+            int flips = 1 + xorshift() % 8;
+            uint8_t was[8];
+
+            // Changed in place and put back, rather than copying the image
+            for (int k = 0; k < flips; k++) {
+                at[k] = pick(t, size);
+                was[k] = seed[at[k]];
+                seed[at[k]] = xorshift();
+            }
+            LLVMFuzzerTestOneInput(seed, size);
+            for (int k = flips - 1; k >= 0; k--)
+                seed[at[k]] = was[k];
+        }
+        printf("%s: %ld mutated runs, %ld mounted, %ld entries parsed\n", argv[i], runs, mounted, entries);
+        free(seed);
+    }
+    if (!files) {
+        fprintf(stderr, "usage: %s [-n runs] [-s seed] image...\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * hostbench.c
+ *
+ * The kernel's frame allocator, formatter and FAT parsing, timed on the
+ * host against libkcore.a (make hostlib). Millions of operations take
+ * seconds here instead of a boot in QEMU, and perf or gprof can see inside
+ * them.
+ *
+ *   hostbench [-n ops] [alloc|mix|printf|fatboot|fatdir ...]
+ *
+ * With no names, everything runs. Each prints nanoseconds per operation.
+ * mix also checks that the allocator ends with every frame it started with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "page.h"
+#include "rprintf.h"
+#include "fat.h"
+#include "ide.h"
+
+#define MIX_SLOTS 32
+
+static uint32_t rng = 2463534242u;
+
+static uint32_t xorshift(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, long ops, double t0) {
+    printf("%-8s %10ld ops %8.1f ns/op\n", name, ops, (now_ns() - t0) / ops);
+}
+
+static void bench_alloc(long n) {
+    double t0 = now_ns();
+
+    for (long i = 0; i < n; i++)
+        free_physical_pages(allocate_physical_pages(1));
+    report("alloc", n, t0);
+}
+
+// Lists of 1 to 4 frames taken and given back in random order, as the
+// kernel's users do, then a check that nothing went missing
+static void bench_mix(long n) {
+    struct ppage *slot[MIX_SLOTS] = { 0 };
+    struct pfa_stats before, after;
+    double t0;
+
+    pfa_get_stats(&before);
+    t0 = now_ns();
+    for (long i = 0; i < n; i++) {
+        uint32_t r = xorshift();
+        struct ppage **s = &slot[r % MIX_SLOTS];
+
+        if (*s) {
+            free_physical_pages(*s);
+            *s = 0;
+        } else {
+            *s = allocate_physical_pages(1 + (r >> 8) % 4);
+        }
+    }
+    report("mix", n, t0);
+    for (int i = 0; i < MIX_SLOTS; i++)
+        free_physical_pages(slot[i]);
+    pfa_get_stats(&after);
+    if (after.free != before.free) {
+        fprintf(stderr, "mix: %u frames free after, %u before\n", after.free, before.free);
+        exit(1);
+    }
+}
+
+static long printed;
+
+static int count_putc(int c) {
+    printed++;
+    return c;
+}
+
+static void bench_printf(long n) {
+    double t0 = now_ns();
+
+    for (long i = 0; i < n; i++)
+        esp_printf(count_putc, "Line %d: 0x%x %s %c\n", (int)i, 0xdeadbeef, "scroll", '!');
+    report("printf", n, t0);
+    if (!printed)
+        exit(1);
+}
+
+// A 31 MiB FAT16 volume, the shape mkfs.vfat gives rootfs.img's
+static void make_boot_sector(struct boot_sector *bs) {
+    memset(bs, 0, sizeof(*bs));
+    bs->bytes_per_sector = ATA_SECTOR_SIZE;
+    bs->num_sectors_per_cluster = 4;
+    bs->num_reserved_sectors = 4;
+    bs->num_fat_tables = 2;
+    bs->num_root_dir_entries = 512;
+    bs->total_sectors_in_fs = 63488;
+    bs->num_sectors_per_fat = 64;
+    memcpy(bs->volume_label, "HOSTBENCH  ", 11);
+    bs->boot_signature = 0xAA55;
+}
+
+static void bench_fatboot(long n) {
+    struct boot_sector bs;
+    struct fat_geometry g;
+    double t0;
+
+    make_boot_sector(&bs);
+    t0 = now_ns();
+    for (long i = 0; i < n; i++) {
+        bs.num_reserved_sectors = 4 + (i & 3);
+        if (fat_parse_boot(&bs, 2048, &g) != ATA_OK) {
+            fprintf(stderr, "fatboot: the boot sector doesn't parse\n");
+            exit(1);
+        }
+    }
+    report("fatboot", n, t0);
+}
+
+// A sector of directory: a two-part long name and its 8.3 entry, repeated
+static void make_dir(struct root_directory_entry *dir, int n) {
+    static const char *lfn = "A long file name.txt";
+    const char *key = "ALONGF~1TXT";
+
+    memset(dir, 0, n * sizeof(*dir));
+    for (int i = 0; i + 3 <= n; i += 3) {
+        for (int part = 2; part >= 1; part--) {
+            struct fat_lfn_entry *l = (struct fat_lfn_entry *)&dir[i + 2 - part];
+            uint16_t c[FAT_LFN_CHARS];
+
+            for (int k = 0; k < FAT_LFN_CHARS; k++) {
+                int pos = (part - 1) * FAT_LFN_CHARS + k;
+                int len = strlen(lfn);
+
+                c[k] = pos < len ? lfn[pos] : pos == len ? 0 : 0xFFFF;
+            }
+            l->seq = part | (part == 2 ? FAT_LFN_LAST : 0);
+            memcpy(l->name1, c, sizeof(l->name1));
+            memcpy(l->name2, c + 5, sizeof(l->name2));
+            memcpy(l->name3, c + 11, sizeof(l->name3));
+            l->attribute = FAT_ATTR_LFN;
+            l->checksum = fat_lfn_checksum(key);
+        }
+        memcpy(dir[i + 2].file_name, key, 11);
+        dir[i + 2].attribute = FAT_ATTR_ARCHIVE;
+    }
+}
+
+static void bench_fatdir(long n) {
+    struct root_directory_entry dir[ATA_SECTOR_SIZE / sizeof(struct root_directory_entry)];
+    const int per = sizeof(dir) / sizeof(dir[0]);
+    char name[FAT_NAME_MAX + 1];
+    struct fat_lfn_state s = { -1, 0, 0 };
+    uint32_t first;
+    long files = 0;
+    double t0;
+
+    make_dir(dir, per);
+    t0 = now_ns();
+    for (long i = 0; i < n; i++) {
+        if (fat_dirent_step(&s, &dir[i % per], i % per, name, &first) == FAT_DIRENT_FILE)
+            files++;
+    }
+    report("fatdir", n, t0);
+    if (files && strcmp(name, "A long file name.txt")) {
+        fprintf(stderr, "fatdir: read back \"%s\"\n", name);
+        exit(1);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*run)(long n);
+} benches[] = {
+    { "alloc",   bench_alloc },
+    { "mix",     bench_mix },
+    { "printf",  bench_printf },
+    { "fatboot", bench_fatboot },
+    { "fatdir",  bench_fatdir },
+};
+
+#define NBENCHES (sizeof(benches) / sizeof(benches[0]))
+
+int main(int argc, char **argv) {
+    long n = 10000000;
+    int named = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            n = atol(argv[++i]);
+        else
+            named = 1;
+    }
+    if (n < 1) {
+        fprintf(stderr, "usage: %s [-n ops] [alloc|mix|printf|fatboot|fatdir ...]\n", argv[0]);
+        return 1;
+    }
+    init_pfa_list();
+    for (size_t b = 0; b < NBENCHES; b++) {
+        int run = !named;
+
+        for (int i = 1; i < argc; i++) {
+            if (!strcmp(argv[i], "-n"))
+                i++;
+            else if (!strcmp(argv[i], benches[b].name))
+                run = 1;
+        }
+        if (run)
+            benches[b].run(n);
+    }
+    return 0;
+}
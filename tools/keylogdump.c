@@ -0,0 +1,152 @@
+/*
+ * keylogdump.c
+ *
+ * Host-side decoder for the binary keystroke log written by keylogger.c.
+ * Accepts either a raw serial capture (make run writes serial.bin) or a
+ * KEYLOG.BIN copied off the FAT volume with mcopy. Prints one CSV line per
+ * record.
+ *
+ * KEYLOG.BIN keeps every boot's log, one after another, each numbering its
+ * sectors from 0. A sector numbered below the one before it, or one whose
+ * first record differs from an earlier copy's, starts the next boot; the
+ * boot column counts them from 0.
+ *
+ *   keylogdump [-m cpu_mhz] file
+ *
+ * With -m, timestamps are printed in milliseconds relative to the first
+ * record instead of raw TSC cycles.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "keylogger.h"
+
+#define MAX_SECTORS 65536
+
+static struct keylog_sector *sectors[MAX_SECTORS];
+
+static const char *key_name(uint16_t key) {
+    static char buf[8];
+
+    if (key == 0)
+        return "";
+    if (key == '\n')
+        return "\\n";
+    if (key == '\t')
+        return "\\t";
+    if (key == '\b')
+        return "\\b";
+    if (key == ',')
+        return "comma";
+    if (key >= 0x20 && key < 0x7f) {
+        buf[0] = key;
+        buf[1] = 0;
+        return buf;
+    }
+    if (key < 0x20) {
+        snprintf(buf, sizeof(buf), "^%c", key + '@');
+        return buf;
+    }
+    snprintf(buf, sizeof(buf), "0x%03x", key);
+    return buf;
+}
+
+// Print the records of one boot's sectors, then forget them
+static void print_boot(int boot, double mhz) {
+    uint64_t t0 = 0;
+    int have_t0 = 0;
+    uint32_t expect = 0;
+
+    for (uint32_t n = 0; n < MAX_SECTORS; n++) {
+        struct keylog_sector *s = sectors[n];
+        if (!s)
+            continue;
+        sectors[n] = NULL;
+        for (int i = 0; i < s->count; i++) {
+            struct keylog_record *r = &s->rec[i];
+
+            if (have_t0 && r->seq != expect)
+                fprintf(stderr, "boot %d: gap: expected record %u, got %u\n", boot, expect, r->seq);
+            expect = r->seq + 1;
+
+            if (!have_t0) {
+                t0 = r->tsc;
+                have_t0 = 1;
+            }
+            if (mhz > 0)
+                printf("%d,%u,%.3f,", boot, r->seq, (double)(r->tsc - t0) / (mhz * 1000.0));
+            else
+                printf("%d,%u,%llu,", boot, r->seq, (unsigned long long)r->tsc);
+            printf("0x%02x,%s,%s%s%s%s\n", r->scancode, key_name(r->key),
+                   (r->modifiers & 0x01) ? "S" : "",
+                   (r->modifiers & 0x02) ? "C" : "",
+                   (r->modifiers & 0x04) ? "A" : "",
+                   (r->modifiers & 0x08) ? "L" : "");
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    double mhz = 0;
+    const char *path = NULL;
+    FILE *f;
+    uint8_t *data;
+    long size;
+    uint32_t last = 0;
+    int boot = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-m") && i + 1 < argc)
+            mhz = atof(argv[++i]);
+        else
+            path = argv[i];
+    }
+    if (!path) {
+        fprintf(stderr, "usage: %s [-m cpu_mhz] serial.bin|KEYLOG.BIN\n", argv[0]);
+        return 1;
+    }
+
+    f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(size ? size : 1);
+    if (fread(data, 1, size, f) != (size_t)size) {
+        perror(path);
+        return 1;
+    }
+    fclose(f);
+
+    printf("boot,seq,%s,scancode,key,modifiers\n", mhz > 0 ? "ms" : "tsc");
+
+    // Scan for sector headers. A sector can show up several times while it
+    // is filling; keep the copy with the most records.
+    for (long off = 0; off + KEYLOG_SECTOR_SIZE <= size; ) {
+        struct keylog_sector *s = (struct keylog_sector *)(data + off);
+        struct keylog_sector *old;
+
+        if (s->magic != KEYLOG_MAGIC || s->version != KEYLOG_VERSION ||
+            s->count > KEYLOG_RECS_PER_SECTOR || s->seqno >= MAX_SECTORS) {
+            off++;
+            continue;
+        }
+        old = sectors[s->seqno];
+        if (s->seqno < last || (old && old->count && s->count && old->rec[0].tsc != s->rec[0].tsc)) {
+            print_boot(boot++, mhz);
+            old = NULL;
+        }
+        if (!old || old->count <= s->count)
+            sectors[s->seqno] = s;
+        last = s->seqno;
+        off += KEYLOG_SECTOR_SIZE;
+    }
+    print_boot(boot, mhz);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * profdump.c
+ *
+ * Host-side symbolizer for the samples prof.c dumps over COM1. Reads the
+ * kernel ELF's symbol table and a serial capture (make run writes
+ * serial.bin), and prints a flat profile: per function, the samples it was
+ * running in (self) and the samples it was anywhere on the stack in
+ * (total).
+ *
+ *   profdump [-o folded.txt] [-n top] kernel serial.bin
+ *
+ * -o also writes the stacks in the folded format flamegraph.pl and
+ * speedscope read: root;...;leaf count, one line per distinct stack.
+ * Samples taken in ring 3 count as [user]. If the capture holds several
+ * dumps, the last one is used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "elf.h"
+#include "prof.h"
+
+struct sym {
+    uint32_t addr;
+    uint32_t size;
+    const char *name;
+    long self, total;
+    long seen;                        // the sample that last counted it in total
+};
+
+struct stack {
+    char *text;
+    long count;
+};
+
+static struct sym *syms;
+static int nsyms;
+static struct sym user = { 0, 0, "[user]", 0, 0, -1 };
+static struct sym unknown = { 0, 0, "[unknown]", 0, 0, -1 };
+
+static uint8_t fold(uint32_t v) {
+    return v ^ (v >> 8) ^ (v >> 16) ^ (v >> 24);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t *slurp(const char *path, long *size) {
+    FILE *f = fopen(path, "rb");
+    uint8_t *data;
+
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(*size ? *size : 1);
+    if (fread(data, 1, *size, f) != (size_t)*size) {
+        perror(path);
+        exit(1);
+    }
+    fclose(f);
+    return data;
+}
+
+static int by_addr(const void *a, const void *b) {
+    const struct sym *x = a, *y = b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+// Every STT_FUNC symbol with an address, sorted by it
+static void load_symbols(const char *path) {
+    long size;
+    uint8_t *elf = slurp(path, &size);
+    const struct elf32_ehdr *eh = (const struct elf32_ehdr *)elf;
+    const struct elf32_shdr *sh;
+
+    if (size < (long)sizeof(*eh) || get32(eh->ident) != ELF_MAGIC || eh->ident[4] != ELF_CLASS32 ||
+        eh->shentsize != sizeof(*sh) || eh->shoff + (uint64_t)eh->shnum * sizeof(*sh) > (uint64_t)size) {
+        fprintf(stderr, "%s: not an ELF32 file with section headers\n", path);
+        exit(1);
+    }
+    sh = (const struct elf32_shdr *)(elf + eh->shoff);
+    for (int i = 0; i < eh->shnum; i++) {
+        const struct elf32_shdr *str = &sh[sh[i].link < eh->shnum ? sh[i].link : 0];
+        const struct elf32_sym *st = (const struct elf32_sym *)(elf + sh[i].offset);
+        uint32_t n = sh[i].size / sizeof(*st);
+
+        if (sh[i].type != ELF_SHT_SYMTAB || sh[i].offset + (uint64_t)sh[i].size > (uint64_t)size ||
+            str->offset + (uint64_t)str->size > (uint64_t)size)
+            continue;
+        syms = realloc(syms, (nsyms + n) * sizeof(*syms));
+        for (uint32_t k = 0; k < n; k++) {
+            if ((st[k].info & 0xf) != ELF_STT_FUNC || !st[k].value || st[k].name >= str->size)
+                continue;
+            syms[nsyms].addr = st[k].value;
+            syms[nsyms].size = st[k].size;
+            syms[nsyms].name = (const char *)elf + str->offset + st[k].name;
+            syms[nsyms].self = syms[nsyms].total = 0;
+            syms[nsyms].seen = -1;
+            nsyms++;
+        }
+    }
+    if (!nsyms) {
+        fprintf(stderr, "%s: no function symbols (was it stripped?)\n", path);
+        exit(1);
+    }
+    qsort(syms, nsyms, sizeof(*syms), by_addr);
+}
+
+// The function holding addr. Sizes can be missing for assembly symbols, so
+// a size of 0 runs up to the next symbol.
+static struct sym *lookup(uint32_t addr) {
+    int lo = 0, hi = nsyms - 1, found = -1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+
+        if (syms[mid].addr <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (found < 0 || (syms[found].size && addr >= syms[found].addr + syms[found].size))
+        return &unknown;
+    return &syms[found];
+}
+
+static int by_self(const void *a, const void *b) {
+    const struct sym *x = *(struct sym *const *)a, *y = *(struct sym *const *)b;
+
+    return x->self != y->self ? (x->self < y->self) - (x->self > y->self)
+                              : (x->total < y->total) - (x->total > y->total);
+}
+
+static int by_text(const void *a, const void *b) {
+    return strcmp(((const struct stack *)a)->text, ((const struct stack *)b)->text);
+}
+
+int main(int argc, char **argv) {
+    const char *kernel = NULL, *capture = NULL, *folded = NULL;
+    struct stack *stacks = NULL;
+    struct sym **order;
+    long size, skipped = 0, samples = 0, nstacks = 0, top = 30;
+    uint32_t hz = 0, dropped = 0;
+    uint8_t *data;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            folded = argv[++i];
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            top = atol(argv[++i]);
+        else if (!kernel)
+            kernel = argv[i];
+        else
+            capture = argv[i];
+    }
+    if (!capture) {
+        fprintf(stderr, "usage: %s [-o folded.txt] [-n top] kernel serial.bin\n", argv[0]);
+        return 1;
+    }
+    load_symbols(kernel);
+    data = slurp(capture, &size);
+
+    for (long off = 0; off + (long)sizeof(struct prof_header) <= size; ) {
+        const uint8_t *p = data + off;
+        uint8_t type = p[1], nwords = p[2];
+        long len = sizeof(struct prof_header) + nwords * 4;
+        uint32_t w[PROF_DEPTH] = { 0 };
+        uint8_t csum = PROF_SYNC ^ type ^ nwords;
+
+        if (p[0] != PROF_SYNC || nwords < 1 || nwords > PROF_DEPTH || off + len > size) {
+            off++;
+            skipped++;
+            continue;
+        }
+        for (int i = 0; i < nwords; i++) {
+            w[i] = get32(p + 4 + 4 * i);
+            csum ^= fold(w[i]);
+        }
+        if (csum != p[3]) {
+            off++;
+            skipped++;
+            continue;
+        }
+        off += len;
+
+        if (type == PROF_REC_BEGIN && nwords >= 3) {
+            // A later dump replaces an earlier one
+            for (int i = 0; i < nsyms; i++)
+                syms[i].self = syms[i].total = 0, syms[i].seen = -1;
+            user.self = user.total = unknown.self = unknown.total = 0;
+            for (long i = 0; i < nstacks; i++)
+                free(stacks[i].text);
+            nstacks = samples = 0;
+            hz = w[0];
+            dropped = w[2];
+        } else if ((type & ~PROF_REC_USER) == PROF_REC_SAMPLE) {
+            struct sym *frame[PROF_DEPTH];
+            char text[PROF_DEPTH * 64] = "";
+            int depth = 0;
+            long s;
+
+            if (type & PROF_REC_USER) {
+                frame[depth++] = &user;
+            } else {
+                // A return address points past its call, which may be the
+                // last instruction of the caller, so look up the byte before
+                for (int i = 0; i < nwords; i++)
+                    frame[depth++] = lookup(i ? w[i] - 1 : w[i]);
+            }
+            frame[0]->self++;
+            for (int i = 0; i < depth; i++) {
+                if (frame[i]->seen != samples) {
+                    frame[i]->seen = samples;
+                    frame[i]->total++;
+                }
+            }
+            samples++;
+
+            for (int i = depth - 1; i >= 0; i--) {
+                strncat(text, frame[i]->name, sizeof(text) - strlen(text) - 2);
+                if (i)
+                    strcat(text, ";");
+            }
+            for (s = 0; s < nstacks && strcmp(stacks[s].text, text); s++)
+                ;
+            if (s == nstacks) {
+                stacks = realloc(stacks, (nstacks + 1) * sizeof(*stacks));
+                stacks[s].text = strdup(text);
+                stacks[s].count = 0;
+                nstacks++;
+            }
+            stacks[s].count++;
+        }
+    }
+
+    if (!samples) {
+        fprintf(stderr, "%s: no profiler samples (run prof start, then prof dump)\n", capture);
+        return 1;
+    }
+    order = malloc((nsyms + 2) * sizeof(*order));
+    for (int i = 0; i < nsyms; i++)
+        order[i] = &syms[i];
+    order[nsyms] = &user;
+    order[nsyms + 1] = &unknown;
+    qsort(order, nsyms + 2, sizeof(*order), by_self);
+
+    printf("%ld samples at %u Hz", samples, hz);
+    if (dropped)
+        printf(", %u older ones overwritten", dropped);
+    printf("\n\n%8s %6s %8s %6s  %s\n", "self", "%", "total", "%", "function");
+    for (int i = 0; i < nsyms + 2 && i < top && order[i]->total; i++) {
+        printf("%8ld %5.1f%% %8ld %5.1f%%  %s\n", order[i]->self, 100.0 * order[i]->self / samples,
+               order[i]->total, 100.0 * order[i]->total / samples, order[i]->name);
+    }
+
+    if (folded) {
+        FILE *f = fopen(folded, "w");
+
+        if (!f) {
+            perror(folded);
+            return 1;
+        }
+        qsort(stacks, nstacks, sizeof(*stacks), by_text);
+        for (long i = 0; i < nstacks; i++)
+            fprintf(f, "%s %ld\n", stacks[i].text, stacks[i].count);
+        fclose(f);
+    }
+    if (skipped)
+        fprintf(stderr, "skipped %ld bytes of non-profile data\n", skipped);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * tracedump.c
+ *
+ * Host-side decoder for the binary trace records written by trace.c.
+ * Reads a serial capture (make run writes serial.bin) and prints either
+ * Chrome trace JSON (load it in chrome://tracing or ui.perfetto.dev) or CSV.
+ *
+ *   tracedump [-f json|csv] [-m cpu_mhz] serial.bin
+ *
+ * Timestamps are converted with the TSC rate from the kernel's TRACE_CLOCK
+ * record. -m overrides it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "trace.h"
+
+#define TRACE_STRUCT(id, label, phase) { #id, label, phase },
+static const struct {
+    const char *id;
+    const char *label;
+    char phase;
+} events[TRACE_NUM_EVENTS] = { TRACE_EVENTS(TRACE_STRUCT) };
+
+static uint8_t fold(uint32_t v) {
+    return v ^ (v >> 8) ^ (v >> 16) ^ (v >> 24);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int main(int argc, char **argv) {
+    const char *fmt = "json";
+    const char *path = NULL;
+    double khz = 0, user_khz = 0;
+    FILE *f;
+    uint8_t *data;
+    long size;
+    long nrec = 0, skipped = 0;
+    uint64_t t0 = 0;
+    int have_t0 = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-f") && i + 1 < argc)
+            fmt = argv[++i];
+        else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+            user_khz = atof(argv[++i]) * 1000.0;
+        else
+            path = argv[i];
+    }
+    if (!path || (strcmp(fmt, "json") && strcmp(fmt, "csv"))) {
+        fprintf(stderr, "usage: %s [-f json|csv] [-m cpu_mhz] serial.bin\n", argv[0]);
+        return 1;
+    }
+
+    f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(size ? size : 1);
+    if (fread(data, 1, size, f) != (size_t)size) {
+        perror(path);
+        return 1;
+    }
+    fclose(f);
+
+    khz = user_khz;
+    if (!strcmp(fmt, "json"))
+        printf("{\"traceEvents\":[\n");
+    else
+        printf("tsc,us,event,a0,a1,a2,a3\n");
+
+    for (long off = 0; off + (long)sizeof(struct trace_header) <= size; ) {
+        const uint8_t *p = data + off;
+        uint8_t id = p[1], nargs = p[2];
+        long len = sizeof(struct trace_header) + nargs * 4;
+        uint32_t args[TRACE_MAX_ARGS] = { 0 };
+
+        if (p[0] != TRACE_SYNC || id >= TRACE_NUM_EVENTS || nargs > TRACE_MAX_ARGS ||
+            off + len > size) {
+            off++;
+            skipped++;
+            continue;
+        }
+
+        uint32_t lo = get32(p + 4), hi = get32(p + 8);
+        uint8_t csum = TRACE_SYNC ^ id ^ nargs ^ fold(lo) ^ fold(hi);
+        for (int i = 0; i < nargs; i++) {
+            args[i] = get32(p + 12 + 4 * i);
+            csum ^= fold(args[i]);
+        }
+        if (csum != p[3]) {
+            off++;
+            skipped++;
+            continue;
+        }
+        off += len;
+
+        uint64_t tsc = ((uint64_t)hi << 32) | lo;
+        if (id == TRACE_CLOCK && !user_khz && args[0])
+            khz = args[0];
+        if (!have_t0) {
+            t0 = tsc;
+            have_t0 = 1;
+        }
+        double us = khz ? (double)(tsc - t0) * 1000.0 / khz : (double)(tsc - t0);
+
+        if (!strcmp(fmt, "csv")) {
+            printf("%llu,%.3f,%s,%u,%u,%u,%u\n", (unsigned long long)tsc, us,
+                   events[id].id, args[0], args[1], args[2], args[3]);
+        } else if (events[id].phase != 'M') {
+            printf("%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                   "\"pid\":0,\"tid\":0,\"args\":{\"a0\":%u,\"a1\":%u,\"a2\":%u,\"a3\":%u}%s}\n",
+                   nrec ? "," : "", events[id].label, events[id].id, events[id].phase, us,
+                   args[0], args[1], args[2], args[3],
+                   events[id].phase == 'i' ? ",\"s\":\"g\"" : "");
+            nrec++;
+        }
+    }
+
+    if (!strcmp(fmt, "json"))
+        printf("],\"displayTimeUnit\":\"ns\"}\n");
+    if (!khz)
+        fprintf(stderr, "no TRACE_CLOCK record and no -m: timestamps are raw TSC cycles\n");
+    if (skipped)
+        fprintf(stderr, "skipped %ld bytes of non-trace data\n", skipped);
+    free(data);
+    return 0;
+}
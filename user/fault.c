@@ -0,0 +1,11 @@
+// fault: write over our own text, which is mapped read-only. The kernel
+// should kill us and go back to the shell.
+
+#include "user.h"
+
+int main(void) {
+    puts("writing to main()...\n");
+    *(volatile uint8_t *)main = 0xC3;
+    puts("still here?\n");
+    return 1;
+}
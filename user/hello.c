@@ -0,0 +1,31 @@
+// hello: say so from ring 3, then read a few bytes of a 1 MiB table. Only
+// the pages touched are ever loaded, so this starts as fast as a small
+// program would.
+
+#include "user.h"
+
+#define TABLE_SIZE (1024 * 1024)
+#define STRIDE     (256 * 1024)
+
+static const uint8_t table[TABLE_SIZE] = { 1, 2, 3 };
+static uint32_t counter = 41;          // .data: a private copy
+static uint32_t zeros[1024];           // .bss: a zero page
+
+int main(void) {
+    uint32_t sum = 0, touched = 0;
+
+    puts("hello from ring 3\n");
+    for (uint32_t i = 0; i < TABLE_SIZE; i += STRIDE, touched++)
+        sum += table[i] + table[i + 1];
+    zeros[0] = ++counter;
+    puts("read ");
+    put_dec(touched);
+    puts(" of ");
+    put_dec(TABLE_SIZE / 4096);
+    puts(" table pages, sum ");
+    put_dec(sum);
+    puts(", counter ");
+    put_dec(zeros[0]);
+    puts("\n");
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef USER_H
+#define USER_H
+
+#include <stdint.h>
+#include "proc.h"
+
+/*
+ * Everything a user program gets: the system calls in proc.h and a _start
+ * that calls main() and exits with what it returns. A program is one .c
+ * file including this, linked with user.ld.
+ */
+
+static inline int syscall3(int n, uint32_t a, uint32_t b, uint32_t c) {
+    int ret;
+
+    asm volatile("int $0x80" : "=a"(ret) : "a"(n), "b"(a), "c"(b), "d"(c) : "memory");
+    return ret;
+}
+
+static inline void exit(int status) {
+    syscall3(SYS_EXIT, status, 0, 0);
+    for (;;)
+        ;
+}
+
+static inline int write(int fd, const void *buf, uint32_t len) {
+    return syscall3(SYS_WRITE, fd, (uint32_t)buf, len);
+}
+
+static inline uint32_t strlen(const char *s) {
+    uint32_t n = 0;
+
+    while (s[n])
+        n++;
+    return n;
+}
+
+static inline void puts(const char *s) {
+    write(1, s, strlen(s));
+}
+
+static inline void put_dec(uint32_t v) {
+    char buf[11];
+    int i = sizeof(buf);
+
+    do {
+        buf[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    write(1, buf + i, sizeof(buf) - i);
+}
+
+int main(void);
+
+asm(".text\n"
+    ".global _start\n"
+    "_start:\n"
+    "    call main\n"
+    "    mov %eax, %ebx\n"
+    "    mov $1, %eax\n"               // SYS_EXIT
+    "    int $0x80\n"
+    "1:  jmp 1b\n");
+
+#endif